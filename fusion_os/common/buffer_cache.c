@@ -0,0 +1,296 @@
+/*
+ * buffer_cache.c - block buffer cache implementation
+ *
+ * every buffer is in the hash table. a pinned buffer is only there, an
+ * unpinned one is also on the lru, and a dirty one is on the dirty list
+ * whether pinned or not. eviction takes unpinned buffers from the lru
+ * head and writes them back first when they are dirty
+ */
+
+#include "buffer_cache.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/gecko.h"
+
+/* lookup key */
+typedef struct {
+    const buffer_device_t* device;
+    uint32_t block;
+} buffer_key_t;
+
+static hash_table_t buffer_table;
+static uint64_t buffer_table_storage[HASH_TABLE_STORAGE_SIZE(BUFFER_CACHE_TABLE_SIZE) / sizeof(uint64_t)];
+static list_t lru_buffers;
+static list_t dirty_buffers;
+static buffer_cache_stats_t buffer_cache_stats;
+static int buffer_cache_initialized = 0;
+
+static int buffer_match(const hash_node_t* node, const void* key) {
+    const buffer_head_t* bh = hash_entry(node, buffer_head_t, hash_link);
+    const buffer_key_t* k = (const buffer_key_t*)key;
+    return bh->device == k->device && bh->block == k->block;
+}
+
+static inline uint64_t buffer_hash(const buffer_device_t* device, uint32_t block) {
+    return hash_u64(block ^ hash_u64((uint64_t)(uintptr_t)device));
+}
+
+/*
+ * initialize buffer cache
+ */
+void buffer_cache_init(void) {
+    if (buffer_cache_initialized) {
+        return;
+    }
+
+    hash_table_init(&buffer_table, buffer_table_storage, BUFFER_CACHE_TABLE_SIZE, buffer_match);
+    list_init(&lru_buffers);
+    list_init(&dirty_buffers);
+    memset(&buffer_cache_stats, 0, sizeof(buffer_cache_stats));
+
+    buffer_cache_initialized = 1;
+    LOG_INFO("buffer_cache", "buffer cache initialized");
+}
+
+static buffer_head_t* find_buffer(const buffer_device_t* device, uint32_t block) {
+    buffer_key_t key = { device, block };
+    hash_node_t* node = hash_table_find(&buffer_table, buffer_hash(device, block), &key);
+    return node ? hash_entry(node, buffer_head_t, hash_link) : NULL;
+}
+
+static void clear_dirty(buffer_head_t* bh) {
+    bh->dirty = 0;
+    list_remove(&dirty_buffers, &bh->dirty_link);
+    buffer_cache_stats.dirty--;
+}
+
+/*
+ * write a dirty buffer to its device
+ */
+static int write_back(buffer_head_t* bh) {
+    if (!bh->dirty) {
+        return 0;
+    }
+
+    if (bh->device->write_block(bh->device->context, bh->block, bh->data) != 0) {
+        LOG_ERROR("buffer_cache", "writing block %u failed", bh->block);
+        return -1;
+    }
+
+    buffer_cache_stats.writes++;
+    clear_dirty(bh);
+    return 0;
+}
+
+/*
+ * unhash and free a buffer that is on no list
+ */
+static void free_buffer(buffer_head_t* bh) {
+    hash_table_remove(&buffer_table, &bh->hash_link);
+    buffer_cache_stats.buffers--;
+    gecko_free_kernel_memory(bh->data);
+    gecko_free_kernel_memory(bh);
+}
+
+/*
+ * evict least recently used buffers until the lru is back at its limit,
+ * a buffer that cannot be written back stays
+ */
+static void shrink(void) {
+    list_node_t* link = list_get_head(&lru_buffers);
+    while (link != NULL && lru_buffers.count > BUFFER_CACHE_MAX_BUFFERS) {
+        list_node_t* next = link->next;
+        buffer_head_t* bh = (buffer_head_t*)link->data;
+        if (write_back(bh) == 0) {
+            list_remove(&lru_buffers, &bh->lru_link);
+            free_buffer(bh);
+            buffer_cache_stats.evictions++;
+        }
+        link = next;
+    }
+}
+
+/*
+ * move the table to twice the capacity, it stays put if memory is short
+ */
+static int grow_table(void) {
+    size_t capacity = buffer_table.capacity * 2;
+    void* storage = gecko_alloc_kernel_memory(HASH_TABLE_STORAGE_SIZE(capacity));
+    if (!storage) {
+        return -1;
+    }
+
+    void* old_storage = buffer_table.slots;
+    hash_table_resize(&buffer_table, storage, capacity);
+    if (old_storage != buffer_table_storage) {
+        gecko_free_kernel_memory(old_storage);
+    }
+    return 0;
+}
+
+/*
+ * pinned buffer of block, read from the device on a miss when read is set
+ */
+static buffer_head_t* pin_buffer(buffer_device_t* device, uint32_t block, int read) {
+    if (!buffer_cache_initialized) {
+        buffer_cache_init();
+    }
+
+    buffer_head_t* bh = find_buffer(device, block);
+    if (bh) {
+        buffer_cache_stats.hits++;
+        if (bh->pin_count++ == 0) {
+            list_remove(&lru_buffers, &bh->lru_link);
+        }
+        return bh;
+    }
+
+    buffer_cache_stats.misses++;
+
+    /* keep an eighth of the slots empty so probes stay short */
+    if (buffer_table.count + 1 > buffer_table.capacity - buffer_table.capacity / 8 && grow_table() != 0) {
+        return NULL;
+    }
+
+    bh = gecko_alloc_kernel_memory(sizeof(buffer_head_t));
+    if (!bh) {
+        return NULL;
+    }
+    memset(bh, 0, sizeof(buffer_head_t));
+
+    bh->data = gecko_alloc_kernel_memory(device->block_size);
+    if (!bh->data) {
+        gecko_free_kernel_memory(bh);
+        return NULL;
+    }
+
+    if (read) {
+        if (device->read_block(device->context, block, bh->data) != 0) {
+            gecko_free_kernel_memory(bh->data);
+            gecko_free_kernel_memory(bh);
+            return NULL;
+        }
+        buffer_cache_stats.reads++;
+    }
+
+    bh->device = device;
+    bh->block = block;
+    bh->pin_count = 1;
+    bh->lru_link.data = bh;
+    bh->dirty_link.data = bh;
+
+    buffer_key_t key = { device, block };
+    hash_table_insert(&buffer_table, &bh->hash_link, buffer_hash(device, block), &key);
+    buffer_cache_stats.buffers++;
+    return bh;
+}
+
+buffer_head_t* buffer_cache_read(buffer_device_t* device, uint32_t block) {
+    return pin_buffer(device, block, 1);
+}
+
+buffer_head_t* buffer_cache_get(buffer_device_t* device, uint32_t block) {
+    return pin_buffer(device, block, 0);
+}
+
+/*
+ * queue bh for write back
+ */
+void buffer_cache_mark_dirty(buffer_head_t* bh) {
+    if (!bh->dirty) {
+        bh->dirty = 1;
+        list_add_tail(&dirty_buffers, &bh->dirty_link);
+        buffer_cache_stats.dirty++;
+    }
+}
+
+/*
+ * drop a pin, the last one puts bh at the lru tail
+ */
+void buffer_cache_release(buffer_head_t* bh) {
+    if (!bh || bh->pin_count == 0) {
+        return;
+    }
+
+    if (--bh->pin_count == 0) {
+        list_add_tail(&lru_buffers, &bh->lru_link);
+        if (lru_buffers.count > BUFFER_CACHE_MAX_BUFFERS) {
+            shrink();
+        }
+    }
+}
+
+/*
+ * take data written to the device around the cache
+ */
+void buffer_cache_update(buffer_device_t* device, uint32_t block, const void* data) {
+    if (!buffer_cache_initialized) {
+        return;
+    }
+
+    buffer_head_t* bh = find_buffer(device, block);
+    if (bh) {
+        memcpy(bh->data, data, device->block_size);
+        if (bh->dirty) {
+            clear_dirty(bh);
+        }
+    }
+}
+
+/*
+ * write back every dirty buffer of device
+ */
+int buffer_cache_sync(buffer_device_t* device) {
+    if (!buffer_cache_initialized) {
+        return 0;
+    }
+
+    int result = 0;
+    list_node_t* link = list_get_head(&dirty_buffers);
+    while (link != NULL) {
+        list_node_t* next = link->next;
+        buffer_head_t* bh = (buffer_head_t*)link->data;
+        if (bh->device == device && write_back(bh) != 0) {
+            result = -1;
+        }
+        link = next;
+    }
+
+    return result;
+}
+
+/*
+ * write back and free every buffer of device, used on unmount
+ */
+int buffer_cache_invalidate(buffer_device_t* device) {
+    if (!buffer_cache_initialized) {
+        return 0;
+    }
+
+    int result = buffer_cache_sync(device);
+
+    list_node_t* link = list_get_head(&lru_buffers);
+    while (link != NULL) {
+        list_node_t* next = link->next;
+        buffer_head_t* bh = (buffer_head_t*)link->data;
+        if (bh->device == device) {
+            if (bh->dirty) {
+                clear_dirty(bh);
+            }
+            list_remove(&lru_buffers, &bh->lru_link);
+            free_buffer(bh);
+        }
+        link = next;
+    }
+
+    return result;
+}
+
+/*
+ * get cache statistics
+ */
+void buffer_cache_get_stats(buffer_cache_stats_t* stats) {
+    if (stats) {
+        *stats = buffer_cache_stats;
+    }
+}
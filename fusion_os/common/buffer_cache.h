@@ -0,0 +1,78 @@
+/*
+ * buffer_cache.h - block buffer cache for fusion os
+ *
+ * keeps recently used blocks of block devices in memory, indexed by
+ * (device, block number). a buffer is pinned while a caller works on its
+ * data and cannot be evicted then. writes only mark the buffer dirty, it
+ * reaches the device on sync or when the buffer is evicted. unpinned
+ * buffers sit on an lru list and the oldest go once the cache is over
+ * its limit
+ */
+
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hash.h"
+#include "list.h"
+
+#define BUFFER_CACHE_TABLE_SIZE 1024    /* initial hash slots, doubled when full */
+#define BUFFER_CACHE_MAX_BUFFERS 2048   /* unpinned buffers kept before eviction */
+
+/* a device the cache reads and writes whole blocks of */
+typedef struct buffer_device {
+    void* context;
+    uint32_t block_size;
+    int (*read_block)(void* context, uint32_t block, void* buffer);
+    int (*write_block)(void* context, uint32_t block, const void* buffer);
+} buffer_device_t;
+
+/* one cached block */
+typedef struct buffer_head {
+    hash_node_t hash_link;              /* keyed by device and block */
+    list_node_t lru_link;               /* unpinned buffers, oldest first */
+    list_node_t dirty_link;             /* dirty buffers of every device */
+    buffer_device_t* device;
+    uint32_t block;
+    uint32_t pin_count;
+    uint8_t dirty;
+    void* data;
+} buffer_head_t;
+
+/* cache statistics */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t reads;                     /* blocks read from devices */
+    uint64_t writes;                    /* blocks written to devices */
+    uint64_t evictions;
+    uint32_t buffers;
+    uint32_t dirty;
+} buffer_cache_stats_t;
+
+void buffer_cache_init(void);
+
+/* pinned buffer of block with its contents read. get skips the read for
+ * a block that is about to be overwritten whole, its data is undefined */
+buffer_head_t* buffer_cache_read(buffer_device_t* device, uint32_t block);
+buffer_head_t* buffer_cache_get(buffer_device_t* device, uint32_t block);
+
+/* data changed, write it back later */
+void buffer_cache_mark_dirty(buffer_head_t* bh);
+
+/* unpin, the buffer stays cached */
+void buffer_cache_release(buffer_head_t* bh);
+
+/* the device now holds data for block, a cached copy takes it and is clean */
+void buffer_cache_update(buffer_device_t* device, uint32_t block, const void* data);
+
+/* write back every dirty buffer of device */
+int buffer_cache_sync(buffer_device_t* device);
+
+/* write back and free every buffer of device, none may be pinned */
+int buffer_cache_invalidate(buffer_device_t* device);
+
+void buffer_cache_get_stats(buffer_cache_stats_t* stats);
+
+#endif /* BUFFER_CACHE_H */
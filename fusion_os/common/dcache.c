@@ -0,0 +1,225 @@
+/*
+ * dcache.c - directory entry cache implementation
+ *
+ * a lookup hashes the parent pointer together with the component bytes and
+ * compares names in place, so path walks never copy a component. hits move
+ * to the tail of the lru list, new entries take a free slot or the head
+ */
+
+#include "dcache.h"
+#include "icache.h"
+#include "string.h"
+#include "logger.h"
+
+/* hash slots, twice the pool */
+#define DCACHE_TABLE_SIZE (DCACHE_SIZE * 2)
+
+/* lookup key, points into the caller's path */
+typedef struct {
+    vfs_inode_t* parent;
+    const char* name;
+    size_t length;
+} dentry_key_t;
+
+static dentry_t dentry_pool[DCACHE_SIZE];
+static list_t free_dentries;
+static list_t lru_dentries;
+static hash_table_t dentry_table;
+static uint64_t dentry_table_storage[HASH_TABLE_STORAGE_SIZE(DCACHE_TABLE_SIZE) / sizeof(uint64_t)];
+static dcache_stats_t dcache_stats;
+static int dcache_initialized = 0;
+
+static int dentry_match(const hash_node_t* node, const void* key) {
+    const dentry_t* dentry = hash_entry(node, dentry_t, hash_link);
+    const dentry_key_t* k = (const dentry_key_t*)key;
+    return dentry->parent == k->parent && dentry->name_length == k->length &&
+           memcmp(dentry->name, k->name, k->length) == 0;
+}
+
+static inline uint64_t dentry_hash(const dentry_key_t* key) {
+    return hash_bytes(key->name, key->length, (uint64_t)(uintptr_t)key->parent);
+}
+
+/*
+ * initialize dentry cache
+ */
+void dcache_init(void) {
+    if (dcache_initialized) {
+        return;
+    }
+
+    memset(dentry_pool, 0, sizeof(dentry_pool));
+    memset(&dcache_stats, 0, sizeof(dcache_stats));
+    list_init(&free_dentries);
+    list_init(&lru_dentries);
+    hash_table_init(&dentry_table, dentry_table_storage, DCACHE_TABLE_SIZE, dentry_match);
+
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        dentry_pool[i].lru_link.data = &dentry_pool[i];
+        list_add_tail(&free_dentries, &dentry_pool[i].lru_link);
+    }
+
+    dcache_initialized = 1;
+    LOG_INFO("dcache", "dentry cache initialized: %u entries", DCACHE_SIZE);
+}
+
+/*
+ * unhash dentry and drop its inode references
+ */
+static void release_dentry(dentry_t* dentry) {
+    hash_table_remove(&dentry_table, &dentry->hash_link);
+    list_remove(&lru_dentries, &dentry->lru_link);
+
+    icache_put(dentry->parent);
+    if (dentry->inode) {
+        icache_put(dentry->inode);
+    }
+    dentry->parent = NULL;
+    dentry->inode = NULL;
+
+    list_add_tail(&free_dentries, &dentry->lru_link);
+    dcache_stats.entries--;
+}
+
+/*
+ * find cached entry for name in parent
+ */
+dentry_t* dcache_lookup(vfs_inode_t* parent, const char* name, size_t length) {
+    if (!dcache_initialized) {
+        return NULL;
+    }
+
+    dentry_key_t key = { parent, name, length };
+    hash_node_t* node = hash_table_find(&dentry_table, dentry_hash(&key), &key);
+    if (node == NULL) {
+        dcache_stats.misses++;
+        return NULL;
+    }
+
+    dentry_t* dentry = hash_entry(node, dentry_t, hash_link);
+    if (dentry->inode) {
+        dcache_stats.hits++;
+    } else {
+        dcache_stats.negative_hits++;
+    }
+
+    /* most recently used entries live at the tail */
+    if (lru_dentries.tail != &dentry->lru_link) {
+        list_remove(&lru_dentries, &dentry->lru_link);
+        list_add_tail(&lru_dentries, &dentry->lru_link);
+    }
+
+    return dentry;
+}
+
+/*
+ * cache what name in parent resolved to, inode NULL records a miss
+ */
+dentry_t* dcache_add(vfs_inode_t* parent, const char* name, size_t length, vfs_inode_t* inode) {
+    if (!dcache_initialized) {
+        dcache_init();
+    }
+
+    if (length == 0 || length >= VFS_MAX_FILENAME_LENGTH) {
+        return NULL;
+    }
+
+    dentry_key_t key = { parent, name, length };
+    uint64_t hash = dentry_hash(&key);
+
+    hash_node_t* node = hash_table_find(&dentry_table, hash, &key);
+    if (node != NULL) {
+        release_dentry(hash_entry(node, dentry_t, hash_link));
+    }
+
+    /* take a free entry, or recycle the least recently used one */
+    list_node_t* link = list_get_head(&free_dentries);
+    if (link != NULL) {
+        list_remove(&free_dentries, link);
+    } else {
+        link = list_get_head(&lru_dentries);
+        release_dentry((dentry_t*)link->data);
+        list_remove(&free_dentries, link);
+        dcache_stats.evictions++;
+    }
+
+    dentry_t* dentry = (dentry_t*)link->data;
+    dentry->parent = parent;
+    dentry->inode = inode;
+    dentry->name_length = (uint32_t)length;
+    memcpy(dentry->name, name, length);
+    dentry->name[length] = '\0';
+
+    icache_hold(parent);
+    if (inode) {
+        icache_hold(inode);
+    }
+
+    hash_table_insert(&dentry_table, &dentry->hash_link, hash, &key);
+    list_add_tail(&lru_dentries, &dentry->lru_link);
+    dcache_stats.entries++;
+
+    return dentry;
+}
+
+/*
+ * forget name in parent, used when the directory changes
+ */
+void dcache_invalidate(vfs_inode_t* parent, const char* name, size_t length) {
+    if (!dcache_initialized) {
+        return;
+    }
+
+    dentry_key_t key = { parent, name, length };
+    hash_node_t* node = hash_table_find(&dentry_table, dentry_hash(&key), &key);
+    if (node != NULL) {
+        release_dentry(hash_entry(node, dentry_t, hash_link));
+    }
+}
+
+/*
+ * drop every entry that refers to inodes of sb
+ */
+void dcache_prune_superblock(vfs_superblock_t* sb) {
+    if (!dcache_initialized) {
+        return;
+    }
+
+    list_node_t* link = list_get_head(&lru_dentries);
+    while (link != NULL) {
+        list_node_t* next = link->next;
+        dentry_t* dentry = (dentry_t*)link->data;
+        if (dentry->parent->sb == sb || (dentry->inode && dentry->inode->sb == sb)) {
+            release_dentry(dentry);
+        }
+        link = next;
+    }
+}
+
+/*
+ * drop every entry cached under dir, used when it is removed
+ */
+void dcache_prune_directory(vfs_inode_t* dir) {
+    if (!dcache_initialized) {
+        return;
+    }
+
+    list_node_t* link = list_get_head(&lru_dentries);
+    while (link != NULL) {
+        list_node_t* next = link->next;
+        dentry_t* dentry = (dentry_t*)link->data;
+        if (dentry->parent == dir) {
+            release_dentry(dentry);
+        }
+        link = next;
+    }
+}
+
+/*
+ * get cache statistics
+ */
+void dcache_get_stats(dcache_stats_t* stats) {
+    if (stats) {
+        *stats = dcache_stats;
+    }
+}
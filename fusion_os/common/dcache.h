@@ -0,0 +1,55 @@
+/*
+ * dcache.h - directory entry cache for fusion os
+ *
+ * remembers what a name resolved to inside a directory, keyed by the
+ * parent inode and the component name. misses are cached too (negative
+ * entries) so repeated lookups of missing names do not reach the
+ * filesystem. entries come from a fixed pool and are recycled in lru order
+ */
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+#include "list.h"
+#include "hash.h"
+
+#define DCACHE_SIZE 1024
+
+/* cached directory entry, inode is NULL for a negative entry */
+typedef struct dentry {
+    vfs_inode_t* parent;
+    vfs_inode_t* inode;
+    hash_node_t hash_link;
+    list_node_t lru_link;
+    uint32_t name_length;
+    char name[VFS_MAX_FILENAME_LENGTH];
+} dentry_t;
+
+/* cache statistics */
+typedef struct {
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t entries;
+} dcache_stats_t;
+
+/* dcache initialization */
+void dcache_init(void);
+
+/* name is a path component of the given length, it need not be null terminated */
+dentry_t* dcache_lookup(vfs_inode_t* parent, const char* name, size_t length);
+dentry_t* dcache_add(vfs_inode_t* parent, const char* name, size_t length, vfs_inode_t* inode);
+
+/* invalidation */
+void dcache_invalidate(vfs_inode_t* parent, const char* name, size_t length);
+void dcache_prune_superblock(vfs_superblock_t* sb);
+void dcache_prune_directory(vfs_inode_t* dir);
+
+/* statistics */
+void dcache_get_stats(dcache_stats_t* stats);
+
+#endif /* DCACHE_H */
@@ -1,315 +1,1990 @@
 #include "ext2.h"
 #include "logger.h"
 #include "string.h"
+#include "rbtree.h"
+#include "icache.h"
+#include "page_cache.h"
+#include "../gecko/pmm.h"
 #include "../gecko/vmm.h"
 #include "../gecko/gecko.h"
 #include <stdarg.h>
 
 #define EXT2_TAG 0x45585400
 
+#define EXT2_DEFAULT_DEVICE_SIZE (1024 * 1024)
+#define EXT2_BYTES_PER_INODE 4096       /* image bytes per inode when formatting */
+#define EXT2_DIRECT_BLOCKS 12
+#define EXT2_IND_BLOCK 12               /* i_block slots of the single, double and triple indirect blocks */
+#define EXT2_DIND_BLOCK 13
+#define EXT2_TIND_BLOCK 14
+#define EXT2_MAX_BLOCK_MAPS 64          /* inodes whose block mappings are cached */
+#define EXT2_MAX_EXTENTS 1024           /* cached runs per inode before its map starts over */
+#define EXT2_INODE_SIZE 128             /* on-disk inode slot, sizeof(ext2_inode_t) rounded up */
+
+/* bytes a directory entry with a name of name_len takes, 4 byte aligned */
+#define EXT2_DIR_REC_LEN(name_len) (((name_len) + sizeof(ext2_dir_entry_t) + 3) & ~(size_t)3)
+#define EXT2_DX_ROOT_INFO (EXT2_DIR_REC_LEN(1) + EXT2_DIR_REC_LEN(2))  /* index root after . and .. */
+#define EXT2_DX_MAX_LEVELS 2            /* the root and one level of index nodes */
+
+/* a run of logical blocks of a file stored back to back on the device */
+typedef struct {
+    rb_node_t link;                     /* ordered by first logical block */
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t length;
+} ext2_extent_t;
+
+/* resolved block mappings of one inode */
+typedef struct {
+    radix_node_t inode_link;            /* keyed by inode number */
+    list_node_t lru_link;
+    rb_tree_t extents;
+} ext2_block_map_t;
+
 static ext2_filesystem_t* mounted_filesystems = NULL;
 static int ext2_initialized = 0;
 
-static uint32_t find_free_bit(uint8_t* bitmap, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        if (bitmap[i] != 0xFF) {
-            for (int bit = 0; bit < 8; bit++) {
-                if (!(bitmap[i] & (1 << bit))) {
-                    return i * 8 + bit;
-                }
-            }
-        }
+static int ext2_vfs_mount(vfs_superblock_t* sb, const char* device, const char* mount_point);
+static int ext2_vfs_umount(vfs_superblock_t* sb);
+static int ext2_vfs_sync(vfs_superblock_t* sb);
+static int ext2_vfs_mkdir(vfs_inode_t* parent, const char* name, uint32_t permissions);
+static int ext2_vfs_rmdir(vfs_inode_t* parent, const char* name);
+static int ext2_vfs_unlink(vfs_inode_t* parent, const char* name);
+static int ext2_vfs_create_file(vfs_inode_t* parent, const char* name, uint32_t permissions);
+static vfs_inode_t* ext2_vfs_lookup(vfs_inode_t* parent, const char* name, size_t length);
+static int ext2_vfs_readdir(vfs_inode_t* dir, uint32_t* cookie, vfs_dirent_t* entries, uint32_t count);
+static int ext2_vfs_readpage(vfs_inode_t* inode, uint64_t index, void* page);
+static int ext2_vfs_readpages(vfs_inode_t* inode, uint64_t index, void** pages, uint32_t count);
+static int ext2_vfs_writepages(vfs_inode_t* inode, uint64_t index, void** pages, uint32_t count);
+
+static const vfs_inode_operations_t ext2_inode_ops = {
+    .mkdir = ext2_vfs_mkdir,
+    .rmdir = ext2_vfs_rmdir,
+    .link = NULL,
+    .unlink = ext2_vfs_unlink,
+    .create_file = ext2_vfs_create_file,
+    .lookup = ext2_vfs_lookup,
+    .readdir = ext2_vfs_readdir,
+    .readpage = ext2_vfs_readpage,
+    .readpages = ext2_vfs_readpages,
+    .writepages = ext2_vfs_writepages
+};
+
+static const vfs_superblock_operations_t ext2_sb_ops = {
+    .mount = ext2_vfs_mount,
+    .umount = ext2_vfs_umount,
+    .sync = ext2_vfs_sync
+};
+
+static inline uint32_t group_first_block(ext2_filesystem_t* fs, uint32_t group) {
+    return fs->superblock->s_first_data_block + group * fs->blocks_per_group;
+}
+
+static inline uint32_t block_group(ext2_filesystem_t* fs, uint32_t block_num) {
+    return (block_num - fs->superblock->s_first_data_block) / fs->blocks_per_group;
+}
+
+static inline uint32_t inode_group(ext2_filesystem_t* fs, uint32_t inode_num) {
+    return (inode_num - 1) / fs->inodes_per_group;
+}
+
+static inline int is_directory(const ext2_inode_t* inode) {
+    return (inode->i_mode & 0xF000) == EXT2_S_IFDIR;
+}
+
+static inline int test_bit(const uint64_t* bitmap, uint32_t bit) {
+    return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void set_bit(uint64_t* bitmap, uint32_t bit) {
+    bitmap[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void reset_bit(uint64_t* bitmap, uint32_t bit) {
+    bitmap[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+static void set_bits(uint64_t* bitmap, uint32_t from, uint32_t to) {
+    for (uint32_t bit = from; bit < to; bit++) {
+        set_bit(bitmap, bit);
+    }
+}
+
+/*
+ * first clear bit in [from, to), a word at a time
+ */
+static uint32_t scan_bits(const uint64_t* bitmap, uint32_t from, uint32_t to) {
+    if (from >= to) {
+        return (uint32_t)-1;
+    }
+    
+    uint32_t word = from / 64;
+    uint64_t free_bits = ~bitmap[word] & (~0ULL << (from % 64));
+    while (free_bits == 0) {
+        if (++word * 64 >= to) {
+            return (uint32_t)-1;
+        }
+        free_bits = ~bitmap[word];
+    }
+    
+    uint32_t bit = word * 64 + __builtin_ctzll(free_bits);
+    return bit < to ? bit : (uint32_t)-1;
+}
+
+/*
+ * first clear bit at or after start, wrapping around to hint. every bit
+ * below hint is in use
+ */
+static uint32_t find_free_bit(const uint64_t* bitmap, uint32_t bits, uint32_t start, uint32_t hint) {
+    uint32_t bit = scan_bits(bitmap, start > hint ? start : hint, bits);
+    if (bit == (uint32_t)-1 && start > hint) {
+        bit = scan_bits(bitmap, hint, start);
+    }
+    return bit;
+}
+
+/* the lowest byte of x that is zero has its top bit set, higher ones may be wrong */
+#define ZERO_BYTES(x) (((x) - 0x0101010101010101ULL) & ~(x) & 0x8080808080808080ULL)
+
+/*
+ * a free bit for a new block: start itself when it is free, else the
+ * first bit of a fully free byte so the block has room to grow into,
+ * else any free bit
+ */
+static uint32_t find_free_run(const uint64_t* bitmap, uint32_t bits, uint32_t start, uint32_t hint) {
+    if (!test_bit(bitmap, start)) {
+        return start;
+    }
+    
+    uint32_t first = start / 64;
+    for (uint32_t byte = start % 64 / 8 + 1; byte < 8; byte++) {
+        if (((bitmap[first] >> (byte * 8)) & 0xFF) == 0) {
+            return first * 64 + byte * 8;
+        }
+    }
+    
+    uint32_t words = bits / 64;
+    for (uint32_t n = 1; n < words; n++) {
+        uint32_t word = (first + n) % words;
+        if (word < hint / 64) {
+            continue;
+        }
+        
+        uint64_t zero = ZERO_BYTES(bitmap[word]);
+        if (zero != 0) {
+            return word * 64 + (__builtin_ctzll(zero) & ~7u);
+        }
+    }
+    
+    return find_free_bit(bitmap, bits, start, hint);
+}
+
+/*
+ * whole block i/o on the memory behind fs, the buffer cache calls these
+ */
+static int device_read_block(void* context, uint32_t block_num, void* buffer) {
+    ext2_filesystem_t* fs = (ext2_filesystem_t*)context;
+    size_t offset = (size_t)block_num * fs->block_size;
+    if (offset + fs->block_size > fs->device_size) {
+        memset(buffer, 0, fs->block_size);
+        return 0;
+    }
+    
+    memcpy(buffer, (char*)fs->device + offset, fs->block_size);
+    return 0;
+}
+
+static int device_write_block(void* context, uint32_t block_num, const void* buffer) {
+    ext2_filesystem_t* fs = (ext2_filesystem_t*)context;
+    size_t offset = (size_t)block_num * fs->block_size;
+    if (offset + fs->block_size > fs->device_size) {
+        return -1;
+    }
+    
+    memcpy((char*)fs->device + offset, buffer, fs->block_size);
+    return 0;
+}
+
+/* a block that may be written, checked before it is dirtied in the cache */
+static int block_writable(ext2_filesystem_t* fs, uint32_t block_num) {
+    return block_num < fs->superblock->s_blocks_count &&
+           (size_t)(block_num + 1) * fs->block_size <= fs->device_size;
+}
+
+/*
+ * pinned buffer of block_num with its contents, NULL past the filesystem
+ */
+static buffer_head_t* read_buffer(ext2_filesystem_t* fs, uint32_t block_num) {
+    if (block_num >= fs->superblock->s_blocks_count) {
+        return NULL;
+    }
+    return buffer_cache_read(&fs->cache, block_num);
+}
+
+/*
+ * pinned zeroed buffer of a block that is overwritten without being read
+ */
+static buffer_head_t* new_buffer(ext2_filesystem_t* fs, uint32_t block_num) {
+    if (!block_writable(fs, block_num)) {
+        return NULL;
+    }
+    
+    buffer_head_t* bh = buffer_cache_get(&fs->cache, block_num);
+    if (bh) {
+        memset(bh->data, 0, fs->block_size);
+    }
+    return bh;
+}
+
+/*
+ * mark bit used in bitmap, moving hint on to the next free bit when it
+ * was taken
+ */
+static void take_bit(uint64_t* bitmap, uint32_t bits, uint32_t* hint, uint32_t bit) {
+    set_bit(bitmap, bit);
+    if (bit == *hint) {
+        uint32_t next = scan_bits(bitmap, bit + 1, bits);
+        *hint = next == (uint32_t)-1 ? bits : next;
+    }
+}
+
+/*
+ * clear bit in bitmap, -1 if it was clear already
+ */
+static int release_bit(uint64_t* bitmap, uint32_t* hint, uint32_t bit) {
+    if (!test_bit(bitmap, bit)) {
+        return -1;
+    }
+    
+    reset_bit(bitmap, bit);
+    if (bit < *hint) {
+        *hint = bit;
+    }
+    return 0;
+}
+
+/*
+ * copy the bitmaps of groups changed since the last call into their
+ * blocks, so the next cache sync takes them to the image
+ */
+static int write_bitmaps(ext2_filesystem_t* fs) {
+    for (uint32_t group = 0; group < fs->group_count; group++) {
+        ext2_group_info_t* info = &fs->groups[group];
+        if (!info->dirty) {
+            continue;
+        }
+        
+        ext2_group_desc_t* desc = &fs->group_descs[group];
+        buffer_head_t* block_bitmap = new_buffer(fs, desc->bg_block_bitmap);
+        buffer_head_t* inode_bitmap = new_buffer(fs, desc->bg_inode_bitmap);
+        if (!block_bitmap || !inode_bitmap) {
+            buffer_cache_release(block_bitmap);
+            buffer_cache_release(inode_bitmap);
+            return -1;
+        }
+        
+        memcpy(block_bitmap->data, info->block_bitmap, fs->block_size);
+        memcpy(inode_bitmap->data, info->inode_bitmap, fs->block_size);
+        buffer_cache_mark_dirty(block_bitmap);
+        buffer_cache_mark_dirty(inode_bitmap);
+        buffer_cache_release(block_bitmap);
+        buffer_cache_release(inode_bitmap);
+        info->dirty = 0;
+    }
+    return 0;
+}
+
+/*
+ * allocate a block at or after goal, searching goal's group first and
+ * then the groups that follow it
+ */
+static uint32_t allocate_block(ext2_filesystem_t* fs, uint32_t goal) {
+    ext2_superblock_t* sb = fs->superblock;
+    if (goal < sb->s_first_data_block || goal >= sb->s_blocks_count) {
+        goal = sb->s_first_data_block;
+    }
+    
+    uint32_t goal_group = block_group(fs, goal);
+    uint32_t start = (goal - sb->s_first_data_block) % fs->blocks_per_group;
+    
+    for (uint32_t i = 0; i < fs->group_count; i++) {
+        uint32_t group = (goal_group + i) % fs->group_count;
+        ext2_group_desc_t* desc = &fs->group_descs[group];
+        ext2_group_info_t* info = &fs->groups[group];
+        if (desc->bg_free_blocks_count == 0) {
+            continue;
+        }
+        
+        /* other groups are entered at their first free block */
+        uint32_t bit = find_free_run(info->block_bitmap, fs->blocks_per_group, i == 0 ? start : info->block_hint, info->block_hint);
+        if (bit == (uint32_t)-1) {
+            continue;
+        }
+        
+        take_bit(info->block_bitmap, fs->blocks_per_group, &info->block_hint, bit);
+        info->dirty = 1;
+        desc->bg_free_blocks_count--;
+        sb->s_free_blocks_count--;
+        return group_first_block(fs, group) + bit;
+    }
+    
+    return (uint32_t)-1;
+}
+
+static void free_block(ext2_filesystem_t* fs, uint32_t block_num) {
+    if (block_num < fs->superblock->s_first_data_block || block_num >= fs->superblock->s_blocks_count) {
+        return;
+    }
+    
+    uint32_t group = block_group(fs, block_num);
+    ext2_group_desc_t* desc = &fs->group_descs[group];
+    ext2_group_info_t* info = &fs->groups[group];
+    if (release_bit(info->block_bitmap, &info->block_hint, block_num - group_first_block(fs, group)) == 0) {
+        info->dirty = 1;
+        desc->bg_free_blocks_count++;
+        fs->superblock->s_free_blocks_count++;
+    }
+}
+
+static int extent_compare(const rb_node_t* a, const rb_node_t* b) {
+    const ext2_extent_t* ea = rb_entry(a, ext2_extent_t, link);
+    const ext2_extent_t* eb = rb_entry(b, ext2_extent_t, link);
+    return ea->logical < eb->logical ? -1 : ea->logical > eb->logical;
+}
+
+/* 0 for the extent holding the logical block, which extents never share */
+static int extent_key_compare(const void* key, const rb_node_t* node) {
+    uint32_t logical = *(const uint32_t*)key;
+    const ext2_extent_t* extent = rb_entry(node, ext2_extent_t, link);
+    if (logical < extent->logical) {
+        return -1;
+    }
+    return logical >= extent->logical + extent->length;
+}
+
+static void clear_extents(ext2_block_map_t* map) {
+    rb_node_t* node;
+    while ((node = rb_tree_first(&map->extents)) != NULL) {
+        rb_tree_erase(&map->extents, node);
+        gecko_free_kernel_memory(rb_entry(node, ext2_extent_t, link));
+    }
+}
+
+static void free_block_map(ext2_filesystem_t* fs, ext2_block_map_t* map) {
+    radix_tree_erase(&fs->block_maps, &map->inode_link);
+    list_remove(&fs->block_map_lru, &map->lru_link);
+    clear_extents(map);
+    gecko_free_kernel_memory(map);
+}
+
+/*
+ * forget the mappings of an inode whose blocks are released
+ */
+static void drop_block_map(ext2_filesystem_t* fs, uint32_t inode_num) {
+    radix_node_t* node = radix_tree_find(&fs->block_maps, inode_num);
+    if (node) {
+        free_block_map(fs, radix_entry(node, ext2_block_map_t, inode_link));
+    }
+}
+
+/*
+ * block map of inode_num, made empty if there is none. the least
+ * recently used map goes when there are too many. NULL without memory,
+ * mappings are then resolved without the cache
+ */
+static ext2_block_map_t* get_block_map(ext2_filesystem_t* fs, uint32_t inode_num) {
+    radix_node_t* node = radix_tree_find(&fs->block_maps, inode_num);
+    if (node) {
+        ext2_block_map_t* map = radix_entry(node, ext2_block_map_t, inode_link);
+        list_remove(&fs->block_map_lru, &map->lru_link);
+        list_add_tail(&fs->block_map_lru, &map->lru_link);
+        return map;
+    }
+    
+    if (list_count(&fs->block_map_lru) >= EXT2_MAX_BLOCK_MAPS) {
+        free_block_map(fs, (ext2_block_map_t*)list_get_head(&fs->block_map_lru)->data);
+    }
+    
+    ext2_block_map_t* map = gecko_alloc_kernel_memory(sizeof(ext2_block_map_t));
+    if (!map) {
+        return NULL;
+    }
+    
+    memset(map, 0, sizeof(ext2_block_map_t));
+    rb_tree_init(&map->extents);
+    map->lru_link.data = map;
+    radix_tree_insert(&fs->block_maps, &map->inode_link, inode_num);
+    list_add_tail(&fs->block_map_lru, &map->lru_link);
+    return map;
+}
+
+/*
+ * remember that length blocks from logical sit at physical. the run is
+ * cut short before the next cached extent and joined to its neighbours
+ * where it continues them on the device
+ */
+static void cache_extent(ext2_block_map_t* map, uint32_t logical, uint32_t physical, uint32_t length) {
+    if (map->extents.count >= EXT2_MAX_EXTENTS) {
+        clear_extents(map);
+    }
+    
+    rb_node_t* next_node = rb_tree_lower_bound(&map->extents, &logical, extent_key_compare);
+    rb_node_t* prev_node = next_node ? rb_tree_prev(next_node) : rb_tree_last(&map->extents);
+    ext2_extent_t* next = next_node ? rb_entry(next_node, ext2_extent_t, link) : NULL;
+    ext2_extent_t* prev = prev_node ? rb_entry(prev_node, ext2_extent_t, link) : NULL;
+    if (next && next->logical <= logical) {
+        return;
+    }
+    if (next && next->logical - logical < length) {
+        length = next->logical - logical;
+    }
+    
+    ext2_extent_t* extent;
+    if (prev && prev->logical + prev->length == logical && prev->physical + prev->length == physical) {
+        extent = prev;
+        extent->length += length;
+    } else {
+        extent = gecko_alloc_kernel_memory(sizeof(ext2_extent_t));
+        if (!extent) {
+            return;
+        }
+        extent->logical = logical;
+        extent->physical = physical;
+        extent->length = length;
+        rb_tree_insert(&map->extents, &extent->link, extent_compare);
+    }
+    
+    if (next && extent->logical + extent->length == next->logical &&
+        extent->physical + extent->length == next->physical) {
+        extent->length += next->length;
+        rb_tree_erase(&map->extents, &next->link);
+        gecko_free_kernel_memory(next);
+    }
+}
+
+/*
+ * path to logical block through the block tree: offsets[0] is the
+ * i_block slot and each further offset an entry of the next indirect
+ * block down. the number of offsets, 0 past the largest file
+ */
+static int block_path(ext2_filesystem_t* fs, uint32_t logical, uint32_t offsets[4]) {
+    uint64_t per_block = fs->block_size / sizeof(uint32_t);
+    uint64_t index = logical;
+    
+    if (index < EXT2_DIRECT_BLOCKS) {
+        offsets[0] = index;
+        return 1;
+    }
+    
+    index -= EXT2_DIRECT_BLOCKS;
+    if (index < per_block) {
+        offsets[0] = EXT2_IND_BLOCK;
+        offsets[1] = index;
+        return 2;
+    }
+    
+    index -= per_block;
+    if (index < per_block * per_block) {
+        offsets[0] = EXT2_DIND_BLOCK;
+        offsets[1] = index / per_block;
+        offsets[2] = index % per_block;
+        return 3;
+    }
+    
+    index -= per_block * per_block;
+    if (index < per_block * per_block * per_block) {
+        offsets[0] = EXT2_TIND_BLOCK;
+        offsets[1] = index / (per_block * per_block);
+        offsets[2] = index / per_block % per_block;
+        offsets[3] = index % per_block;
+        return 4;
+    }
+    
+    return 0;
+}
+
+/*
+ * walk the block tree of inode down to logical block. with create, holes
+ * on the way are filled with blocks from goal on, indirect blocks
+ * landing just before the data they map, and inode is updated for the
+ * caller to write back. *run is the number of blocks from logical on
+ * that follow it on the device, as far as one indirect block tells.
+ * the block, 0 for a hole, -1 on error or past the largest file
+ */
+static uint32_t map_block(ext2_filesystem_t* fs, ext2_inode_t* inode, uint32_t logical, int create, uint32_t goal,
+                          uint32_t* run) {
+    uint32_t offsets[4];
+    int depth = block_path(fs, logical, offsets);
+    *run = 1;
+    if (depth == 0) {
+        return (uint32_t)-1;
+    }
+    
+    /* slot holds the next block down, in the inode or in the indirect block pinned as parent */
+    buffer_head_t* parent = NULL;
+    uint32_t* slot = &inode->i_block[offsets[0]];
+    uint32_t block = 0;
+    
+    for (int level = 0; ; level++) {
+        block = *slot;
+        if (block == 0) {
+            if (!create) {
+                break;
+            }
+            if (parent && !block_writable(fs, parent->block)) {
+                block = (uint32_t)-1;
+                break;
+            }
+            
+            block = allocate_block(fs, goal);
+            if (block == (uint32_t)-1) {
+                break;
+            }
+            if (level < depth - 1) {
+                /* a new indirect block maps nothing yet */
+                buffer_head_t* bh = new_buffer(fs, block);
+                if (!bh) {
+                    free_block(fs, block);
+                    block = (uint32_t)-1;
+                    break;
+                }
+                buffer_cache_mark_dirty(bh);
+                buffer_cache_release(bh);
+            }
+            
+            *slot = block;
+            inode->i_blocks += fs->block_size / 512;
+            if (parent) {
+                buffer_cache_mark_dirty(parent);
+            }
+            goal = block + 1;
+        }
+        
+        if (level == depth - 1) {
+            uint32_t slots = parent ? fs->block_size / sizeof(uint32_t) - offsets[level] : EXT2_DIRECT_BLOCKS - offsets[0];
+            while (*run < slots && slot[*run] == block + *run) {
+                (*run)++;
+            }
+            break;
+        }
+        
+        buffer_head_t* bh = read_buffer(fs, block);
+        buffer_cache_release(parent);
+        parent = bh;
+        if (!bh) {
+            block = (uint32_t)-1;
+            break;
+        }
+        slot = (uint32_t*)bh->data + offsets[level + 1];
+    }
+    
+    buffer_cache_release(parent);
+    return block;
+}
+
+/*
+ * device block holding logical block of a file, 0 for a hole and -1 on
+ * error. answered from the inode's cached extents where possible, a miss
+ * walks the block tree and caches the run found there
+ */
+static uint32_t lookup_block(ext2_filesystem_t* fs, uint32_t inode_num, const ext2_inode_t* inode, uint32_t logical) {
+    ext2_block_map_t* map = get_block_map(fs, inode_num);
+    if (map) {
+        rb_node_t* node = rb_tree_find(&map->extents, &logical, extent_key_compare);
+        if (node) {
+            ext2_extent_t* extent = rb_entry(node, ext2_extent_t, link);
+            return extent->physical + (logical - extent->logical);
+        }
+    }
+    
+    /* the inode is only written when blocks are created */
+    uint32_t run;
+    uint32_t block = map_block(fs, (ext2_inode_t*)inode, logical, 0, 0, &run);
+    if (map && block != 0 && block != (uint32_t)-1) {
+        cache_extent(map, logical, block, run);
+    }
+    return block;
+}
+
+/*
+ * goal for the data block at index of a file: right after the block
+ * before it. the first block goes in the inode's group, at one of 16
+ * offsets picked by inode number so files written side by side do not
+ * interleave their blocks
+ */
+static uint32_t data_goal(ext2_filesystem_t* fs, uint32_t inode_num, const ext2_inode_t* inode, uint32_t index) {
+    if (index > 0) {
+        uint32_t prev = lookup_block(fs, inode_num, inode, index - 1);
+        if (prev != 0 && prev != (uint32_t)-1) {
+            return prev + 1;
+        }
+    }
+    
+    uint32_t colour = ((inode_num - 1) % 16) * (fs->blocks_per_group / 16);
+    return group_first_block(fs, inode_group(fs, inode_num)) + colour;
+}
+
+/*
+ * like lookup_block, but a hole is filled with a new block, along with
+ * any indirect blocks missing above it. the caller writes inode back
+ */
+static uint32_t create_block(ext2_filesystem_t* fs, uint32_t inode_num, ext2_inode_t* inode, uint32_t logical) {
+    uint32_t block = lookup_block(fs, inode_num, inode, logical);
+    if (block != 0) {
+        return block;
+    }
+    
+    uint32_t run;
+    block = map_block(fs, inode, logical, 1, data_goal(fs, inode_num, inode, logical), &run);
+    ext2_block_map_t* map = get_block_map(fs, inode_num);
+    if (map && block != (uint32_t)-1) {
+        cache_extent(map, logical, block, run);
+    }
+    return block;
+}
+
+/*
+ * group for a new directory (orlov). directories under the root are
+ * spread to the group with the fewest directories among those with at
+ * least average free inodes and blocks. deeper ones stay in or near the
+ * parent's group unless it is short of inodes or blocks or already holds
+ * more than its share of directories
+ */
+static int find_group_dir(ext2_filesystem_t* fs, uint32_t parent_inode) {
+    uint32_t groups = fs->group_count;
+    uint32_t parent_group = inode_group(fs, parent_inode);
+    uint32_t avg_free_inodes = fs->superblock->s_free_inodes_count / groups;
+    uint32_t avg_free_blocks = fs->superblock->s_free_blocks_count / groups;
+    
+    if (parent_inode == EXT2_ROOT_INODE) {
+        int best = -1;
+        uint32_t best_dirs = (uint32_t)-1;
+        for (uint32_t i = 0; i < groups; i++) {
+            uint32_t group = (fs->dir_group_rotor + i) % groups;
+            ext2_group_desc_t* desc = &fs->group_descs[group];
+            if (desc->bg_used_dirs_count < best_dirs &&
+                desc->bg_free_inodes_count > 0 &&
+                desc->bg_free_inodes_count >= avg_free_inodes &&
+                desc->bg_free_blocks_count >= avg_free_blocks) {
+                best = group;
+                best_dirs = desc->bg_used_dirs_count;
+            }
+        }
+        if (best >= 0) {
+            /* ties go to the next group the next time */
+            fs->dir_group_rotor = best + 1;
+            return best;
+        }
+    } else {
+        uint32_t dirs = 0;
+        for (uint32_t group = 0; group < groups; group++) {
+            dirs += fs->group_descs[group].bg_used_dirs_count;
+        }
+        
+        uint32_t max_dirs = dirs / groups + fs->inodes_per_group / 16;
+        uint32_t min_inodes = avg_free_inodes > fs->inodes_per_group / 4 ? avg_free_inodes - fs->inodes_per_group / 4 : 1;
+        uint32_t min_blocks = avg_free_blocks > fs->blocks_per_group / 4 ? avg_free_blocks - fs->blocks_per_group / 4 : 1;
+        
+        for (uint32_t i = 0; i < groups; i++) {
+            uint32_t group = (parent_group + i) % groups;
+            ext2_group_desc_t* desc = &fs->group_descs[group];
+            if (desc->bg_used_dirs_count < max_dirs &&
+                desc->bg_free_inodes_count >= min_inodes &&
+                desc->bg_free_blocks_count >= min_blocks) {
+                return group;
+            }
+        }
+    }
+    
+    /* any group with its share of free inodes, then any with one at all */
+    for (uint32_t i = 0; i < groups; i++) {
+        uint32_t group = (parent_group + i) % groups;
+        uint32_t free_inodes = fs->group_descs[group].bg_free_inodes_count;
+        if (free_inodes > 0 && free_inodes >= avg_free_inodes) {
+            return group;
+        }
+    }
+    for (uint32_t i = 0; i < groups; i++) {
+        uint32_t group = (parent_group + i) % groups;
+        if (fs->group_descs[group].bg_free_inodes_count > 0) {
+            return group;
+        }
+    }
+    
+    return -1;
+}
+
+/*
+ * group for a new file: the parent's group while it has inodes and
+ * blocks left, else a quadratic probe from it and finally a linear scan
+ */
+static int find_group_other(ext2_filesystem_t* fs, uint32_t parent_inode) {
+    uint32_t groups = fs->group_count;
+    uint32_t parent_group = inode_group(fs, parent_inode);
+    ext2_group_desc_t* desc = &fs->group_descs[parent_group];
+    if (desc->bg_free_inodes_count > 0 && desc->bg_free_blocks_count > 0) {
+        return parent_group;
+    }
+    
+    /* files of one directory overflow to the same groups, different
+     * directories to different ones */
+    uint32_t group = (parent_group + parent_inode) % groups;
+    for (uint32_t i = 1; i < groups; i <<= 1) {
+        group = (group + i) % groups;
+        desc = &fs->group_descs[group];
+        if (desc->bg_free_inodes_count > 0 && desc->bg_free_blocks_count > 0) {
+            return group;
+        }
+    }
+    
+    for (uint32_t i = 0; i < groups; i++) {
+        group = (parent_group + i) % groups;
+        if (fs->group_descs[group].bg_free_inodes_count > 0) {
+            return group;
+        }
+    }
+    
+    return -1;
+}
+
+static uint32_t allocate_inode(ext2_filesystem_t* fs, uint32_t parent_inode, int directory) {
+    int group = directory ? find_group_dir(fs, parent_inode) : find_group_other(fs, parent_inode);
+    if (group < 0) {
+        return (uint32_t)-1;
+    }
+    
+    /* the hint is the lowest free inode of the group */
+    ext2_group_desc_t* desc = &fs->group_descs[group];
+    ext2_group_info_t* info = &fs->groups[group];
+    uint32_t bit = info->inode_hint;
+    if (bit >= fs->inodes_per_group) {
+        return (uint32_t)-1;
+    }
+    
+    take_bit(info->inode_bitmap, fs->inodes_per_group, &info->inode_hint, bit);
+    info->dirty = 1;
+    
+    desc->bg_free_inodes_count--;
+    fs->superblock->s_free_inodes_count--;
+    if (directory) {
+        desc->bg_used_dirs_count++;
+    }
+    
+    return group * fs->inodes_per_group + bit + 1;
+}
+
+static void free_inode(ext2_filesystem_t* fs, uint32_t inode_num, int directory) {
+    uint32_t group = inode_group(fs, inode_num);
+    ext2_group_desc_t* desc = &fs->group_descs[group];
+    ext2_group_info_t* info = &fs->groups[group];
+    if (release_bit(info->inode_bitmap, &info->inode_hint, (inode_num - 1) % fs->inodes_per_group) == 0) {
+        info->dirty = 1;
+        desc->bg_free_inodes_count++;
+        fs->superblock->s_free_inodes_count++;
+        if (directory) {
+            desc->bg_used_dirs_count--;
+        }
+    }
+}
+
+/*
+ * free block and, for an indirect block depth levels above the data,
+ * every block under it
+ */
+static void release_tree(ext2_filesystem_t* fs, uint32_t block_num, int depth) {
+    if (depth > 0) {
+        buffer_head_t* bh = read_buffer(fs, block_num);
+        if (bh) {
+            uint32_t* entries = (uint32_t*)bh->data;
+            for (uint32_t i = 0; i < fs->block_size / sizeof(uint32_t); i++) {
+                if (entries[i] != 0) {
+                    release_tree(fs, entries[i], depth - 1);
+                }
+            }
+            buffer_cache_release(bh);
+        }
+    }
+    free_block(fs, block_num);
+}
+
+/*
+ * free the data and indirect blocks of an inode
+ */
+static void release_blocks(ext2_filesystem_t* fs, uint32_t inode_num, ext2_inode_t* inode) {
+    drop_block_map(fs, inode_num);
+    for (int i = 0; i <= EXT2_TIND_BLOCK; i++) {
+        if (inode->i_block[i] != 0) {
+            release_tree(fs, inode->i_block[i], i < EXT2_IND_BLOCK ? 0 : i - EXT2_IND_BLOCK + 1);
+            inode->i_block[i] = 0;
+        }
+    }
+    inode->i_blocks = 0;
+}
+
+/*
+ * write the inode and first block of an empty directory holding . and ..
+ */
+static int init_directory(ext2_filesystem_t* fs, uint32_t inode_num, uint32_t parent_inode, uint32_t mode) {
+    uint32_t block_num = allocate_block(fs, group_first_block(fs, inode_group(fs, inode_num)));
+    if (block_num == (uint32_t)-1) {
+        return -1;
+    }
+    
+    buffer_head_t* bh = new_buffer(fs, block_num);
+    if (!bh) {
+        free_block(fs, block_num);
+        return -1;
+    }
+    
+    ext2_dir_entry_t* dot = (ext2_dir_entry_t*)bh->data;
+    dot->inode = inode_num;
+    dot->name_len = 1;
+    dot->rec_len = EXT2_DIR_REC_LEN(1);
+    dot->name[0] = '.';
+    
+    ext2_dir_entry_t* dot_dot = (ext2_dir_entry_t*)((char*)bh->data + dot->rec_len);
+    dot_dot->inode = parent_inode;
+    dot_dot->name_len = 2;
+    dot_dot->rec_len = fs->block_size - dot->rec_len;
+    dot_dot->name[0] = '.';
+    dot_dot->name[1] = '.';
+    
+    buffer_cache_mark_dirty(bh);
+    buffer_cache_release(bh);
+    
+    ext2_inode_t inode;
+    memset(&inode, 0, sizeof(ext2_inode_t));
+    inode.i_mode = mode;
+    inode.i_size = fs->block_size;
+    inode.i_links_count = 2;
+    inode.i_blocks = fs->block_size / 512;
+    inode.i_block[0] = block_num;
+    
+    return ext2_write_inode(fs, inode_num, &inode);
+}
+
+int ext2_init(void) {
+    if (ext2_initialized) {
+        return 0;
+    }
+    
+    LOG_INFO("ext2", "initializing ext2 filesystem driver");
+    
+    mounted_filesystems = NULL;
+    ext2_initialized = 1;
+    
+    if (vfs_register_filesystem("ext2", &ext2_inode_ops, &ext2_sb_ops, 0) != 0) {
+        LOG_ERROR("ext2", "failed to register ext2");
+    }
+    
+    LOG_INFO("ext2", "ext2 filesystem driver initialized successfully");
+    return 0;
+}
+
+static void free_filesystem(ext2_filesystem_t* fs) {
+    while (!list_is_empty(&fs->block_map_lru)) {
+        free_block_map(fs, (ext2_block_map_t*)list_get_head(&fs->block_map_lru)->data);
+    }
+    if (fs->groups) {
+        write_bitmaps(fs);
+    }
+    if (buffer_cache_invalidate(&fs->cache) != 0) {
+        LOG_WARNING("ext2", "%s: dirty blocks lost on unmount", fs->device_name);
+    }
+    
+    if (fs->groups) {
+        for (uint32_t group = 0; group < fs->group_count; group++) {
+            if (fs->groups[group].block_bitmap) {
+                gecko_free_kernel_memory(fs->groups[group].block_bitmap);
+            }
+            if (fs->groups[group].inode_bitmap) {
+                gecko_free_kernel_memory(fs->groups[group].inode_bitmap);
+            }
+        }
+        gecko_free_kernel_memory(fs->groups);
+    }
+    if (fs->group_descs) {
+        gecko_free_kernel_memory(fs->group_descs);
+    }
+    if (fs->superblock) {
+        gecko_free_kernel_memory(fs->superblock);
+    }
+    if (fs->owns_device) {
+        gecko_free_kernel_memory(fs->device);
+    }
+    gecko_free_kernel_memory(fs);
+}
+
+/*
+ * lay out the superblock, group descriptors, bitmaps and root directory
+ * of a fresh filesystem over the image. every group starts with its block
+ * bitmap, inode bitmap and inode table, group 0 after the superblock and
+ * descriptor table
+ */
+static int format_image(ext2_filesystem_t* fs) {
+    ext2_superblock_t* sb = fs->superblock;
+    uint32_t blocks_count = fs->device_size / fs->block_size;
+    uint32_t first_data_block = fs->block_size == 1024 ? 1 : 0;
+    
+    fs->blocks_per_group = fs->block_size * 8;
+    fs->group_count = (blocks_count - first_data_block + fs->blocks_per_group - 1) / fs->blocks_per_group;
+    
+    uint32_t inodes_per_block = fs->block_size / EXT2_INODE_SIZE;
+    uint32_t inodes_per_group = (fs->device_size / EXT2_BYTES_PER_INODE + fs->group_count - 1) / fs->group_count;
+    inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    if (inodes_per_group > fs->block_size * 8) {
+        inodes_per_group = fs->block_size * 8;
+    }
+    fs->inodes_per_group = inodes_per_group;
+    
+    uint32_t inode_table_blocks = inodes_per_group / inodes_per_block;
+    uint32_t descriptor_blocks = (fs->group_count * sizeof(ext2_group_desc_t) + fs->block_size - 1) / fs->block_size;
+    
+    /* a last group too small for its own metadata is left out */
+    uint32_t last_first = first_data_block + (fs->group_count - 1) * fs->blocks_per_group;
+    uint32_t overhead = 2 + inode_table_blocks + (fs->group_count == 1 ? 1 + descriptor_blocks : 0);
+    if (blocks_count - last_first <= overhead) {
+        if (fs->group_count == 1) {
+            LOG_ERROR("ext2", "%s: image of %u blocks is too small", fs->device_name, blocks_count);
+            return -1;
+        }
+        fs->group_count--;
+        blocks_count = last_first;
+    }
+    
+    sb->s_magic = EXT2_MAGIC;
+    sb->s_rev_level = 1;
+    sb->s_log_block_size = fs->block_size == 4096 ? 2 : fs->block_size == 2048 ? 1 : 0;
+    sb->s_blocks_count = blocks_count;
+    sb->s_first_data_block = first_data_block;
+    sb->s_blocks_per_group = fs->blocks_per_group;
+    sb->s_frags_per_group = fs->blocks_per_group;
+    sb->s_inodes_per_group = inodes_per_group;
+    sb->s_inodes_count = inodes_per_group * fs->group_count;
+    sb->s_first_ino = 11;
+    sb->s_inode_size = EXT2_INODE_SIZE;
+    
+    fs->group_descs = gecko_alloc_kernel_memory(fs->group_count * sizeof(ext2_group_desc_t));
+    if (!fs->group_descs) {
+        return -1;
+    }
+    memset(fs->group_descs, 0, fs->group_count * sizeof(ext2_group_desc_t));
+    
+    fs->groups = gecko_alloc_kernel_memory(fs->group_count * sizeof(ext2_group_info_t));
+    if (!fs->groups) {
+        return -1;
+    }
+    memset(fs->groups, 0, fs->group_count * sizeof(ext2_group_info_t));
+    
+    for (uint32_t group = 0; group < fs->group_count; group++) {
+        ext2_group_desc_t* desc = &fs->group_descs[group];
+        uint32_t first = group_first_block(fs, group);
+        uint32_t group_blocks = blocks_count - first < fs->blocks_per_group ? blocks_count - first : fs->blocks_per_group;
+        uint32_t meta = first + (group == 0 ? 1 + descriptor_blocks : 0);
+        
+        desc->bg_block_bitmap = meta;
+        desc->bg_inode_bitmap = meta + 1;
+        desc->bg_inode_table = meta + 2;
+        
+        uint32_t used = desc->bg_inode_table + inode_table_blocks - first;
+        desc->bg_free_blocks_count = group_blocks - used;
+        desc->bg_free_inodes_count = inodes_per_group;
+        
+        /* metadata is in use and bits past the end of a short group stay set */
+        ext2_group_info_t* info = &fs->groups[group];
+        info->block_bitmap = gecko_alloc_kernel_memory(fs->block_size);
+        info->inode_bitmap = gecko_alloc_kernel_memory(fs->block_size);
+        if (!info->block_bitmap || !info->inode_bitmap) {
+            return -1;
+        }
+        memset(info->block_bitmap, 0, fs->block_size);
+        memset(info->inode_bitmap, 0, fs->block_size);
+        
+        set_bits(info->block_bitmap, 0, used);
+        set_bits(info->block_bitmap, group_blocks, fs->blocks_per_group);
+        set_bits(info->inode_bitmap, inodes_per_group, fs->block_size * 8);
+        if (group == 0) {
+            /* inodes below s_first_ino are reserved, the root among them */
+            set_bits(info->inode_bitmap, 0, sb->s_first_ino - 1);
+            desc->bg_free_inodes_count -= sb->s_first_ino - 1;
+        }
+        
+        info->block_hint = used;
+        info->inode_hint = group == 0 ? sb->s_first_ino - 1 : 0;
+        info->dirty = 1;
+        
+        sb->s_free_blocks_count += desc->bg_free_blocks_count;
+        sb->s_free_inodes_count += desc->bg_free_inodes_count;
+    }
+    
+    if (init_directory(fs, EXT2_ROOT_INODE, EXT2_ROOT_INODE, EXT2_S_IFDIR | 0755) != 0) {
+        LOG_ERROR("ext2", "failed to create root inode");
+        return -1;
+    }
+    fs->group_descs[0].bg_used_dirs_count++;
+    
+    sb->s_state = 1;
+    return 0;
+}
+
+int ext2_mount(const char* device) {
+    if (ext2_get_filesystem(device)) {
+        LOG_WARNING("ext2", "%s is already mounted", device);
+        return -1;
+    }
+    
+    /* with no block layer the image lives in kernel memory */
+    void* image = gecko_alloc_kernel_memory(EXT2_DEFAULT_DEVICE_SIZE);
+    if (!image) {
+        LOG_ERROR("ext2", "failed to allocate image for %s", device);
+        return -1;
+    }
+    
+    if (ext2_mount_image(device, image, EXT2_DEFAULT_DEVICE_SIZE) != 0) {
+        gecko_free_kernel_memory(image);
+        return -1;
+    }
+    
+    ext2_get_filesystem(device)->owns_device = 1;
+    return 0;
+}
+
+int ext2_mount_image(const char* device, void* image, size_t size) {
+    ext2_filesystem_t* fs = gecko_alloc_kernel_memory(sizeof(ext2_filesystem_t));
+    if (!fs) {
+        LOG_ERROR("ext2", "failed to allocate filesystem structure");
+        return -1;
+    }
+    
+    memset(fs, 0, sizeof(ext2_filesystem_t));
+    
+    fs->device_name = device;
+    fs->device = image;
+    fs->device_size = size;
+    fs->block_size = 1024;
+    
+    fs->cache.context = fs;
+    fs->cache.block_size = fs->block_size;
+    fs->cache.read_block = device_read_block;
+    fs->cache.write_block = device_write_block;
+    radix_tree_init(&fs->block_maps);
+    list_init(&fs->block_map_lru);
+    
+    fs->superblock = gecko_alloc_kernel_memory(sizeof(ext2_superblock_t));
+    if (!fs->superblock) {
+        gecko_free_kernel_memory(fs);
+        return -1;
+    }
+    memset(fs->superblock, 0, sizeof(ext2_superblock_t));
+    
+    if (format_image(fs) != 0) {
+        free_filesystem(fs);
+        return -1;
+    }
+    
+    ext2_filesystem_t* current = mounted_filesystems;
+    while (current && current->next) {
+        current = current->next;
+    }
+    if (current) {
+        current->next = fs;
+    } else {
+        mounted_filesystems = fs;
+    }
+    
+    LOG_INFO("ext2", "mounted ext2 filesystem on %s: %u blocks in %u groups", device,
+             fs->superblock->s_blocks_count, fs->group_count);
+    return 0;
+}
+
+/*
+ * pinned buffer of the inode table block holding inode_num and the
+ * inode's offset in it
+ */
+static buffer_head_t* inode_buffer(ext2_filesystem_t* fs, uint32_t inode_num, uint32_t* inode_offset) {
+    if (inode_num == 0 || inode_num > fs->superblock->s_inodes_count) {
+        return NULL;
+    }
+    
+    /* slots are s_inode_size apart so none straddles a block */
+    uint32_t group = inode_group(fs, inode_num);
+    uint32_t inode_index = (inode_num - 1) % fs->inodes_per_group;
+    uint32_t inode_size = fs->superblock->s_inode_size;
+    uint32_t inode_block = fs->group_descs[group].bg_inode_table + (inode_index * inode_size) / fs->block_size;
+    *inode_offset = (inode_index * inode_size) % fs->block_size;
+    
+    return read_buffer(fs, inode_block);
+}
+
+int ext2_read_inode(ext2_filesystem_t* fs, uint32_t inode_num, ext2_inode_t* inode) {
+    uint32_t inode_offset;
+    buffer_head_t* bh = inode_buffer(fs, inode_num, &inode_offset);
+    if (!bh) {
+        return -1;
+    }
+    
+    memcpy(inode, (char*)bh->data + inode_offset, sizeof(ext2_inode_t));
+    buffer_cache_release(bh);
+    return 0;
+}
+
+int ext2_write_inode(ext2_filesystem_t* fs, uint32_t inode_num, ext2_inode_t* inode) {
+    uint32_t inode_offset;
+    buffer_head_t* bh = inode_buffer(fs, inode_num, &inode_offset);
+    if (!bh) {
+        return -1;
     }
-    return (uint32_t)-1;
+    
+    if (!block_writable(fs, bh->block)) {
+        buffer_cache_release(bh);
+        return -1;
+    }
+    
+    memcpy((char*)bh->data + inode_offset, inode, sizeof(ext2_inode_t));
+    buffer_cache_mark_dirty(bh);
+    buffer_cache_release(bh);
+    return 0;
 }
 
-static uint32_t allocate_block(ext2_filesystem_t* fs) {
-    ext2_group_desc_t* group = &fs->group_descs[0];
-    uint8_t* block_bitmap = gecko_alloc_kernel_memory(fs->block_size);
-    if (!block_bitmap) return (uint32_t)-1;
+int ext2_read_block(ext2_filesystem_t* fs, uint32_t block_num, void* buffer) {
+    buffer_head_t* bh = read_buffer(fs, block_num);
+    if (!bh) {
+        return -1;
+    }
     
-    if (ext2_read_block(fs, group->bg_block_bitmap, block_bitmap) != 0) {
-        gecko_free_kernel_memory(block_bitmap);
-        return (uint32_t)-1;
+    memcpy(buffer, bh->data, fs->block_size);
+    buffer_cache_release(bh);
+    return 0;
+}
+
+int ext2_write_block(ext2_filesystem_t* fs, uint32_t block_num, const void* buffer) {
+    if (!block_writable(fs, block_num)) {
+        return -1;
     }
     
-    uint32_t block_num = find_free_bit(block_bitmap, fs->block_size);
-    if (block_num == (uint32_t)-1) {
-        gecko_free_kernel_memory(block_bitmap);
-        return (uint32_t)-1;
+    buffer_head_t* bh = buffer_cache_get(&fs->cache, block_num);
+    if (!bh) {
+        return -1;
     }
     
-    block_bitmap[block_num / 8] |= (1 << (block_num % 8));
+    memcpy(bh->data, buffer, fs->block_size);
+    buffer_cache_mark_dirty(bh);
+    buffer_cache_release(bh);
+    return 0;
+}
+
+int ext2_write_blocks(ext2_filesystem_t* fs, uint32_t block_num, uint32_t count, const void* buffer) {
+    if (block_num + count > fs->superblock->s_blocks_count) {
+        return -1;
+    }
     
-    if (ext2_write_block(fs, group->bg_block_bitmap, block_bitmap) != 0) {
-        gecko_free_kernel_memory(block_bitmap);
-        return (uint32_t)-1;
+    size_t offset = block_num * fs->block_size;
+    size_t size = count * fs->block_size;
+    if (offset + size > fs->device_size) {
+        return -1;
     }
     
-    group->bg_free_blocks_count--;
-    gecko_free_kernel_memory(block_bitmap);
+    /* the run goes to the device in one piece, cached copies follow it */
+    memcpy((char*)fs->device + offset, buffer, size);
+    for (uint32_t i = 0; i < count; i++) {
+        buffer_cache_update(&fs->cache, block_num + i, (const char*)buffer + i * fs->block_size);
+    }
+    return 0;
+}
+
+int ext2_sync(ext2_filesystem_t* fs) {
+    if (write_bitmaps(fs) != 0) {
+        return -1;
+    }
+    return buffer_cache_sync(&fs->cache);
+}
+
+ext2_filesystem_t* ext2_get_filesystem(const char* device) {
+    for (ext2_filesystem_t* fs = mounted_filesystems; fs; fs = fs->next) {
+        if (strcmp(fs->device_name, device) == 0) {
+            return fs;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * pinned buffer of logical block of a directory, NULL for a hole
+ */
+static buffer_head_t* read_dir_block(ext2_filesystem_t* fs, uint32_t dir_num, const ext2_inode_t* dir, uint32_t logical) {
+    uint32_t block_num = lookup_block(fs, dir_num, dir, logical);
+    if (block_num == 0 || block_num == (uint32_t)-1) {
+        return NULL;
+    }
+    return read_buffer(fs, block_num);
+}
+
+/*
+ * pinned zeroed buffer of a new block at the end of directory dir, its
+ * place in *logical. the caller writes dir back
+ */
+static buffer_head_t* append_dir_block(ext2_filesystem_t* fs, uint32_t dir_num, ext2_inode_t* dir, uint32_t* logical) {
+    *logical = dir->i_size / fs->block_size;
+    uint32_t block_num = create_block(fs, dir_num, dir, *logical);
+    if (block_num == (uint32_t)-1) {
+        LOG_WARNING("ext2", "directory %u is full", dir_num);
+        return NULL;
+    }
     
-    return group->bg_block_bitmap + 1 + block_num;
+    /* the block stays mapped if this fails, the size keeps it out of lookups */
+    buffer_head_t* bh = new_buffer(fs, block_num);
+    if (bh) {
+        dir->i_size += fs->block_size;
+    }
+    return bh;
 }
 
-static uint32_t allocate_inode(ext2_filesystem_t* fs) {
-    ext2_group_desc_t* group = &fs->group_descs[0];
-    uint8_t* inode_bitmap = gecko_alloc_kernel_memory(fs->block_size);
-    if (!inode_bitmap) return (uint32_t)-1;
+/*
+ * name in one directory block, *prev is the entry before it or NULL
+ */
+static ext2_dir_entry_t* search_block(ext2_filesystem_t* fs, buffer_head_t* bh, const char* name, size_t name_len,
+                                      ext2_dir_entry_t** prev) {
+    ext2_dir_entry_t* before = NULL;
+    uint32_t offset = 0;
+    while (offset + sizeof(ext2_dir_entry_t) <= fs->block_size) {
+        ext2_dir_entry_t* entry = (ext2_dir_entry_t*)((char*)bh->data + offset);
+        if (entry->rec_len == 0) {
+            break;
+        }
+        if (entry->inode != 0 && entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0) {
+            if (prev) {
+                *prev = before;
+            }
+            return entry;
+        }
+        
+        before = entry;
+        offset += entry->rec_len;
+    }
     
-    if (ext2_read_block(fs, group->bg_inode_bitmap, inode_bitmap) != 0) {
-        gecko_free_kernel_memory(inode_bitmap);
-        return (uint32_t)-1;
+    return NULL;
+}
+
+/*
+ * put an entry for inode_num in the first slack of the block big enough
+ * for it and dirty the block, -1 when there is none
+ */
+static int insert_into_block(ext2_filesystem_t* fs, buffer_head_t* bh, const char* name, size_t name_len, uint32_t inode_num) {
+    if (!block_writable(fs, bh->block)) {
+        return -1;
     }
     
-    uint32_t inode_num = find_free_bit(inode_bitmap, fs->block_size);
-    if (inode_num == (uint32_t)-1) {
-        gecko_free_kernel_memory(inode_bitmap);
-        return (uint32_t)-1;
+    size_t needed = EXT2_DIR_REC_LEN(name_len);
+    uint32_t offset = 0;
+    while (offset + sizeof(ext2_dir_entry_t) <= fs->block_size) {
+        ext2_dir_entry_t* entry = (ext2_dir_entry_t*)((char*)bh->data + offset);
+        if (entry->rec_len == 0) {
+            break;
+        }
+        
+        size_t used = entry->inode ? EXT2_DIR_REC_LEN(entry->name_len) : 0;
+        if (entry->rec_len >= used + needed) {
+            /* split the slack off the end of the entry */
+            ext2_dir_entry_t* new_entry = entry;
+            if (used > 0) {
+                new_entry = (ext2_dir_entry_t*)((char*)entry + used);
+                new_entry->rec_len = entry->rec_len - used;
+                entry->rec_len = used;
+            }
+            new_entry->inode = inode_num;
+            new_entry->name_len = name_len;
+            memcpy(new_entry->name, name, name_len);
+            
+            buffer_cache_mark_dirty(bh);
+            return 0;
+        }
+        
+        offset += entry->rec_len;
     }
     
-    inode_bitmap[inode_num / 8] |= (1 << (inode_num % 8));
+    return -1;
+}
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0];
+    uint32_t b1 = buf[1];
+    
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+    
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/*
+ * index hash of a name: the tea hash of ext3 over signed chars with no
+ * seed. the low bit stays clear, in the index it marks a continued hash
+ */
+static uint32_t dx_hash(const char* name, size_t name_len) {
+    uint32_t buf[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    const signed char* p = (const signed char*)name;
+    int len = (int)name_len;
+    
+    while (len > 0) {
+        /* 16 bytes at a time packed into words, padded with the length left */
+        uint32_t in[4];
+        uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+        pad |= pad << 16;
+        
+        uint32_t val = pad;
+        int words = 0;
+        for (int i = 0; i < len && i < 16; i++) {
+            val = (uint32_t)(int)p[i] + (val << 8);
+            if (i % 4 == 3) {
+                in[words++] = val;
+                val = pad;
+            }
+        }
+        if (words < 4) {
+            in[words++] = val;
+        }
+        while (words < 4) {
+            in[words++] = pad;
+        }
+        
+        tea_transform(buf, in);
+        len -= 16;
+        p += 16;
+    }
     
-    if (ext2_write_block(fs, group->bg_inode_bitmap, inode_bitmap) != 0) {
-        gecko_free_kernel_memory(inode_bitmap);
+    /* the top hash is kept free as an end of directory marker */
+    uint32_t hash = buf[0] & ~1u;
+    return hash == 0xFFFFFFFE ? 0xFFFFFFFC : hash;
+}
+
+/* a step on the path from the index root down to a leaf */
+typedef struct {
+    buffer_head_t* bh;
+    ext2_dx_entry_t* entries;
+    ext2_dx_entry_t* at;                /* entry followed down */
+} dx_frame_t;
+
+/* an entry of a leaf being split */
+typedef struct {
+    uint32_t hash;
+    uint16_t offset;
+    uint16_t size;
+} dx_map_t;
+
+static inline ext2_dx_countlimit_t* dx_countlimit(ext2_dx_entry_t* entries) {
+    return (ext2_dx_countlimit_t*)entries;
+}
+
+static inline ext2_dx_root_info_t* dx_root_info(buffer_head_t* root) {
+    return (ext2_dx_root_info_t*)((char*)root->data + EXT2_DX_ROOT_INFO);
+}
+
+static inline uint32_t dx_root_limit(ext2_filesystem_t* fs) {
+    return (fs->block_size - EXT2_DX_ROOT_INFO - sizeof(ext2_dx_root_info_t)) / sizeof(ext2_dx_entry_t);
+}
+
+static inline uint32_t dx_node_limit(ext2_filesystem_t* fs) {
+    return (fs->block_size - sizeof(ext2_dir_entry_t)) / sizeof(ext2_dx_entry_t);
+}
+
+static void dx_release(dx_frame_t* frames, int levels) {
+    for (int level = 0; level <= levels; level++) {
+        buffer_cache_release(frames[level].bh);
+    }
+}
+
+/*
+ * walk the index of dir down to the leaf for hash, at each level taking
+ * the last entry whose hash is not above it. frames 0 to *levels stay
+ * pinned for dx_release. the leaf's logical block, -1 when the index is
+ * damaged
+ */
+static uint32_t dx_probe(ext2_filesystem_t* fs, uint32_t dir_num, const ext2_inode_t* dir, uint32_t hash,
+                         dx_frame_t* frames, int* levels) {
+    buffer_head_t* bh = read_dir_block(fs, dir_num, dir, 0);
+    if (!bh) {
         return (uint32_t)-1;
     }
     
-    group->bg_free_inodes_count--;
-    gecko_free_kernel_memory(inode_bitmap);
+    ext2_dx_root_info_t* info = dx_root_info(bh);
+    if (info->reserved_zero != 0 || info->hash_version != EXT2_DX_HASH_TEA ||
+        info->info_length != sizeof(ext2_dx_root_info_t) || info->indirect_levels >= EXT2_DX_MAX_LEVELS) {
+        LOG_WARNING("ext2", "directory %u: bad index root", dir_num);
+        buffer_cache_release(bh);
+        return (uint32_t)-1;
+    }
     
-    return group->bg_inode_table + inode_num;
+    *levels = info->indirect_levels;
+    ext2_dx_entry_t* entries = (ext2_dx_entry_t*)(info + 1);
+    uint32_t limit = dx_root_limit(fs);
+    
+    for (int level = 0; ; level++) {
+        ext2_dx_countlimit_t* countlimit = dx_countlimit(entries);
+        frames[level].bh = bh;
+        if (countlimit->limit != limit || countlimit->count == 0 || countlimit->count > limit) {
+            LOG_WARNING("ext2", "directory %u: bad index node", dir_num);
+            dx_release(frames, level);
+            return (uint32_t)-1;
+        }
+        
+        ext2_dx_entry_t* low = entries + 1;
+        ext2_dx_entry_t* high = entries + countlimit->count - 1;
+        while (low <= high) {
+            ext2_dx_entry_t* middle = low + (high - low) / 2;
+            if (middle->hash > hash) {
+                high = middle - 1;
+            } else {
+                low = middle + 1;
+            }
+        }
+        frames[level].entries = entries;
+        frames[level].at = low - 1;
+        
+        if (level == *levels) {
+            return frames[level].at->block;
+        }
+        
+        bh = read_dir_block(fs, dir_num, dir, frames[level].at->block);
+        if (!bh) {
+            dx_release(frames, level);
+            return (uint32_t)-1;
+        }
+        entries = (ext2_dx_entry_t*)((char*)bh->data + sizeof(ext2_dir_entry_t));
+        limit = dx_node_limit(fs);
+    }
 }
 
-int ext2_init(void) {
-    if (ext2_initialized) {
-        return 0;
+/*
+ * move frames on to the next leaf when it may also hold names of hash,
+ * that is when its lowest hash continues hash. its logical block or -1
+ */
+static uint32_t dx_next_leaf(ext2_filesystem_t* fs, uint32_t dir_num, const ext2_inode_t* dir, uint32_t hash,
+                             dx_frame_t* frames, int levels) {
+    int level = levels;
+    while (frames[level].at + 1 >= frames[level].entries + dx_countlimit(frames[level].entries)->count) {
+        if (level == 0) {
+            return (uint32_t)-1;
+        }
+        level--;
     }
     
-    LOG_INFO("ext2", "initializing ext2 filesystem driver");
-    
-    mounted_filesystems = NULL;
-    ext2_initialized = 1;
+    frames[level].at++;
+    if ((frames[level].at->hash & ~1u) != hash) {
+        return (uint32_t)-1;
+    }
     
-    LOG_INFO("ext2", "ext2 filesystem driver initialized successfully");
-    return 0;
+    for (; level < levels; level++) {
+        buffer_head_t* bh = read_dir_block(fs, dir_num, dir, frames[level].at->block);
+        if (!bh) {
+            return (uint32_t)-1;
+        }
+        buffer_cache_release(frames[level + 1].bh);
+        frames[level + 1].bh = bh;
+        frames[level + 1].entries = (ext2_dx_entry_t*)((char*)bh->data + sizeof(ext2_dir_entry_t));
+        frames[level + 1].at = frames[level + 1].entries;
+    }
+    return frames[levels].at->block;
 }
 
-int ext2_mount(const char* device) {
-    ext2_filesystem_t* fs = gecko_alloc_kernel_memory(sizeof(ext2_filesystem_t));
-    if (!fs) {
-        LOG_ERROR("ext2", "failed to allocate filesystem structure");
+/*
+ * find name through the index of dir, reading only the leaves its hash
+ * leads to. 1 with the entry as for lookup_entry, 0 when it is not
+ * there and -1 when the index is damaged
+ */
+static int dx_lookup(ext2_filesystem_t* fs, uint32_t dir_num, const ext2_inode_t* dir, const char* name, size_t name_len,
+                     ext2_dir_entry_t** entry, buffer_head_t** bh, ext2_dir_entry_t** prev) {
+    uint32_t hash = dx_hash(name, name_len);
+    dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+    int levels;
+    uint32_t leaf = dx_probe(fs, dir_num, dir, hash, frames, &levels);
+    if (leaf == (uint32_t)-1) {
         return -1;
     }
     
-    memset(fs, 0, sizeof(ext2_filesystem_t));
+    int found = 0;
+    while (leaf != (uint32_t)-1) {
+        buffer_head_t* block = read_dir_block(fs, dir_num, dir, leaf);
+        if (block) {
+            *entry = search_block(fs, block, name, name_len, prev);
+            if (*entry) {
+                *bh = block;
+                found = 1;
+                break;
+            }
+            buffer_cache_release(block);
+        }
+        leaf = dx_next_leaf(fs, dir_num, dir, hash, frames, levels);
+    }
     
-    fs->device = (void*)device;
-    fs->device_size = 1024 * 1024;
-    fs->block_size = 1024;
-    fs->blocks_per_group = 8192;
-    fs->group_count = 1;
+    dx_release(frames, levels);
+    return found;
+}
+
+/*
+ * find name in directory dir. on success the entry's block stays pinned
+ * in *bh, and *prev is the entry before it in that block or NULL
+ */
+static ext2_dir_entry_t* lookup_entry(ext2_filesystem_t* fs, uint32_t dir_num, const ext2_inode_t* dir, const char* name,
+                                      buffer_head_t** bh, ext2_dir_entry_t** prev) {
+    size_t name_len = strlen(name);
+    ext2_dir_entry_t* entry = NULL;
     
-    fs->superblock = gecko_alloc_kernel_memory(sizeof(ext2_superblock_t));
-    if (!fs->superblock) {
-        gecko_free_kernel_memory(fs);
-        return -1;
+    /* . and .. sit in block 0 outside the index, a damaged index leaves
+     * the blocks to be searched one by one */
+    int dots = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+    if ((dir->i_flags & EXT2_INDEX_FL) && !dots && dx_lookup(fs, dir_num, dir, name, name_len, &entry, bh, prev) >= 0) {
+        return entry;
     }
     
-    memset(fs->superblock, 0, sizeof(ext2_superblock_t));
-    fs->superblock->s_magic = EXT2_MAGIC;
-    fs->superblock->s_log_block_size = 0;
-    fs->superblock->s_inodes_count = 1000;
-    fs->superblock->s_blocks_count = 8192;
-    fs->superblock->s_free_blocks_count = 7000;
-    fs->superblock->s_free_inodes_count = 900;
-    fs->superblock->s_blocks_per_group = 8192;
-    fs->superblock->s_inodes_per_group = 1000;
-    fs->superblock->s_first_ino = 11;
-    fs->superblock->s_inode_size = 128;
-    
-    fs->group_descs = gecko_alloc_kernel_memory(sizeof(ext2_group_desc_t));
-    if (!fs->group_descs) {
-        gecko_free_kernel_memory(fs->superblock);
-        gecko_free_kernel_memory(fs);
-        return -1;
+    uint32_t blocks = dir->i_size / fs->block_size;
+    for (uint32_t b = 0; b < blocks; b++) {
+        buffer_head_t* block = read_dir_block(fs, dir_num, dir, b);
+        if (!block) {
+            continue;
+        }
+        
+        entry = search_block(fs, block, name, name_len, prev);
+        if (entry) {
+            *bh = block;
+            return entry;
+        }
+        buffer_cache_release(block);
     }
     
-    memset(fs->group_descs, 0, sizeof(ext2_group_desc_t));
-    fs->group_descs->bg_block_bitmap = 3;
-    fs->group_descs->bg_inode_bitmap = 4;
-    fs->group_descs->bg_inode_table = 5;
-    fs->group_descs->bg_free_blocks_count = 7000;
-    fs->group_descs->bg_free_inodes_count = 900;
-    
-    fs->inode_table_start = 5;
-    fs->data_block_start = fs->inode_table_start + 100;
+    return NULL;
+}
+
+static uint32_t find_entry(ext2_filesystem_t* fs, uint32_t dir_num, const ext2_inode_t* dir, const char* name) {
+    buffer_head_t* bh;
+    ext2_dir_entry_t* entry = lookup_entry(fs, dir_num, dir, name, &bh, NULL);
+    if (!entry) {
+        return 0;
+    }
     
-    ext2_inode_t root_inode;
-    memset(&root_inode, 0, sizeof(ext2_inode_t));
-    root_inode.i_mode = EXT2_S_IFDIR | 0755;
-    root_inode.i_size = 1024;
-    root_inode.i_links_count = 2;
-    root_inode.i_blocks = 2;
+    uint32_t inode_num = entry->inode;
+    buffer_cache_release(bh);
+    return inode_num;
+}
+
+/*
+ * insert an entry for a block at hash after the one followed down frame
+ */
+static void dx_insert(dx_frame_t* frame, uint32_t hash, uint32_t block) {
+    ext2_dx_countlimit_t* countlimit = dx_countlimit(frame->entries);
+    ext2_dx_entry_t* new_entry = frame->at + 1;
+    memmove(new_entry + 1, new_entry, (frame->entries + countlimit->count - new_entry) * sizeof(ext2_dx_entry_t));
+    new_entry->hash = hash;
+    new_entry->block = block;
+    countlimit->count++;
+    buffer_cache_mark_dirty(frame->bh);
+}
+
+/*
+ * pinned new index node appended to dir, an empty entry spanning it
+ * hides it from linear scans
+ */
+static buffer_head_t* dx_new_node(ext2_filesystem_t* fs, uint32_t dir_num, ext2_inode_t* dir, uint32_t* logical) {
+    buffer_head_t* bh = append_dir_block(fs, dir_num, dir, logical);
+    if (bh) {
+        ((ext2_dir_entry_t*)bh->data)->rec_len = fs->block_size;
+        dx_countlimit((ext2_dx_entry_t*)((char*)bh->data + sizeof(ext2_dir_entry_t)))->limit = dx_node_limit(fs);
+        buffer_cache_mark_dirty(bh);
+    }
+    return bh;
+}
+
+/*
+ * make room for one more entry in the index node at the bottom of the
+ * path. a full root hands its entries down to a new node and gains a
+ * level, a full node below the root is split in two. -1 once the index
+ * is as large as it gets
+ */
+static int dx_grow(ext2_filesystem_t* fs, uint32_t dir_num, ext2_inode_t* dir, dx_frame_t* frames, int* levels) {
+    dx_frame_t* frame = &frames[*levels];
+    ext2_dx_countlimit_t* countlimit = dx_countlimit(frame->entries);
+    if (countlimit->count < countlimit->limit) {
+        return 0;
+    }
     
-    if (ext2_write_inode(fs, EXT2_ROOT_INODE, &root_inode) != 0) {
-        LOG_ERROR("ext2", "failed to create root inode");
-        gecko_free_kernel_memory(fs->group_descs);
-        gecko_free_kernel_memory(fs->superblock);
-        gecko_free_kernel_memory(fs);
+    ext2_dx_countlimit_t* root_countlimit = dx_countlimit(frames[0].entries);
+    if (*levels > 0 && root_countlimit->count == root_countlimit->limit) {
+        LOG_WARNING("ext2", "directory %u: index is full", dir_num);
         return -1;
     }
     
-    fs->superblock->s_free_inodes_count--;
-    fs->group_descs->bg_free_inodes_count--;
-    
-    fs->superblock->s_state = 1;
+    uint32_t logical;
+    buffer_head_t* bh = dx_new_node(fs, dir_num, dir, &logical);
+    if (!bh) {
+        return -1;
+    }
+    ext2_dx_entry_t* entries = (ext2_dx_entry_t*)((char*)bh->data + sizeof(ext2_dir_entry_t));
     
-    ext2_filesystem_t* current = mounted_filesystems;
-    while (current && current->next) {
-        current = current->next;
+    if (*levels == 0) {
+        memcpy(entries + 1, frame->entries + 1, (countlimit->count - 1) * sizeof(ext2_dx_entry_t));
+        entries[0].block = frame->entries[0].block;
+        dx_countlimit(entries)->count = countlimit->count;
+        
+        frames[1].bh = bh;
+        frames[1].entries = entries;
+        frames[1].at = entries + (frame->at - frame->entries);
+        
+        countlimit->count = 1;
+        frame->entries[0].block = logical;
+        frame->at = frame->entries;
+        dx_root_info(frame->bh)->indirect_levels = 1;
+        buffer_cache_mark_dirty(frame->bh);
+        *levels = 1;
+        return 0;
     }
-    if (current) {
-        current->next = fs;
+    
+    /* the upper half moves to the new node, the first hash it takes over is where the root points at it */
+    uint32_t count = countlimit->count;
+    uint32_t split = count / 2;
+    uint32_t split_hash = frame->entries[split].hash;
+    memcpy(entries + 1, frame->entries + split + 1, (count - split - 1) * sizeof(ext2_dx_entry_t));
+    entries[0].block = frame->entries[split].block;
+    dx_countlimit(entries)->count = count - split;
+    countlimit->count = split;
+    buffer_cache_mark_dirty(frame->bh);
+    
+    dx_insert(&frames[0], split_hash, logical);
+    if (frame->at >= frame->entries + split) {
+        frame->at = entries + (frame->at - frame->entries - split);
+        frame->entries = entries;
+        buffer_cache_release(frame->bh);
+        frame->bh = bh;
+        frames[0].at++;
     } else {
-        mounted_filesystems = fs;
+        buffer_cache_release(bh);
     }
-    
-    LOG_INFO("ext2", "mounted ext2 filesystem on %s", device);
     return 0;
 }
 
-int ext2_read_inode(ext2_filesystem_t* fs, uint32_t inode_num, ext2_inode_t* inode) {
-    if (inode_num == 0 || inode_num > fs->superblock->s_inodes_count) {
+static int dx_map_compare(const dx_map_t* a, const dx_map_t* b) {
+    return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
+
+/*
+ * pack the entries map[from, to) of a copied leaf into block, the last
+ * one spanning the rest of it
+ */
+static void dx_fill_leaf(ext2_filesystem_t* fs, void* block, const char* copy, const dx_map_t* map, uint32_t from, uint32_t to) {
+    ext2_dir_entry_t* last = (ext2_dir_entry_t*)block;
+    uint32_t offset = 0;
+    
+    memset(block, 0, fs->block_size);
+    for (uint32_t i = from; i < to; i++) {
+        last = (ext2_dir_entry_t*)((char*)block + offset);
+        memcpy(last, copy + map[i].offset, map[i].size);
+        last->rec_len = map[i].size;
+        offset += map[i].size;
+    }
+    last->rec_len = fs->block_size - ((char*)last - (char*)block);
+}
+
+/*
+ * split a full leaf in two by hash, the upper half going to a new block
+ * the index points at, and add the entry to the half its hash falls in.
+ * the split is kept off a run of equal hashes where it can be, else the
+ * new block's hash is marked as continuing the one before
+ */
+static int dx_split_leaf(ext2_filesystem_t* fs, uint32_t dir_num, ext2_inode_t* dir, dx_frame_t* frames, int* levels,
+                         buffer_head_t* bh, uint32_t hash, const char* name, size_t name_len, uint32_t inode_num) {
+    if (dx_grow(fs, dir_num, dir, frames, levels) != 0) {
         return -1;
     }
     
-    uint32_t inode_table_block = fs->inode_table_start;
-    uint32_t inode_index = inode_num - 1;
-    uint32_t inode_block = inode_table_block + (inode_index * sizeof(ext2_inode_t)) / fs->block_size;
-    uint32_t inode_offset = (inode_index * sizeof(ext2_inode_t)) % fs->block_size;
+    char* copy = gecko_alloc_kernel_memory(fs->block_size);
+    dx_map_t* map = gecko_alloc_kernel_memory(fs->block_size / EXT2_DIR_REC_LEN(1) * sizeof(dx_map_t));
+    if (!copy || !map) {
+        if (copy) {
+            gecko_free_kernel_memory(copy);
+        }
+        if (map) {
+            gecko_free_kernel_memory(map);
+        }
+        return -1;
+    }
     
-    void* block_buffer = gecko_alloc_kernel_memory(fs->block_size);
-    if (!block_buffer) return -1;
+    /* live entries of the leaf sorted by hash */
+    memcpy(copy, bh->data, fs->block_size);
+    uint32_t count = 0;
+    uint32_t offset = 0;
+    while (offset + sizeof(ext2_dir_entry_t) <= fs->block_size) {
+        ext2_dir_entry_t* entry = (ext2_dir_entry_t*)(copy + offset);
+        if (entry->rec_len == 0) {
+            break;
+        }
+        if (entry->inode != 0) {
+            dx_map_t item = { dx_hash(entry->name, entry->name_len), offset, EXT2_DIR_REC_LEN(entry->name_len) };
+            uint32_t i = count++;
+            while (i > 0 && dx_map_compare(&map[i - 1], &item) > 0) {
+                map[i] = map[i - 1];
+                i--;
+            }
+            map[i] = item;
+        }
+        offset += entry->rec_len;
+    }
     
-    if (ext2_read_block(fs, inode_block, block_buffer) != 0) {
-        gecko_free_kernel_memory(block_buffer);
-        return -1;
+    /* about half the bytes stay */
+    uint32_t split = 0;
+    uint32_t size = 0;
+    while (split + 1 < count && size + map[split].size / 2 <= fs->block_size / 2) {
+        size += map[split++].size;
+    }
+    if (split == 0) {
+        split = count > 1 ? 1 : 0;
     }
     
-    memcpy(inode, (char*)block_buffer + inode_offset, sizeof(ext2_inode_t));
-    gecko_free_kernel_memory(block_buffer);
+    uint32_t logical;
+    buffer_head_t* new_bh = append_dir_block(fs, dir_num, dir, &logical);
+    int result = -1;
+    if (new_bh) {
+        uint32_t split_hash = split < count ? map[split].hash : hash;
+        if (split > 0 && split < count && map[split - 1].hash == split_hash) {
+            split_hash |= 1;
+        }
+        
+        dx_fill_leaf(fs, bh->data, copy, map, 0, split);
+        dx_fill_leaf(fs, new_bh->data, copy, map, split, count);
+        buffer_cache_mark_dirty(bh);
+        buffer_cache_mark_dirty(new_bh);
+        dx_insert(&frames[*levels], split_hash, logical);
+        
+        result = insert_into_block(fs, hash >= split_hash ? new_bh : bh, name, name_len, inode_num);
+        buffer_cache_release(new_bh);
+    }
     
-    return 0;
+    gecko_free_kernel_memory(copy);
+    gecko_free_kernel_memory(map);
+    return result;
 }
 
-int ext2_write_inode(ext2_filesystem_t* fs, uint32_t inode_num, ext2_inode_t* inode) {
-    if (inode_num == 0 || inode_num > fs->superblock->s_inodes_count) {
+/*
+ * add an entry through the index of dir. a damaged index is dropped
+ * from dir, which is then left to the linear code
+ */
+static int dx_add_entry(ext2_filesystem_t* fs, uint32_t dir_num, ext2_inode_t* dir, const char* name, size_t name_len,
+                        uint32_t inode_num) {
+    uint32_t hash = dx_hash(name, name_len);
+    dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+    int levels;
+    uint32_t leaf = dx_probe(fs, dir_num, dir, hash, frames, &levels);
+    if (leaf == (uint32_t)-1) {
+        dir->i_flags &= ~EXT2_INDEX_FL;
         return -1;
     }
     
-    uint32_t inode_table_block = fs->inode_table_start;
-    uint32_t inode_index = inode_num - 1;
-    uint32_t inode_block = inode_table_block + (inode_index * sizeof(ext2_inode_t)) / fs->block_size;
-    uint32_t inode_offset = (inode_index * sizeof(ext2_inode_t)) % fs->block_size;
-    
-    void* block_buffer = gecko_alloc_kernel_memory(fs->block_size);
-    if (!block_buffer) return -1;
+    int result = -1;
+    buffer_head_t* bh = read_dir_block(fs, dir_num, dir, leaf);
+    if (bh) {
+        result = insert_into_block(fs, bh, name, name_len, inode_num);
+        if (result != 0) {
+            result = dx_split_leaf(fs, dir_num, dir, frames, &levels, bh, hash, name, name_len, inode_num);
+        }
+        buffer_cache_release(bh);
+    }
     
-    if (ext2_read_block(fs, inode_block, block_buffer) != 0) {
-        gecko_free_kernel_memory(block_buffer);
+    dx_release(frames, levels);
+    return result;
+}
+
+/*
+ * turn a directory whose only block is full into an indexed one. the
+ * entries after .. move to a new leaf and the rest of block 0 becomes
+ * the index root, with that leaf as its one entry
+ */
+static int dx_make_indexed(ext2_filesystem_t* fs, uint32_t dir_num, ext2_inode_t* dir) {
+    buffer_head_t* root = read_dir_block(fs, dir_num, dir, 0);
+    if (!root) {
         return -1;
     }
     
-    memcpy((char*)block_buffer + inode_offset, inode, sizeof(ext2_inode_t));
+    ext2_dir_entry_t* dot = (ext2_dir_entry_t*)root->data;
+    ext2_dir_entry_t* dot_dot = (ext2_dir_entry_t*)((char*)root->data + EXT2_DIR_REC_LEN(1));
+    if (!block_writable(fs, root->block) || dot->rec_len != EXT2_DIR_REC_LEN(1) || dot_dot->name_len != 2 ||
+        dot_dot->rec_len < EXT2_DIR_REC_LEN(2) || dot->rec_len + dot_dot->rec_len > fs->block_size) {
+        buffer_cache_release(root);
+        return -1;
+    }
     
-    if (ext2_write_block(fs, inode_block, block_buffer) != 0) {
-        gecko_free_kernel_memory(block_buffer);
+    uint32_t logical;
+    buffer_head_t* leaf = append_dir_block(fs, dir_num, dir, &logical);
+    if (!leaf) {
+        buffer_cache_release(root);
         return -1;
     }
     
-    gecko_free_kernel_memory(block_buffer);
+    /* the moved entries keep their lengths, the last one grows to the end of the leaf */
+    uint32_t start = dot->rec_len + dot_dot->rec_len;
+    uint32_t moved = fs->block_size - start;
+    memcpy(leaf->data, (char*)root->data + start, moved);
+    ext2_dir_entry_t* last = (ext2_dir_entry_t*)leaf->data;
+    uint32_t offset = 0;
+    while (offset < moved && ((ext2_dir_entry_t*)((char*)leaf->data + offset))->rec_len != 0) {
+        last = (ext2_dir_entry_t*)((char*)leaf->data + offset);
+        offset += last->rec_len;
+    }
+    last->rec_len = fs->block_size - ((char*)last - (char*)leaf->data);
+    
+    dot_dot->rec_len = fs->block_size - dot->rec_len;
+    ext2_dx_root_info_t* info = dx_root_info(root);
+    memset(info, 0, fs->block_size - EXT2_DX_ROOT_INFO);
+    info->hash_version = EXT2_DX_HASH_TEA;
+    info->info_length = sizeof(ext2_dx_root_info_t);
+    
+    ext2_dx_entry_t* entries = (ext2_dx_entry_t*)(info + 1);
+    dx_countlimit(entries)->limit = dx_root_limit(fs);
+    dx_countlimit(entries)->count = 1;
+    entries[0].block = logical;
+    
+    buffer_cache_mark_dirty(root);
+    buffer_cache_mark_dirty(leaf);
+    buffer_cache_release(root);
+    buffer_cache_release(leaf);
+    
+    dir->i_flags |= EXT2_INDEX_FL;
+    fs->superblock->s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
     return 0;
 }
 
-int ext2_read_block(ext2_filesystem_t* fs, uint32_t block_num, void* buffer) {
-    if (block_num >= fs->superblock->s_blocks_count) {
-        return -1;
+/*
+ * add an entry for inode_num to directory dir_num. an indexed directory
+ * puts it in the leaf its hash belongs to. otherwise it goes into the
+ * first slack big enough, and once the first block is full the
+ * directory gets an index. the caller writes dir back
+ */
+static int add_entry(ext2_filesystem_t* fs, uint32_t dir_num, ext2_inode_t* dir, const char* name, uint32_t inode_num) {
+    size_t name_len = strlen(name);
+    if (dir->i_flags & EXT2_INDEX_FL) {
+        int result = dx_add_entry(fs, dir_num, dir, name, name_len, inode_num);
+        if (result == 0 || (dir->i_flags & EXT2_INDEX_FL)) {
+            return result;
+        }
     }
     
-    size_t offset = block_num * fs->block_size;
-    if (offset + fs->block_size > fs->device_size) {
-        memset(buffer, 0, fs->block_size);
-        return 0;
+    uint32_t blocks = dir->i_size / fs->block_size;
+    for (uint32_t b = 0; b < blocks; b++) {
+        buffer_head_t* bh = read_dir_block(fs, dir_num, dir, b);
+        if (!bh) {
+            continue;
+        }
+        
+        int result = insert_into_block(fs, bh, name, name_len, inode_num);
+        buffer_cache_release(bh);
+        if (result == 0) {
+            return 0;
+        }
     }
     
-    memcpy(buffer, (char*)fs->device + offset, fs->block_size);
-    return 0;
-}
-
-int ext2_write_block(ext2_filesystem_t* fs, uint32_t block_num, const void* buffer) {
-    if (block_num >= fs->superblock->s_blocks_count) {
-        return -1;
+    if (blocks == 1 && dx_make_indexed(fs, dir_num, dir) == 0) {
+        return dx_add_entry(fs, dir_num, dir, name, name_len, inode_num);
     }
     
-    size_t offset = block_num * fs->block_size;
-    if (offset + fs->block_size > fs->device_size) {
+    uint32_t logical;
+    buffer_head_t* bh = append_dir_block(fs, dir_num, dir, &logical);
+    if (!bh) {
         return -1;
     }
     
-    memcpy((char*)fs->device + offset, buffer, fs->block_size);
-    return 0;
+    ((ext2_dir_entry_t*)bh->data)->rec_len = fs->block_size;
+    int result = insert_into_block(fs, bh, name, name_len, inode_num);
+    buffer_cache_release(bh);
+    return result;
 }
 
-int ext2_find_inode(ext2_filesystem_t* fs, const char* path, uint32_t* inode_num) {
-    if (strcmp(path, "/") == 0) {
-        *inode_num = EXT2_ROOT_INODE;
-        return 0;
+/*
+ * drop the entry for name, its space goes to the entry before it
+ */
+static int remove_entry(ext2_filesystem_t* fs, uint32_t dir_num, const ext2_inode_t* dir, const char* name) {
+    buffer_head_t* bh;
+    ext2_dir_entry_t* prev;
+    ext2_dir_entry_t* entry = lookup_entry(fs, dir_num, dir, name, &bh, &prev);
+    if (!entry) {
+        return -1;
     }
     
-    ext2_inode_t inode;
-    if (ext2_read_inode(fs, EXT2_ROOT_INODE, &inode) != 0) {
+    if (!block_writable(fs, bh->block)) {
+        buffer_cache_release(bh);
         return -1;
     }
     
-    char path_copy[256];
-    strncpy(path_copy, path, sizeof(path_copy) - 1);
-    path_copy[sizeof(path_copy) - 1] = '\0';
+    if (prev) {
+        prev->rec_len += entry->rec_len;
+    } else {
+        entry->inode = 0;
+    }
     
-    char* token = strtok(path_copy + 1, "/");
-    while (token) {
-        ext2_dir_entry_t* dir_entry;
-        char dir_buffer[1024];
-        size_t bytes_read;
+    buffer_cache_mark_dirty(bh);
+    buffer_cache_release(bh);
+    return 0;
+}
+
+/*
+ * a directory holding nothing but . and ..
+ */
+static int directory_empty(ext2_filesystem_t* fs, uint32_t dir_num, const ext2_inode_t* dir) {
+    uint32_t blocks = dir->i_size / fs->block_size;
+    
+    for (uint32_t b = 0; b < blocks; b++) {
+        uint32_t block_num = lookup_block(fs, dir_num, dir, b);
+        if (block_num == 0 || block_num == (uint32_t)-1) {
+            continue;
+        }
         
-        if (ext2_read_directory(fs, inode.i_block[0], dir_buffer, sizeof(dir_buffer), &bytes_read) != 0) {
-            return -1;
+        buffer_head_t* bh = read_buffer(fs, block_num);
+        if (!bh) {
+            return 0;
         }
         
-        dir_entry = (ext2_dir_entry_t*)dir_buffer;
         uint32_t offset = 0;
-        int found = 0;
-        
-        while (offset < bytes_read) {
-            if (strncmp(dir_entry->name, token, dir_entry->name_len) == 0 && 
-                dir_entry->name_len == strlen(token)) {
-                *inode_num = dir_entry->inode;
-                found = 1;
+        while (offset + sizeof(ext2_dir_entry_t) <= fs->block_size) {
+            ext2_dir_entry_t* entry = (ext2_dir_entry_t*)((char*)bh->data + offset);
+            if (entry->rec_len == 0) {
                 break;
             }
             
-            offset += dir_entry->rec_len;
-            dir_entry = (ext2_dir_entry_t*)((char*)dir_entry + dir_entry->rec_len);
+            int dots = (entry->name_len == 1 && entry->name[0] == '.') ||
+                       (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+            if (entry->inode != 0 && !dots) {
+                buffer_cache_release(bh);
+                return 0;
+            }
+            
+            offset += entry->rec_len;
         }
         
-        if (!found) {
+        buffer_cache_release(bh);
+    }
+    
+    return 1;
+}
+
+int ext2_find_inode(ext2_filesystem_t* fs, const char* path, uint32_t* inode_num) {
+    char path_copy[256];
+    strncpy(path_copy, path, sizeof(path_copy) - 1);
+    path_copy[sizeof(path_copy) - 1] = '\0';
+    
+    /* walk down from the root, inode_num is the directory searched */
+    *inode_num = EXT2_ROOT_INODE;
+    char* token = strtok(path_copy, "/");
+    while (token) {
+        ext2_inode_t dir;
+        if (ext2_read_inode(fs, *inode_num, &dir) != 0 || !is_directory(&dir)) {
             return -1;
         }
         
-        if (ext2_read_inode(fs, *inode_num, &inode) != 0) {
+        uint32_t next = find_entry(fs, *inode_num, &dir, token);
+        if (next == 0) {
             return -1;
         }
         
+        *inode_num = next;
         token = strtok(NULL, "/");
     }
     
@@ -330,79 +2005,61 @@ int ext2_read_directory(ext2_filesystem_t* fs, uint32_t inode_num, void* buffer,
     return ext2_read_data(fs, inode_num, 0, buffer, size, bytes_read);
 }
 
-int ext2_create_file(ext2_filesystem_t* fs, uint32_t parent_inode, const char* name, uint32_t permissions) {
-    ext2_inode_t parent_inode_data;
-    if (ext2_read_inode(fs, parent_inode, &parent_inode_data) != 0) {
+/*
+ * allocate an inode of mode and link it into parent_inode as name. files
+ * go to the parent's group, directories where find_group_dir puts them
+ */
+static int create_inode(ext2_filesystem_t* fs, uint32_t parent_inode, const char* name, uint32_t mode) {
+    ext2_inode_t parent;
+    if (ext2_read_inode(fs, parent_inode, &parent) != 0 || !is_directory(&parent)) {
+        return -1;
+    }
+    
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > EXT2_NAME_LEN || find_entry(fs, parent_inode, &parent, name) != 0) {
         return -1;
     }
     
-    uint32_t new_inode_num = allocate_inode(fs);
+    int directory = (mode & 0xF000) == EXT2_S_IFDIR;
+    uint32_t new_inode_num = allocate_inode(fs, parent_inode, directory);
     if (new_inode_num == (uint32_t)-1) {
         return -1;
     }
     
     ext2_inode_t new_inode;
     memset(&new_inode, 0, sizeof(ext2_inode_t));
-    new_inode.i_mode = EXT2_S_IFREG | permissions;
-    new_inode.i_size = 0;
-    new_inode.i_links_count = 1;
-    new_inode.i_blocks = 0;
-    new_inode.i_atime = new_inode.i_ctime = new_inode.i_mtime = 0;
-    
-    if (ext2_write_inode(fs, new_inode_num, &new_inode) != 0) {
-        return -1;
+    int result;
+    if (directory) {
+        result = init_directory(fs, new_inode_num, parent_inode, mode);
+    } else {
+        new_inode.i_mode = mode;
+        new_inode.i_links_count = 1;
+        result = ext2_write_inode(fs, new_inode_num, &new_inode);
     }
     
-    size_t name_len = strlen(name);
-    size_t entry_size = sizeof(ext2_dir_entry_t) + name_len;
-    if (entry_size < 8) entry_size = 8;
-    
-    ext2_dir_entry_t* new_entry = gecko_alloc_kernel_memory(entry_size);
-    if (!new_entry) {
-        return -1;
+    if (result == 0) {
+        result = add_entry(fs, parent_inode, &parent, name, new_inode_num);
     }
-    
-    new_entry->inode = new_inode_num;
-    new_entry->name_len = name_len;
-    new_entry->rec_len = entry_size;
-    strncpy(new_entry->name, name, name_len);
-    
-    uint32_t block_num = parent_inode_data.i_block[0];
-    if (block_num == 0) {
-        block_num = allocate_block(fs);
-        if (block_num == (uint32_t)-1) {
-            gecko_free_kernel_memory(new_entry);
-            return -1;
+    if (result != 0) {
+        if (directory && ext2_read_inode(fs, new_inode_num, &new_inode) == 0) {
+            release_blocks(fs, new_inode_num, &new_inode);
         }
-        parent_inode_data.i_block[0] = block_num;
-        parent_inode_data.i_blocks += fs->block_size / 512;
-    }
-    
-    void* block_buffer = gecko_alloc_kernel_memory(fs->block_size);
-    if (!block_buffer) {
-        gecko_free_kernel_memory(new_entry);
-        return -1;
-    }
-    
-    if (ext2_read_block(fs, block_num, block_buffer) != 0) {
-        gecko_free_kernel_memory(block_buffer);
-        gecko_free_kernel_memory(new_entry);
+        free_inode(fs, new_inode_num, directory);
         return -1;
     }
     
-    memcpy(block_buffer, new_entry, entry_size);
-    
-    if (ext2_write_block(fs, block_num, block_buffer) != 0) {
-        gecko_free_kernel_memory(block_buffer);
-        gecko_free_kernel_memory(new_entry);
-        return -1;
+    if (directory) {
+        parent.i_links_count++;
     }
-    
-    gecko_free_kernel_memory(block_buffer);
-    gecko_free_kernel_memory(new_entry);
-    
-    parent_inode_data.i_size += entry_size;
-    return ext2_write_inode(fs, parent_inode, &parent_inode_data);
+    return ext2_write_inode(fs, parent_inode, &parent);
+}
+
+int ext2_create_file(ext2_filesystem_t* fs, uint32_t parent_inode, const char* name, uint32_t permissions) {
+    return create_inode(fs, parent_inode, name, EXT2_S_IFREG | permissions);
+}
+
+int ext2_mkdir(ext2_filesystem_t* fs, uint32_t parent_inode, const char* name, uint32_t permissions) {
+    return create_inode(fs, parent_inode, name, EXT2_S_IFDIR | permissions);
 }
 
 int ext2_write_data(ext2_filesystem_t* fs, uint32_t inode_num, uint32_t offset, const void* data, size_t size, size_t* bytes_written) {
@@ -411,148 +2068,238 @@ int ext2_write_data(ext2_filesystem_t* fs, uint32_t inode_num, uint32_t offset,
         return -1;
     }
     
-    uint32_t start_block = offset / fs->block_size;
-    uint32_t end_block = (offset + size - 1) / fs->block_size;
-    
-    for (uint32_t block = start_block; block <= end_block; block++) {
-        uint32_t physical_block;
-        
-        if (block < 12) {
-            physical_block = inode.i_block[block];
-            if (physical_block == 0) {
-                physical_block = allocate_block(fs);
-                if (physical_block == (uint32_t)-1) {
-                    *bytes_written = 0;
-                    return -1;
-                }
-                inode.i_block[block] = physical_block;
-                inode.i_blocks += fs->block_size / 512;
-            }
-        } else {
-            physical_block = allocate_block(fs);
-            if (physical_block == (uint32_t)-1) {
-                *bytes_written = 0;
-                return -1;
-            }
+    /* whole blocks replace the cached block, partial ones are merged into it */
+    size_t done = 0;
+    int result = 0;
+    
+    while (done < size) {
+        uint32_t position = offset + done;
+        uint32_t block = position / fs->block_size;
+        size_t block_offset = position % fs->block_size;
+        size_t chunk = fs->block_size - block_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
         }
         
-        void* block_buffer = gecko_alloc_kernel_memory(fs->block_size);
-        if (!block_buffer) {
-            *bytes_written = 0;
-            return -1;
+        const char* src = (const char*)data + done;
+        uint32_t physical_block = lookup_block(fs, inode_num, &inode, block);
+        int fresh = 0;
+        if (physical_block == 0) {
+            physical_block = create_block(fs, inode_num, &inode, block);
+            fresh = 1;
         }
-        
-        if (ext2_read_block(fs, physical_block, block_buffer) != 0) {
-            gecko_free_kernel_memory(block_buffer);
-            *bytes_written = 0;
-            return -1;
+        if (physical_block == (uint32_t)-1) {
+            result = -1;
+            break;
         }
         
-        size_t block_offset = (block == start_block) ? (offset % fs->block_size) : 0;
-        size_t block_size = (block == end_block) ? 
-            (size - (block_offset % fs->block_size)) : 
-            (fs->block_size - block_offset);
-        
-        if (block_size > fs->block_size - block_offset) {
-            block_size = fs->block_size - block_offset;
+        if (chunk == fs->block_size) {
+            result = ext2_write_block(fs, physical_block, src);
+        } else {
+            buffer_head_t* bh = NULL;
+            if (fresh) {
+                bh = new_buffer(fs, physical_block);
+            } else if (block_writable(fs, physical_block)) {
+                bh = read_buffer(fs, physical_block);
+            }
+            if (!bh) {
+                result = -1;
+                break;
+            }
+            
+            memcpy((char*)bh->data + block_offset, src, chunk);
+            buffer_cache_mark_dirty(bh);
+            buffer_cache_release(bh);
         }
         
-        memcpy((char*)block_buffer + block_offset, 
-               (char*)data + ((block - start_block) * fs->block_size), 
-               block_size);
-        
-        if (ext2_write_block(fs, physical_block, block_buffer) != 0) {
-            gecko_free_kernel_memory(block_buffer);
-            *bytes_written = 0;
-            return -1;
+        if (result != 0) {
+            break;
         }
-        
-        gecko_free_kernel_memory(block_buffer);
+        done += chunk;
     }
     
-    if (offset + size > inode.i_size) {
-        inode.i_size = offset + size;
+    if (offset + done > inode.i_size) {
+        inode.i_size = offset + done;
+    }
+    if (done > 0 && ext2_write_inode(fs, inode_num, &inode) != 0) {
+        result = -1;
     }
     
-    ext2_write_inode(fs, inode_num, &inode);
-    
-    *bytes_written = size;
-    return 0;
+    *bytes_written = done;
+    return result;
 }
 
-int ext2_read_data(ext2_filesystem_t* fs, uint32_t inode_num, uint32_t offset, void* data, size_t size, size_t* bytes_read) {
-    ext2_inode_t inode;
-    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
-        return -1;
-    }
-    
-    if (offset >= inode.i_size) {
+/*
+ * copy file data of an inode already read into memory
+ */
+static int read_inode_data(ext2_filesystem_t* fs, uint32_t inode_num, const ext2_inode_t* inode, uint32_t offset, void* data,
+                           size_t size, size_t* bytes_read) {
+    if (offset >= inode->i_size) {
         *bytes_read = 0;
         return 0;
     }
     
-    if (offset + size > inode.i_size) {
-        size = inode.i_size - offset;
+    if (offset + size > inode->i_size) {
+        size = inode->i_size - offset;
     }
     
-    *bytes_read = size;
-    
-    uint32_t start_block = offset / fs->block_size;
-    uint32_t end_block = (offset + size - 1) / fs->block_size;
+    /* every block is copied out of the cache */
+    size_t done = 0;
     
-    for (uint32_t block = start_block; block <= end_block; block++) {
-        uint32_t physical_block = (block < 12) ? inode.i_block[block] : 0;
-        if (physical_block == 0) {
-            memset((char*)data + ((block - start_block) * fs->block_size), 0, fs->block_size);
-            continue;
+    while (done < size) {
+        uint32_t position = offset + done;
+        uint32_t block = position / fs->block_size;
+        size_t block_offset = position % fs->block_size;
+        size_t chunk = fs->block_size - block_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
         }
         
-        void* block_buffer = gecko_alloc_kernel_memory(fs->block_size);
-        if (!block_buffer) {
+        char* dest = (char*)data + done;
+        uint32_t physical_block = lookup_block(fs, inode_num, inode, block);
+        if (physical_block == (uint32_t)-1) {
             *bytes_read = 0;
             return -1;
         }
         
-        if (ext2_read_block(fs, physical_block, block_buffer) != 0) {
-            gecko_free_kernel_memory(block_buffer);
-            *bytes_read = 0;
-            return -1;
+        if (physical_block == 0) {
+            memset(dest, 0, chunk);
+        } else {
+            buffer_head_t* bh = read_buffer(fs, physical_block);
+            if (!bh) {
+                *bytes_read = 0;
+                return -1;
+            }
+            memcpy(dest, (char*)bh->data + block_offset, chunk);
+            buffer_cache_release(bh);
         }
         
-        size_t block_offset = (block == start_block) ? (offset % fs->block_size) : 0;
-        size_t block_size = (block == end_block) ? 
-            (size - (block_offset % fs->block_size)) : 
-            (fs->block_size - block_offset);
-        
-        if (block_size > fs->block_size - block_offset) {
-            block_size = fs->block_size - block_offset;
+        done += chunk;
+    }
+    
+    *bytes_read = size;
+    return 0;
+}
+
+int ext2_read_data(ext2_filesystem_t* fs, uint32_t inode_num, uint32_t offset, void* data, size_t size, size_t* bytes_read) {
+    ext2_inode_t inode;
+    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
+        return -1;
+    }
+    
+    return read_inode_data(fs, inode_num, &inode, offset, data, size, bytes_read);
+}
+
+int ext2_readpage(ext2_filesystem_t* fs, uint32_t inode_num, uint64_t index, void* page) {
+    return ext2_readpages(fs, inode_num, index, &page, 1);
+}
+
+int ext2_readpages(ext2_filesystem_t* fs, uint32_t inode_num, uint64_t index, void** pages, uint32_t count) {
+    /* one inode read for the whole batch */
+    ext2_inode_t inode;
+    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        size_t bytes_read = 0;
+        uint32_t offset = (uint32_t)((index + i) * PAGE_SIZE);
+        if (read_inode_data(fs, inode_num, &inode, offset, pages[i], PAGE_SIZE, &bytes_read) != 0) {
+            return -1;
         }
         
-        memcpy((char*)data + ((block - start_block) * fs->block_size),
-               (char*)block_buffer + block_offset,
-               block_size);
-        
-        gecko_free_kernel_memory(block_buffer);
+        /* the part of the page past end of file reads as zeroes */
+        if (bytes_read < PAGE_SIZE) {
+            memset((char*)pages[i] + bytes_read, 0, PAGE_SIZE - bytes_read);
+        }
     }
     
     return 0;
 }
 
+/* blocks gathered into one device write by ext2_writepages */
+#define EXT2_WRITE_RUN_BYTES (64 * 1024)
+
+int ext2_writepages(ext2_filesystem_t* fs, uint32_t inode_num, uint64_t index, void** pages, uint32_t count, uint32_t file_size) {
+    ext2_inode_t inode;
+    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
+        return -1;
+    }
+    
+    uint32_t run_capacity = EXT2_WRITE_RUN_BYTES / fs->block_size;
+    char* run = gecko_alloc_kernel_memory(EXT2_WRITE_RUN_BYTES);
+    if (!run) {
+        return -1;
+    }
+    
+    /* physically adjacent blocks are gathered and written with one call */
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    uint32_t blocks_per_page = PAGE_SIZE / fs->block_size;
+    int result = 0;
+    
+    for (uint32_t i = 0; i < count && result == 0; i++) {
+        for (uint32_t b = 0; b < blocks_per_page; b++) {
+            uint64_t logical = (index + i) * blocks_per_page + b;
+            if (logical * fs->block_size >= file_size) {
+                break;
+            }
+            
+            uint32_t physical_block = create_block(fs, inode_num, &inode, (uint32_t)logical);
+            if (physical_block == (uint32_t)-1) {
+                result = -1;
+                break;
+            }
+            
+            if (run_length > 0 && (physical_block != run_start + run_length || run_length == run_capacity)) {
+                if (ext2_write_blocks(fs, run_start, run_length, run) != 0) {
+                    result = -1;
+                    break;
+                }
+                run_length = 0;
+            }
+            if (run_length == 0) {
+                run_start = physical_block;
+            }
+            
+            memcpy(run + run_length * fs->block_size, (char*)pages[i] + b * fs->block_size, fs->block_size);
+            run_length++;
+        }
+    }
+    
+    if (result == 0 && run_length > 0) {
+        result = ext2_write_blocks(fs, run_start, run_length, run);
+    }
+    gecko_free_kernel_memory(run);
+    
+    /* size and block map go out once per batch */
+    if (file_size > inode.i_size) {
+        inode.i_size = file_size;
+    }
+    if (ext2_write_inode(fs, inode_num, &inode) != 0) {
+        return -1;
+    }
+    
+    return result;
+}
+
 int ext2_umount(const char* device) {
     ext2_filesystem_t* prev = NULL;
     ext2_filesystem_t* current = mounted_filesystems;
     
     while (current) {
-        if (strcmp(current->device, device) == 0) {
+        if (strcmp(current->device_name, device) == 0) {
+            if (current->sb) {
+                LOG_WARNING("ext2", "%s is still mounted", device);
+                return -1;
+            }
             if (prev) {
                 prev->next = current->next;
             } else {
                 mounted_filesystems = current->next;
             }
             
-            gecko_free_kernel_memory(current->superblock);
-            gecko_free_kernel_memory(current->group_descs);
-            gecko_free_kernel_memory(current);
+            free_filesystem(current);
             
             LOG_INFO("ext2", "unmounted ext2 filesystem from %s", device);
             return 0;
@@ -570,62 +2317,297 @@ int ext2_delete_file(ext2_filesystem_t* fs, uint32_t parent_inode, const char* n
         return -1;
     }
     
-    uint32_t block_num = parent_inode_data.i_block[0];
-    void* block_buffer = gecko_alloc_kernel_memory(fs->block_size);
-    if (!block_buffer) return -1;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -1;
+    }
     
-    if (ext2_read_block(fs, block_num, block_buffer) != 0) {
-        gecko_free_kernel_memory(block_buffer);
+    uint32_t target_inode = find_entry(fs, parent_inode, &parent_inode_data, name);
+    ext2_inode_t target_inode_data;
+    if (target_inode == 0 || ext2_read_inode(fs, target_inode, &target_inode_data) != 0) {
         return -1;
     }
     
-    ext2_dir_entry_t* dir_entry = (ext2_dir_entry_t*)block_buffer;
-    uint32_t offset = 0;
+    /* a directory goes only once it is empty, taking its .. link along */
+    int directory = is_directory(&target_inode_data);
+    if (directory && !directory_empty(fs, target_inode, &target_inode_data)) {
+        return -1;
+    }
     
-    while (offset < parent_inode_data.i_size) {
-        if (strncmp(dir_entry->name, name, dir_entry->name_len) == 0 &&
-            dir_entry->name_len == strlen(name)) {
-            
-            uint32_t target_inode = dir_entry->inode;
-            
-            memset(dir_entry, 0, dir_entry->rec_len);
-            parent_inode_data.i_size -= dir_entry->rec_len;
-            
-            if (ext2_write_block(fs, block_num, block_buffer) != 0) {
-                gecko_free_kernel_memory(block_buffer);
-                return -1;
-            }
-            
-            ext2_inode_t target_inode_data;
-            if (ext2_read_inode(fs, target_inode, &target_inode_data) != 0) {
-                gecko_free_kernel_memory(block_buffer);
-                return -1;
+    if (remove_entry(fs, parent_inode, &parent_inode_data, name) != 0) {
+        return -1;
+    }
+    
+    if (directory) {
+        target_inode_data.i_links_count = 0;
+        parent_inode_data.i_links_count--;
+    } else {
+        target_inode_data.i_links_count--;
+    }
+    
+    if (target_inode_data.i_links_count == 0) {
+        release_blocks(fs, target_inode, &target_inode_data);
+        free_inode(fs, target_inode, directory);
+        memset(&target_inode_data, 0, sizeof(ext2_inode_t));
+    }
+    
+    ext2_write_inode(fs, target_inode, &target_inode_data);
+    return ext2_write_inode(fs, parent_inode, &parent_inode_data);
+}
+
+/*
+ * vfs glue. a mount attaches to the image ext2_mount_image formatted under
+ * the device name and leaves it in place on umount. file data goes
+ * through the page cache. vfs inode numbers are the ext2 ones, except
+ * that the root keeps the number vfs_mount gave it and trades it with
+ * ext2's root inode
+ */
+static uint32_t swap_root(vfs_superblock_t* sb, uint32_t num) {
+    uint32_t root_id = sb->root_inode->inode_id;
+    return num == root_id ? EXT2_ROOT_INODE : num == EXT2_ROOT_INODE ? root_id : num;
+}
+
+static inline ext2_filesystem_t* vfs_filesystem(vfs_inode_t* inode) {
+    return (ext2_filesystem_t*)inode->sb->data;
+}
+
+static inline uint32_t vfs_inode_num(vfs_inode_t* inode) {
+    return swap_root(inode->sb, inode->inode_id);
+}
+
+static void copy_attributes(vfs_inode_t* inode, const ext2_inode_t* raw) {
+    inode->type = is_directory(raw) ? VFS_TYPE_DIRECTORY : VFS_TYPE_FILE;
+    inode->permissions = raw->i_mode & 0777;
+    inode->size = raw->i_size;
+    inode->link_count = raw->i_links_count;
+    inode->creation_time = raw->i_ctime;
+    inode->modification_time = raw->i_mtime;
+    inode->access_time = raw->i_atime;
+}
+
+/*
+ * reread a directory after a change of its entries
+ */
+static void refresh_directory(vfs_inode_t* dir) {
+    ext2_inode_t raw;
+    if (ext2_read_inode(vfs_filesystem(dir), vfs_inode_num(dir), &raw) == 0) {
+        copy_attributes(dir, &raw);
+    }
+}
+
+static int ext2_vfs_mount(vfs_superblock_t* sb, const char* device, const char* mount_point) {
+    ext2_filesystem_t* fs = ext2_get_filesystem(device);
+    if (!fs || fs->sb) {
+        LOG_ERROR("ext2", "no unmounted ext2 image on %s", device);
+        return -1;
+    }
+    
+    ext2_inode_t root;
+    if (ext2_read_inode(fs, EXT2_ROOT_INODE, &root) != 0) {
+        return -1;
+    }
+    
+    fs->sb = sb;
+    sb->data = fs;
+    copy_attributes(sb->root_inode, &root);
+    
+    LOG_INFO("ext2", "%s mounted on %s", device, mount_point);
+    return 0;
+}
+
+/*
+ * the vfs has written back and synced by now
+ */
+static int ext2_vfs_umount(vfs_superblock_t* sb) {
+    ext2_filesystem_t* fs = (ext2_filesystem_t*)sb->data;
+    fs->sb = NULL;
+    sb->data = NULL;
+    return 0;
+}
+
+static int ext2_vfs_sync(vfs_superblock_t* sb) {
+    return ext2_sync((ext2_filesystem_t*)sb->data);
+}
+
+static vfs_inode_t* ext2_vfs_lookup(vfs_inode_t* parent, const char* name, size_t length) {
+    ext2_filesystem_t* fs = vfs_filesystem(parent);
+    uint32_t dir_num = vfs_inode_num(parent);
+    char copy[VFS_MAX_FILENAME_LENGTH];
+    ext2_inode_t raw;
+    
+    if (length >= sizeof(copy) || ext2_read_inode(fs, dir_num, &raw) != 0 || !is_directory(&raw)) {
+        return NULL;
+    }
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    
+    uint32_t num = find_entry(fs, dir_num, &raw, copy);
+    if (num == 0) {
+        return NULL;
+    }
+    
+    /* an inode still cached is not read again */
+    uint32_t id = swap_root(parent->sb, num);
+    vfs_inode_t* inode = icache_get(parent->sb, id);
+    if (inode) {
+        return inode;
+    }
+    
+    if (ext2_read_inode(fs, num, &raw) != 0 || !(inode = icache_alloc(parent->sb, id))) {
+        return NULL;
+    }
+    copy_attributes(inode, &raw);
+    inode->ops = &ext2_inode_ops;
+    return inode;
+}
+
+static int create_entry(vfs_inode_t* parent, const char* name, uint32_t permissions, int directory) {
+    ext2_filesystem_t* fs = vfs_filesystem(parent);
+    uint32_t dir_num = vfs_inode_num(parent);
+    
+    int result = directory ? ext2_mkdir(fs, dir_num, name, permissions & 0777)
+                           : ext2_create_file(fs, dir_num, name, permissions & 0777);
+    if (result == 0) {
+        refresh_directory(parent);
+    }
+    return result;
+}
+
+static int ext2_vfs_create_file(vfs_inode_t* parent, const char* name, uint32_t permissions) {
+    return create_entry(parent, name, permissions, 0);
+}
+
+static int ext2_vfs_mkdir(vfs_inode_t* parent, const char* name, uint32_t permissions) {
+    return create_entry(parent, name, permissions, 1);
+}
+
+/*
+ * delete name from parent. the inode number may be handed out again
+ * right away, so a cached inode goes with it and one still in use makes
+ * the removal fail
+ */
+static int delete_entry(vfs_inode_t* parent, const char* name, int directory) {
+    ext2_filesystem_t* fs = vfs_filesystem(parent);
+    uint32_t dir_num = vfs_inode_num(parent);
+    ext2_inode_t raw;
+    
+    if (ext2_read_inode(fs, dir_num, &raw) != 0 || !is_directory(&raw)) {
+        return -1;
+    }
+    
+    uint32_t num = find_entry(fs, dir_num, &raw, name);
+    if (num == 0 || ext2_read_inode(fs, num, &raw) != 0 || is_directory(&raw) != directory) {
+        return -1;
+    }
+    
+    vfs_inode_t* cached = icache_get(parent->sb, swap_root(parent->sb, num));
+    if (cached && cached->reference_count > 1) {
+        icache_put(cached);
+        return -1;
+    }
+    
+    int result = ext2_delete_file(fs, dir_num, name);
+    if (cached) {
+        /* unwritten pages must not reach the freed blocks */
+        if (result == 0) {
+            page_cache_truncate(cached);
+            cached->link_count = 0;
+        }
+        icache_put(cached);
+    }
+    
+    if (result == 0) {
+        refresh_directory(parent);
+    }
+    return result;
+}
+
+static int ext2_vfs_unlink(vfs_inode_t* parent, const char* name) {
+    return delete_entry(parent, name, 0);
+}
+
+static int ext2_vfs_rmdir(vfs_inode_t* parent, const char* name) {
+    return delete_entry(parent, name, 1);
+}
+
+/*
+ * cookies are byte positions in the directory. blocks are walked from
+ * their start, since removing an entry can merge the one a cookie points
+ * into with the entry before it
+ */
+static int ext2_vfs_readdir(vfs_inode_t* dir, uint32_t* cookie, vfs_dirent_t* entries, uint32_t count) {
+    ext2_filesystem_t* fs = vfs_filesystem(dir);
+    uint32_t dir_num = vfs_inode_num(dir);
+    ext2_inode_t raw;
+    
+    if (ext2_read_inode(fs, dir_num, &raw) != 0 || !is_directory(&raw)) {
+        return -1;
+    }
+    
+    uint32_t filled = 0;
+    while (filled < count && *cookie < raw.i_size) {
+        uint32_t logical = *cookie / fs->block_size;
+        uint32_t block_start = logical * fs->block_size;
+        uint32_t skip = *cookie - block_start;
+        
+        buffer_head_t* bh = read_dir_block(fs, dir_num, &raw, logical);
+        uint32_t offset = 0;
+        while (bh && filled < count && offset + sizeof(ext2_dir_entry_t) <= fs->block_size) {
+            ext2_dir_entry_t* entry = (ext2_dir_entry_t*)((char*)bh->data + offset);
+            if (entry->rec_len == 0) {
+                break;
             }
             
-            target_inode_data.i_links_count--;
-            if (target_inode_data.i_links_count == 0) {
-                for (int i = 0; i < 12; i++) {
-                    if (target_inode_data.i_block[i] != 0) {
-                        ext2_inode_t inode;
-                        memset(&inode, 0, sizeof(ext2_inode_t));
-                        ext2_write_inode(fs, target_inode, &inode);
-                        break;
-                    }
+            uint32_t next = offset + entry->rec_len;
+            int dots = (entry->name_len == 1 && entry->name[0] == '.') ||
+                       (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+            if (offset >= skip && entry->inode != 0 && !dots && entry->name_len < VFS_MAX_FILENAME_LENGTH) {
+                vfs_dirent_t* dirent = &entries[filled++];
+                memcpy(dirent->name, entry->name, entry->name_len);
+                dirent->name[entry->name_len] = '\0';
+                dirent->inode_id = swap_root(dir->sb, entry->inode);
+                dirent->cookie = block_start + next;
+                
+                /* a cached inode knows about data not written back yet */
+                vfs_inode_t* inode = icache_get(dir->sb, dirent->inode_id);
+                ext2_inode_t child;
+                dirent->type = VFS_TYPE_FILE;
+                dirent->size = 0;
+                if (inode) {
+                    dirent->type = inode->type;
+                    dirent->size = inode->size;
+                    icache_put(inode);
+                } else if (ext2_read_inode(fs, entry->inode, &child) == 0) {
+                    dirent->type = is_directory(&child) ? VFS_TYPE_DIRECTORY : VFS_TYPE_FILE;
+                    dirent->size = child.i_size;
                 }
-            } else {
-                ext2_write_inode(fs, target_inode, &target_inode_data);
+                *cookie = dirent->cookie;
             }
-            
-            ext2_write_inode(fs, parent_inode, &parent_inode_data);
-            gecko_free_kernel_memory(block_buffer);
-            
-            return 0;
+            offset = next;
         }
         
-        offset += dir_entry->rec_len;
-        dir_entry = (ext2_dir_entry_t*)((char*)dir_entry + dir_entry->rec_len);
+        if (bh) {
+            buffer_cache_release(bh);
+        }
+        /* the rest of the block holds nothing more to list */
+        if (filled < count) {
+            *cookie = block_start + fs->block_size;
+        }
     }
     
-    gecko_free_kernel_memory(block_buffer);
-    return -1;
+    return (int)filled;
+}
+
+static int ext2_vfs_readpage(vfs_inode_t* inode, uint64_t index, void* page) {
+    return ext2_readpage(vfs_filesystem(inode), vfs_inode_num(inode), index, page);
+}
+
+static int ext2_vfs_readpages(vfs_inode_t* inode, uint64_t index, void** pages, uint32_t count) {
+    return ext2_readpages(vfs_filesystem(inode), vfs_inode_num(inode), index, pages, count);
+}
+
+/*
+ * the cached size is the file's size, it reaches the disk inode here
+ */
+static int ext2_vfs_writepages(vfs_inode_t* inode, uint64_t index, void** pages, uint32_t count) {
+    return ext2_writepages(vfs_filesystem(inode), vfs_inode_num(inode), index, pages, count, inode->size);
 }
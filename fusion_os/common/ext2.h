@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "vfs.h"
+#include "buffer_cache.h"
+#include "radix_tree.h"
 
 #define EXT2_MAGIC 0xEF53
 #define EXT2_BLOCK_SIZE_1024 1024
@@ -11,6 +13,7 @@
 #define EXT2_BLOCK_SIZE_4096 4096
 #define EXT2_SUPERBLOCK_OFFSET 1024
 #define EXT2_ROOT_INODE 2
+#define EXT2_NAME_LEN 255
 
 typedef struct {
     uint32_t s_inodes_count;
@@ -93,6 +96,32 @@ typedef struct {
     char     name[];
 } ext2_dir_entry_t;
 
+/* hashed directory index (htree). block 0 of an indexed directory holds
+ * . and .. followed by the root of the index, further index blocks hold
+ * one empty entry spanning the block, so a linear scan skips them */
+typedef struct {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;
+    uint8_t  info_length;
+    uint8_t  indirect_levels;
+    uint8_t  unused_flags;
+} ext2_dx_root_info_t;
+
+/* sorted by hash, the first entry of a node holds its limit and count in place of a hash */
+typedef struct {
+    uint32_t hash;                  /* lowest hash in the block, low bit set if it continues the block before */
+    uint32_t block;                 /* logical block of the directory */
+} ext2_dx_entry_t;
+
+typedef struct {
+    uint16_t limit;
+    uint16_t count;
+} ext2_dx_countlimit_t;
+
+#define EXT2_INDEX_FL 0x00001000                /* i_flags: directory has a hashed index */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_DX_HASH_TEA 2
+
 #define EXT2_S_IFSOCK 0xC000
 #define EXT2_S_IFLNK  0xA000
 #define EXT2_S_IFREG  0x8000
@@ -113,33 +142,66 @@ typedef struct {
 #define EXT2_S_IWOTH  0x0002
 #define EXT2_S_IXOTH  0x0001
 
+/* in-memory state of a block group, the bitmaps reach the image on sync */
+typedef struct {
+    uint64_t* block_bitmap;
+    uint64_t* inode_bitmap;
+    uint32_t block_hint;            /* first free bit, every bit below is in use */
+    uint32_t inode_hint;
+    uint8_t dirty;
+} ext2_group_info_t;
+
 typedef struct ext2_filesystem ext2_filesystem_t;
 
 struct ext2_filesystem {
-    void* device;
+    const char* device_name;
+    void* device;                   /* memory holding the image */
     size_t device_size;
+    int owns_device;                /* image allocated by ext2_mount, freed with the filesystem */
     uint32_t block_size;
     uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
     uint32_t group_count;
+    uint32_t dir_group_rotor;       /* where the search for a top level directory's group starts */
     ext2_superblock_t* superblock;
     ext2_group_desc_t* group_descs;
-    uint32_t inode_table_start;
-    uint32_t data_block_start;
+    ext2_group_info_t* groups;
+    buffer_device_t cache;          /* blocks go through the buffer cache */
+    radix_tree_t block_maps;        /* cached block mappings by inode number */
+    list_t block_map_lru;
+    vfs_superblock_t* sb;           /* vfs mount of the image, NULL when not mounted */
     ext2_filesystem_t* next;
 };
 
 int ext2_init(void);
+
+/* format a fresh 1 MiB image in kernel memory and mount it as device,
+ * the image is freed by ext2_umount */
 int ext2_mount(const char* device);
+
+/* format size bytes of memory at image as a fresh filesystem and mount it
+ * as device. the image is split into block groups of 8 * block size
+ * blocks, each with its own bitmaps and inode table. vfs_mount of device
+ * as type ext2 then puts it in the file tree, and it has to be unmounted
+ * there before ext2_umount */
+int ext2_mount_image(const char* device, void* image, size_t size);
 int ext2_umount(const char* device);
+ext2_filesystem_t* ext2_get_filesystem(const char* device);
+int ext2_sync(ext2_filesystem_t* fs);
 int ext2_read_inode(ext2_filesystem_t* fs, uint32_t inode_num, ext2_inode_t* inode);
 int ext2_write_inode(ext2_filesystem_t* fs, uint32_t inode_num, ext2_inode_t* inode);
 int ext2_read_block(ext2_filesystem_t* fs, uint32_t block_num, void* buffer);
 int ext2_write_block(ext2_filesystem_t* fs, uint32_t block_num, const void* buffer);
+int ext2_write_blocks(ext2_filesystem_t* fs, uint32_t block_num, uint32_t count, const void* buffer);
 int ext2_find_inode(ext2_filesystem_t* fs, const char* path, uint32_t* inode_num);
 int ext2_read_directory(ext2_filesystem_t* fs, uint32_t inode_num, void* buffer, size_t size, size_t* bytes_read);
 int ext2_create_file(ext2_filesystem_t* fs, uint32_t parent_inode, const char* name, uint32_t permissions);
+int ext2_mkdir(ext2_filesystem_t* fs, uint32_t parent_inode, const char* name, uint32_t permissions);
 int ext2_delete_file(ext2_filesystem_t* fs, uint32_t parent_inode, const char* name);
 int ext2_write_data(ext2_filesystem_t* fs, uint32_t inode_num, uint32_t offset, const void* data, size_t size, size_t* bytes_written);
 int ext2_read_data(ext2_filesystem_t* fs, uint32_t inode_num, uint32_t offset, void* data, size_t size, size_t* bytes_read);
+int ext2_readpage(ext2_filesystem_t* fs, uint32_t inode_num, uint64_t index, void* page);
+int ext2_readpages(ext2_filesystem_t* fs, uint32_t inode_num, uint64_t index, void** pages, uint32_t count);
+int ext2_writepages(ext2_filesystem_t* fs, uint32_t inode_num, uint64_t index, void** pages, uint32_t count, uint32_t file_size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,175 @@
+/*
+ * fdtable.c - per-task file descriptor table implementation
+ */
+
+#include "fdtable.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/gecko.h"
+
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
+
+/*
+ * allocate an empty array of size slots, header and bitmaps in one block
+ */
+static fd_array_t* alloc_array(uint32_t size) {
+    size_t open_words = BITMAP_WORDS(size);
+    size_t full_words = BITMAP_WORDS(open_words);
+    size_t bytes = sizeof(fd_array_t) + size * sizeof(vfs_file_t*) +
+                   (open_words + full_words) * sizeof(uint64_t);
+
+    fd_array_t* array = gecko_alloc_kernel_memory(bytes);
+    if (!array) {
+        return NULL;
+    }
+
+    memset(array, 0, bytes);
+    array->size = size;
+    array->files = (vfs_file_t**)(array + 1);
+    array->open_bits = (uint64_t*)(array->files + size);
+    array->full_bits = array->open_bits + open_words;
+    return array;
+}
+
+/*
+ * create a table with FDTABLE_INITIAL_SIZE slots
+ */
+vfs_file_table_t* fdtable_create(void) {
+    vfs_file_table_t* table = gecko_alloc_kernel_memory(sizeof(vfs_file_table_t));
+    if (!table) {
+        return NULL;
+    }
+
+    table->array = alloc_array(FDTABLE_INITIAL_SIZE);
+    if (!table->array) {
+        gecko_free_kernel_memory(table);
+        return NULL;
+    }
+
+    table->next_fd = 0;
+    table->used_count = 0;
+    return table;
+}
+
+/*
+ * free table and every array it used
+ */
+void fdtable_destroy(vfs_file_table_t* table) {
+    fd_array_t* array = table->array;
+    while (array) {
+        fd_array_t* retired = array->retired;
+        gecko_free_kernel_memory(array);
+        array = retired;
+    }
+    gecko_free_kernel_memory(table);
+}
+
+/*
+ * lowest free slot at or above start, array->size if there is none
+ */
+static uint32_t find_free_slot(const fd_array_t* array, uint32_t start) {
+    uint32_t open_words = BITMAP_WORDS(array->size);
+    if (start >= array->size) {
+        return array->size;
+    }
+
+    /* rest of the word start is in */
+    uint32_t word = start / 64;
+    uint64_t taken = array->open_bits[word] | ((1ULL << (start % 64)) - 1);
+    if (~taken) {
+        return word * 64 + __builtin_ctzll(~taken);
+    }
+
+    /* then the first later word that is not full */
+    for (uint32_t next = word + 1; next < open_words; next = (next | 63) + 1) {
+        uint64_t full = array->full_bits[next / 64] | ((1ULL << (next % 64)) - 1);
+        if (~full) {
+            uint32_t free_word = (next & ~63u) + __builtin_ctzll(~full);
+            if (free_word >= open_words) {
+                break;
+            }
+            return free_word * 64 + __builtin_ctzll(~array->open_bits[free_word]);
+        }
+    }
+
+    return array->size;
+}
+
+/*
+ * replace the array with one twice its size
+ */
+static int grow_table(vfs_file_table_t* table) {
+    fd_array_t* old = table->array;
+    if (old->size >= VFS_MAX_FILE_DESCRIPTORS) {
+        return -1;
+    }
+
+    fd_array_t* array = alloc_array(old->size * 2);
+    if (!array) {
+        return -1;
+    }
+
+    memcpy(array->files, old->files, old->size * sizeof(vfs_file_t*));
+    memcpy(array->open_bits, old->open_bits, BITMAP_WORDS(old->size) * sizeof(uint64_t));
+    memcpy(array->full_bits, old->full_bits, BITMAP_WORDS(BITMAP_WORDS(old->size)) * sizeof(uint64_t));
+    array->retired = old;
+
+    /* readers see either the old array or a complete new one */
+    __atomic_store_n(&table->array, array, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * take the lowest free slot
+ */
+int fdtable_alloc(vfs_file_table_t* table) {
+    uint32_t fd = find_free_slot(table->array, table->next_fd);
+    if (fd >= table->array->size) {
+        fd = table->array->size;
+        if (grow_table(table) != 0) {
+            LOG_WARNING("fdtable", "descriptor table full");
+            return -1;
+        }
+    }
+
+    fd_array_t* array = table->array;
+    uint32_t word = fd / 64;
+    array->open_bits[word] |= 1ULL << (fd % 64);
+    if (array->open_bits[word] == ~0ULL) {
+        array->full_bits[word / 64] |= 1ULL << (word % 64);
+    }
+
+    table->next_fd = fd + 1;
+    table->used_count++;
+    return (int)fd;
+}
+
+/*
+ * point a taken slot at file
+ */
+void fdtable_install(vfs_file_table_t* table, uint32_t fd, vfs_file_t* file) {
+    __atomic_store_n(&table->array->files[fd], file, __ATOMIC_RELEASE);
+}
+
+/*
+ * free a slot, returns the file it held
+ */
+vfs_file_t* fdtable_remove(vfs_file_table_t* table, uint32_t fd) {
+    fd_array_t* array = table->array;
+    if (fd >= array->size || !(array->open_bits[fd / 64] & (1ULL << (fd % 64)))) {
+        return NULL;
+    }
+
+    vfs_file_t* file = array->files[fd];
+    __atomic_store_n(&array->files[fd], NULL, __ATOMIC_RELEASE);
+
+    uint32_t word = fd / 64;
+    array->open_bits[word] &= ~(1ULL << (fd % 64));
+    array->full_bits[word / 64] &= ~(1ULL << (word % 64));
+
+    if (fd < table->next_fd) {
+        table->next_fd = fd;
+    }
+    table->used_count--;
+    return file;
+}
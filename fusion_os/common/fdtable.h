@@ -0,0 +1,62 @@
+/*
+ * fdtable.h - per-task file descriptor tables for fusion os
+ *
+ * a table maps descriptor numbers to open files. the slot array lives in
+ * an fd_array_t that is replaced by one twice its size when it fills up,
+ * so tables start small and grow to VFS_MAX_FILE_DESCRIPTORS. new
+ * descriptors take the lowest free slot, found through an open bitmap and
+ * a second bitmap of full open words.
+ *
+ * lookups take no lock. the array pointer and the slots are published
+ * with release stores, and replaced arrays stay allocated until the table
+ * is destroyed, so a reader holding an old array never sees freed memory.
+ * the retired arrays together are smaller than the live one. only the
+ * owning task installs and removes descriptors
+ */
+
+#ifndef FDTABLE_H
+#define FDTABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+#define FDTABLE_INITIAL_SIZE 64         /* slots in a new table, multiple of 64 */
+
+/* slot storage, replaced as a whole on growth */
+typedef struct fd_array {
+    uint32_t size;
+    vfs_file_t** files;                 /* NULL for a free or reserved slot */
+    uint64_t* open_bits;                /* one bit per slot */
+    uint64_t* full_bits;                /* one bit per open_bits word without a free slot */
+    struct fd_array* retired;           /* smaller array this one replaced */
+} fd_array_t;
+
+/* descriptor table of one task */
+struct vfs_file_table {
+    fd_array_t* array;
+    uint32_t next_fd;                   /* no free slot below this one */
+    uint32_t used_count;
+};
+
+/* table lifetime, destroy does not close the files */
+vfs_file_table_t* fdtable_create(void);
+void fdtable_destroy(vfs_file_table_t* table);
+
+/* take the lowest free slot, -1 when the table cannot grow */
+int fdtable_alloc(vfs_file_table_t* table);
+
+/* set a taken slot, and give a slot back returning its file */
+void fdtable_install(vfs_file_table_t* table, uint32_t fd, vfs_file_t* file);
+vfs_file_t* fdtable_remove(vfs_file_table_t* table, uint32_t fd);
+
+/* lock free descriptor lookup */
+static inline vfs_file_t* fdtable_lookup(vfs_file_table_t* table, uint32_t fd) {
+    fd_array_t* array = __atomic_load_n(&table->array, __ATOMIC_ACQUIRE);
+    if (fd >= array->size) {
+        return NULL;
+    }
+    return __atomic_load_n(&array->files[fd], __ATOMIC_ACQUIRE);
+}
+
+#endif /* FDTABLE_H */
@@ -0,0 +1,483 @@
+/*
+ * format.c - formatted output core implementation
+ *
+ * decimal conversion emits two digits per step from a lookup table and
+ * divides 32-bit values by 100 with a multiply and shift. hex digits are
+ * produced without branches. output is written straight into the caller
+ * buffer, so no second pass is needed to measure or copy it
+ */
+
+#include "format.h"
+#include "string.h"
+
+/* "00" "01" ... "99" */
+static const char digit_pairs[200] = {
+    '0','0','0','1','0','2','0','3','0','4','0','5','0','6','0','7','0','8','0','9',
+    '1','0','1','1','1','2','1','3','1','4','1','5','1','6','1','7','1','8','1','9',
+    '2','0','2','1','2','2','2','3','2','4','2','5','2','6','2','7','2','8','2','9',
+    '3','0','3','1','3','2','3','3','3','4','3','5','3','6','3','7','3','8','3','9',
+    '4','0','4','1','4','2','4','3','4','4','4','5','4','6','4','7','4','8','4','9',
+    '5','0','5','1','5','2','5','3','5','4','5','5','5','6','5','7','5','8','5','9',
+    '6','0','6','1','6','2','6','3','6','4','6','5','6','6','6','7','6','8','6','9',
+    '7','0','7','1','7','2','7','3','7','4','7','5','7','6','7','7','7','8','7','9',
+    '8','0','8','1','8','2','8','3','8','4','8','5','8','6','8','7','8','8','8','9',
+    '9','0','9','1','9','2','9','3','9','4','9','5','9','6','9','7','9','8','9','9'
+};
+
+/* conversion flags */
+#define FORMAT_LEFT      0x01
+#define FORMAT_ZERO      0x02
+#define FORMAT_PLUS      0x04
+#define FORMAT_SPACE     0x08
+#define FORMAT_ALTERNATE 0x10
+
+/* parsed conversion specification */
+typedef struct {
+    uint32_t flags;
+    int width;
+    int precision;      /* -1 when not given */
+} format_spec_t;
+
+/*
+ * exact quotient for every 32-bit value: 0x51eb851f = ceil(2^37 / 100)
+ */
+static inline uint32_t divide_by_100(uint32_t value) {
+    return (uint32_t)(((uint64_t)value * 0x51eb851fULL) >> 37);
+}
+
+/*
+ * initialize output buffer
+ */
+void format_init(format_buffer_t* fb, char* buffer, size_t capacity) {
+    fb->buffer = buffer;
+    fb->capacity = capacity;
+    fb->used = 0;
+    fb->length = 0;
+    if (capacity > 0) {
+        buffer[0] = '\0';
+    }
+}
+
+/*
+ * check if output was cut short
+ */
+int format_truncated(const format_buffer_t* fb) {
+    return fb->length > fb->used;
+}
+
+/*
+ * drop output back to a previous length
+ */
+void format_rewind(format_buffer_t* fb, size_t used) {
+    if (used < fb->used) {
+        fb->used = used;
+        fb->buffer[used] = '\0';
+    }
+    fb->length = fb->used;
+}
+
+/*
+ * append raw bytes, storing as many as fit
+ */
+void format_append_bytes(format_buffer_t* fb, const char* data, size_t size) {
+    if (fb->used < fb->capacity) {
+        size_t room = fb->capacity - 1 - fb->used;
+        size_t count = size < room ? size : room;
+        char* out = fb->buffer + fb->used;
+        /* pieces are short, an inline loop beats a call */
+        for (size_t i = 0; i < count; i++) {
+            out[i] = data[i];
+        }
+        out[count] = '\0';
+        fb->used += count;
+    }
+    fb->length += size;
+}
+
+/*
+ * append a character repeated count times
+ */
+static void append_fill(format_buffer_t* fb, char c, size_t count) {
+    if (fb->used < fb->capacity) {
+        size_t room = fb->capacity - 1 - fb->used;
+        size_t stored = count < room ? count : room;
+        char* out = fb->buffer + fb->used;
+        for (size_t i = 0; i < stored; i++) {
+            out[i] = c;
+        }
+        out[stored] = '\0';
+        fb->used += stored;
+    }
+    fb->length += count;
+}
+
+void format_append_char(format_buffer_t* fb, char c) {
+    format_append_bytes(fb, &c, 1);
+}
+
+void format_append_string(format_buffer_t* fb, const char* str) {
+    format_append_bytes(fb, str, strlen(str));
+}
+
+/* 10^n for n = 0..19 */
+static const uint64_t powers_of_10[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/*
+ * number of decimal digits, from the bit length (1233 / 4096 ~ log10(2))
+ */
+static inline size_t decimal_digits(uint64_t value) {
+    size_t guess = ((64 - __builtin_clzll(value | 1)) * 1233) >> 12;
+    size_t count = guess + (value >= powers_of_10[guess]);
+    return count ? count : 1;
+}
+
+/*
+ * write decimal digits of value, back to front
+ */
+size_t format_u64_decimal(char* out, uint64_t value) {
+    size_t count = decimal_digits(value);
+    char* p = out + count;
+
+    /* only values above 32 bits need the full-width division */
+    while (value > 0xffffffffULL) {
+        uint64_t quotient = value / 100;
+        uint32_t pair = (uint32_t)(value - quotient * 100) * 2;
+        p -= 2;
+        p[0] = digit_pairs[pair];
+        p[1] = digit_pairs[pair + 1];
+        value = quotient;
+    }
+
+    uint32_t v = (uint32_t)value;
+    while (v >= 100) {
+        uint32_t quotient = divide_by_100(v);
+        uint32_t pair = (v - quotient * 100) * 2;
+        p -= 2;
+        p[0] = digit_pairs[pair];
+        p[1] = digit_pairs[pair + 1];
+        v = quotient;
+    }
+
+    if (v >= 10) {
+        p[-2] = digit_pairs[v * 2];
+        p[-1] = digit_pairs[v * 2 + 1];
+    } else {
+        p[-1] = (char)('0' + v);
+    }
+
+    return count;
+}
+
+/*
+ * write hex digits of value
+ */
+size_t format_u64_hex(char* out, uint64_t value, int uppercase) {
+    size_t count = (67 - __builtin_clzll(value | 1)) / 4;
+    int letter_offset = (uppercase ? 'A' : 'a') - '0' - 10;
+
+    for (size_t i = count; i > 0; i--) {
+        int nibble = (int)(value & 0xf);
+        /* (9 - nibble) >> 31 is all ones exactly when nibble > 9 */
+        out[i - 1] = (char)('0' + nibble + (((9 - nibble) >> 31) & letter_offset));
+        value >>= 4;
+    }
+
+    return count;
+}
+
+/*
+ * write octal digits of value
+ */
+static size_t format_u64_octal(char* out, uint64_t value) {
+    size_t count = (66 - __builtin_clzll(value | 1)) / 3;
+    for (size_t i = count; i > 0; i--) {
+        out[i - 1] = (char)('0' + (value & 7));
+        value >>= 3;
+    }
+    return count;
+}
+
+void format_append_unsigned(format_buffer_t* fb, uint64_t value) {
+    char digits[20];
+    format_append_bytes(fb, digits, format_u64_decimal(digits, value));
+}
+
+void format_append_signed(format_buffer_t* fb, int64_t value) {
+    if (value < 0) {
+        format_append_char(fb, '-');
+        format_append_unsigned(fb, 0 - (uint64_t)value);
+    } else {
+        format_append_unsigned(fb, (uint64_t)value);
+    }
+}
+
+void format_append_hex(format_buffer_t* fb, uint64_t value) {
+    char digits[16];
+    format_append_bytes(fb, digits, format_u64_hex(digits, value, 0));
+}
+
+/*
+ * append a converted field with sign or prefix, precision zeros and padding
+ */
+static void append_field(format_buffer_t* fb, const format_spec_t* spec,
+                         const char* prefix, size_t prefix_len,
+                         const char* digits, size_t digit_count) {
+    size_t zeros = 0;
+    if (spec->precision >= 0 && (size_t)spec->precision > digit_count) {
+        zeros = spec->precision - digit_count;
+    }
+
+    size_t total = prefix_len + zeros + digit_count;
+    size_t pad = (spec->width > 0 && (size_t)spec->width > total) ? spec->width - total : 0;
+
+    if (pad == 0 && zeros == 0) {
+        if (prefix_len > 0) {
+            format_append_bytes(fb, prefix, prefix_len);
+        }
+        format_append_bytes(fb, digits, digit_count);
+        return;
+    }
+
+    if (!(spec->flags & FORMAT_LEFT)) {
+        if ((spec->flags & FORMAT_ZERO) && spec->precision < 0) {
+            zeros += pad;
+        } else {
+            append_fill(fb, ' ', pad);
+        }
+        pad = 0;
+    }
+
+    format_append_bytes(fb, prefix, prefix_len);
+    append_fill(fb, '0', zeros);
+    format_append_bytes(fb, digits, digit_count);
+    append_fill(fb, ' ', pad);
+}
+
+/*
+ * fetch an integer argument of the given length modifier
+ */
+#define FORMAT_LENGTH_INT   0
+#define FORMAT_LENGTH_LONG  1
+#define FORMAT_LENGTH_LLONG 2
+#define FORMAT_LENGTH_SIZE  3
+#define FORMAT_LENGTH_SHORT 4
+#define FORMAT_LENGTH_CHAR  5
+
+static uint64_t fetch_unsigned(va_list* args, int length) {
+    switch (length) {
+        case FORMAT_LENGTH_LONG:  return va_arg(*args, unsigned long);
+        case FORMAT_LENGTH_LLONG: return va_arg(*args, unsigned long long);
+        case FORMAT_LENGTH_SIZE:  return va_arg(*args, size_t);
+        case FORMAT_LENGTH_SHORT: return (unsigned short)va_arg(*args, unsigned int);
+        case FORMAT_LENGTH_CHAR:  return (unsigned char)va_arg(*args, unsigned int);
+        default:                  return va_arg(*args, unsigned int);
+    }
+}
+
+static int64_t fetch_signed(va_list* args, int length) {
+    switch (length) {
+        case FORMAT_LENGTH_LONG:  return va_arg(*args, long);
+        case FORMAT_LENGTH_LLONG: return va_arg(*args, long long);
+        case FORMAT_LENGTH_SIZE:  return (int64_t)va_arg(*args, size_t);
+        case FORMAT_LENGTH_SHORT: return (short)va_arg(*args, int);
+        case FORMAT_LENGTH_CHAR:  return (signed char)va_arg(*args, int);
+        default:                  return va_arg(*args, int);
+    }
+}
+
+/*
+ * copy text up to a terminator or the stop character, scanning and storing
+ * in one pass. returns where copying stopped
+ */
+static const char* append_text(format_buffer_t* fb, const char* p, char stop) {
+    const char* start = p;
+    if (fb->used < fb->capacity) {
+        char* out = fb->buffer + fb->used;
+        size_t room = fb->capacity - 1 - fb->used;
+        size_t count = 0;
+        while (count < room && p[count] != '\0' && p[count] != stop) {
+            out[count] = p[count];
+            count++;
+        }
+        out[count] = '\0';
+        fb->used += count;
+        p += count;
+    }
+    /* count whatever did not fit */
+    while (*p != '\0' && *p != stop) {
+        p++;
+    }
+    fb->length += p - start;
+    return p;
+}
+
+void format_appendf(format_buffer_t* fb, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    format_vappendf(fb, format, args);
+    va_end(args);
+}
+
+/*
+ * printf-style formatting into the buffer
+ */
+void format_vappendf(format_buffer_t* fb, const char* format, va_list args) {
+    va_list ap;
+    va_copy(ap, args);
+
+    const char* p = format;
+    while (*p != '\0') {
+        /* copy the literal run up to the next conversion in one go */
+        if (*p != '%') {
+            p = append_text(fb, p, '%');
+            continue;
+        }
+        p++;
+
+        format_spec_t spec = { 0, 0, -1 };
+
+        /* flags */
+        for (;; p++) {
+            if (*p == '-') spec.flags |= FORMAT_LEFT;
+            else if (*p == '0') spec.flags |= FORMAT_ZERO;
+            else if (*p == '+') spec.flags |= FORMAT_PLUS;
+            else if (*p == ' ') spec.flags |= FORMAT_SPACE;
+            else if (*p == '#') spec.flags |= FORMAT_ALTERNATE;
+            else break;
+        }
+
+        /* width */
+        if (*p == '*') {
+            spec.width = va_arg(ap, int);
+            if (spec.width < 0) {
+                spec.flags |= FORMAT_LEFT;
+                spec.width = -spec.width;
+            }
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') {
+                spec.width = spec.width * 10 + (*p++ - '0');
+            }
+        }
+
+        /* precision */
+        if (*p == '.') {
+            p++;
+            spec.precision = 0;
+            if (*p == '*') {
+                spec.precision = va_arg(ap, int);
+                p++;
+            } else {
+                while (*p >= '0' && *p <= '9') {
+                    spec.precision = spec.precision * 10 + (*p++ - '0');
+                }
+            }
+        }
+
+        /* length modifier */
+        int length = FORMAT_LENGTH_INT;
+        if (*p == 'h') {
+            /* promoted to int, printed truncated back to the named type */
+            length = (p[1] == 'h') ? FORMAT_LENGTH_CHAR : FORMAT_LENGTH_SHORT;
+            p += (p[1] == 'h') ? 2 : 1;
+        } else if (*p == 'l') {
+            length = (p[1] == 'l') ? FORMAT_LENGTH_LLONG : FORMAT_LENGTH_LONG;
+            p += (p[1] == 'l') ? 2 : 1;
+        } else if (*p == 'z' || *p == 'j' || *p == 't') {
+            length = FORMAT_LENGTH_SIZE;
+            p++;
+        }
+
+        char digits[24];
+        size_t count;
+
+        switch (*p) {
+            case 'd':
+            case 'i': {
+                int64_t value = fetch_signed(&ap, length);
+                uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+                const char* sign = value < 0 ? "-" :
+                                   (spec.flags & FORMAT_PLUS) ? "+" :
+                                   (spec.flags & FORMAT_SPACE) ? " " : "";
+                count = (magnitude == 0 && spec.precision == 0) ? 0 : format_u64_decimal(digits, magnitude);
+                append_field(fb, &spec, sign, *sign != '\0', digits, count);
+                break;
+            }
+            case 'u': {
+                uint64_t value = fetch_unsigned(&ap, length);
+                count = (value == 0 && spec.precision == 0) ? 0 : format_u64_decimal(digits, value);
+                append_field(fb, &spec, "", 0, digits, count);
+                break;
+            }
+            case 'x':
+            case 'X': {
+                uint64_t value = fetch_unsigned(&ap, length);
+                int upper = (*p == 'X');
+                count = (value == 0 && spec.precision == 0) ? 0 : format_u64_hex(digits, value, upper);
+                int prefixed = (spec.flags & FORMAT_ALTERNATE) && value != 0;
+                append_field(fb, &spec, upper ? "0X" : "0x", prefixed ? 2 : 0, digits, count);
+                break;
+            }
+            case 'o': {
+                uint64_t value = fetch_unsigned(&ap, length);
+                count = (value == 0 && spec.precision == 0) ? 0 : format_u64_octal(digits, value);
+                int prefixed = (spec.flags & FORMAT_ALTERNATE) && value != 0;
+                append_field(fb, &spec, "0", prefixed ? 1 : 0, digits, count);
+                break;
+            }
+            case 'p': {
+                uintptr_t value = (uintptr_t)va_arg(ap, void*);
+                count = format_u64_hex(digits, value, 0);
+                append_field(fb, &spec, "0x", 2, digits, count);
+                break;
+            }
+            case 'c': {
+                char c = (char)va_arg(ap, int);
+                spec.precision = -1;
+                append_field(fb, &spec, "", 0, &c, 1);
+                break;
+            }
+            case 's': {
+                const char* str = va_arg(ap, const char*);
+                if (str == NULL) {
+                    str = "(null)";
+                }
+                if (spec.width == 0 && spec.precision < 0) {
+                    append_text(fb, str, '\0');
+                    break;
+                }
+                size_t str_len;
+                if (spec.precision >= 0) {
+                    const char* end = memchr(str, '\0', spec.precision);
+                    str_len = end ? (size_t)(end - str) : (size_t)spec.precision;
+                } else {
+                    str_len = strlen(str);
+                }
+                spec.precision = -1;
+                spec.flags &= ~FORMAT_ZERO;
+                append_field(fb, &spec, "", 0, str, str_len);
+                break;
+            }
+            case '%':
+                format_append_char(fb, '%');
+                break;
+            case '\0':
+                /* incomplete conversion at the end of the format, print it as is */
+                format_append_char(fb, '%');
+                p--;
+                break;
+            default:
+                format_append_char(fb, *p);
+                break;
+        }
+        p++;
+    }
+
+    va_end(ap);
+}
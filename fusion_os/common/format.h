@@ -0,0 +1,46 @@
+/*
+ * format.h - formatted output core for fusion os
+ *
+ * appends formatted text into a caller supplied buffer in a single pass.
+ * backs vsnprintf and can be used directly to build output piece by piece
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+/* output buffer, always null terminated while capacity > 0 */
+typedef struct {
+    char* buffer;
+    size_t capacity;    /* size of buffer including the terminator */
+    size_t used;        /* characters stored, excluding the terminator */
+    size_t length;      /* characters the full output needs */
+} format_buffer_t;
+
+/* buffer setup */
+void format_init(format_buffer_t* fb, char* buffer, size_t capacity);
+int format_truncated(const format_buffer_t* fb);
+void format_rewind(format_buffer_t* fb, size_t used);
+
+/* typed appenders */
+void format_append_char(format_buffer_t* fb, char c);
+void format_append_bytes(format_buffer_t* fb, const char* data, size_t size);
+void format_append_string(format_buffer_t* fb, const char* str);
+void format_append_unsigned(format_buffer_t* fb, uint64_t value);
+void format_append_signed(format_buffer_t* fb, int64_t value);
+void format_append_hex(format_buffer_t* fb, uint64_t value);
+
+/* printf-style appenders, arguments are checked against the format at compile time */
+void format_appendf(format_buffer_t* fb, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+void format_vappendf(format_buffer_t* fb, const char* format, va_list args)
+    __attribute__((format(printf, 2, 0)));
+
+/* raw conversions, write digits to out and return the count (no terminator) */
+size_t format_u64_decimal(char* out, uint64_t value);
+size_t format_u64_hex(char* out, uint64_t value, int uppercase);
+
+#endif /* FORMAT_H */
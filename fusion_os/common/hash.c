@@ -0,0 +1,330 @@
+/*
+ * hash.c - open addressing hash table and hash functions
+ *
+ * each control byte is either empty, deleted, or the low 7 bits of the
+ * hash of the node in that slot. lookups compare 16 control bytes at once
+ * and only call the match function on slots whose bits agree, so most
+ * probes touch a single cache line of metadata and one node
+ */
+
+#include "hash.h"
+#include "string.h"
+#include <emmintrin.h>
+
+/* control byte values, full slots hold 0x00 - 0x7f */
+#define CONTROL_EMPTY   0x80
+#define CONTROL_DELETED 0xfe
+
+/* keep at least 1/8 of the slots empty so probes stay short */
+#define MAX_GROWTH(capacity) ((capacity) - (capacity) / 8)
+
+/* hash function constants */
+#define HASH_K0 0xa0761d6478bd642fULL
+#define HASH_K1 0xe7037ed1a0b428dbULL
+#define HASH_K2 0x8ebc6af09c88c6e3ULL
+
+/* unaligned loads */
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+
+static inline uint64_t hash_tag(uint64_t hash) {
+    return hash & 0x7f;
+}
+
+static inline size_t hash_group(uint64_t hash) {
+    return (size_t)(hash >> 7);
+}
+
+/* mask of slots in the group whose control byte equals value */
+static inline uint32_t group_match(const uint8_t* group, uint8_t value) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)value)));
+}
+
+/* mask of empty or deleted slots, the only bytes with the top bit set */
+static inline uint32_t group_free(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+/*
+ * initialize table over caller supplied storage
+ */
+int hash_table_init(hash_table_t* table, void* storage, size_t capacity, hash_match_func_t match) {
+    if (capacity < HASH_GROUP_SIZE || (capacity & (capacity - 1)) != 0) {
+        return -1;
+    }
+
+    table->slots = (hash_node_t**)storage;
+    table->control = (uint8_t*)storage + capacity * sizeof(hash_node_t*);
+    table->capacity = capacity;
+    table->count = 0;
+    table->growth_left = MAX_GROWTH(capacity);
+    table->match = match;
+
+    memset(table->control, CONTROL_EMPTY, capacity);
+    return 0;
+}
+
+/*
+ * first empty or deleted slot in the probe sequence of hash
+ */
+static size_t find_free_slot(const hash_table_t* table, uint64_t hash) {
+    size_t group_mask = table->capacity / HASH_GROUP_SIZE - 1;
+    size_t group = hash_group(hash) & group_mask;
+
+    /* triangular steps visit every group when the group count is a power of two */
+    for (size_t step = 1;; step++) {
+        uint32_t free_mask = group_free(table->control + group * HASH_GROUP_SIZE);
+        if (free_mask != 0) {
+            return group * HASH_GROUP_SIZE + __builtin_ctz(free_mask);
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+/*
+ * rehash in place to turn tombstones back into empty slots. every full slot
+ * is first marked deleted, then each node moves to the first free slot on
+ * its probe sequence, swapping with nodes not yet placed
+ */
+static void drop_deleted(hash_table_t* table) {
+    uint8_t* control = table->control;
+
+    for (size_t i = 0; i < table->capacity; i++) {
+        control[i] = (control[i] & CONTROL_EMPTY) ? CONTROL_EMPTY : CONTROL_DELETED;
+    }
+
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (control[i] != CONTROL_DELETED) {
+            continue;
+        }
+
+        hash_node_t* node = table->slots[i];
+        uint8_t tag = (uint8_t)hash_tag(node->hash);
+        size_t target = find_free_slot(table, node->hash);
+
+        /* any slot of the right group is as good as another */
+        if (target / HASH_GROUP_SIZE == i / HASH_GROUP_SIZE) {
+            control[i] = tag;
+            continue;
+        }
+
+        if (control[target] == CONTROL_EMPTY) {
+            table->slots[target] = node;
+            table->slots[i] = NULL;
+            control[target] = tag;
+            control[i] = CONTROL_EMPTY;
+        } else {
+            /* target holds a node still waiting, swap and place that one next */
+            table->slots[i] = table->slots[target];
+            table->slots[target] = node;
+            control[target] = tag;
+            i--;
+        }
+    }
+
+    table->growth_left = MAX_GROWTH(table->capacity) - table->count;
+}
+
+/*
+ * place a node known to be absent
+ */
+static void place_node(hash_table_t* table, hash_node_t* node) {
+    size_t slot = find_free_slot(table, node->hash);
+    if (table->control[slot] == CONTROL_EMPTY) {
+        table->growth_left--;
+    }
+    table->control[slot] = (uint8_t)hash_tag(node->hash);
+    table->slots[slot] = node;
+    table->count++;
+}
+
+/*
+ * move all nodes into new storage, the old storage can be freed afterwards
+ */
+int hash_table_resize(hash_table_t* table, void* storage, size_t capacity) {
+    if (capacity < HASH_GROUP_SIZE || (capacity & (capacity - 1)) != 0 ||
+        MAX_GROWTH(capacity) < table->count) {
+        return -1;
+    }
+
+    hash_table_t old = *table;
+    hash_table_init(table, storage, capacity, old.match);
+
+    /* nodes keep their hash, so nothing is rehashed or compared */
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.control[i] < CONTROL_EMPTY) {
+            place_node(table, old.slots[i]);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * find node matching key
+ */
+hash_node_t* hash_table_find(const hash_table_t* table, uint64_t hash, const void* key) {
+    size_t group_mask = table->capacity / HASH_GROUP_SIZE - 1;
+    size_t group = hash_group(hash) & group_mask;
+    uint8_t tag = (uint8_t)hash_tag(hash);
+
+    for (size_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t* control = table->control + group * HASH_GROUP_SIZE;
+        hash_node_t** slots = table->slots + group * HASH_GROUP_SIZE;
+
+        for (uint32_t candidates = group_match(control, tag); candidates != 0;
+             candidates &= candidates - 1) {
+            hash_node_t* node = slots[__builtin_ctz(candidates)];
+            if (node->hash == hash && table->match(node, key)) {
+                return node;
+            }
+        }
+
+        /* a group with an empty slot ends every probe sequence through it */
+        if (group_match(control, CONTROL_EMPTY) != 0) {
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+
+    return NULL;
+}
+
+/*
+ * insert node under key, fails if key is present or the table is full
+ */
+int hash_table_insert(hash_table_t* table, hash_node_t* node, uint64_t hash, const void* key) {
+    if (hash_table_find(table, hash, key) != NULL) {
+        return -1;
+    }
+
+    /* out of empty slots, reclaim tombstones before giving up */
+    if (table->growth_left == 0) {
+        if (table->count >= MAX_GROWTH(table->capacity)) {
+            return -1;
+        }
+        drop_deleted(table);
+    }
+
+    node->hash = hash;
+    place_node(table, node);
+    return 0;
+}
+
+/*
+ * remove node from table
+ */
+void hash_table_remove(hash_table_t* table, hash_node_t* node) {
+    size_t group_mask = table->capacity / HASH_GROUP_SIZE - 1;
+    size_t group = hash_group(node->hash) & group_mask;
+    uint8_t tag = (uint8_t)hash_tag(node->hash);
+
+    for (size_t step = 1; step <= group_mask + 1; step++) {
+        uint8_t* control = table->control + group * HASH_GROUP_SIZE;
+        hash_node_t** slots = table->slots + group * HASH_GROUP_SIZE;
+
+        for (uint32_t candidates = group_match(control, tag); candidates != 0;
+             candidates &= candidates - 1) {
+            int index = __builtin_ctz(candidates);
+            if (slots[index] != node) {
+                continue;
+            }
+
+            /*
+             * probes already stop at a group that has an empty slot, so one
+             * more empty there is safe. otherwise leave a tombstone to keep
+             * later groups reachable
+             */
+            if (group_match(control, CONTROL_EMPTY) != 0) {
+                control[index] = CONTROL_EMPTY;
+                table->growth_left++;
+            } else {
+                control[index] = CONTROL_DELETED;
+            }
+            slots[index] = NULL;
+            table->count--;
+            return;
+        }
+
+        if (group_match(control, CONTROL_EMPTY) != 0) {
+            return;
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+/*
+ * get next node at or after cursor
+ */
+hash_node_t* hash_table_next(const hash_table_t* table, size_t* cursor) {
+    while (*cursor < table->capacity) {
+        size_t slot = (*cursor)++;
+        if (table->control[slot] < CONTROL_EMPTY) {
+            return table->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * multiply two words and fold the 128-bit product
+ */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+/*
+ * hash a byte string, reading 16 bytes per step
+ */
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t a;
+    uint64_t b;
+
+    seed ^= hash_mix(seed ^ HASH_K0, HASH_K1);
+
+    if (size <= 16) {
+        if (size >= 8) {
+            a = *(const unaligned_u64*)p;
+            b = *(const unaligned_u64*)(p + size - 8);
+        } else if (size >= 4) {
+            a = *(const unaligned_u32*)p;
+            b = *(const unaligned_u32*)(p + size - 4);
+        } else if (size > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        size_t left = size;
+        while (left > 16) {
+            seed = hash_mix(*(const unaligned_u64*)p ^ HASH_K1, *(const unaligned_u64*)(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        /* last 16 bytes, overlapping what was already mixed */
+        a = *(const unaligned_u64*)(p + left - 16);
+        b = *(const unaligned_u64*)(p + left - 8);
+    }
+
+    __uint128_t product = (__uint128_t)(a ^ HASH_K1) * (b ^ seed);
+    return hash_mix((uint64_t)product ^ HASH_K0 ^ size, (uint64_t)(product >> 64) ^ HASH_K1);
+}
+
+/*
+ * hash a null terminated string
+ */
+uint64_t hash_string(const char* str) {
+    return hash_bytes(str, strlen(str), 0);
+}
+
+/*
+ * hash an integer key such as an id
+ */
+uint64_t hash_u64(uint64_t value) {
+    return hash_mix(value ^ HASH_K0, HASH_K2);
+}
@@ -0,0 +1,61 @@
+/*
+ * hash.h - open addressing hash table and hash functions for fusion os
+ *
+ * the table is intrusive: objects embed a hash_node_t and the table only
+ * stores pointers to them, so it never allocates. slots are grouped 16 at
+ * a time behind one byte of metadata each (swiss table layout), and a whole
+ * group is probed with a single sse2 compare
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* slots probed together */
+#define HASH_GROUP_SIZE 16
+
+/* bytes of storage a table of the given capacity needs */
+#define HASH_TABLE_STORAGE_SIZE(capacity) ((capacity) * (sizeof(void*) + 1))
+
+/* get the containing object from its embedded node */
+#define hash_entry(node, type, member) \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+/* embedded in every object stored in a table */
+typedef struct hash_node {
+    uint64_t hash;
+} hash_node_t;
+
+/* return nonzero if node holds key */
+typedef int (*hash_match_func_t)(const hash_node_t* node, const void* key);
+
+/* hash table structure */
+typedef struct {
+    hash_node_t** slots;
+    uint8_t* control;       /* one metadata byte per slot */
+    size_t capacity;        /* power of two, at least HASH_GROUP_SIZE */
+    size_t count;
+    size_t growth_left;     /* empty slots that may still be filled */
+    hash_match_func_t match;
+} hash_table_t;
+
+/* table setup, storage is 8 byte aligned and HASH_TABLE_STORAGE_SIZE(capacity) long */
+int hash_table_init(hash_table_t* table, void* storage, size_t capacity, hash_match_func_t match);
+int hash_table_resize(hash_table_t* table, void* storage, size_t capacity);
+
+/* lookup, insertion and removal */
+hash_node_t* hash_table_find(const hash_table_t* table, uint64_t hash, const void* key);
+int hash_table_insert(hash_table_t* table, hash_node_t* node, uint64_t hash, const void* key);
+void hash_table_remove(hash_table_t* table, hash_node_t* node);
+
+/* walk all nodes, cursor starts at 0 */
+hash_node_t* hash_table_next(const hash_table_t* table, size_t* cursor);
+
+/* hash functions */
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed);
+uint64_t hash_string(const char* str);
+uint64_t hash_u64(uint64_t value);
+
+#endif /* HASH_H */
@@ -0,0 +1,252 @@
+/*
+ * icache.c - inode cache implementation
+ *
+ * a referenced inode is only in the hash table. when its count drops to
+ * zero it is also appended to the unused lru, and taking a reference
+ * again removes it from there. eviction takes unused inodes from the head
+ */
+
+#include "icache.h"
+#include "page_cache.h"
+#include "memfile.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/gecko.h"
+
+/* unused inodes freed at once when the table is full */
+#define ICACHE_SHRINK_BATCH 64
+
+/* lookup key */
+typedef struct {
+    vfs_superblock_t* sb;
+    uint32_t inode_id;
+} inode_key_t;
+
+static hash_table_t inode_table;
+static uint64_t inode_table_storage[HASH_TABLE_STORAGE_SIZE(ICACHE_TABLE_SIZE) / sizeof(uint64_t)];
+static list_t unused_inodes;
+static icache_stats_t icache_stats;
+static int icache_initialized = 0;
+
+static int inode_match(const hash_node_t* node, const void* key) {
+    const vfs_inode_t* inode = hash_entry(node, vfs_inode_t, cache_link);
+    const inode_key_t* k = (const inode_key_t*)key;
+    return inode->sb == k->sb && inode->inode_id == k->inode_id;
+}
+
+static inline uint64_t inode_hash(vfs_superblock_t* sb, uint32_t inode_id) {
+    return hash_u64(inode_id ^ hash_u64((uint64_t)(uintptr_t)sb));
+}
+
+/*
+ * initialize inode cache
+ */
+void icache_init(void) {
+    if (icache_initialized) {
+        return;
+    }
+
+    hash_table_init(&inode_table, inode_table_storage, ICACHE_TABLE_SIZE, inode_match);
+    list_init(&unused_inodes);
+    memset(&icache_stats, 0, sizeof(icache_stats));
+
+    icache_initialized = 1;
+    LOG_INFO("icache", "inode cache initialized");
+}
+
+/*
+ * take an inode off the unused list
+ */
+static void remove_unused(vfs_inode_t* inode) {
+    list_remove(&unused_inodes, &inode->lru_link);
+    icache_stats.unused--;
+}
+
+/*
+ * unhash and free an inode that is not on the unused list
+ */
+static void evict_inode(vfs_inode_t* inode) {
+    hash_table_remove(&inode_table, &inode->cache_link);
+    icache_stats.cached--;
+    icache_stats.evictions++;
+
+    page_cache_truncate(inode);
+    if (inode->type == VFS_TYPE_FILE) {
+        memfile_release(inode);
+    } else if (inode->data) {
+        gecko_free_kernel_memory(inode->data);
+    }
+    gecko_free_kernel_memory(inode);
+}
+
+/*
+ * find cached inode and take a reference
+ */
+vfs_inode_t* icache_get(vfs_superblock_t* sb, uint32_t inode_id) {
+    if (!icache_initialized) {
+        return NULL;
+    }
+
+    inode_key_t key = { sb, inode_id };
+    hash_node_t* node = hash_table_find(&inode_table, inode_hash(sb, inode_id), &key);
+    if (node == NULL) {
+        icache_stats.misses++;
+        return NULL;
+    }
+
+    icache_stats.hits++;
+    vfs_inode_t* inode = hash_entry(node, vfs_inode_t, cache_link);
+    icache_hold(inode);
+    return inode;
+}
+
+/*
+ * move the table to twice the capacity, for when every cached inode is in
+ * use, as with in-memory filesystems
+ */
+static int grow_table(void) {
+    size_t capacity = inode_table.capacity * 2;
+    void* storage = gecko_alloc_kernel_memory(HASH_TABLE_STORAGE_SIZE(capacity));
+    if (!storage) {
+        return -1;
+    }
+
+    void* old_storage = inode_table.slots;
+    hash_table_resize(&inode_table, storage, capacity);
+    if (old_storage != inode_table_storage) {
+        gecko_free_kernel_memory(old_storage);
+    }
+    return 0;
+}
+
+/*
+ * allocate and index a new inode
+ */
+vfs_inode_t* icache_alloc(vfs_superblock_t* sb, uint32_t inode_id) {
+    if (!icache_initialized) {
+        icache_init();
+    }
+
+    inode_key_t key = { sb, inode_id };
+    uint64_t hash = inode_hash(sb, inode_id);
+    if (hash_table_find(&inode_table, hash, &key) != NULL) {
+        return NULL;
+    }
+
+    vfs_inode_t* inode = gecko_alloc_kernel_memory(sizeof(vfs_inode_t));
+    if (!inode) {
+        /* give memory back and try once more */
+        if (icache_shrink(ICACHE_SHRINK_BATCH) == 0) {
+            return NULL;
+        }
+        inode = gecko_alloc_kernel_memory(sizeof(vfs_inode_t));
+        if (!inode) {
+            return NULL;
+        }
+    }
+
+    memset(inode, 0, sizeof(vfs_inode_t));
+    inode->inode_id = inode_id;
+    inode->sb = sb;
+    inode->reference_count = 1;
+    inode->lru_link.data = inode;
+    range_lock_tree_init(&inode->io_locks);
+    range_lock_tree_init(&inode->advisory_locks);
+
+    if (hash_table_insert(&inode_table, &inode->cache_link, hash, &key) != 0) {
+        if ((icache_shrink(ICACHE_SHRINK_BATCH) == 0 && grow_table() != 0) ||
+            hash_table_insert(&inode_table, &inode->cache_link, hash, &key) != 0) {
+            LOG_WARNING("icache", "inode cache full");
+            gecko_free_kernel_memory(inode);
+            return NULL;
+        }
+    }
+
+    inode->cached = 1;
+    icache_stats.cached++;
+    return inode;
+}
+
+/*
+ * take another reference
+ */
+void icache_hold(vfs_inode_t* inode) {
+    if (inode->cached && inode->reference_count == 0) {
+        remove_unused(inode);
+    }
+    inode->reference_count++;
+}
+
+/*
+ * drop a reference, unused inodes stay cached unless they were deleted
+ */
+void icache_put(vfs_inode_t* inode) {
+    if (inode->reference_count <= 0) {
+        return;
+    }
+
+    inode->reference_count--;
+    if (inode->reference_count > 0 || !inode->cached) {
+        return;
+    }
+
+    /* deleted inodes are not worth keeping */
+    if (inode->link_count == 0) {
+        evict_inode(inode);
+        return;
+    }
+
+    list_add_tail(&unused_inodes, &inode->lru_link);
+    icache_stats.unused++;
+
+    if (icache_stats.unused > ICACHE_MAX_UNUSED) {
+        icache_shrink(icache_stats.unused - ICACHE_MAX_UNUSED);
+    }
+}
+
+/*
+ * free least recently used inodes
+ */
+size_t icache_shrink(size_t count) {
+    size_t freed = 0;
+    list_node_t* link = list_get_head(&unused_inodes);
+
+    while (link != NULL && freed < count) {
+        list_node_t* next = link->next;
+        vfs_inode_t* inode = (vfs_inode_t*)link->data;
+        /* dirty file data exists nowhere else yet */
+        if (inode->dirty_pages == 0) {
+            remove_unused(inode);
+            evict_inode(inode);
+            freed++;
+        }
+        link = next;
+    }
+
+    return freed;
+}
+
+/*
+ * free every unused inode of sb, used on unmount
+ */
+void icache_evict_superblock(vfs_superblock_t* sb) {
+    list_node_t* link = list_get_head(&unused_inodes);
+    while (link != NULL) {
+        list_node_t* next = link->next;
+        vfs_inode_t* inode = (vfs_inode_t*)link->data;
+        if (inode->sb == sb) {
+            remove_unused(inode);
+            evict_inode(inode);
+        }
+        link = next;
+    }
+}
+
+/*
+ * get cache statistics
+ */
+void icache_get_stats(icache_stats_t* stats) {
+    if (stats) {
+        *stats = icache_stats;
+    }
+}
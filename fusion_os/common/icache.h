@@ -0,0 +1,50 @@
+/*
+ * icache.h - inode cache for fusion os
+ *
+ * inodes are indexed by (superblock, inode number) and stay in memory
+ * after their last reference is dropped, on an lru list of unused inodes.
+ * the next lookup of the same inode reuses it instead of rebuilding it.
+ * unused inodes are freed oldest first when the list grows past its limit
+ * or when memory is needed
+ */
+
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+#define ICACHE_TABLE_SIZE 4096          /* initial hash slots, doubled when all are in use */
+#define ICACHE_MAX_UNUSED 1024          /* unused inodes kept for reuse */
+
+/* cache statistics */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t cached;
+    uint32_t unused;
+} icache_stats_t;
+
+/* icache initialization */
+void icache_init(void);
+
+/* referenced inode from the cache, NULL on a miss */
+vfs_inode_t* icache_get(vfs_superblock_t* sb, uint32_t inode_id);
+
+/* new zeroed inode holding one reference, NULL if already cached or out of memory */
+vfs_inode_t* icache_alloc(vfs_superblock_t* sb, uint32_t inode_id);
+
+/* reference counting */
+void icache_hold(vfs_inode_t* inode);
+void icache_put(vfs_inode_t* inode);
+
+/* free up to count unused inodes, returns how many were freed */
+size_t icache_shrink(size_t count);
+void icache_evict_superblock(vfs_superblock_t* sb);
+
+/* statistics */
+void icache_get_stats(icache_stats_t* stats);
+
+#endif /* ICACHE_H */
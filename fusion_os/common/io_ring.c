@@ -0,0 +1,389 @@
+/*
+ * io_ring.c - asynchronous vfs request implementation
+ */
+
+#include "io_ring.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/scheduler.h"
+#include "../gecko/gecko.h"
+
+/* a run of linked entries, queued as one piece of work */
+typedef struct {
+    list_node_t queue_link;
+    io_ring_t* ring;
+    uint32_t count;
+    io_sqe_t sqes[];
+} io_chain_t;
+
+static list_t work_queue;
+static io_ring_stats_t io_ring_stats;
+static uint32_t worker_count = 0;
+static int workers_started = 0;
+static uint32_t parked_workers[IO_RING_WORKERS];    /* task ids of blocked workers */
+static uint32_t parked_count = 0;
+static io_ring_t* kernel_ring = NULL;       /* ring set up outside of a task */
+static int io_ring_initialized = 0;
+
+/*
+ * worker task body, blocks until io_ring_enter queues work
+ */
+static void worker_task(void) {
+    for (;;) {
+        if (!io_ring_process()) {
+            parked_workers[parked_count++] = scheduler_get_current_task()->task_id;
+            scheduler_block_task(TASK_BLOCKED);
+        }
+    }
+}
+
+/*
+ * initialize io rings
+ */
+void io_ring_init(void) {
+    if (io_ring_initialized) {
+        return;
+    }
+
+    list_init(&work_queue);
+    memset(&io_ring_stats, 0, sizeof(io_ring_stats));
+    io_ring_initialized = 1;
+    LOG_INFO("io_ring", "io rings initialized");
+}
+
+/*
+ * start the workers once there is a ring to serve
+ */
+static void start_workers(void) {
+    workers_started = 1;
+    for (uint32_t i = 0; i < IO_RING_WORKERS; i++) {
+        if (gecko_create_task(worker_task, "io_worker") < 0) {
+            break;
+        }
+        worker_count++;
+    }
+
+    if (worker_count == 0) {
+        LOG_WARNING("io_ring", "no worker tasks, requests run on submission");
+        return;
+    }
+    LOG_INFO("io_ring", "started %u io workers", worker_count);
+}
+
+/*
+ * unblock up to count parked workers
+ */
+static void wake_workers(uint32_t count) {
+    while (count-- > 0 && parked_count > 0) {
+        scheduler_unblock_task(parked_workers[--parked_count]);
+    }
+}
+
+static io_ring_t** current_ring(void) {
+    task_t* task = scheduler_get_current_task();
+    return task ? &task->io_ring : &kernel_ring;
+}
+
+/*
+ * set up the ring of the calling task, entries is a power of two
+ */
+io_ring_t* io_ring_setup(uint32_t entries) {
+    if (!io_ring_initialized || entries == 0 || entries > IO_RING_MAX_ENTRIES || (entries & (entries - 1))) {
+        return NULL;
+    }
+
+    io_ring_t** slot = current_ring();
+    if (*slot) {
+        return NULL;
+    }
+
+    vfs_file_table_t* files = vfs_get_file_table();
+    if (!files) {
+        return NULL;
+    }
+
+    io_ring_t* ring = gecko_alloc_kernel_memory(sizeof(io_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(io_ring_t));
+    ring->sq_entries = entries;
+    ring->cq_entries = entries * 2;
+    ring->sqes = gecko_alloc_kernel_memory(ring->sq_entries * sizeof(io_sqe_t));
+    ring->cqes = gecko_alloc_kernel_memory(ring->cq_entries * sizeof(io_cqe_t));
+    if (!ring->sqes || !ring->cqes) {
+        if (ring->sqes) {
+            gecko_free_kernel_memory(ring->sqes);
+        }
+        if (ring->cqes) {
+            gecko_free_kernel_memory(ring->cqes);
+        }
+        gecko_free_kernel_memory(ring);
+        return NULL;
+    }
+
+    memset(ring->sqes, 0, ring->sq_entries * sizeof(io_sqe_t));
+    memset(ring->cqes, 0, ring->cq_entries * sizeof(io_cqe_t));
+    ring->files = files;
+
+    if (!workers_started) {
+        start_workers();
+    }
+
+    *slot = ring;
+    return ring;
+}
+
+/*
+ * run queued work until every request of ring has completed
+ */
+static void wait_idle(io_ring_t* ring) {
+    while (__atomic_load_n(&ring->in_flight, __ATOMIC_ACQUIRE) > 0) {
+        if (!io_ring_process()) {
+            gecko_yield();
+        }
+    }
+}
+
+static void free_ring(io_ring_t* ring) {
+    wait_idle(ring);
+    gecko_free_kernel_memory(ring->sqes);
+    gecko_free_kernel_memory(ring->cqes);
+    gecko_free_kernel_memory(ring);
+}
+
+/*
+ * tear down the ring of the calling task once its requests completed
+ */
+int io_ring_destroy(io_ring_t* ring) {
+    io_ring_t** slot = current_ring();
+    if (!ring || *slot != ring) {
+        return -1;
+    }
+
+    free_ring(ring);
+    *slot = NULL;
+    return 0;
+}
+
+/*
+ * tear down the ring of an exiting task
+ */
+void io_ring_exit_task(task_t* task) {
+    if (task->io_ring) {
+        free_ring(task->io_ring);
+        task->io_ring = NULL;
+    }
+}
+
+/*
+ * post a completion. slots are claimed in any order and published in
+ * claim order, so the task never sees an entry before it is written
+ */
+static void post_completion(io_ring_t* ring, uint64_t user_data, int32_t result) {
+    uint32_t slot = __atomic_fetch_add(&ring->cq_reserved, 1, __ATOMIC_RELAXED);
+    io_cqe_t* cqe = &ring->cqes[slot & (ring->cq_entries - 1)];
+    cqe->user_data = user_data;
+    cqe->result = result;
+
+    while (__atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE) != slot) {
+        gecko_yield();
+    }
+    __atomic_store_n(&ring->cq_tail, slot + 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&ring->in_flight, 1, __ATOMIC_RELEASE);
+    io_ring_stats.completed++;
+}
+
+/*
+ * run one request, returns its completion result
+ */
+static int32_t run_request(const io_sqe_t* sqe, int32_t* chain_fd) {
+    uint32_t fd = (uint32_t)(sqe->fd == IO_FD_PREVIOUS ? *chain_fd : sqe->fd);
+    int current = sqe->offset == IO_OFFSET_CURRENT;
+    size_t done = 0;
+    int result;
+
+    /* byte counts must fit the result */
+    if (sqe->length > INT32_MAX) {
+        return IO_RESULT_ERROR;
+    }
+
+    switch (sqe->opcode) {
+        case IO_OP_NOP:
+            return 0;
+
+        case IO_OP_READ:
+            result = current ? vfs_read(fd, sqe->addr, sqe->length, &done)
+                             : vfs_pread(fd, sqe->addr, sqe->length, sqe->offset, &done);
+            break;
+
+        case IO_OP_WRITE:
+            result = current ? vfs_write(fd, sqe->addr, sqe->length, &done)
+                             : vfs_pwrite(fd, sqe->addr, sqe->length, sqe->offset, &done);
+            break;
+
+        case IO_OP_READV:
+            result = current ? vfs_readv(fd, sqe->addr, sqe->length, &done)
+                             : vfs_preadv(fd, sqe->addr, sqe->length, sqe->offset, &done);
+            break;
+
+        case IO_OP_WRITEV:
+            result = current ? vfs_writev(fd, sqe->addr, sqe->length, &done)
+                             : vfs_pwritev(fd, sqe->addr, sqe->length, sqe->offset, &done);
+            break;
+
+        case IO_OP_OPEN:
+            result = vfs_open(sqe->addr, sqe->open_flags, 0);
+            if (result >= 0) {
+                *chain_fd = result;
+                return result;
+            }
+            return IO_RESULT_ERROR;
+
+        case IO_OP_CLOSE:
+            return vfs_close(fd) == 0 ? 0 : IO_RESULT_ERROR;
+
+        case IO_OP_FSYNC:
+            return vfs_fsync(fd) == 0 ? 0 : IO_RESULT_ERROR;
+
+        case IO_OP_STAT:
+            return vfs_stat(sqe->addr, sqe->addr2) == 0 ? 0 : IO_RESULT_ERROR;
+
+        default:
+            return IO_RESULT_ERROR;
+    }
+
+    if (result != 0 || done > INT32_MAX) {
+        return IO_RESULT_ERROR;
+    }
+    return (int32_t)done;
+}
+
+/*
+ * run the entries of a chain in order against the submitter's descriptors
+ */
+static void run_chain(io_chain_t* chain) {
+    io_ring_t* ring = chain->ring;
+    vfs_file_table_t* previous = vfs_swap_file_table(ring->files);
+    int32_t chain_fd = -1;
+    int failed = 0;
+
+    for (uint32_t i = 0; i < chain->count; i++) {
+        const io_sqe_t* sqe = &chain->sqes[i];
+        int32_t result;
+
+        if (failed) {
+            result = IO_RESULT_CANCELED;
+            io_ring_stats.canceled++;
+        } else {
+            result = run_request(sqe, &chain_fd);
+            failed = result < 0;
+        }
+
+        post_completion(ring, sqe->user_data, result);
+    }
+
+    vfs_swap_file_table(previous);
+}
+
+/*
+ * submit new entries as chains, then wait for completions
+ */
+int io_ring_enter(io_ring_t* ring, uint32_t to_submit, uint32_t min_complete) {
+    if (!ring) {
+        return -1;
+    }
+
+    uint32_t available = ring->sq_tail - ring->sq_head;
+    if (to_submit > available) {
+        to_submit = available;
+    }
+
+    uint32_t submitted = 0;
+    uint32_t queued = 0;
+
+    while (submitted < to_submit) {
+        /* a chain ends at the first entry without IO_SQE_LINK */
+        uint32_t count = 1;
+        while (submitted + count < to_submit &&
+               (ring->sqes[(ring->sq_head + count - 1) & (ring->sq_entries - 1)].flags & IO_SQE_LINK)) {
+            count++;
+        }
+
+        /* leave room in the completion ring for everything in flight */
+        uint32_t ready = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE) - ring->cq_head;
+        if (__atomic_load_n(&ring->in_flight, __ATOMIC_ACQUIRE) + ready + count > ring->cq_entries) {
+            break;
+        }
+
+        io_chain_t* chain = gecko_alloc_kernel_memory(sizeof(io_chain_t) + count * sizeof(io_sqe_t));
+        if (!chain) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            chain->sqes[i] = ring->sqes[(ring->sq_head + i) & (ring->sq_entries - 1)];
+        }
+        chain->ring = ring;
+        chain->count = count;
+        chain->queue_link.data = chain;
+
+        __atomic_store_n(&ring->sq_head, ring->sq_head + count, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&ring->in_flight, count, __ATOMIC_RELEASE);
+        submitted += count;
+        io_ring_stats.submitted += count;
+
+        if (worker_count == 0) {
+            io_ring_stats.inline_chains++;
+            run_chain(chain);
+            gecko_free_kernel_memory(chain);
+        } else {
+            list_add_tail(&work_queue, &chain->queue_link);
+            io_ring_stats.queued++;
+            queued++;
+        }
+    }
+
+    /* the whole batch is handed over at once */
+    if (queued) {
+        io_ring_stats.notifications++;
+        wake_workers(queued);
+    }
+
+    while (__atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE) - ring->cq_head < min_complete &&
+           __atomic_load_n(&ring->in_flight, __ATOMIC_ACQUIRE) > 0) {
+        if (!io_ring_process()) {
+            gecko_yield();
+        }
+    }
+
+    return (int)submitted;
+}
+
+/*
+ * take one chain off the work queue and run it
+ */
+int io_ring_process(void) {
+    list_node_t* link = list_get_head(&work_queue);
+    if (link == NULL) {
+        return 0;
+    }
+
+    list_remove(&work_queue, link);
+    io_ring_stats.queued--;
+
+    io_chain_t* chain = (io_chain_t*)link->data;
+    run_chain(chain);
+    gecko_free_kernel_memory(chain);
+    return 1;
+}
+
+/*
+ * get io ring statistics
+ */
+void io_ring_get_stats(io_ring_stats_t* stats) {
+    if (stats) {
+        *stats = io_ring_stats;
+    }
+}
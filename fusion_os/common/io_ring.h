@@ -0,0 +1,146 @@
+/*
+ * io_ring.h - asynchronous vfs requests for fusion os
+ *
+ * a task sets up one ring pair. it fills submission entries in place,
+ * then hands all new ones over with a single io_ring_enter call and goes
+ * on working. kernel worker tasks run the requests and post a completion
+ * entry for each, which the task reaps whenever it likes. the workers
+ * start with the first ring and stay blocked while there is no work,
+ * io_ring_enter wakes them for the chains it queues. both rings are
+ * plain memory shared by the task and the workers, the producer of a
+ * ring publishes its tail with a release store and the consumer its head.
+ *
+ * entries flagged IO_SQE_LINK run in order with the next entry, and a
+ * failure cancels the rest of the chain. workers run a chain against the
+ * descriptor table of the ring's task, opens and closes included, and
+ * scheduling is cooperative so a table change is never interleaved with
+ * another. a descriptor must stay open until every request on it has
+ * completed
+ */
+
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+#include "list.h"
+#include "string.h"
+
+#define IO_RING_MAX_ENTRIES 4096        /* submission entries, power of two */
+#define IO_RING_WORKERS 4               /* kernel worker tasks */
+
+/* operations */
+#define IO_OP_NOP    0
+#define IO_OP_READ   1                  /* addr, length bytes */
+#define IO_OP_WRITE  2
+#define IO_OP_READV  3                  /* addr is a vfs_iovec_t array of length entries */
+#define IO_OP_WRITEV 4
+#define IO_OP_OPEN   5                  /* addr is the path, open_flags, result is the descriptor */
+#define IO_OP_CLOSE  6
+#define IO_OP_FSYNC  7
+#define IO_OP_STAT   8                  /* addr is the path, addr2 a vfs_stat_t */
+
+/* submission entry flags */
+#define IO_SQE_LINK 0x1                 /* the next entry runs after this one succeeds */
+
+#define IO_OFFSET_CURRENT ((uint64_t)-1)    /* use and move the file position */
+#define IO_FD_PREVIOUS -2               /* descriptor of the last open in the chain */
+
+/* completion results besides byte counts and descriptors */
+#define IO_RESULT_ERROR    -1
+#define IO_RESULT_CANCELED -2           /* an earlier linked entry failed */
+
+/* submission entry, filled by the task */
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t reserved;
+    int32_t fd;
+    uint64_t offset;
+    void* addr;
+    void* addr2;
+    uint32_t length;
+    uint32_t open_flags;
+    uint64_t user_data;                 /* handed back in the completion */
+} io_sqe_t;
+
+/* completion entry, filled by the kernel */
+typedef struct {
+    uint64_t user_data;
+    int32_t result;
+    uint32_t reserved;
+} io_cqe_t;
+
+/* ring pair of one task, the completion ring has twice the entries */
+typedef struct io_ring {
+    io_sqe_t* sqes;
+    uint32_t sq_entries;
+    uint32_t sq_head;                   /* advanced by io_ring_enter */
+    uint32_t sq_tail;                   /* advanced by the task */
+
+    io_cqe_t* cqes;
+    uint32_t cq_entries;
+    uint32_t cq_head;                   /* advanced by the task */
+    uint32_t cq_tail;                   /* advanced by the kernel */
+    uint32_t cq_reserved;               /* slots claimed by workers, published in order */
+
+    uint32_t in_flight;                 /* submitted, not yet completed */
+    vfs_file_table_t* files;            /* descriptor table of the owner */
+} io_ring_t;
+
+/* ring statistics */
+typedef struct {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t canceled;
+    uint64_t notifications;             /* io_ring_enter calls that queued work */
+    uint64_t inline_chains;             /* chains run by the submitting task, without workers */
+    uint32_t queued;                    /* chains waiting for a worker */
+} io_ring_stats_t;
+
+/* initialization, the workers start with the first ring */
+void io_ring_init(void);
+
+/* ring of the calling task, setup fails if it has one already */
+io_ring_t* io_ring_setup(uint32_t entries);
+int io_ring_destroy(io_ring_t* ring);
+void io_ring_exit_task(struct task_control_block* task);
+
+/* submit up to to_submit new entries, then wait until min_complete
+ * completions are ready. returns the number submitted or -1 */
+int io_ring_enter(io_ring_t* ring, uint32_t to_submit, uint32_t min_complete);
+
+/* run one queued chain, returns 0 when there was none. worker task body */
+int io_ring_process(void);
+
+/* statistics */
+void io_ring_get_stats(io_ring_stats_t* stats);
+
+/* next free submission entry, NULL when the ring is full */
+static inline io_sqe_t* io_ring_get_sqe(io_ring_t* ring) {
+    uint32_t head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_tail - head == ring->sq_entries) {
+        return NULL;
+    }
+    io_sqe_t* sqe = &ring->sqes[ring->sq_tail & (ring->sq_entries - 1)];
+    memset(sqe, 0, sizeof(io_sqe_t));
+    __atomic_store_n(&ring->sq_tail, ring->sq_tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* oldest unreaped completion, NULL when there is none */
+static inline io_cqe_t* io_ring_peek_cqe(io_ring_t* ring) {
+    uint32_t tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (ring->cq_head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[ring->cq_head & (ring->cq_entries - 1)];
+}
+
+/* give the peeked completion entry back */
+static inline void io_ring_cqe_seen(io_ring_t* ring) {
+    __atomic_store_n(&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* IO_RING_H */
@@ -6,6 +6,27 @@
 #include "list.h"
 #include "../gecko/pmm.h"
 
+/*
+ * list nodes are 24 bytes, so they are carved out of whole pages instead
+ * of taking a pmm block each. free nodes are chained through next
+ */
+#define NODES_PER_PAGE (PAGE_SIZE / sizeof(list_node_t))
+static list_node_t* free_nodes = NULL;
+
+/* refill the free node pool with one page */
+static int node_pool_grow(void) {
+    list_node_t* page = pmm_alloc_page();
+    if (page == NULL) {
+        return -1;
+    }
+    
+    for (size_t i = 0; i < NODES_PER_PAGE; i++) {
+        page[i].next = free_nodes;
+        free_nodes = &page[i];
+    }
+    return 0;
+}
+
 /* initialize a list */
 void list_init(list_t* list) {
     list->head = NULL;
@@ -88,10 +109,11 @@ uint32_t list_count(list_t* list) {
 
 /* create new list node */
 list_node_t* list_create_node(void* data) {
-    list_node_t* node = pmm_alloc(sizeof(list_node_t));
-    if (node == NULL) {
+    if (free_nodes == NULL && node_pool_grow() != 0) {
         return NULL;
     }
+    list_node_t* node = free_nodes;
+    free_nodes = node->next;
     node->next = NULL;
     node->prev = NULL;
     node->data = data;
@@ -101,9 +123,9 @@ list_node_t* list_create_node(void* data) {
 /* destroy list node */
 void list_destroy_node(list_node_t* node) {
     if (node != NULL) {
-        node->next = NULL;
         node->prev = NULL;
         node->data = NULL;
-        pmm_free(node, sizeof(list_node_t));
+        node->next = free_nodes;
+        free_nodes = node;
     }
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+/*
+ * memfile.c - in-memory file storage implementation
+ */
+
+#include "memfile.h"
+#include "string.h"
+#include "../gecko/pmm.h"
+#include "../gecko/gecko.h"
+
+/* backing of every hole */
+static const uint8_t zero_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static memfile_extent_t* find_extent(vfs_inode_t* inode, uint64_t index) {
+    memfile_t* file = (memfile_t*)inode->data;
+    if (!file) {
+        return NULL;
+    }
+
+    radix_node_t* node = radix_tree_find(&file->extents, index);
+    return node ? radix_entry(node, memfile_extent_t, index_link) : NULL;
+}
+
+/*
+ * set up empty storage for inode
+ */
+int memfile_init(vfs_inode_t* inode, memfile_quota_t* quota) {
+    memfile_t* file = gecko_alloc_kernel_memory(sizeof(memfile_t));
+    if (!file) {
+        return -1;
+    }
+
+    radix_tree_init(&file->extents);
+    file->quota = quota;
+    inode->data = file;
+    return 0;
+}
+
+/*
+ * extent at index, allocated zeroed when missing
+ */
+static memfile_extent_t* get_extent(vfs_inode_t* inode, uint64_t index) {
+    memfile_extent_t* extent = find_extent(inode, index);
+    if (extent) {
+        return extent;
+    }
+
+    if (!inode->data && memfile_init(inode, NULL) != 0) {
+        return NULL;
+    }
+
+    memfile_t* file = (memfile_t*)inode->data;
+    if (file->quota && file->quota->pages >= file->quota->max_pages) {
+        return NULL;
+    }
+
+    extent = gecko_alloc_kernel_memory(sizeof(memfile_extent_t));
+    if (!extent) {
+        return NULL;
+    }
+
+    extent->data = pmm_alloc_page();
+    if (!extent->data) {
+        gecko_free_kernel_memory(extent);
+        return NULL;
+    }
+    memset(extent->data, 0, PAGE_SIZE);
+
+    radix_tree_insert(&file->extents, &extent->index_link, index);
+    if (file->quota) {
+        file->quota->pages++;
+    }
+    return extent;
+}
+
+/*
+ * copy up to size bytes from offset, stops at end of file
+ */
+size_t memfile_read(vfs_inode_t* inode, uint64_t offset, void* buffer, size_t size) {
+    if (offset >= inode->size) {
+        return 0;
+    }
+    if (size > inode->size - offset) {
+        size = inode->size - offset;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        uint64_t position = offset + done;
+        size_t page_offset = position % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - page_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        memcpy((char*)buffer + done, (const char*)memfile_page(inode, position / PAGE_SIZE) + page_offset, chunk);
+        done += chunk;
+    }
+
+    return done;
+}
+
+/*
+ * copy size bytes to offset, the file grows to cover them
+ */
+size_t memfile_write(vfs_inode_t* inode, uint64_t offset, const void* buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        uint64_t position = offset + done;
+        size_t page_offset = position % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - page_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        memfile_extent_t* extent = get_extent(inode, position / PAGE_SIZE);
+        if (!extent) {
+            break;
+        }
+
+        memcpy((char*)extent->data + page_offset, (const char*)buffer + done, chunk);
+        done += chunk;
+    }
+
+    if (offset + done > inode->size) {
+        inode->size = (uint32_t)(offset + done);
+    }
+    return done;
+}
+
+/*
+ * page data at index for reading
+ */
+const void* memfile_page(vfs_inode_t* inode, uint64_t index) {
+    memfile_extent_t* extent = find_extent(inode, index);
+    return extent ? extent->data : zero_page;
+}
+
+/*
+ * free every extent, the file is empty afterwards
+ */
+void memfile_truncate(vfs_inode_t* inode) {
+    memfile_t* file = (memfile_t*)inode->data;
+    inode->size = 0;
+    if (!file) {
+        return;
+    }
+
+    radix_node_t* node;
+    while ((node = radix_tree_first(&file->extents)) != NULL) {
+        memfile_extent_t* extent = radix_entry(node, memfile_extent_t, index_link);
+        radix_tree_erase(&file->extents, &extent->index_link);
+        pmm_free_page(extent->data);
+        gecko_free_kernel_memory(extent);
+        if (file->quota) {
+            file->quota->pages--;
+        }
+    }
+}
+
+/*
+ * free every extent and the tree
+ */
+void memfile_release(vfs_inode_t* inode) {
+    if (!inode->data) {
+        return;
+    }
+
+    memfile_truncate(inode);
+    gecko_free_kernel_memory(inode->data);
+    inode->data = NULL;
+}
@@ -0,0 +1,56 @@
+/*
+ * memfile.h - in-memory file storage for fusion os
+ *
+ * regular files without a backing device keep their data in page
+ * sized extents, indexed by page index in a radix tree hung off the
+ * inode's data pointer. writes allocate only the pages they touch, so an
+ * append never copies what is already in the file. pages that were never
+ * written are holes and read as zeros. a filesystem may charge the pages
+ * of its files to a shared quota, writes stop short once it is used up
+ */
+
+#ifndef MEMFILE_H
+#define MEMFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+#include "radix_tree.h"
+
+/* one page of file data */
+typedef struct {
+    radix_node_t index_link;            /* keyed by page index in the file */
+    void* data;
+} memfile_extent_t;
+
+/* page budget shared by the files of one filesystem */
+typedef struct {
+    uint32_t max_pages;
+    uint32_t pages;
+} memfile_quota_t;
+
+/* extents of one file, inode->data points here */
+typedef struct {
+    radix_tree_t extents;
+    memfile_quota_t* quota;             /* NULL for no limit */
+} memfile_t;
+
+/* set up empty storage charged to quota, without it storage is created
+ * unlimited on the first write */
+int memfile_init(vfs_inode_t* inode, memfile_quota_t* quota);
+
+/* copy file data at offset, reads stop at end of file and writes extend
+ * it. both return the number of bytes copied, a short write means memory
+ * ran out */
+size_t memfile_read(vfs_inode_t* inode, uint64_t offset, void* buffer, size_t size);
+size_t memfile_write(vfs_inode_t* inode, uint64_t offset, const void* buffer, size_t size);
+
+/* data of the page at index, a hole reads from a shared zero page */
+const void* memfile_page(vfs_inode_t* inode, uint64_t index);
+
+/* truncate frees every extent and empties the file, release also
+ * frees the storage itself */
+void memfile_truncate(vfs_inode_t* inode);
+void memfile_release(vfs_inode_t* inode);
+
+#endif /* MEMFILE_H */
@@ -0,0 +1,286 @@
+/*
+ * mount.c - mount table implementation
+ *
+ * nodes are created along the path of every mount and freed again once
+ * they hold neither a mount nor children. the hash table starts on static
+ * storage and moves to twice the capacity whenever it fills up
+ */
+
+#include "mount.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/gecko.h"
+
+/* one path component of the trie */
+typedef struct mount_node {
+    hash_node_t hash_link;              /* keyed by parent and name */
+    struct mount_node* parent;
+    vfs_mount_point_t* mount;           /* visible mount here, NULL on the way to one */
+    uint32_t children;
+    uint32_t name_length;
+    char name[VFS_MAX_FILENAME_LENGTH];
+} mount_node_t;
+
+/* lookup key, points into the caller's path */
+typedef struct {
+    const mount_node_t* parent;
+    const char* name;
+    size_t length;
+} mount_key_t;
+
+static mount_node_t root_node;
+static hash_table_t node_table;
+static uint64_t node_table_storage[HASH_TABLE_STORAGE_SIZE(MOUNT_TABLE_SIZE) / sizeof(uint64_t)];
+static mount_stats_t mount_stats;
+
+static int node_match(const hash_node_t* node, const void* key) {
+    const mount_node_t* m = hash_entry(node, mount_node_t, hash_link);
+    const mount_key_t* k = (const mount_key_t*)key;
+    return m->parent == k->parent && m->name_length == k->length &&
+           memcmp(m->name, k->name, k->length) == 0;
+}
+
+static inline uint64_t node_hash(const mount_key_t* key) {
+    return hash_bytes(key->name, key->length, (uint64_t)(uintptr_t)key->parent);
+}
+
+/*
+ * initialize mount table
+ */
+void mount_init(void) {
+    memset(&root_node, 0, sizeof(root_node));
+    memset(&mount_stats, 0, sizeof(mount_stats));
+    hash_table_init(&node_table, node_table_storage, MOUNT_TABLE_SIZE, node_match);
+    mount_stats.table_capacity = MOUNT_TABLE_SIZE;
+}
+
+/*
+ * next component of the path at cursor, NULL at the end
+ */
+static const char* next_component(const char** cursor, size_t* length) {
+    const char* p = *cursor;
+    while (*p == '/') {
+        p++;
+    }
+    if (*p == '\0') {
+        *cursor = p;
+        return NULL;
+    }
+
+    const char* name = p;
+    while (*p != '\0' && *p != '/') {
+        p++;
+    }
+    *length = p - name;
+    *cursor = p;
+    return name;
+}
+
+static mount_node_t* find_child(const mount_node_t* parent, const char* name, size_t length) {
+    mount_key_t key = { parent, name, length };
+    hash_node_t* node = hash_table_find(&node_table, node_hash(&key), &key);
+    return node ? hash_entry(node, mount_node_t, hash_link) : NULL;
+}
+
+/*
+ * move the table to twice the capacity, it stays put if memory is short
+ */
+static int grow_table(void) {
+    size_t capacity = node_table.capacity * 2;
+    void* storage = gecko_alloc_kernel_memory(HASH_TABLE_STORAGE_SIZE(capacity));
+    if (!storage) {
+        return -1;
+    }
+
+    void* old_storage = node_table.slots;
+    hash_table_resize(&node_table, storage, capacity);
+    if (old_storage != node_table_storage) {
+        gecko_free_kernel_memory(old_storage);
+    }
+
+    mount_stats.table_capacity = capacity;
+    return 0;
+}
+
+static mount_node_t* add_child(mount_node_t* parent, const char* name, size_t length) {
+    /* keep an eighth of the slots empty so probes stay short */
+    if (node_table.count + 1 > node_table.capacity - node_table.capacity / 8 && grow_table() != 0) {
+        return NULL;
+    }
+
+    mount_node_t* node = gecko_alloc_kernel_memory(sizeof(mount_node_t));
+    if (!node) {
+        return NULL;
+    }
+
+    memset(node, 0, sizeof(mount_node_t));
+    node->parent = parent;
+    node->name_length = length;
+    memcpy(node->name, name, length);
+
+    mount_key_t key = { parent, node->name, length };
+    if (hash_table_insert(&node_table, &node->hash_link, node_hash(&key), &key) != 0) {
+        gecko_free_kernel_memory(node);
+        return NULL;
+    }
+
+    parent->children++;
+    mount_stats.nodes++;
+    return node;
+}
+
+/*
+ * free node and its ancestors while they lead to nothing
+ */
+static void prune(mount_node_t* node) {
+    while (node != &root_node && node->mount == NULL && node->children == 0) {
+        mount_node_t* parent = node->parent;
+        hash_table_remove(&node_table, &node->hash_link);
+        gecko_free_kernel_memory(node);
+        parent->children--;
+        mount_stats.nodes--;
+        node = parent;
+    }
+}
+
+/*
+ * add mp under mp->path
+ */
+int mount_insert(vfs_mount_point_t* mp) {
+    if (!mp || !mp->path || mp->path[0] != '/') {
+        return -1;
+    }
+
+    mount_node_t* node = &root_node;
+    const char* cursor = mp->path;
+    const char* name;
+    size_t length;
+
+    while ((name = next_component(&cursor, &length)) != NULL) {
+        if (name[0] == '.' && length == 1) {
+            continue;
+        }
+
+        /* mount paths are taken literally, ".." would have to be resolved first */
+        if ((name[0] == '.' && name[1] == '.' && length == 2) || length >= VFS_MAX_FILENAME_LENGTH) {
+            LOG_ERROR("mount", "bad mount path %s", mp->path);
+            prune(node);
+            return -1;
+        }
+
+        mount_node_t* child = find_child(node, name, length);
+        if (!child) {
+            child = add_child(node, name, length);
+            if (!child) {
+                prune(node);
+                return -1;
+            }
+        }
+        node = child;
+    }
+
+    mp->covered = node->mount;
+    mp->node = node;
+    node->mount = mp;
+    mount_stats.mounts++;
+    return 0;
+}
+
+/*
+ * remove mp, the mount it covered becomes visible again
+ */
+void mount_remove(vfs_mount_point_t* mp) {
+    if (!mp || !mp->node) {
+        return;
+    }
+
+    mount_node_t* node = mp->node;
+    vfs_mount_point_t** link = &node->mount;
+    while (*link != NULL && *link != mp) {
+        link = &(*link)->covered;
+    }
+    if (*link == NULL) {
+        return;
+    }
+
+    *link = mp->covered;
+    mp->covered = NULL;
+    mp->node = NULL;
+    mount_stats.mounts--;
+    prune(node);
+}
+
+/*
+ * visible mount on exactly path
+ */
+vfs_mount_point_t* mount_find(const char* path) {
+    if (!path || path[0] != '/') {
+        return NULL;
+    }
+
+    const mount_node_t* node = &root_node;
+    const char* cursor = path;
+    const char* name;
+    size_t length;
+
+    while ((name = next_component(&cursor, &length)) != NULL) {
+        if (name[0] == '.' && length == 1) {
+            continue;
+        }
+        node = find_child(node, name, length);
+        if (!node) {
+            return NULL;
+        }
+    }
+
+    return node->mount;
+}
+
+/*
+ * deepest mount on path. ".." ends the walk, the rest of the path is
+ * resolved inside the mount found so far and never leaves it
+ */
+vfs_mount_point_t* mount_resolve(const char* path, size_t* consumed) {
+    if (!path || path[0] != '/') {
+        return NULL;
+    }
+
+    const mount_node_t* node = &root_node;
+    vfs_mount_point_t* best = root_node.mount;
+    size_t best_length = 0;
+    const char* cursor = path;
+    const char* name;
+    size_t length;
+
+    while ((name = next_component(&cursor, &length)) != NULL) {
+        if (name[0] == '.' && length == 1) {
+            continue;
+        }
+        if (name[0] == '.' && name[1] == '.' && length == 2) {
+            break;
+        }
+
+        node = find_child(node, name, length);
+        if (!node) {
+            break;
+        }
+        if (node->mount) {
+            best = node->mount;
+            best_length = cursor - path;
+        }
+    }
+
+    if (consumed) {
+        *consumed = best_length;
+    }
+    return best;
+}
+
+/*
+ * get mount table statistics
+ */
+void mount_get_stats(mount_stats_t* stats) {
+    if (stats) {
+        *stats = mount_stats;
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * mount.h - mount table for fusion os
+ *
+ * mount points live in a trie of path components. every node is one
+ * component below its parent, and all nodes sit in a single hash table
+ * keyed by the parent pointer and the component bytes, the same way the
+ * dentry cache is keyed. resolving a path costs one probe per component
+ * and stops at the first component without a node, so it never walks
+ * deeper than the deepest mount on the path. components are matched
+ * whole, "/mntx" does not resolve through a mount at "/mnt". a mount on
+ * a path that is mounted already hides the old one until it is unmounted
+ */
+
+#ifndef MOUNT_H
+#define MOUNT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+#define MOUNT_TABLE_SIZE 256            /* initial hash slots, doubled as the trie grows */
+
+/* mount table statistics */
+typedef struct {
+    uint32_t mounts;
+    uint32_t nodes;                     /* trie nodes, mounted or on the way to a mount */
+    uint32_t table_capacity;
+} mount_stats_t;
+
+/* mount table initialization */
+void mount_init(void);
+
+/* add mp under mp->path, remove it again */
+int mount_insert(vfs_mount_point_t* mp);
+void mount_remove(vfs_mount_point_t* mp);
+
+/* visible mount on exactly path, NULL if there is none */
+vfs_mount_point_t* mount_find(const char* path);
+
+/* deepest mount path resolves through, consumed is set to the length of
+ * the path prefix it covers */
+vfs_mount_point_t* mount_resolve(const char* path, size_t* consumed);
+
+/* statistics */
+void mount_get_stats(mount_stats_t* stats);
+
+#endif /* MOUNT_H */
@@ -0,0 +1,519 @@
+/*
+ * page_cache.c - file data page cache implementation
+ *
+ * every cached page is in its inode's radix tree. clean pages are also on
+ * the lru list, hits move them to the tail and reclaim takes the head.
+ * dirtying or holding a page takes it off the lru until it is clean and
+ * unreferenced again
+ */
+
+#include "page_cache.h"
+#include "readahead.h"
+#include "writeback.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/pmm.h"
+#include "../gecko/gecko.h"
+
+/* clean pages freed at once when memory runs out */
+#define PAGE_CACHE_SHRINK_BATCH 32
+
+/* most pages handed to readpages in one call */
+#define PAGE_CACHE_READ_BATCH 64
+
+/* position in an iovec array */
+typedef struct {
+    const vfs_iovec_t* iov;
+    size_t offset;                      /* into the current iovec */
+} iov_cursor_t;
+
+static list_t clean_pages;
+static page_cache_stats_t page_cache_stats;
+static int page_cache_initialized = 0;
+
+/*
+ * initialize page cache
+ */
+void page_cache_init(void) {
+    if (page_cache_initialized) {
+        return;
+    }
+
+    list_init(&clean_pages);
+    memset(&page_cache_stats, 0, sizeof(page_cache_stats));
+
+    page_cache_initialized = 1;
+    LOG_INFO("page_cache", "page cache initialized: %u clean pages max", PAGE_CACHE_MAX_PAGES);
+}
+
+/* clean unreferenced pages are the ones on the lru, once they are read in */
+static int on_lru(const cached_page_t* page) {
+    return (page->flags & (PAGE_CACHE_UPTODATE | PAGE_CACHE_DIRTY)) == PAGE_CACHE_UPTODATE &&
+           page->references == 0;
+}
+
+/*
+ * unindex and free a page, a held page is freed by its last put
+ */
+static void free_page(cached_page_t* page) {
+    vfs_inode_t* inode = page->inode;
+
+    radix_tree_erase(&inode->pages, &page->index_link);
+    if (page->flags & PAGE_CACHE_DIRTY) {
+        page_cache_stats.dirty--;
+        if (--inode->dirty_pages == 0) {
+            writeback_clear_inode(inode);
+        }
+    } else if (on_lru(page)) {
+        list_remove(&clean_pages, &page->lru_link);
+    }
+    page_cache_stats.pages--;
+
+    if (page->references > 0) {
+        page->inode = NULL;
+        page->flags &= ~PAGE_CACHE_DIRTY;
+        return;
+    }
+
+    pmm_free_page(page->data);
+    gecko_free_kernel_memory(page);
+}
+
+/*
+ * allocate an empty page and index it under inode. it joins the lru when
+ * it is up to date, so reclaim never frees a page still being read
+ */
+static cached_page_t* add_page(vfs_inode_t* inode, uint64_t index) {
+    cached_page_t* page = gecko_alloc_kernel_memory(sizeof(cached_page_t));
+    if (!page) {
+        return NULL;
+    }
+
+    void* data = pmm_alloc_page();
+    if (!data) {
+        /* give clean pages back and try once more */
+        if (page_cache_shrink(PAGE_CACHE_SHRINK_BATCH) == 0 || !(data = pmm_alloc_page())) {
+            gecko_free_kernel_memory(page);
+            return NULL;
+        }
+    }
+
+    memset(page, 0, sizeof(cached_page_t));
+    page->inode = inode;
+    page->data = data;
+    page->lru_link.data = page;
+    radix_tree_insert(&inode->pages, &page->index_link, index);
+    page_cache_stats.pages++;
+
+    return page;
+}
+
+/*
+ * page was filled, make room for it on the lru and put it at the tail
+ */
+static void set_uptodate(cached_page_t* page) {
+    if (list_count(&clean_pages) >= PAGE_CACHE_MAX_PAGES) {
+        page_cache_shrink(list_count(&clean_pages) - PAGE_CACHE_MAX_PAGES + 1);
+    }
+
+    page->flags |= PAGE_CACHE_UPTODATE;
+    list_add_tail(&clean_pages, &page->lru_link);
+}
+
+/*
+ * find cached page of inode
+ */
+cached_page_t* page_cache_find(vfs_inode_t* inode, uint64_t index) {
+    radix_node_t* node = radix_tree_find(&inode->pages, index);
+    return node ? radix_entry(node, cached_page_t, index_link) : NULL;
+}
+
+/*
+ * count a hit and move a clean page to the lru tail
+ */
+static void touch_page(cached_page_t* page) {
+    page_cache_stats.hits++;
+    if (on_lru(page) && clean_pages.tail != &page->lru_link) {
+        list_remove(&clean_pages, &page->lru_link);
+        list_add_tail(&clean_pages, &page->lru_link);
+    }
+}
+
+/*
+ * add and read in a missing page. fill is 0 when the caller overwrites
+ * the whole valid part of the page and the old contents are not needed
+ */
+static cached_page_t* read_page(vfs_inode_t* inode, uint64_t index, int fill) {
+    cached_page_t* page = add_page(inode, index);
+    if (!page) {
+        return NULL;
+    }
+
+    /* pages past the end of file have nothing to read */
+    if (!fill || index * PAGE_SIZE >= inode->size || !inode->ops || !inode->ops->readpage) {
+        memset(page->data, 0, PAGE_SIZE);
+    } else {
+        page_cache_stats.reads++;
+        if (inode->ops->readpage(inode, index, page->data) != 0) {
+            free_page(page);
+            return NULL;
+        }
+    }
+
+    set_uptodate(page);
+    return page;
+}
+
+static cached_page_t* lookup_page(vfs_inode_t* inode, uint64_t index, int fill) {
+    cached_page_t* page = page_cache_find(inode, index);
+    if (page) {
+        touch_page(page);
+        return page;
+    }
+
+    page_cache_stats.misses++;
+    return read_page(inode, index, fill);
+}
+
+/*
+ * find page, reading it through the filesystem on a miss
+ */
+cached_page_t* page_cache_get(vfs_inode_t* inode, uint64_t index) {
+    return lookup_page(inode, index, 1);
+}
+
+/*
+ * read a batch of new pages starting at index with one filesystem call
+ */
+static void read_batch(vfs_inode_t* inode, uint64_t index, cached_page_t** pages, uint32_t count) {
+    void* data[PAGE_CACHE_READ_BATCH];
+    int result = 0;
+
+    if (inode->ops->readpages) {
+        for (uint32_t i = 0; i < count; i++) {
+            data[i] = pages[i]->data;
+        }
+        page_cache_stats.reads++;
+        result = inode->ops->readpages(inode, index, data, count);
+    } else {
+        for (uint32_t i = 0; i < count && result == 0; i++) {
+            page_cache_stats.reads++;
+            result = inode->ops->readpage(inode, index + i, pages[i]->data);
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (result != 0) {
+            free_page(pages[i]);
+        } else {
+            set_uptodate(pages[i]);
+        }
+    }
+}
+
+/*
+ * read uncached pages of [index, index + count) ahead of the reader
+ */
+void page_cache_readahead(vfs_inode_t* inode, uint64_t index, uint32_t count, uint32_t demand, uint32_t async_size) {
+    if (!inode->ops || !inode->ops->readpage || inode->size == 0) {
+        return;
+    }
+
+    /* nothing past end of file */
+    uint64_t end_index = ((uint64_t)inode->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end = index + count < end_index ? index + count : end_index;
+    uint64_t marker = (async_size > 0 && async_size <= count) ? index + count - async_size : (uint64_t)-1;
+
+    cached_page_t* batch[PAGE_CACHE_READ_BATCH];
+    uint32_t batched = 0;
+    uint64_t batch_start = index;
+
+    for (uint64_t i = index; i < end; i++) {
+        if (page_cache_find(inode, i)) {
+            /* a cached page splits the range */
+            if (batched) {
+                read_batch(inode, batch_start, batch, batched);
+                batched = 0;
+            }
+            continue;
+        }
+
+        cached_page_t* page = add_page(inode, i);
+        if (!page) {
+            break;
+        }
+
+        if (i >= index + demand) {
+            page->flags |= PAGE_CACHE_PREFETCHED;
+            page_cache_stats.readahead_pages++;
+        }
+        if (i == marker) {
+            page->flags |= PAGE_CACHE_READAHEAD;
+        }
+
+        if (batched == 0) {
+            batch_start = i;
+        }
+        batch[batched++] = page;
+        if (batched == PAGE_CACHE_READ_BATCH) {
+            read_batch(inode, batch_start, batch, batched);
+            batched = 0;
+        }
+    }
+
+    if (batched) {
+        read_batch(inode, batch_start, batch, batched);
+    }
+}
+
+static size_t iov_length(const vfs_iovec_t* iov, uint32_t iov_count) {
+    size_t size = 0;
+    for (uint32_t i = 0; i < iov_count; i++) {
+        size += iov[i].length;
+    }
+    return size;
+}
+
+/*
+ * copy between a page and the buffers at cursor, to_iov picks the
+ * direction. size must not run past the last buffer
+ */
+static void iov_copy(iov_cursor_t* cursor, void* page_data, size_t size, int to_iov) {
+    while (size > 0) {
+        size_t chunk = cursor->iov->length - cursor->offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        char* base = (char*)cursor->iov->base + cursor->offset;
+        if (to_iov) {
+            memcpy(base, page_data, chunk);
+        } else {
+            memcpy(page_data, base, chunk);
+        }
+
+        page_data = (char*)page_data + chunk;
+        size -= chunk;
+        cursor->offset += chunk;
+        if (cursor->offset == cursor->iov->length) {
+            cursor->iov++;
+            cursor->offset = 0;
+        }
+    }
+}
+
+/*
+ * read file data through the cache into the buffers of iov, stops at end
+ * of file
+ */
+int page_cache_read(vfs_inode_t* inode, vfs_readahead_t* ra, uint64_t offset,
+                    const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_read) {
+    iov_cursor_t cursor = { iov, 0 };
+    size_t size = iov_length(iov, iov_count);
+    size_t done = 0;
+
+    if (offset < inode->size) {
+        if (size > inode->size - offset) {
+            size = inode->size - offset;
+        }
+
+        uint64_t last_index = (offset + size - 1) / PAGE_SIZE;
+
+        while (done < size) {
+            uint64_t position = offset + done;
+            uint64_t index = position / PAGE_SIZE;
+
+            cached_page_t* page = page_cache_find(inode, index);
+            if (page) {
+                touch_page(page);
+                if (ra && (page->flags & PAGE_CACHE_READAHEAD)) {
+                    page->flags &= ~PAGE_CACHE_READAHEAD;
+                    readahead_marker(inode, ra, index);
+                }
+            } else {
+                page_cache_stats.misses++;
+                if (ra) {
+                    readahead_miss(inode, ra, index, (uint32_t)(last_index - index + 1));
+                    page = page_cache_find(inode, index);
+                }
+                if (!page) {
+                    page = read_page(inode, index, 1);
+                }
+            }
+
+            if (!page) {
+                if (bytes_read) {
+                    *bytes_read = done;
+                }
+                return -1;
+            }
+
+            if (page->flags & PAGE_CACHE_PREFETCHED) {
+                page->flags &= ~PAGE_CACHE_PREFETCHED;
+                page_cache_stats.readahead_hits++;
+            }
+            if (ra) {
+                ra->prev_index = index;
+            }
+
+            size_t page_offset = position % PAGE_SIZE;
+            size_t chunk = PAGE_SIZE - page_offset;
+            if (chunk > size - done) {
+                chunk = size - done;
+            }
+
+            iov_copy(&cursor, (char*)page->data + page_offset, chunk, 1);
+            done += chunk;
+        }
+    }
+
+    if (bytes_read) {
+        *bytes_read = done;
+    }
+    return 0;
+}
+
+/*
+ * write file data into the cache and mark the pages dirty, extends the file.
+ * all buffers of a gather write share each page lookup and the dirty
+ * limit check
+ */
+int page_cache_write(vfs_inode_t* inode, uint64_t offset,
+                     const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_written) {
+    iov_cursor_t cursor = { iov, 0 };
+    size_t size = iov_length(iov, iov_count);
+    size_t done = 0;
+    int result = 0;
+
+    while (done < size) {
+        uint64_t position = offset + done;
+        size_t page_offset = position % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - page_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        /* a page written from its start up to or past end of file needs no read */
+        int fill = !(page_offset == 0 && (chunk == PAGE_SIZE || position + chunk >= inode->size));
+
+        cached_page_t* page = lookup_page(inode, position / PAGE_SIZE, fill);
+        if (!page) {
+            result = -1;
+            break;
+        }
+
+        iov_copy(&cursor, (char*)page->data + page_offset, chunk, 0);
+        page_cache_set_dirty(page);
+        done += chunk;
+    }
+
+    if (offset + done > inode->size) {
+        inode->size = (uint32_t)(offset + done);
+    }
+    writeback_balance();
+
+    if (bytes_written) {
+        *bytes_written = done;
+    }
+    return result;
+}
+
+/*
+ * mark page dirty, dirty pages are not reclaimed
+ */
+void page_cache_set_dirty(cached_page_t* page) {
+    if (page->flags & PAGE_CACHE_DIRTY) {
+        return;
+    }
+
+    if (on_lru(page)) {
+        list_remove(&clean_pages, &page->lru_link);
+    }
+    page->flags |= PAGE_CACHE_DIRTY;
+    page_cache_stats.dirty++;
+    if (page->inode->dirty_pages++ == 0) {
+        writeback_mark_inode(page->inode);
+    }
+}
+
+/*
+ * mark page clean after it was written back
+ */
+void page_cache_clear_dirty(cached_page_t* page) {
+    if (!(page->flags & PAGE_CACHE_DIRTY)) {
+        return;
+    }
+
+    page->flags &= ~PAGE_CACHE_DIRTY;
+    page_cache_stats.dirty--;
+    if (on_lru(page)) {
+        list_add_tail(&clean_pages, &page->lru_link);
+    }
+    if (--page->inode->dirty_pages == 0) {
+        writeback_clear_inode(page->inode);
+    }
+}
+
+/*
+ * take a reference for a pipe or message holding the page
+ */
+void page_cache_hold(cached_page_t* page) {
+    if (on_lru(page) && page->inode) {
+        list_remove(&clean_pages, &page->lru_link);
+    }
+    page->references++;
+}
+
+/*
+ * drop a reference, the last one frees a page that left the cache
+ */
+void page_cache_put(cached_page_t* page) {
+    if (--page->references > 0) {
+        return;
+    }
+
+    if (page->inode == NULL) {
+        pmm_free_page(page->data);
+        gecko_free_kernel_memory(page);
+    } else if (on_lru(page)) {
+        list_add_tail(&clean_pages, &page->lru_link);
+    }
+}
+
+/*
+ * free least recently used clean pages
+ */
+size_t page_cache_shrink(size_t count) {
+    size_t freed = 0;
+
+    while (freed < count) {
+        list_node_t* link = list_get_head(&clean_pages);
+        if (link == NULL) {
+            break;
+        }
+        free_page((cached_page_t*)link->data);
+        page_cache_stats.evictions++;
+        freed++;
+    }
+
+    return freed;
+}
+
+/*
+ * drop every page of inode, used when the inode is evicted
+ */
+void page_cache_truncate(vfs_inode_t* inode) {
+    radix_node_t* node;
+    while ((node = radix_tree_first(&inode->pages)) != NULL) {
+        free_page(radix_entry(node, cached_page_t, index_link));
+    }
+}
+
+/*
+ * get cache statistics
+ */
+void page_cache_get_stats(page_cache_stats_t* stats) {
+    if (stats) {
+        *stats = page_cache_stats;
+    }
+}
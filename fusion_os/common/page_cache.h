@@ -0,0 +1,89 @@
+/*
+ * page_cache.h - file data page cache for fusion os
+ *
+ * file data of inodes whose filesystem provides a readpage operation is
+ * kept in page sized pieces, indexed per inode by page index in a radix
+ * tree. reads are served from cached pages and only misses reach the
+ * filesystem. writes land in cached pages and mark them dirty, dirty pages
+ * are not reclaimed until writeback has cleaned them. clean pages sit on a
+ * global lru and are freed oldest first past PAGE_CACHE_MAX_PAGES or when
+ * memory runs out. pipes and ipc messages hold pages by reference, a held
+ * page is not reclaimed and outlives its removal from the file until the
+ * last reference is dropped
+ */
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+#include "list.h"
+#include "radix_tree.h"
+
+#define PAGE_CACHE_MAX_PAGES 4096       /* clean pages kept, 16 MiB */
+
+/* page flags */
+#define PAGE_CACHE_UPTODATE 0x1         /* data matches the file */
+#define PAGE_CACHE_DIRTY    0x2         /* newer than the filesystem copy */
+#define PAGE_CACHE_READAHEAD 0x4        /* reading it submits the next readahead window */
+#define PAGE_CACHE_PREFETCHED 0x8       /* read ahead and not read since */
+
+/* one cached page of a file */
+typedef struct cached_page {
+    radix_node_t index_link;            /* keyed by page index in the file */
+    list_node_t lru_link;               /* clean page lru */
+    vfs_inode_t* inode;                 /* NULL once removed while still held */
+    void* data;
+    uint32_t flags;
+    uint32_t references;                /* holders besides the cache */
+} cached_page_t;
+
+/* cache statistics */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t reads;                     /* readpage calls */
+    uint64_t evictions;
+    uint64_t readahead_pages;           /* pages read ahead of the reader */
+    uint64_t readahead_hits;            /* of those, read later */
+    uint32_t pages;
+    uint32_t dirty;
+} page_cache_stats_t;
+
+/* page cache initialization */
+void page_cache_init(void);
+
+/* page lookup, get fills a missing page through readpage */
+cached_page_t* page_cache_find(vfs_inode_t* inode, uint64_t index);
+cached_page_t* page_cache_get(vfs_inode_t* inode, uint64_t index);
+
+/* copy file data through the cache to or from the buffers of iov, ra may be
+ * NULL to read without readahead */
+int page_cache_read(vfs_inode_t* inode, vfs_readahead_t* ra, uint64_t offset,
+                    const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_read);
+int page_cache_write(vfs_inode_t* inode, uint64_t offset,
+                     const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_written);
+
+/* read uncached pages of a range in batches, the first demand pages were
+ * asked for and the page async_size before the end gets the marker */
+void page_cache_readahead(vfs_inode_t* inode, uint64_t index, uint32_t count, uint32_t demand, uint32_t async_size);
+
+/* dirty state */
+void page_cache_set_dirty(cached_page_t* page);
+void page_cache_clear_dirty(cached_page_t* page);
+
+/* references held outside the cache, put frees a removed page */
+void page_cache_hold(cached_page_t* page);
+void page_cache_put(cached_page_t* page);
+
+/* free up to count clean pages, returns how many were freed */
+size_t page_cache_shrink(size_t count);
+
+/* drop every page of inode, dirty ones included */
+void page_cache_truncate(vfs_inode_t* inode);
+
+/* statistics */
+void page_cache_get_stats(page_cache_stats_t* stats);
+
+#endif /* PAGE_CACHE_H */
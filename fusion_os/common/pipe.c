@@ -0,0 +1,239 @@
+/*
+ * pipe.c - in kernel pipe implementation
+ */
+
+#include "pipe.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/pmm.h"
+#include "../gecko/gecko.h"
+
+static int pipe_file_read(vfs_file_t* file, void* buffer, size_t size, size_t* bytes_read);
+static int pipe_file_write(vfs_file_t* file, const void* buffer, size_t size, size_t* bytes_written);
+static int pipe_file_close(vfs_file_t* file);
+
+const vfs_file_operations_t pipe_file_ops = {
+    .open = NULL,
+    .read = pipe_file_read,
+    .write = pipe_file_write,
+    .close = pipe_file_close,
+    .seek = NULL,
+    .stat = NULL,
+    .unlink = NULL
+};
+
+/*
+ * create a pipe with one reader and one writer
+ */
+pipe_t* pipe_create(void) {
+    pipe_t* pipe = gecko_alloc_kernel_memory(sizeof(pipe_t));
+    if (!pipe) {
+        return NULL;
+    }
+
+    memset(pipe, 0, sizeof(pipe_t));
+    pipe->inode.type = VFS_TYPE_PIPE;
+    pipe->inode.permissions = 0600;
+    pipe->inode.link_count = 1;
+    pipe->inode.data = pipe;
+    pipe->readers = 1;
+    pipe->writers = 1;
+    return pipe;
+}
+
+static pipe_buffer_t* buffer_at(pipe_t* pipe, uint32_t i) {
+    return &pipe->buffers[(pipe->head + i) % PIPE_BUFFERS];
+}
+
+/* give back the page of a buffer */
+static void release_buffer(pipe_buffer_t* buffer) {
+    if (buffer->page) {
+        page_cache_put(buffer->page);
+    } else {
+        pmm_free_page(buffer->data);
+    }
+}
+
+/*
+ * close one end, the last close frees the pipe and what it still holds
+ */
+void pipe_close_end(pipe_t* pipe, int write_end) {
+    if (write_end) {
+        pipe->writers--;
+    } else {
+        pipe->readers--;
+    }
+
+    if (pipe->readers > 0 || pipe->writers > 0) {
+        return;
+    }
+
+    while (pipe->count > 0) {
+        release_buffer(buffer_at(pipe, 0));
+        pipe->head = (pipe->head + 1) % PIPE_BUFFERS;
+        pipe->count--;
+    }
+    gecko_free_kernel_memory(pipe);
+}
+
+pipe_buffer_t* pipe_peek(pipe_t* pipe) {
+    return pipe_peek_at(pipe, 0);
+}
+
+pipe_buffer_t* pipe_peek_at(pipe_t* pipe, uint32_t i) {
+    return i < pipe->count ? buffer_at(pipe, i) : NULL;
+}
+
+void pipe_consume(pipe_t* pipe, uint32_t length) {
+    pipe_buffer_t* buffer = buffer_at(pipe, 0);
+    buffer->offset += length;
+    buffer->length -= length;
+    pipe->inode.size -= length;
+
+    if (buffer->length == 0) {
+        release_buffer(buffer);
+        pipe->head = (pipe->head + 1) % PIPE_BUFFERS;
+        pipe->count--;
+    }
+}
+
+int pipe_take(pipe_t* pipe, pipe_buffer_t* buffer) {
+    if (pipe->count == 0) {
+        return -1;
+    }
+
+    *buffer = *buffer_at(pipe, 0);
+    pipe->inode.size -= buffer->length;
+    pipe->head = (pipe->head + 1) % PIPE_BUFFERS;
+    pipe->count--;
+    return 0;
+}
+
+static int push_buffer(pipe_t* pipe, const pipe_buffer_t* buffer) {
+    if (pipe->count == PIPE_BUFFERS) {
+        return -1;
+    }
+
+    *buffer_at(pipe, pipe->count) = *buffer;
+    pipe->count++;
+    pipe->inode.size += buffer->length;
+    return 0;
+}
+
+size_t pipe_read(pipe_t* pipe, void* buffer, size_t size) {
+    size_t done = 0;
+
+    while (done < size && pipe->count > 0) {
+        pipe_buffer_t* head = buffer_at(pipe, 0);
+        size_t chunk = head->length < size - done ? head->length : size - done;
+        memcpy((char*)buffer + done, (char*)head->data + head->offset, chunk);
+        pipe_consume(pipe, chunk);
+        done += chunk;
+    }
+
+    return done;
+}
+
+/*
+ * copy into the last buffer while it is a page of the pipe with room,
+ * then into new pages
+ */
+size_t pipe_write(pipe_t* pipe, const void* buffer, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        pipe_buffer_t* tail = pipe->count ? buffer_at(pipe, pipe->count - 1) : NULL;
+        if (!tail || tail->page || tail->offset + tail->length == PAGE_SIZE) {
+            if (pipe->count == PIPE_BUFFERS) {
+                break;
+            }
+            void* data = pmm_alloc_page();
+            if (!data) {
+                break;
+            }
+            pipe_buffer_t fresh = { NULL, data, 0, 0 };
+            push_buffer(pipe, &fresh);
+            tail = buffer_at(pipe, pipe->count - 1);
+        }
+
+        size_t room = PAGE_SIZE - (tail->offset + tail->length);
+        size_t chunk = room < size - done ? room : size - done;
+        memcpy((char*)tail->data + tail->offset + tail->length, (const char*)buffer + done, chunk);
+        tail->length += chunk;
+        pipe->inode.size += chunk;
+        done += chunk;
+    }
+
+    return done;
+}
+
+int pipe_push_page(pipe_t* pipe, cached_page_t* page, uint32_t offset, uint32_t length) {
+    pipe_buffer_t buffer = { page, page->data, offset, length };
+    if (push_buffer(pipe, &buffer) != 0) {
+        return -1;
+    }
+    page_cache_hold(page);
+    return 0;
+}
+
+/*
+ * hand whole buffers over, a buffer that does not fit in size is copied
+ */
+size_t pipe_move(pipe_t* from, pipe_t* to, size_t size) {
+    size_t done = 0;
+
+    while (done < size && from->count > 0) {
+        pipe_buffer_t* head = buffer_at(from, 0);
+        if (head->length > size - done) {
+            size_t chunk = pipe_write(to, (char*)head->data + head->offset, size - done);
+            pipe_consume(from, chunk);
+            done += chunk;
+            break;
+        }
+
+        pipe_buffer_t buffer;
+        if (to->count == PIPE_BUFFERS) {
+            break;
+        }
+        pipe_take(from, &buffer);
+        push_buffer(to, &buffer);
+        done += buffer.length;
+    }
+
+    return done;
+}
+
+static int pipe_file_read(vfs_file_t* file, void* buffer, size_t size, size_t* bytes_read) {
+    if (!(file->flags & VFS_PERM_READ)) {
+        return -1;
+    }
+
+    size_t done = pipe_read((pipe_t*)file->inode->data, buffer, size);
+    if (bytes_read) {
+        *bytes_read = done;
+    }
+    return 0;
+}
+
+static int pipe_file_write(vfs_file_t* file, const void* buffer, size_t size, size_t* bytes_written) {
+    pipe_t* pipe = (pipe_t*)file->inode->data;
+    if (!(file->flags & VFS_PERM_WRITE) || pipe->readers == 0) {
+        return -1;
+    }
+
+    size_t done = pipe_write(pipe, buffer, size);
+    if (bytes_written) {
+        *bytes_written = done;
+    }
+    return 0;
+}
+
+/*
+ * the pipe frees its inode with the last end, so the file lets go of it
+ */
+static int pipe_file_close(vfs_file_t* file) {
+    pipe_t* pipe = (pipe_t*)file->inode->data;
+    file->inode = NULL;
+    pipe_close_end(pipe, file->flags & VFS_PERM_WRITE);
+    return 0;
+}
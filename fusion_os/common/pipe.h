@@ -0,0 +1,65 @@
+/*
+ * pipe.h - in kernel pipes for fusion os
+ *
+ * a pipe is a ring of PIPE_BUFFERS buffers, each a piece of one page.
+ * bytes written to a pipe are copied into pages the pipe owns. splicing
+ * from a file adds the file's cached pages by reference instead and
+ * splicing out of a pipe hands the references on, so file data passes
+ * through a pipe without being copied. nothing blocks, reading an empty
+ * pipe returns no bytes and writing a full one writes none
+ */
+
+#ifndef PIPE_H
+#define PIPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+#include "page_cache.h"
+
+#define PIPE_BUFFERS 16                 /* pages a pipe holds, 64 KiB */
+
+/* one piece of a page in the pipe */
+typedef struct {
+    cached_page_t* page;                /* held file page, NULL for a page of the pipe */
+    void* data;                         /* start of the page */
+    uint32_t offset;
+    uint32_t length;
+} pipe_buffer_t;
+
+typedef struct pipe {
+    vfs_inode_t inode;
+    pipe_buffer_t buffers[PIPE_BUFFERS];
+    uint32_t head;                      /* oldest buffer */
+    uint32_t count;
+    uint32_t readers;
+    uint32_t writers;
+} pipe_t;
+
+/* pipe lifetime, the pipe is freed when both ends are closed */
+pipe_t* pipe_create(void);
+void pipe_close_end(pipe_t* pipe, int write_end);
+
+/* copy bytes in and out, return the number copied */
+size_t pipe_read(pipe_t* pipe, void* buffer, size_t size);
+size_t pipe_write(pipe_t* pipe, const void* buffer, size_t size);
+
+/* add bytes of a cached page by reference, -1 when the pipe is full */
+int pipe_push_page(pipe_t* pipe, cached_page_t* page, uint32_t offset, uint32_t length);
+
+/* move whole buffers to another pipe, returns the bytes moved */
+size_t pipe_move(pipe_t* from, pipe_t* to, size_t size);
+
+/* oldest buffer, or the i-th oldest, NULL past the last one. consume
+ * drops length bytes from the oldest */
+pipe_buffer_t* pipe_peek(pipe_t* pipe);
+pipe_buffer_t* pipe_peek_at(pipe_t* pipe, uint32_t i);
+void pipe_consume(pipe_t* pipe, uint32_t length);
+
+/* take the oldest buffer out, the caller owns its page or reference */
+int pipe_take(pipe_t* pipe, pipe_buffer_t* buffer);
+
+/* file operations of the two ends */
+extern const vfs_file_operations_t pipe_file_ops;
+
+#endif /* PIPE_H */
@@ -0,0 +1,222 @@
+/*
+ * radix_tree.c - intrusive compressed radix tree implementation
+ *
+ * tree links are tagged pointers: the low bit marks a link to a key, a
+ * clear low bit a link to the branch hosted by that node. inserting a key
+ * adds one branch, which the new node hosts. removing a key drops the
+ * branch above it; if that branch lived in another node, the removed
+ * node's own branch moves into the freed slot so every branch keeps a host
+ */
+
+#include "radix_tree.h"
+
+#define KEY_REF(node)    ((uintptr_t)(node) | 1)
+#define BRANCH_REF(node) ((uintptr_t)(node))
+
+static inline int ref_is_key(uintptr_t ref) {
+    return (int)(ref & 1);
+}
+
+static inline radix_node_t* ref_node(uintptr_t ref) {
+    return (radix_node_t*)(ref & ~(uintptr_t)1);
+}
+
+static inline int key_direction(uint64_t key, uint32_t bit) {
+    return (int)((key >> bit) & 1);
+}
+
+/*
+ * set the parent of whatever ref links to
+ */
+static void set_parent(uintptr_t ref, radix_node_t* parent) {
+    if (ref_is_key(ref)) {
+        ref_node(ref)->parent = parent;
+    } else {
+        ref_node(ref)->branch_parent = parent;
+    }
+}
+
+/*
+ * point the link holding old_ref at new_ref
+ */
+static void replace_ref(radix_tree_t* tree, radix_node_t* parent,
+                        uintptr_t old_ref, uintptr_t new_ref) {
+    if (parent == NULL) {
+        tree->root = new_ref;
+    } else {
+        parent->child[parent->child[1] == old_ref] = new_ref;
+    }
+}
+
+/*
+ * smallest key below ref
+ */
+static radix_node_t* subtree_first(uintptr_t ref) {
+    while (!ref_is_key(ref)) {
+        ref = ref_node(ref)->child[0];
+    }
+    return ref_node(ref);
+}
+
+/*
+ * smallest key after everything below ref
+ */
+static radix_node_t* subtree_next(uintptr_t ref, radix_node_t* parent) {
+    while (parent != NULL && parent->child[1] == ref) {
+        ref = BRANCH_REF(parent);
+        parent = parent->branch_parent;
+    }
+    return parent ? subtree_first(parent->child[1]) : NULL;
+}
+
+/*
+ * key that shares the longest prefix with key
+ */
+static radix_node_t* closest_key(const radix_tree_t* tree, uint64_t key) {
+    uintptr_t ref = tree->root;
+    while (!ref_is_key(ref)) {
+        radix_node_t* branch = ref_node(ref);
+        ref = branch->child[key_direction(key, branch->bit)];
+    }
+    return ref_node(ref);
+}
+
+/*
+ * initialize empty tree
+ */
+void radix_tree_init(radix_tree_t* tree) {
+    tree->root = 0;
+    tree->count = 0;
+}
+
+/*
+ * insert node under key
+ */
+int radix_tree_insert(radix_tree_t* tree, radix_node_t* node, uint64_t key) {
+    node->key = key;
+    node->has_branch = 0;
+
+    if (tree->root == 0) {
+        node->parent = NULL;
+        tree->root = KEY_REF(node);
+        tree->count = 1;
+        return 0;
+    }
+
+    uint64_t difference = key ^ closest_key(tree, key)->key;
+    if (difference == 0) {
+        return -1;
+    }
+    uint32_t bit = 63 - __builtin_clzll(difference);
+
+    /* branches test strictly lower bits going down, find where bit fits */
+    radix_node_t* parent = NULL;
+    uintptr_t ref = tree->root;
+    while (!ref_is_key(ref) && ref_node(ref)->bit > bit) {
+        parent = ref_node(ref);
+        ref = parent->child[key_direction(key, parent->bit)];
+    }
+
+    /* the new branch splits ref's subtree from the new key */
+    int direction = key_direction(key, bit);
+    node->bit = bit;
+    node->has_branch = 1;
+    node->child[direction] = KEY_REF(node);
+    node->child[!direction] = ref;
+    node->branch_parent = parent;
+    node->parent = node;
+    set_parent(ref, node);
+    replace_ref(tree, parent, ref, BRANCH_REF(node));
+
+    tree->count++;
+    return 0;
+}
+
+/*
+ * remove node from tree
+ */
+void radix_tree_erase(radix_tree_t* tree, radix_node_t* node) {
+    radix_node_t* branch = node->parent;
+    tree->count--;
+
+    if (branch == NULL) {
+        tree->root = 0;
+        return;
+    }
+
+    /* the sibling subtree takes the place of the branch above node */
+    uintptr_t sibling = branch->child[branch->child[0] == KEY_REF(node)];
+    replace_ref(tree, branch->branch_parent, BRANCH_REF(branch), sibling);
+    set_parent(sibling, branch->branch_parent);
+
+    if (branch == node) {
+        /* node hosted the branch it hung from, nothing else refers to it */
+        return;
+    }
+
+    if (!node->has_branch) {
+        branch->has_branch = 0;
+        return;
+    }
+
+    /* move node's own branch into the host that just lost its branch */
+    branch->bit = node->bit;
+    branch->child[0] = node->child[0];
+    branch->child[1] = node->child[1];
+    branch->branch_parent = node->branch_parent;
+    set_parent(branch->child[0], branch);
+    set_parent(branch->child[1], branch);
+    replace_ref(tree, branch->branch_parent, BRANCH_REF(node), BRANCH_REF(branch));
+    node->has_branch = 0;
+}
+
+/*
+ * find node with key
+ */
+radix_node_t* radix_tree_find(const radix_tree_t* tree, uint64_t key) {
+    if (tree->root == 0) {
+        return NULL;
+    }
+    radix_node_t* node = closest_key(tree, key);
+    return node->key == key ? node : NULL;
+}
+
+/*
+ * find the node with the smallest key not less than key
+ */
+radix_node_t* radix_tree_lower_bound(const radix_tree_t* tree, uint64_t key) {
+    if (tree->root == 0) {
+        return NULL;
+    }
+
+    radix_node_t* closest = closest_key(tree, key);
+    if (closest->key == key) {
+        return closest;
+    }
+    uint32_t bit = 63 - __builtin_clzll(key ^ closest->key);
+
+    /* subtree sharing key's prefix above bit */
+    radix_node_t* parent = NULL;
+    uintptr_t ref = tree->root;
+    while (!ref_is_key(ref) && ref_node(ref)->bit > bit) {
+        parent = ref_node(ref);
+        ref = parent->child[key_direction(key, parent->bit)];
+    }
+
+    /* key sorts either before or after that whole subtree */
+    if (key_direction(key, bit) == 0) {
+        return subtree_first(ref);
+    }
+    return subtree_next(ref, parent);
+}
+
+radix_node_t* radix_tree_first(const radix_tree_t* tree) {
+    return tree->root ? subtree_first(tree->root) : NULL;
+}
+
+/*
+ * node with the next larger key
+ */
+radix_node_t* radix_tree_next(const radix_node_t* node) {
+    return subtree_next(KEY_REF(node), node->parent);
+}
@@ -0,0 +1,54 @@
+/*
+ * radix_tree.h - intrusive compressed radix tree for fusion os
+ *
+ * maps 64-bit keys (page indexes, ids, offsets) to objects that embed a
+ * radix_node_t. the tree is a crit-bit tree: each branch tests the highest
+ * bit where its two subtrees differ, so depth is bounded by the key width
+ * and never by the number of keys. a tree of n keys has n - 1 branches and
+ * every object carries room for one, so nothing is allocated
+ */
+
+#ifndef RADIX_TREE_H
+#define RADIX_TREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* get the containing object from its embedded node */
+#define radix_entry(node, type, member) \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+/* embedded in every object stored in a tree */
+typedef struct radix_node {
+    uint64_t key;
+    struct radix_node* parent;          /* branch above this key, NULL at the root */
+
+    /* branch hosted by this node, valid while has_branch is set */
+    struct radix_node* branch_parent;
+    uintptr_t child[2];                 /* node pointer, low bit set for a key */
+    uint32_t bit;                       /* bit tested by the branch */
+    uint32_t has_branch;
+} radix_node_t;
+
+/* tree structure */
+typedef struct {
+    uintptr_t root;
+    size_t count;
+} radix_tree_t;
+
+/* tree setup */
+void radix_tree_init(radix_tree_t* tree);
+
+/* insert node under its key, fails if the key is present */
+int radix_tree_insert(radix_tree_t* tree, radix_node_t* node, uint64_t key);
+void radix_tree_erase(radix_tree_t* tree, radix_node_t* node);
+
+/* lookup */
+radix_node_t* radix_tree_find(const radix_tree_t* tree, uint64_t key);
+radix_node_t* radix_tree_lower_bound(const radix_tree_t* tree, uint64_t key);
+
+/* ascending key order */
+radix_node_t* radix_tree_first(const radix_tree_t* tree);
+radix_node_t* radix_tree_next(const radix_node_t* node);
+
+#endif /* RADIX_TREE_H */
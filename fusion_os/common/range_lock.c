@@ -0,0 +1,280 @@
+/*
+ * range_lock.c - byte range lock implementation
+ *
+ * a waiter polls: it checks the tree under the guard and yields while a
+ * conflicting range is held. an advisory owner's own ranges never
+ * overlap, set trims them before adding the new one, so clearing a range
+ * splits at most one lock
+ */
+
+#include "range_lock.h"
+#include "string.h"
+#include "../gecko/gecko.h"
+
+static range_lock_stats_t range_lock_stats;
+
+static inline range_lock_t* lock_entry(const rb_node_t* node) {
+    return rb_entry(node, range_lock_t, tree_link);
+}
+
+/*
+ * largest end of node and its children
+ */
+static void update_end(rb_node_t* node) {
+    range_lock_t* lock = lock_entry(node);
+    uint64_t end = lock->end;
+
+    if (node->left && lock_entry(node->left)->subtree_end > end) {
+        end = lock_entry(node->left)->subtree_end;
+    }
+    if (node->right && lock_entry(node->right)->subtree_end > end) {
+        end = lock_entry(node->right)->subtree_end;
+    }
+    lock->subtree_end = end;
+}
+
+static int compare_start(const rb_node_t* a, const rb_node_t* b) {
+    uint64_t x = lock_entry(a)->start;
+    uint64_t y = lock_entry(b)->start;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * initialize an empty tree
+ */
+void range_lock_tree_init(range_lock_tree_t* tree) {
+    rb_tree_init_augmented(&tree->ranges, update_end);
+    tree->busy = 0;
+}
+
+static inline void guard_enter(range_lock_tree_t* tree) {
+    while (__atomic_test_and_set(&tree->busy, __ATOMIC_ACQUIRE)) {
+        __asm__ volatile ("pause");
+    }
+}
+
+static inline void guard_exit(range_lock_tree_t* tree) {
+    __atomic_clear(&tree->busy, __ATOMIC_RELEASE);
+}
+
+static inline int conflicts(const range_lock_t* held, range_lock_type_t type, const void* owner) {
+    if (held->type == RANGE_LOCK_READ && type == RANGE_LOCK_READ) {
+        return 0;
+    }
+    return owner == NULL || held->owner != owner;
+}
+
+/*
+ * held range under node that overlaps [start, end) and conflicts with
+ * type, subtrees ending at or before start are skipped whole
+ */
+static range_lock_t* find_conflict(const rb_node_t* node, uint64_t start, uint64_t end,
+                                   range_lock_type_t type, const void* owner) {
+    while (node != NULL && lock_entry(node)->subtree_end > start) {
+        range_lock_t* lock = lock_entry(node);
+
+        if (node->left != NULL) {
+            range_lock_t* found = find_conflict(node->left, start, end, type, owner);
+            if (found) {
+                return found;
+            }
+        }
+
+        /* everything further right starts at or after this lock */
+        if (lock->start >= end) {
+            return NULL;
+        }
+        if (lock->end > start && conflicts(lock, type, owner)) {
+            return lock;
+        }
+        node = node->right;
+    }
+
+    return NULL;
+}
+
+static void insert(range_lock_tree_t* tree, range_lock_t* lock) {
+    lock->subtree_end = lock->end;
+    rb_tree_insert(&tree->ranges, &lock->tree_link, compare_start);
+}
+
+/*
+ * hold [start, end) for one transfer
+ */
+int range_lock_acquire(range_lock_tree_t* tree, range_lock_t* lock, uint64_t start, uint64_t end,
+                       range_lock_type_t type, int wait) {
+    if (start >= end) {
+        return -1;
+    }
+
+    lock->start = start;
+    lock->end = end;
+    lock->type = type;
+    lock->owner = NULL;
+
+    for (int waited = 0;; waited = 1) {
+        guard_enter(tree);
+        if (!find_conflict(tree->ranges.root, start, end, type, NULL)) {
+            insert(tree, lock);
+            __atomic_add_fetch(&range_lock_stats.acquired, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&range_lock_stats.waited, waited, __ATOMIC_RELAXED);
+            guard_exit(tree);
+            return 0;
+        }
+        guard_exit(tree);
+
+        if (!wait) {
+            __atomic_add_fetch(&range_lock_stats.refused, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        gecko_yield();
+    }
+}
+
+/*
+ * drop a transfer's range, waiters see it gone on their next check
+ */
+void range_lock_release(range_lock_tree_t* tree, range_lock_t* lock) {
+    guard_enter(tree);
+    rb_tree_erase(&tree->ranges, &lock->tree_link);
+    guard_exit(tree);
+}
+
+/*
+ * cut [start, end) out of the locks on owned with the guard held. a lock
+ * reaching past both sides keeps its left part and spare becomes the
+ * right one, returns -1 when that split has no spare
+ */
+static int trim_owned(range_lock_tree_t* tree, list_t* owned, uint64_t start, uint64_t end,
+                      range_lock_t** spare) {
+    list_node_t* link = list_get_head(owned);
+    while (link != NULL) {
+        list_node_t* next = link->next;
+        range_lock_t* lock = (range_lock_t*)link->data;
+
+        if (lock->start < end && lock->end > start) {
+            /* start or end change, so the lock goes back in at its new place */
+            rb_tree_erase(&tree->ranges, &lock->tree_link);
+
+            if (lock->start < start && lock->end > end) {
+                if (!*spare) {
+                    insert(tree, lock);
+                    return -1;
+                }
+                range_lock_t* right = *spare;
+                *spare = NULL;
+                right->start = end;
+                right->end = lock->end;
+                right->type = lock->type;
+                right->owner = lock->owner;
+                right->owner_link.data = right;
+                lock->end = start;
+                insert(tree, lock);
+                insert(tree, right);
+                list_add_tail(owned, &right->owner_link);
+            } else if (lock->start < start) {
+                lock->end = start;
+                insert(tree, lock);
+            } else if (lock->end > end) {
+                lock->start = end;
+                insert(tree, lock);
+            } else {
+                list_remove(owned, link);
+                gecko_free_kernel_memory(lock);
+            }
+        }
+
+        link = next;
+    }
+
+    return 0;
+}
+
+/*
+ * hold [start, end) for owner until it is cleared
+ */
+int range_lock_set(range_lock_tree_t* tree, list_t* owned, const void* owner,
+                   uint64_t start, uint64_t end, range_lock_type_t type, int wait) {
+    if (start >= end || !owner) {
+        return -1;
+    }
+
+    /* replacing part of an older lock may split it */
+    range_lock_t* lock = gecko_alloc_kernel_memory(sizeof(range_lock_t));
+    range_lock_t* spare = gecko_alloc_kernel_memory(sizeof(range_lock_t));
+    if (!lock || !spare) {
+        if (lock) {
+            gecko_free_kernel_memory(lock);
+        }
+        if (spare) {
+            gecko_free_kernel_memory(spare);
+        }
+        return -1;
+    }
+
+    memset(lock, 0, sizeof(range_lock_t));
+    lock->start = start;
+    lock->end = end;
+    lock->type = type;
+    lock->owner = owner;
+    lock->owner_link.data = lock;
+
+    for (int waited = 0;; waited = 1) {
+        guard_enter(tree);
+        if (!find_conflict(tree->ranges.root, start, end, type, owner)) {
+            trim_owned(tree, owned, start, end, &spare);
+            insert(tree, lock);
+            list_add_tail(owned, &lock->owner_link);
+            __atomic_add_fetch(&range_lock_stats.acquired, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&range_lock_stats.waited, waited, __ATOMIC_RELAXED);
+            guard_exit(tree);
+            break;
+        }
+        guard_exit(tree);
+
+        if (!wait) {
+            __atomic_add_fetch(&range_lock_stats.refused, 1, __ATOMIC_RELAXED);
+            gecko_free_kernel_memory(lock);
+            gecko_free_kernel_memory(spare);
+            return -1;
+        }
+        gecko_yield();
+    }
+
+    if (spare) {
+        gecko_free_kernel_memory(spare);
+    }
+    return 0;
+}
+
+/*
+ * drop [start, end) from the locks on owned
+ */
+int range_lock_clear(range_lock_tree_t* tree, list_t* owned, uint64_t start, uint64_t end) {
+    if (start >= end) {
+        return -1;
+    }
+    if (list_is_empty(owned)) {
+        return 0;
+    }
+
+    range_lock_t* spare = gecko_alloc_kernel_memory(sizeof(range_lock_t));
+
+    guard_enter(tree);
+    int result = trim_owned(tree, owned, start, end, &spare);
+    guard_exit(tree);
+
+    if (spare) {
+        gecko_free_kernel_memory(spare);
+    }
+    return result;
+}
+
+/*
+ * get range lock statistics
+ */
+void range_lock_get_stats(range_lock_stats_t* stats) {
+    if (stats) {
+        *stats = range_lock_stats;
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * range_lock.h - byte range locks for fusion os
+ *
+ * the locks held on one file sit in an interval tree: a red-black tree
+ * ordered by start, where every node also knows the largest end below
+ * it, so a conflict is found in O(log n) however many ranges are held.
+ * read ranges share, a write range excludes every range it overlaps, and
+ * ranges that do not overlap never wait on each other. i/o locks live on
+ * the caller's stack for one transfer, advisory locks are allocated here
+ * and kept on a list of their owner. waiting has no deadlock detection
+ */
+
+#ifndef RANGE_LOCK_H
+#define RANGE_LOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "rbtree.h"
+#include "list.h"
+
+#define RANGE_LOCK_EOF UINT64_MAX        /* end of a range that runs to the end of the file */
+
+typedef enum {
+    RANGE_LOCK_READ = 1,
+    RANGE_LOCK_WRITE = 2
+} range_lock_type_t;
+
+/* one held range [start, end) */
+typedef struct range_lock {
+    rb_node_t tree_link;                /* keyed by start */
+    uint64_t start;
+    uint64_t end;
+    uint64_t subtree_end;               /* largest end in this subtree */
+    range_lock_type_t type;
+    const void* owner;                  /* advisory owner, NULL for i/o locks */
+    list_node_t owner_link;             /* locks of the owner */
+} range_lock_t;
+
+/* every range held on one file */
+typedef struct {
+    rb_tree_t ranges;
+    uint8_t busy;                       /* guards the tree, held only while it changes */
+} range_lock_tree_t;
+
+/* counters over every tree */
+typedef struct {
+    uint64_t acquired;                  /* ranges granted, transfers and advisory */
+    uint64_t waited;                    /* of those, ranges that found a conflict first */
+    uint64_t refused;                   /* requests that would have had to wait and did not */
+} range_lock_stats_t;
+
+void range_lock_tree_init(range_lock_tree_t* tree);
+
+/* hold [start, end) with lock for a transfer. waits while another range
+ * conflicts, or returns -1 at once when wait is 0 */
+int range_lock_acquire(range_lock_tree_t* tree, range_lock_t* lock, uint64_t start, uint64_t end,
+                       range_lock_type_t type, int wait);
+void range_lock_release(range_lock_tree_t* tree, range_lock_t* lock);
+
+/* advisory locks. set replaces what owner held over [start, end) with a
+ * lock of type, ranges of the same owner never conflict. clear drops
+ * [start, end) from the locks on owned, splitting one that spans it */
+int range_lock_set(range_lock_tree_t* tree, list_t* owned, const void* owner,
+                   uint64_t start, uint64_t end, range_lock_type_t type, int wait);
+int range_lock_clear(range_lock_tree_t* tree, list_t* owned, uint64_t start, uint64_t end);
+
+void range_lock_get_stats(range_lock_stats_t* stats);
+
+#endif /* RANGE_LOCK_H */
@@ -0,0 +1,400 @@
+/*
+ * rbtree.c - intrusive red-black tree implementation
+ *
+ * classic red-black tree with parent links. missing children count as
+ * black leaves, so nodes need no sentinel and the tree needs no memory
+ */
+
+#include "rbtree.h"
+
+static inline int is_red(const rb_node_t* node) {
+    return node != NULL && node->color == RB_RED;
+}
+
+static inline int is_black(const rb_node_t* node) {
+    return node == NULL || node->color == RB_BLACK;
+}
+
+/*
+ * point whatever referenced old_child at new_child
+ */
+static void replace_child(rb_tree_t* tree, rb_node_t* parent,
+                          rb_node_t* old_child, rb_node_t* new_child) {
+    if (parent == NULL) {
+        tree->root = new_child;
+    } else if (parent->left == old_child) {
+        parent->left = new_child;
+    } else {
+        parent->right = new_child;
+    }
+}
+
+/*
+ * rotate node down to the left, its right child takes its place
+ */
+static void rotate_left(rb_tree_t* tree, rb_node_t* node) {
+    rb_node_t* pivot = node->right;
+
+    node->right = pivot->left;
+    if (pivot->left != NULL) {
+        pivot->left->parent = node;
+    }
+
+    pivot->parent = node->parent;
+    replace_child(tree, node->parent, node, pivot);
+
+    pivot->left = node;
+    node->parent = pivot;
+
+    /* pivot now covers what node did, node lost the pivot's right side */
+    if (tree->augment) {
+        tree->augment(node);
+        tree->augment(pivot);
+    }
+}
+
+/*
+ * rotate node down to the right, its left child takes its place
+ */
+static void rotate_right(rb_tree_t* tree, rb_node_t* node) {
+    rb_node_t* pivot = node->left;
+
+    node->left = pivot->right;
+    if (pivot->right != NULL) {
+        pivot->right->parent = node;
+    }
+
+    pivot->parent = node->parent;
+    replace_child(tree, node->parent, node, pivot);
+
+    pivot->right = node;
+    node->parent = pivot;
+
+    if (tree->augment) {
+        tree->augment(node);
+        tree->augment(pivot);
+    }
+}
+
+/*
+ * recompute the summaries from node up to the root
+ */
+static void augment_path(rb_tree_t* tree, rb_node_t* node) {
+    if (tree->augment) {
+        for (; node != NULL; node = node->parent) {
+            tree->augment(node);
+        }
+    }
+}
+
+/*
+ * initialize empty tree
+ */
+void rb_tree_init(rb_tree_t* tree) {
+    tree->root = NULL;
+    tree->count = 0;
+    tree->augment = NULL;
+}
+
+/*
+ * initialize empty tree whose nodes carry subtree summaries
+ */
+void rb_tree_init_augmented(rb_tree_t* tree, rb_augment_func_t augment) {
+    rb_tree_init(tree);
+    tree->augment = augment;
+}
+
+/*
+ * attach node as a red leaf
+ */
+void rb_link_node(rb_node_t* node, rb_node_t* parent, rb_node_t** link) {
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+/*
+ * restore balance after a node was linked, and count it
+ */
+void rb_insert_color(rb_tree_t* tree, rb_node_t* node) {
+    tree->count++;
+
+    /* the new leaf changes every summary above it, rotations keep them right */
+    augment_path(tree, node);
+
+    while (is_red(node->parent)) {
+        rb_node_t* parent = node->parent;
+        rb_node_t* grandparent = parent->parent;
+
+        if (parent == grandparent->left) {
+            rb_node_t* uncle = grandparent->right;
+            if (is_red(uncle)) {
+                /* push the red up and continue from the grandparent */
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                grandparent->color = RB_RED;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(tree, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            grandparent->color = RB_RED;
+            rotate_right(tree, grandparent);
+        } else {
+            rb_node_t* uncle = grandparent->left;
+            if (is_red(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                grandparent->color = RB_RED;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(tree, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            grandparent->color = RB_RED;
+            rotate_left(tree, grandparent);
+        }
+    }
+
+    tree->root->color = RB_BLACK;
+}
+
+/*
+ * insert node in order
+ */
+void rb_tree_insert(rb_tree_t* tree, rb_node_t* node, rb_compare_func_t compare) {
+    rb_node_t* parent = NULL;
+    rb_node_t** link = &tree->root;
+
+    while (*link != NULL) {
+        parent = *link;
+        link = (compare(node, parent) < 0) ? &parent->left : &parent->right;
+    }
+
+    rb_link_node(node, parent, link);
+    rb_insert_color(tree, node);
+}
+
+/*
+ * fix a black height deficit at node (possibly NULL) below parent
+ */
+static void erase_color(rb_tree_t* tree, rb_node_t* node, rb_node_t* parent) {
+    while (node != tree->root && is_black(node)) {
+        if (node == parent->left) {
+            rb_node_t* sibling = parent->right;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(tree, parent);
+                sibling = parent->right;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (is_black(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_right(tree, sibling);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(tree, parent);
+            node = tree->root;
+        } else {
+            rb_node_t* sibling = parent->left;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(tree, parent);
+                sibling = parent->left;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (is_black(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_left(tree, sibling);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(tree, parent);
+            node = tree->root;
+        }
+    }
+
+    if (node != NULL) {
+        node->color = RB_BLACK;
+    }
+}
+
+/*
+ * remove node from tree
+ */
+void rb_tree_erase(rb_tree_t* tree, rb_node_t* node) {
+    rb_node_t* child;
+    rb_node_t* parent;
+    int removed_color;
+
+    if (node->left == NULL || node->right == NULL) {
+        /* at most one child, splice node out directly */
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        removed_color = node->color;
+        if (child != NULL) {
+            child->parent = parent;
+        }
+        replace_child(tree, parent, node, child);
+    } else {
+        /* two children, the in-order successor takes node's place */
+        rb_node_t* successor = node->right;
+        while (successor->left != NULL) {
+            successor = successor->left;
+        }
+
+        child = successor->right;
+        removed_color = successor->color;
+
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            parent->left = child;
+            if (child != NULL) {
+                child->parent = parent;
+            }
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->parent = node->parent;
+        successor->color = node->color;
+        replace_child(tree, node->parent, node, successor);
+    }
+
+    /* everything from the lowest changed node up lost node */
+    augment_path(tree, parent);
+
+    if (removed_color == RB_BLACK) {
+        erase_color(tree, child, parent);
+    }
+
+    node->parent = NULL;
+    node->left = NULL;
+    node->right = NULL;
+    tree->count--;
+}
+
+/*
+ * find a node equal to key
+ */
+rb_node_t* rb_tree_find(const rb_tree_t* tree, const void* key, rb_key_compare_func_t compare) {
+    rb_node_t* node = tree->root;
+
+    while (node != NULL) {
+        int result = compare(key, node);
+        if (result == 0) {
+            return node;
+        }
+        node = (result < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * find the first node not less than key
+ */
+rb_node_t* rb_tree_lower_bound(const rb_tree_t* tree, const void* key, rb_key_compare_func_t compare) {
+    rb_node_t* node = tree->root;
+    rb_node_t* best = NULL;
+
+    while (node != NULL) {
+        if (compare(key, node) <= 0) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return best;
+}
+
+rb_node_t* rb_tree_first(const rb_tree_t* tree) {
+    rb_node_t* node = tree->root;
+    if (node != NULL) {
+        while (node->left != NULL) {
+            node = node->left;
+        }
+    }
+    return node;
+}
+
+rb_node_t* rb_tree_last(const rb_tree_t* tree) {
+    rb_node_t* node = tree->root;
+    if (node != NULL) {
+        while (node->right != NULL) {
+            node = node->right;
+        }
+    }
+    return node;
+}
+
+/*
+ * in-order successor
+ */
+rb_node_t* rb_tree_next(const rb_node_t* node) {
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) {
+            node = node->left;
+        }
+        return (rb_node_t*)node;
+    }
+
+    while (node->parent != NULL && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+/*
+ * in-order predecessor
+ */
+rb_node_t* rb_tree_prev(const rb_node_t* node) {
+    if (node->left != NULL) {
+        node = node->left;
+        while (node->right != NULL) {
+            node = node->right;
+        }
+        return (rb_node_t*)node;
+    }
+
+    while (node->parent != NULL && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
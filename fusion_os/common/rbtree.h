@@ -0,0 +1,68 @@
+/*
+ * rbtree.h - intrusive red-black tree for fusion os
+ *
+ * objects embed an rb_node_t and are ordered by a compare function, so the
+ * tree never allocates. lookups, insertion and removal are O(log n). an
+ * augmented tree keeps a summary of every subtree in its nodes, such as
+ * the largest end of an interval tree, and has it recomputed wherever
+ * the shape changes
+ */
+
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+/* get the containing object from its embedded node */
+#define rb_entry(node, type, member) \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+/* embedded in every object stored in a tree */
+typedef struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    int color;
+} rb_node_t;
+
+/* recompute the summary of node from node and its children */
+typedef void (*rb_augment_func_t)(rb_node_t* node);
+
+/* tree structure */
+typedef struct {
+    rb_node_t* root;
+    size_t count;
+    rb_augment_func_t augment;          /* NULL for a plain tree */
+} rb_tree_t;
+
+/* order two nodes, or a key against a node: <0, 0 or >0 */
+typedef int (*rb_compare_func_t)(const rb_node_t* a, const rb_node_t* b);
+typedef int (*rb_key_compare_func_t)(const void* key, const rb_node_t* node);
+
+/* tree setup */
+void rb_tree_init(rb_tree_t* tree);
+void rb_tree_init_augmented(rb_tree_t* tree, rb_augment_func_t augment);
+
+/* insert node, equal nodes go after existing ones */
+void rb_tree_insert(rb_tree_t* tree, rb_node_t* node, rb_compare_func_t compare);
+void rb_tree_erase(rb_tree_t* tree, rb_node_t* node);
+
+/* link node under parent at *link found by a custom descent, then rebalance */
+void rb_link_node(rb_node_t* node, rb_node_t* parent, rb_node_t** link);
+void rb_insert_color(rb_tree_t* tree, rb_node_t* node);
+
+/* lookup */
+rb_node_t* rb_tree_find(const rb_tree_t* tree, const void* key, rb_key_compare_func_t compare);
+rb_node_t* rb_tree_lower_bound(const rb_tree_t* tree, const void* key, rb_key_compare_func_t compare);
+
+/* in-order traversal */
+rb_node_t* rb_tree_first(const rb_tree_t* tree);
+rb_node_t* rb_tree_last(const rb_tree_t* tree);
+rb_node_t* rb_tree_next(const rb_node_t* node);
+rb_node_t* rb_tree_prev(const rb_node_t* node);
+
+#endif /* RBTREE_H */
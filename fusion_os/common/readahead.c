@@ -0,0 +1,116 @@
+/*
+ * readahead.c - sequential readahead implementation
+ */
+
+#include "readahead.h"
+#include "page_cache.h"
+#include "string.h"
+#include "../gecko/pmm.h"
+
+static uint32_t default_max_pages = READAHEAD_DEFAULT_MAX;
+static readahead_stats_t readahead_stats;
+
+/*
+ * reset readahead state of a newly opened file
+ */
+void readahead_init(vfs_readahead_t* ra) {
+    memset(ra, 0, sizeof(vfs_readahead_t));
+    ra->max_pages = default_max_pages;
+    /* a first read at page 0 counts as sequential */
+    ra->prev_index = (uint64_t)-1;
+}
+
+/*
+ * set window limit for files opened from now on
+ */
+void readahead_set_max(uint32_t bytes) {
+    uint32_t pages = bytes / PAGE_SIZE;
+    if (pages != 0 && pages < READAHEAD_MIN_PAGES) {
+        pages = READAHEAD_MIN_PAGES;
+    }
+    if (pages > READAHEAD_MAX_PAGES) {
+        pages = READAHEAD_MAX_PAGES;
+    }
+    default_max_pages = pages;
+}
+
+/*
+ * size of the window after the current one, small windows grow faster
+ */
+static uint32_t next_window_size(const vfs_readahead_t* ra) {
+    uint32_t size = ra->size < READAHEAD_MIN_PAGES ? READAHEAD_MIN_PAGES : ra->size;
+    size *= (size < ra->max_pages / 16) ? 4 : 2;
+    return size > ra->max_pages ? ra->max_pages : size;
+}
+
+static void submit_window(vfs_inode_t* inode, vfs_readahead_t* ra, uint64_t start,
+                          uint32_t size, uint32_t demand, uint32_t async_size) {
+    ra->start = start;
+    ra->size = size;
+    ra->async_size = async_size;
+    readahead_stats.windows++;
+    page_cache_readahead(inode, start, size, demand, async_size);
+}
+
+/*
+ * page index is not cached and request_pages pages from it are wanted
+ */
+void readahead_miss(vfs_inode_t* inode, vfs_readahead_t* ra, uint64_t index, uint32_t request_pages) {
+    if (ra->max_pages == 0) {
+        return;
+    }
+
+    if (request_pages > ra->max_pages) {
+        request_pages = ra->max_pages;
+    }
+
+    /* the reader caught up with the window, the marker page was dropped */
+    if (ra->size && index == ra->start + ra->size) {
+        uint32_t size = next_window_size(ra);
+        uint32_t demand = request_pages < size ? request_pages : size;
+        submit_window(inode, ra, index, size, demand, size - demand);
+        return;
+    }
+
+    /* reading on from the last page starts a window */
+    if (index == ra->prev_index || index == ra->prev_index + 1) {
+        uint32_t size = request_pages * 2;
+        if (size < READAHEAD_MIN_PAGES) {
+            size = READAHEAD_MIN_PAGES;
+        }
+        if (size > ra->max_pages) {
+            size = ra->max_pages;
+        }
+        submit_window(inode, ra, index, size, request_pages, size - request_pages);
+        return;
+    }
+
+    /* random access, read only what was asked for */
+    ra->size = 0;
+    readahead_stats.random_misses++;
+}
+
+/*
+ * the marked page index was read, submit the next window ahead of the reader
+ */
+void readahead_marker(vfs_inode_t* inode, vfs_readahead_t* ra, uint64_t index) {
+    uint64_t start = ra->start + ra->size;
+
+    /* the marker belongs to a window this file no longer tracks */
+    if (index < ra->start || index >= start) {
+        start = index + 1;
+    }
+
+    uint32_t size = next_window_size(ra);
+    readahead_stats.async_windows++;
+    submit_window(inode, ra, start, size, 0, size);
+}
+
+/*
+ * get readahead statistics
+ */
+void readahead_get_stats(readahead_stats_t* stats) {
+    if (stats) {
+        *stats = readahead_stats;
+    }
+}
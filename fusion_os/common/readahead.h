@@ -0,0 +1,44 @@
+/*
+ * readahead.h - sequential readahead for fusion os
+ *
+ * every open file keeps a readahead window. a miss that continues the
+ * previous read starts a window of READAHEAD_MIN_PAGES and reads it in one
+ * batch. the page async_size pages before the end of a window carries a
+ * marker, and reading that page submits the next window, twice as large,
+ * before the reader gets there. windows stop growing at the file's
+ * max_pages. a miss anywhere else drops the window, so random readers
+ * only read what they ask for
+ */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+#define READAHEAD_MIN_PAGES 4           /* first window, 16 KiB */
+#define READAHEAD_DEFAULT_MAX 32        /* window limit of new files, 128 KiB */
+#define READAHEAD_MAX_PAGES 256         /* largest limit that can be set, 1 MiB */
+
+/* readahead statistics */
+typedef struct {
+    uint64_t windows;                   /* windows submitted */
+    uint64_t async_windows;             /* of those, submitted from a marker */
+    uint64_t random_misses;             /* misses read without readahead */
+} readahead_stats_t;
+
+/* per file state */
+void readahead_init(vfs_readahead_t* ra);
+
+/* window limit for files opened from now on, 0 disables readahead */
+void readahead_set_max(uint32_t bytes);
+
+/* called by the page cache on a miss and when a marked page is read */
+void readahead_miss(vfs_inode_t* inode, vfs_readahead_t* ra, uint64_t index, uint32_t request_pages);
+void readahead_marker(vfs_inode_t* inode, vfs_readahead_t* ra, uint64_t index);
+
+/* statistics */
+void readahead_get_stats(readahead_stats_t* stats);
+
+#endif /* READAHEAD_H */
@@ -5,14 +5,49 @@
  */
 
 #include "string.h"
+#include "format.h"
+#include "../gecko/pmm.h"
+#include <emmintrin.h>
+
+/* below this size a streaming store costs more than the cache it saves */
+#define STREAM_THRESHOLD 256
+
+/*
+ * the sse2 routines below only ever issue aligned 16-byte loads on the
+ * string being scanned. an aligned load never straddles a page boundary, so
+ * reading past the terminator cannot fault. where a second string is read
+ * unaligned, the block is compared bytewise if the load would cross a page.
+ */
+
+/* bitmask of the bytes in an aligned block equal to the pattern */
+static inline uint32_t block_match(const void* block, __m128i pattern) {
+    __m128i data = _mm_load_si128((const __m128i*)block);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(data, pattern));
+}
+
+/* true if an unaligned 16-byte load at ptr would cross into the next page */
+static inline int crosses_page(const void* ptr) {
+    return ((uintptr_t)ptr & (PAGE_SIZE - 1)) > PAGE_SIZE - 16;
+}
 
 /* calculate string length */
 size_t strlen(const char* str) {
-    size_t len = 0;
-    while (str[len] != '\0') {
-        len++;
+    const char* block = (const char*)((uintptr_t)str & ~(uintptr_t)15);
+    __m128i zero = _mm_setzero_si128();
+    
+    /* ignore the bytes of the first block that precede the string */
+    uint32_t mask = block_match(block, zero) >> ((uintptr_t)str & 15);
+    if (mask != 0) {
+        return __builtin_ctz(mask);
+    }
+    
+    for (;;) {
+        block += 16;
+        mask = block_match(block, zero);
+        if (mask != 0) {
+            return (size_t)(block - str) + __builtin_ctz(mask);
+        }
     }
-    return len;
 }
 
 /* copy string */
@@ -38,26 +73,168 @@ char* strncpy(char* dest, const char* src, size_t n) {
     return original_dest;
 }
 
+/*
+ * mask of the first difference or terminator within the next 16 bytes.
+ * s1 must be 16-byte aligned; s2 is loaded unaligned unless that would cross
+ * a page, in which case the block is compared bytewise up to limit bytes
+ */
+static inline uint32_t compare_block(const unsigned char* s1, const unsigned char* s2, size_t limit) {
+    if (crosses_page(s2)) {
+        uint32_t count = limit < 16 ? (uint32_t)limit : 16;
+        for (uint32_t i = 0; i < count; i++) {
+            if (s1[i] != s2[i] || s1[i] == '\0') {
+                return 1u << i;
+            }
+        }
+        return 0;
+    }
+    
+    __m128i a = _mm_load_si128((const __m128i*)s1);
+    __m128i b = _mm_loadu_si128((const __m128i*)s2);
+    uint32_t equal = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+    uint32_t nul = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128()));
+    return (~equal & 0xffff) | nul;
+}
+
 /* compare strings */
 int strcmp(const char* str1, const char* str2) {
-    while (*str1 != '\0' && *str1 == *str2) {
-        str1++;
-        str2++;
+    const unsigned char* s1 = (const unsigned char*)str1;
+    const unsigned char* s2 = (const unsigned char*)str2;
+    
+    /* bytewise until s1 is aligned */
+    while (((uintptr_t)s1 & 15) != 0) {
+        if (*s1 != *s2 || *s1 == '\0') {
+            return *s1 - *s2;
+        }
+        s1++;
+        s2++;
+    }
+    
+    for (;;) {
+        uint32_t mask = compare_block(s1, s2, 16);
+        if (mask != 0) {
+            uint32_t i = __builtin_ctz(mask);
+            return s1[i] - s2[i];
+        }
+        s1 += 16;
+        s2 += 16;
     }
-    return (*str1 - *str2);
 }
 
 /* compare strings with limit */
 int strncmp(const char* str1, const char* str2, size_t n) {
-    while (n > 0 && *str1 != '\0' && *str1 == *str2) {
-        str1++;
-        str2++;
+    const unsigned char* s1 = (const unsigned char*)str1;
+    const unsigned char* s2 = (const unsigned char*)str2;
+    
+    /* bytewise until s1 is aligned */
+    while (n > 0 && ((uintptr_t)s1 & 15) != 0) {
+        if (*s1 != *s2 || *s1 == '\0') {
+            return *s1 - *s2;
+        }
+        s1++;
+        s2++;
         n--;
     }
+    
+    while (n > 0) {
+        uint32_t mask = compare_block(s1, s2, n);
+        if (n < 16) {
+            mask &= (1u << n) - 1;
+        }
+        if (mask != 0) {
+            uint32_t i = __builtin_ctz(mask);
+            return s1[i] - s2[i];
+        }
+        if (n <= 16) {
+            break;
+        }
+        s1 += 16;
+        s2 += 16;
+        n -= 16;
+    }
+    
+    return 0;
+}
+
+/* find character in string */
+char* strchr(const char* str, int c) {
+    const char* block = (const char*)((uintptr_t)str & ~(uintptr_t)15);
+    uint32_t skip = ~0u << ((uintptr_t)str & 15);
+    __m128i zero = _mm_setzero_si128();
+    __m128i pattern = _mm_set1_epi8((char)c);
+    
+    for (;;) {
+        uint32_t nul = block_match(block, zero) & skip;
+        uint32_t match = block_match(block, pattern) & skip;
+        uint32_t mask = nul | match;
+        if (mask != 0) {
+            uint32_t i = __builtin_ctz(mask);
+            return (match & (1u << i)) ? (char*)(block + i) : NULL;
+        }
+        block += 16;
+        skip = ~0u;
+    }
+}
+
+/* find last occurrence of character in string */
+char* strrchr(const char* str, int c) {
+    const char* block = (const char*)((uintptr_t)str & ~(uintptr_t)15);
+    uint32_t skip = ~0u << ((uintptr_t)str & 15);
+    __m128i zero = _mm_setzero_si128();
+    __m128i pattern = _mm_set1_epi8((char)c);
+    const char* last = NULL;
+    
+    for (;;) {
+        uint32_t nul = block_match(block, zero) & skip;
+        uint32_t match = block_match(block, pattern) & skip;
+        
+        if (nul != 0) {
+            /* keep matches up to and including the terminator */
+            match &= nul ^ (nul - 1);
+            if (match != 0) {
+                last = block + 31 - __builtin_clz(match);
+            }
+            return (char*)last;
+        }
+        if (match != 0) {
+            last = block + 31 - __builtin_clz(match);
+        }
+        
+        block += 16;
+        skip = ~0u;
+    }
+}
+
+/* find byte in memory */
+void* memchr(const void* ptr, int value, size_t n) {
     if (n == 0) {
-        return 0;
+        return NULL;
+    }
+    
+    const char* start = (const char*)ptr;
+    const char* block = (const char*)((uintptr_t)start & ~(uintptr_t)15);
+    size_t offset = (uintptr_t)start & 15;
+    __m128i pattern = _mm_set1_epi8((char)value);
+    
+    /* count bytes from the aligned block start so masking stays simple,
+     * a length that would wrap means search until found */
+    n = n > SIZE_MAX - offset ? SIZE_MAX : n + offset;
+    uint32_t mask = block_match(block, pattern) & (~0u << offset);
+    
+    for (;;) {
+        if (n < 16) {
+            mask &= (1u << n) - 1;
+        }
+        if (mask != 0) {
+            return (void*)(block + __builtin_ctz(mask));
+        }
+        if (n <= 16) {
+            return NULL;
+        }
+        block += 16;
+        n -= 16;
+        mask = block_match(block, pattern);
     }
-    return (*str1 - *str2);
 }
 
 /* concatenate strings */
@@ -155,6 +332,75 @@ void* memset(void* ptr, int value, size_t n) {
     return ptr;
 }
 
+/* zero a page with non-temporal stores */
+void clear_page_nt(void* page) {
+    long long* p = (long long*)page;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(long long); i += 4) {
+        _mm_stream_si64(p + i, 0);
+        _mm_stream_si64(p + i + 1, 0);
+        _mm_stream_si64(p + i + 2, 0);
+        _mm_stream_si64(p + i + 3, 0);
+    }
+    _mm_sfence();
+}
+
+/* copy a page with non-temporal stores, both pages must be 16-byte aligned */
+void copy_page_nt(void* dest, const void* src) {
+    __m128i* d = (__m128i*)dest;
+    const __m128i* s = (const __m128i*)src;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(__m128i); i += 4) {
+        __m128i x0 = _mm_load_si128(s + i);
+        __m128i x1 = _mm_load_si128(s + i + 1);
+        __m128i x2 = _mm_load_si128(s + i + 2);
+        __m128i x3 = _mm_load_si128(s + i + 3);
+        _mm_stream_si128(d + i, x0);
+        _mm_stream_si128(d + i + 1, x1);
+        _mm_stream_si128(d + i + 2, x2);
+        _mm_stream_si128(d + i + 3, x3);
+    }
+    _mm_sfence();
+}
+
+/* set memory with non-temporal stores */
+void* memset_stream(void* ptr, int value, size_t n) {
+    if (n < STREAM_THRESHOLD) {
+        return memset(ptr, value, n);
+    }
+    
+    unsigned char* p = (unsigned char*)ptr;
+    unsigned char v = (unsigned char)value;
+    
+    /* align head to 16 bytes */
+    while (((uintptr_t)p & 15) != 0) {
+        *p++ = v;
+        n--;
+    }
+    
+    __m128i pattern = _mm_set1_epi8((char)v);
+    while (n >= 64) {
+        _mm_stream_si128((__m128i*)p, pattern);
+        _mm_stream_si128((__m128i*)(p + 16), pattern);
+        _mm_stream_si128((__m128i*)(p + 32), pattern);
+        _mm_stream_si128((__m128i*)(p + 48), pattern);
+        p += 64;
+        n -= 64;
+    }
+    while (n >= 16) {
+        _mm_stream_si128((__m128i*)p, pattern);
+        p += 16;
+        n -= 16;
+    }
+    _mm_sfence();
+    
+    /* tail goes through the cache */
+    while (n > 0) {
+        *p++ = v;
+        n--;
+    }
+    
+    return ptr;
+}
+
 /* character classification */
 int isdigit(int c) {
     return (c >= '0' && c <= '9');
@@ -222,23 +468,51 @@ char* strtok(char* str, const char* delim) {
     return start;
 }
 
-/* find substring */
+/*
+ * find substring: scan aligned blocks for positions where the first two
+ * needle characters match, then verify each candidate
+ */
 char* strstr(const char* haystack, const char* needle) {
-    if (*needle == '\0') {
+    if (needle[0] == '\0') {
         return (char*)haystack;
     }
+    if (needle[1] == '\0') {
+        return strchr(haystack, needle[0]);
+    }
+    
+    size_t needle_len = strlen(needle);
+    __m128i zero = _mm_setzero_si128();
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i second = _mm_set1_epi8(needle[1]);
+    
+    const char* block = (const char*)((uintptr_t)haystack & ~(uintptr_t)15);
+    uint32_t skip = ~0u << ((uintptr_t)haystack & 15);
     
-    for (size_t i = 0; haystack[i] != '\0'; i++) {
-        size_t j = 0;
-        while (haystack[i + j] == needle[j] && needle[j] != '\0') {
-            j++;
+    for (;;) {
+        uint32_t nul = block_match(block, zero) & skip;
+        
+        /* a match in the last byte needs its successor from the next block */
+        uint32_t candidates = block_match(block, first) &
+                              ((block_match(block, second) >> 1) | 0x8000) & skip;
+        if (nul != 0) {
+            candidates &= (nul & -nul) - 1;
+        }
+        
+        while (candidates != 0) {
+            const char* candidate = block + __builtin_ctz(candidates);
+            if (strncmp(candidate, needle, needle_len) == 0) {
+                return (char*)candidate;
+            }
+            candidates &= candidates - 1;
         }
-        if (needle[j] == '\0') {
-            return (char*)(haystack + i);
+        
+        if (nul != 0) {
+            return NULL;
         }
+        
+        block += 16;
+        skip = ~0u;
     }
-    
-    return NULL;
 }
 
 /* string to unsigned long */
@@ -372,73 +646,15 @@ int snprintf(char* str, size_t size, const char* format, ...) {
 
 /* variable argument sprintf */
 int vsprintf(char* str, const char* format, va_list args) {
-    int i = 0;
-    
-    for (const char* p = format; *p != '\0'; p++) {
-        if (*p == '%' && *(p + 1) != '\0') {
-            p++; /* skip % */
-            
-            switch (*p) {
-                case 'd': {
-                    int val = va_arg(args, int);
-                    char temp[32];
-                    int_to_str(val, temp, 10);
-                    strcpy(str + i, temp);
-                    i += strlen(temp);
-                    break;
-                }
-                case 'u': {
-                    unsigned int val = va_arg(args, unsigned int);
-                    char temp[32];
-                    int_to_str(val, temp, 10);
-                    strcpy(str + i, temp);
-                    i += strlen(temp);
-                    break;
-                }
-                case 'x': {
-                    unsigned int val = va_arg(args, unsigned int);
-                    char temp[32];
-                    int_to_str(val, temp, 16);
-                    strcpy(str + i, temp);
-                    i += strlen(temp);
-                    break;
-                }
-                case 'c': {
-                    char val = (char)va_arg(args, int);
-                    str[i++] = val;
-                    break;
-                }
-                case 's': {
-                    char* val = va_arg(args, char*);
-                    strcpy(str + i, val);
-                    i += strlen(val);
-                    break;
-                }
-                case '%': {
-                    str[i++] = '%';
-                    break;
-                }
-                default:
-                    str[i++] = *p;
-                    break;
-            }
-        } else {
-            str[i++] = *p;
-        }
-    }
-    
-    str[i] = '\0';
-    return i;
+    return vsnprintf(str, SIZE_MAX, format, args);
 }
 
-/* variable argument snprintf */
+/* variable argument snprintf, returns the number of characters stored */
 int vsnprintf(char* str, size_t size, const char* format, va_list args) {
-    int result = vsprintf(str, format, args);
-    if (result >= size) {
-        str[size - 1] = '\0';
-        return size - 1;
-    }
-    return result;
+    format_buffer_t fb;
+    format_init(&fb, str, size);
+    format_vappendf(&fb, format, args);
+    return (int)fb.used;
 }
 
 /* simplified memory allocation */
@@ -466,16 +682,6 @@ void free(void* ptr) {
     (void)ptr;
 }
 
-/* find character in string */
-char* strchr(const char* str, int c) {
-    while (*str != '\0') {
-        if (*str == (char)c) {
-            return (char*)str;
-        }
-        str++;
-    }
-    return NULL;
-}
 
 /* absolute value */
 int abs(int x) {
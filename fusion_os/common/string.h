@@ -21,13 +21,21 @@ int strncmp(const char* str1, const char* str2, size_t n);
 char* strcat(char* dest, const char* src);
 char* strncat(char* dest, const char* src, size_t n);
 char* strdup(const char* str);
+char* strchr(const char* str, int c);
+char* strrchr(const char* str, int c);
 
 /* memory functions */
 void* memcpy(void* dest, const void* src, size_t n);
 void* memmove(void* dest, const void* src, size_t n);
 int memcmp(const void* ptr1, const void* ptr2, size_t n);
+void* memchr(const void* ptr, int value, size_t n);
 void* memset(void* ptr, int value, size_t n);
 
+/* non-temporal memory functions (bypass the cache, page_size = 4096) */
+void clear_page_nt(void* page);
+void copy_page_nt(void* dest, const void* src);
+void* memset_stream(void* ptr, int value, size_t n);
+
 /* character functions */
 int isdigit(int c);
 int isalpha(int c);
@@ -0,0 +1,424 @@
+/*
+ * tmpfs.c - memory filesystem implementation
+ *
+ * inode numbers are handed out per filesystem and inodes live in the
+ * inode cache, the reference an entry holds keeps them there. unlinking
+ * drops it and the inode cache frees the inode with its data once the
+ * last open file is closed
+ */
+
+#include "tmpfs.h"
+#include "memfile.h"
+#include "icache.h"
+#include "hash.h"
+#include "radix_tree.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/pmm.h"
+#include "../gecko/gecko.h"
+
+/* one name in a directory */
+typedef struct {
+    hash_node_t hash_link;              /* keyed by parent and name */
+    radix_node_t cookie_link;           /* keyed by cookie, creation order */
+    vfs_inode_t* parent;
+    vfs_inode_t* inode;
+    uint32_t name_length;
+    char name[VFS_MAX_FILENAME_LENGTH];
+} tmpfs_entry_t;
+
+/* directory inode data */
+typedef struct {
+    radix_tree_t entries;
+    uint32_t next_cookie;               /* cookies are never reused, so listings resume safely */
+} tmpfs_dir_t;
+
+/* superblock data */
+typedef struct {
+    hash_table_t entry_table;
+    memfile_quota_t quota;
+    uint32_t inodes;
+    uint32_t max_inodes;
+    uint32_t next_inode_id;
+} tmpfs_info_t;
+
+/* lookup key, points into the caller's name */
+typedef struct {
+    const vfs_inode_t* parent;
+    const char* name;
+    size_t length;
+} tmpfs_key_t;
+
+static int tmpfs_mount(vfs_superblock_t* sb, const char* device, const char* mount_point);
+static int tmpfs_umount(vfs_superblock_t* sb);
+static int tmpfs_mkdir(vfs_inode_t* parent, const char* name, uint32_t permissions);
+static int tmpfs_rmdir(vfs_inode_t* parent, const char* name);
+static int tmpfs_unlink(vfs_inode_t* parent, const char* name);
+static int tmpfs_create_file(vfs_inode_t* parent, const char* name, uint32_t permissions);
+static vfs_inode_t* tmpfs_lookup(vfs_inode_t* parent, const char* name, size_t length);
+static int tmpfs_readdir(vfs_inode_t* dir, uint32_t* cookie, vfs_dirent_t* entries, uint32_t count);
+
+static const vfs_inode_operations_t tmpfs_inode_ops = {
+    .mkdir = tmpfs_mkdir,
+    .rmdir = tmpfs_rmdir,
+    .link = NULL,
+    .unlink = tmpfs_unlink,
+    .create_file = tmpfs_create_file,
+    .lookup = tmpfs_lookup,
+    .readdir = tmpfs_readdir,
+    .readpage = NULL,
+    .readpages = NULL,
+    .writepages = NULL
+};
+
+static const vfs_superblock_operations_t tmpfs_sb_ops = {
+    .mount = tmpfs_mount,
+    .umount = tmpfs_umount,
+    .sync = NULL
+};
+
+static int entry_match(const hash_node_t* node, const void* key) {
+    const tmpfs_entry_t* entry = hash_entry(node, tmpfs_entry_t, hash_link);
+    const tmpfs_key_t* k = (const tmpfs_key_t*)key;
+    return entry->parent == k->parent && entry->name_length == k->length &&
+           memcmp(entry->name, k->name, k->length) == 0;
+}
+
+static inline uint64_t entry_hash(const tmpfs_key_t* key) {
+    return hash_bytes(key->name, key->length, (uint64_t)(uintptr_t)key->parent);
+}
+
+static inline tmpfs_info_t* sb_info(vfs_superblock_t* sb) {
+    return (tmpfs_info_t*)sb->data;
+}
+
+/*
+ * register the filesystem type
+ */
+void tmpfs_init(void) {
+    if (vfs_register_filesystem("tmpfs", &tmpfs_inode_ops, &tmpfs_sb_ops, 0) != 0) {
+        LOG_ERROR("tmpfs", "failed to register tmpfs");
+    }
+}
+
+static tmpfs_dir_t* new_dir(void) {
+    tmpfs_dir_t* dir = gecko_alloc_kernel_memory(sizeof(tmpfs_dir_t));
+    if (dir) {
+        radix_tree_init(&dir->entries);
+        dir->next_cookie = 1;
+    }
+    return dir;
+}
+
+/*
+ * set up the filesystem data and the root directory
+ */
+static int tmpfs_mount(vfs_superblock_t* sb, const char* device, const char* mount_point) {
+    (void)device;
+
+    tmpfs_info_t* info = gecko_alloc_kernel_memory(sizeof(tmpfs_info_t));
+    if (!info) {
+        return -1;
+    }
+    memset(info, 0, sizeof(tmpfs_info_t));
+
+    void* storage = gecko_alloc_kernel_memory(HASH_TABLE_STORAGE_SIZE(TMPFS_TABLE_SIZE));
+    tmpfs_dir_t* root_dir = new_dir();
+    if (!storage || !root_dir) {
+        gecko_free_kernel_memory(storage);
+        gecko_free_kernel_memory(root_dir);
+        gecko_free_kernel_memory(info);
+        return -1;
+    }
+    hash_table_init(&info->entry_table, storage, TMPFS_TABLE_SIZE, entry_match);
+
+    uint32_t memory_pages = pmm_get_total_memory() / PAGE_SIZE;
+    info->quota.max_pages = memory_pages / TMPFS_MEMORY_SHARE;
+    info->max_inodes = memory_pages / TMPFS_MEMORY_SHARE;
+    info->inodes = 1;
+    info->next_inode_id = sb->root_inode->inode_id + 1;
+
+    sb->data = info;
+    sb->root_inode->data = root_dir;
+    sb->root_inode->link_count = 2;
+
+    LOG_INFO("tmpfs", "mounted on %s, %u pages", mount_point, info->quota.max_pages);
+    return 0;
+}
+
+static tmpfs_entry_t* find_entry(vfs_inode_t* parent, const char* name, size_t length) {
+    tmpfs_key_t key = { parent, name, length };
+    hash_node_t* node = hash_table_find(&sb_info(parent->sb)->entry_table, entry_hash(&key), &key);
+    return node ? hash_entry(node, tmpfs_entry_t, hash_link) : NULL;
+}
+
+/*
+ * move the entry table to twice the capacity
+ */
+static int grow_table(tmpfs_info_t* info) {
+    size_t capacity = info->entry_table.capacity * 2;
+    void* storage = gecko_alloc_kernel_memory(HASH_TABLE_STORAGE_SIZE(capacity));
+    if (!storage) {
+        return -1;
+    }
+
+    void* old_storage = info->entry_table.slots;
+    hash_table_resize(&info->entry_table, storage, capacity);
+    gecko_free_kernel_memory(old_storage);
+    return 0;
+}
+
+/*
+ * link inode under name in parent, the entry takes over the caller's
+ * reference
+ */
+static int add_entry(vfs_inode_t* parent, const char* name, size_t length, vfs_inode_t* inode) {
+    tmpfs_info_t* info = sb_info(parent->sb);
+    hash_table_t* table = &info->entry_table;
+
+    /* keep an eighth of the slots empty so probes stay short */
+    if (table->count + 1 > table->capacity - table->capacity / 8 && grow_table(info) != 0) {
+        return -1;
+    }
+
+    tmpfs_entry_t* entry = gecko_alloc_kernel_memory(sizeof(tmpfs_entry_t));
+    if (!entry) {
+        return -1;
+    }
+
+    memset(entry, 0, sizeof(tmpfs_entry_t));
+    entry->parent = parent;
+    entry->inode = inode;
+    entry->name_length = length;
+    memcpy(entry->name, name, length);
+
+    tmpfs_key_t key = { parent, entry->name, length };
+    if (hash_table_insert(table, &entry->hash_link, entry_hash(&key), &key) != 0) {
+        gecko_free_kernel_memory(entry);
+        return -1;
+    }
+
+    tmpfs_dir_t* dir = (tmpfs_dir_t*)parent->data;
+    radix_tree_insert(&dir->entries, &entry->cookie_link, dir->next_cookie++);
+    parent->size++;
+    return 0;
+}
+
+/*
+ * unhash entry and free it, returns its inode still referenced
+ */
+static vfs_inode_t* remove_entry(tmpfs_entry_t* entry) {
+    vfs_inode_t* parent = entry->parent;
+    vfs_inode_t* inode = entry->inode;
+
+    hash_table_remove(&sb_info(parent->sb)->entry_table, &entry->hash_link);
+    radix_tree_erase(&((tmpfs_dir_t*)parent->data)->entries, &entry->cookie_link);
+    parent->size--;
+    gecko_free_kernel_memory(entry);
+    return inode;
+}
+
+/*
+ * new inode of type holding one reference, with its storage set up
+ */
+static vfs_inode_t* new_inode(vfs_superblock_t* sb, vfs_type_t type, uint32_t permissions) {
+    tmpfs_info_t* info = sb_info(sb);
+    if (info->inodes >= info->max_inodes) {
+        return NULL;
+    }
+
+    vfs_inode_t* inode = icache_alloc(sb, info->next_inode_id);
+    if (!inode) {
+        return NULL;
+    }
+
+    inode->type = type;
+    inode->permissions = permissions;
+    inode->ops = &tmpfs_inode_ops;
+    inode->creation_time = (uint32_t)(gecko_get_uptime() / 1000);
+    inode->modification_time = inode->creation_time;
+    inode->access_time = inode->creation_time;
+
+    int result;
+    if (type == VFS_TYPE_DIRECTORY) {
+        inode->link_count = 2;
+        inode->data = new_dir();
+        result = inode->data ? 0 : -1;
+    } else {
+        inode->link_count = 1;
+        result = memfile_init(inode, &info->quota);
+    }
+
+    if (result != 0) {
+        inode->link_count = 0;
+        icache_put(inode);
+        return NULL;
+    }
+
+    info->next_inode_id++;
+    info->inodes++;
+    return inode;
+}
+
+/*
+ * add a new inode of type under name in parent
+ */
+static int create(vfs_inode_t* parent, const char* name, vfs_type_t type, uint32_t permissions) {
+    size_t length = strlen(name);
+    if (parent->type != VFS_TYPE_DIRECTORY || length == 0 || length >= VFS_MAX_FILENAME_LENGTH) {
+        return -1;
+    }
+    if (find_entry(parent, name, length)) {
+        return -1;
+    }
+
+    vfs_inode_t* inode = new_inode(parent->sb, type, permissions);
+    if (!inode) {
+        return -1;
+    }
+
+    if (add_entry(parent, name, length, inode) != 0) {
+        sb_info(parent->sb)->inodes--;
+        inode->link_count = 0;
+        icache_put(inode);
+        return -1;
+    }
+
+    if (type == VFS_TYPE_DIRECTORY) {
+        parent->link_count++;
+    }
+    return 0;
+}
+
+static int tmpfs_create_file(vfs_inode_t* parent, const char* name, uint32_t permissions) {
+    return create(parent, name, VFS_TYPE_FILE, permissions);
+}
+
+static int tmpfs_mkdir(vfs_inode_t* parent, const char* name, uint32_t permissions) {
+    return create(parent, name, VFS_TYPE_DIRECTORY, permissions);
+}
+
+static vfs_inode_t* tmpfs_lookup(vfs_inode_t* parent, const char* name, size_t length) {
+    if (parent->type != VFS_TYPE_DIRECTORY) {
+        return NULL;
+    }
+    /* entries keep their inodes cached, so this is always a hit */
+    tmpfs_entry_t* entry = find_entry(parent, name, length);
+    return entry ? icache_get(parent->sb, entry->inode->inode_id) : NULL;
+}
+
+/*
+ * entries in creation order from cookie on, each record carries the
+ * cookie after it
+ */
+static int tmpfs_readdir(vfs_inode_t* dir, uint32_t* cookie, vfs_dirent_t* entries, uint32_t count) {
+    if (dir->type != VFS_TYPE_DIRECTORY) {
+        return -1;
+    }
+
+    tmpfs_dir_t* data = (tmpfs_dir_t*)dir->data;
+    radix_node_t* node = radix_tree_lower_bound(&data->entries, *cookie);
+    uint32_t filled = 0;
+
+    while (node != NULL && filled < count) {
+        tmpfs_entry_t* entry = radix_entry(node, tmpfs_entry_t, cookie_link);
+        vfs_dirent_t* dirent = &entries[filled++];
+
+        memcpy(dirent->name, entry->name, entry->name_length);
+        dirent->name[entry->name_length] = '\0';
+        dirent->type = entry->inode->type;
+        dirent->size = entry->inode->size;
+        dirent->inode_id = entry->inode->inode_id;
+        dirent->cookie = (uint32_t)node->key + 1;
+
+        *cookie = dirent->cookie;
+        node = radix_tree_next(node);
+    }
+
+    return (int)filled;
+}
+
+/*
+ * drop the entry's reference on a removed inode, open files keep it alive
+ */
+static void release_inode(vfs_superblock_t* sb, vfs_inode_t* inode) {
+    inode->link_count = 0;
+    sb_info(sb)->inodes--;
+    icache_put(inode);
+}
+
+static int tmpfs_unlink(vfs_inode_t* parent, const char* name) {
+    if (parent->type != VFS_TYPE_DIRECTORY) {
+        return -1;
+    }
+
+    tmpfs_entry_t* entry = find_entry(parent, name, strlen(name));
+    if (!entry || entry->inode->type == VFS_TYPE_DIRECTORY) {
+        return -1;
+    }
+
+    release_inode(parent->sb, remove_entry(entry));
+    return 0;
+}
+
+static int tmpfs_rmdir(vfs_inode_t* parent, const char* name) {
+    if (parent->type != VFS_TYPE_DIRECTORY) {
+        return -1;
+    }
+
+    tmpfs_entry_t* entry = find_entry(parent, name, strlen(name));
+    if (!entry || entry->inode->type != VFS_TYPE_DIRECTORY || entry->inode->size != 0) {
+        return -1;
+    }
+
+    release_inode(parent->sb, remove_entry(entry));
+    parent->link_count--;
+    return 0;
+}
+
+/*
+ * free every entry and the data of every file, then the filesystem data
+ */
+static int tmpfs_umount(vfs_superblock_t* sb) {
+    tmpfs_info_t* info = sb_info(sb);
+    if (!info) {
+        return -1;
+    }
+
+    size_t cursor = 0;
+    hash_node_t* node;
+    while ((node = hash_table_next(&info->entry_table, &cursor)) != NULL) {
+        tmpfs_entry_t* entry = hash_entry(node, tmpfs_entry_t, hash_link);
+        vfs_inode_t* inode = entry->inode;
+
+        /* the quota goes away with the filesystem */
+        if (inode->type == VFS_TYPE_FILE) {
+            memfile_release(inode);
+        }
+
+        hash_table_remove(&info->entry_table, &entry->hash_link);
+        gecko_free_kernel_memory(entry);
+        release_inode(sb, inode);
+    }
+
+    gecko_free_kernel_memory(info->entry_table.slots);
+    gecko_free_kernel_memory(info);
+    sb->data = NULL;
+    return 0;
+}
+
+/*
+ * usage of a mounted tmpfs
+ */
+int tmpfs_get_stats(vfs_superblock_t* sb, tmpfs_stats_t* stats) {
+    if (!sb || sb->ops != &tmpfs_sb_ops || !sb->data || !stats) {
+        return -1;
+    }
+
+    tmpfs_info_t* info = sb_info(sb);
+    stats->pages = info->quota.pages;
+    stats->max_pages = info->quota.max_pages;
+    stats->inodes = info->inodes;
+    stats->max_inodes = info->max_inodes;
+    return 0;
+}
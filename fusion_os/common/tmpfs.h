@@ -0,0 +1,37 @@
+/*
+ * tmpfs.h - memory filesystem for fusion os
+ *
+ * a tree of directories and files that lives in memory only. entries of
+ * every directory sit in one hash table per filesystem, keyed by the
+ * parent inode and the name, and each directory also keeps its entries
+ * in creation order. file data is kept in page sized extents charged to
+ * the filesystem's page quota. every entry holds a reference on its
+ * inode, so nothing is reclaimed until it is unlinked. registered as
+ * "tmpfs" and mounted with vfs_mount
+ */
+
+#ifndef TMPFS_H
+#define TMPFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+#define TMPFS_TABLE_SIZE 256            /* initial hash slots, doubled as entries are added */
+#define TMPFS_MEMORY_SHARE 2            /* data and inodes may use 1/n of memory each */
+
+/* usage of one mounted tmpfs */
+typedef struct {
+    uint32_t pages;
+    uint32_t max_pages;
+    uint32_t inodes;
+    uint32_t max_inodes;
+} tmpfs_stats_t;
+
+/* register the filesystem type */
+void tmpfs_init(void);
+
+/* usage of the tmpfs sb */
+int tmpfs_get_stats(vfs_superblock_t* sb, tmpfs_stats_t* stats);
+
+#endif /* TMPFS_H */
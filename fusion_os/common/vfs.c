@@ -1,20 +1,37 @@
 #include "vfs.h"
 #include "logger.h"
 #include "string.h"
+#include "dcache.h"
+#include "icache.h"
+#include "page_cache.h"
+#include "fdtable.h"
+#include "readahead.h"
+#include "writeback.h"
+#include "io_ring.h"
+#include "pipe.h"
+#include "mount.h"
+#include "memfile.h"
+#include "tmpfs.h"
+#include "ext2.h"
+#include "range_lock.h"
 #include "../gecko/pmm.h"
 #include "../gecko/vmm.h"
 #include "../gecko/scheduler.h"
 #include "../gecko/gecko.h"
+#include "../gecko/ipc.h"
 #include <stdarg.h>
 
 #define VFS_TAG 0x56465300
 
+/* deepest path vfs_lookup will walk, bounds the ".." stack */
+#define VFS_MAX_PATH_DEPTH 64
+
 static int vfs_initialized = 0;
-static vfs_mount_point_t mount_points[VFS_MAX_MOUNT_POINTS];
-static vfs_file_t file_descriptors[VFS_MAX_FILE_DESCRIPTORS];
-static vfs_inode_t* inode_cache = NULL;
+static list_t mounts;                             /* every mount, oldest first */
+static vfs_filesystem_t filesystems[VFS_MAX_FILESYSTEMS];
+static uint32_t filesystem_count = 0;
+static vfs_file_table_t* kernel_files = NULL;     /* descriptors opened outside of a task */
 static uint32_t next_inode_id = 1;
-static uint32_t next_file_id = 1;
 
 static const vfs_file_operations_t default_file_ops = {
     .open = NULL,
@@ -31,7 +48,12 @@ static const vfs_inode_operations_t default_inode_ops = {
     .rmdir = NULL,
     .link = NULL,
     .unlink = NULL,
-    .create_file = NULL
+    .create_file = NULL,
+    .lookup = NULL,
+    .readdir = NULL,
+    .readpage = NULL,
+    .readpages = NULL,
+    .writepages = NULL
 };
 
 static const vfs_superblock_operations_t default_sb_ops = {
@@ -47,101 +69,190 @@ int vfs_init(void) {
     
     LOG_INFO("vfs", "initializing virtual file system");
     
-    memset(mount_points, 0, sizeof(mount_points));
-    memset(file_descriptors, 0, sizeof(file_descriptors));
+    list_init(&mounts);
+    mount_init();
     
-    inode_cache = NULL;
     next_inode_id = 1;
-    next_file_id = 1;
+    
+    icache_init();
+    dcache_init();
+    page_cache_init();
+    writeback_init();
+    io_ring_init();
     
     vfs_initialized = 1;
+    tmpfs_init();
+    ext2_init();
     LOG_INFO("vfs", "virtual file system initialized successfully");
     
     return 0;
 }
 
+static const vfs_filesystem_t* find_filesystem(const char* name) {
+    for (uint32_t i = 0; i < filesystem_count; i++) {
+        if (strcmp(filesystems[i].name, name) == 0) {
+            return &filesystems[i];
+        }
+    }
+    return NULL;
+}
+
 int vfs_mount(const char* device, const char* mount_point, const char* fs_type) {
     if (!device || !mount_point || !fs_type || !vfs_initialized) {
         return -1;
     }
     
-    for (int i = 0; i < VFS_MAX_MOUNT_POINTS; i++) {
-        if (!mount_points[i].active) {
-            mount_points[i].active = 1;
-            mount_points[i].device_name = device;
-            mount_points[i].mount_point = mount_point;
-            mount_points[i].path = mount_point;
-            
-            vfs_superblock_t* sb = gecko_alloc_kernel_memory(sizeof(vfs_superblock_t));
-            if (!sb) {
-                mount_points[i].active = 0;
-                return -1;
-            }
-            
-            memset(sb, 0, sizeof(vfs_superblock_t));
-            sb->device_name = device;
-            sb->mount_point = mount_point;
-            sb->ops = &default_sb_ops;
-            sb->reference_count = 1;
-            
-            vfs_inode_t* root_inode = gecko_alloc_kernel_memory(sizeof(vfs_inode_t));
-            if (!root_inode) {
-                gecko_free_kernel_memory(sb);
-                mount_points[i].active = 0;
-                return -1;
-            }
-            
-            memset(root_inode, 0, sizeof(vfs_inode_t));
-            root_inode->inode_id = next_inode_id++;
-            root_inode->type = VFS_TYPE_DIRECTORY;
-            root_inode->permissions = 0755;
-            root_inode->size = 0;
-            root_inode->link_count = 1;
-            root_inode->ops = &default_inode_ops;
-            root_inode->sb = sb;
-            root_inode->reference_count = 1;
-            
-            sb->root_inode = root_inode;
-            mount_points[i].superblock = sb;
-            mount_points[i].mount_inode = root_inode;
-            
-            return 0;
+    const vfs_filesystem_t* fs = find_filesystem(fs_type);
+    if (!fs) {
+        LOG_ERROR("vfs", "unknown filesystem type %s", fs_type);
+        return -1;
+    }
+    
+    if (list_count(&mounts) >= VFS_MAX_MOUNT_POINTS) {
+        return -1;
+    }
+    
+    vfs_mount_point_t* mp = gecko_alloc_kernel_memory(sizeof(vfs_mount_point_t));
+    if (!mp) {
+        return -1;
+    }
+    
+    memset(mp, 0, sizeof(vfs_mount_point_t));
+    mp->device_name = device;
+    mp->mount_point = mount_point;
+    mp->path = mount_point;
+    mp->path_length = strlen(mount_point);
+    
+    vfs_superblock_t* sb = gecko_alloc_kernel_memory(sizeof(vfs_superblock_t));
+    if (!sb) {
+        gecko_free_kernel_memory(mp);
+        return -1;
+    }
+    
+    memset(sb, 0, sizeof(vfs_superblock_t));
+    sb->device_name = device;
+    sb->mount_point = mount_point;
+    sb->ops = fs->sb_ops ? fs->sb_ops : &default_sb_ops;
+    sb->reference_count = 1;
+    
+    /* the mount holds the root's reference until umount */
+    vfs_inode_t* root_inode = icache_alloc(sb, next_inode_id++);
+    if (!root_inode) {
+        gecko_free_kernel_memory(sb);
+        gecko_free_kernel_memory(mp);
+        return -1;
+    }
+    
+    root_inode->type = VFS_TYPE_DIRECTORY;
+    root_inode->permissions = 0755;
+    root_inode->size = 0;
+    root_inode->link_count = 1;
+    root_inode->ops = fs->inode_ops ? fs->inode_ops : &default_inode_ops;
+    
+    sb->root_inode = root_inode;
+    mp->superblock = sb;
+    mp->mount_inode = root_inode;
+    
+    if (sb->ops->mount && sb->ops->mount(sb, device, mount_point) != 0) {
+        LOG_ERROR("vfs", "failed to mount %s on %s", fs_type, mount_point);
+        icache_put(root_inode);
+        icache_evict_superblock(sb);
+        gecko_free_kernel_memory(sb);
+        gecko_free_kernel_memory(mp);
+        return -1;
+    }
+    
+    if (mount_insert(mp) != 0) {
+        if (sb->ops->umount) {
+            sb->ops->umount(sb);
         }
+        icache_put(root_inode);
+        icache_evict_superblock(sb);
+        gecko_free_kernel_memory(sb);
+        gecko_free_kernel_memory(mp);
+        return -1;
     }
     
-    return -1;
+    mp->mount_link.data = mp;
+    list_add_tail(&mounts, &mp->mount_link);
+    
+    return 0;
 }
 
-static vfs_mount_point_t* find_mount_point(const char* path) {
-    if (!path || path[0] != '/') {
+/*
+ * resolve one component below dir, asking the filesystem only on a cache miss
+ */
+static vfs_inode_t* lookup_child(vfs_inode_t* dir, const char* name, size_t length) {
+    dentry_t* dentry = dcache_lookup(dir, name, length);
+    if (dentry) {
+        return dentry->inode;
+    }
+    
+    if (!dir->ops || !dir->ops->lookup) {
         return NULL;
     }
     
-    size_t path_len = strlen(path);
-    vfs_mount_point_t* best_match = NULL;
-    size_t best_match_len = 0;
+    /* the dentry takes over keeping the inode cached */
+    vfs_inode_t* inode = dir->ops->lookup(dir, name, length);
+    dcache_add(dir, name, length, inode);
+    if (inode) {
+        icache_put(inode);
+    }
+    return inode;
+}
+
+/*
+ * walk path component by component starting at root. components are
+ * passed as (pointer, length) into path and never copied
+ */
+static vfs_inode_t* walk_path(vfs_inode_t* root, const char* path) {
+    vfs_inode_t* parents[VFS_MAX_PATH_DEPTH];
+    int depth = 0;
+    vfs_inode_t* dir = root;
+    const char* p = path;
     
-    for (int i = 0; i < VFS_MAX_MOUNT_POINTS; i++) {
-        if (!mount_points[i].active) {
+    for (;;) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            return dir;
+        }
+        
+        const char* name = p;
+        while (*p != '\0' && *p != '/') {
+            p++;
+        }
+        size_t length = p - name;
+        
+        if (dir->type != VFS_TYPE_DIRECTORY) {
+            return NULL;
+        }
+        
+        if (name[0] == '.' && length == 1) {
             continue;
         }
         
-        const char* mount_path = mount_points[i].path;
-        if (mount_path[0] != '/') {
+        /* ".." never leaves the mount the walk started in */
+        if (name[0] == '.' && name[1] == '.' && length == 2) {
+            if (depth > 0) {
+                dir = parents[--depth];
+            }
             continue;
         }
         
-        size_t mount_len = strlen(mount_path);
+        if (length >= VFS_MAX_FILENAME_LENGTH || depth == VFS_MAX_PATH_DEPTH) {
+            return NULL;
+        }
         
-        if (path_len >= mount_len && strncmp(path, mount_path, mount_len) == 0) {
-            if (mount_len > best_match_len) {
-                best_match = &mount_points[i];
-                best_match_len = mount_len;
-            }
+        vfs_inode_t* child = lookup_child(dir, name, length);
+        if (!child) {
+            return NULL;
         }
+        
+        parents[depth++] = dir;
+        dir = child;
     }
-    
-    return best_match;
 }
 
 vfs_inode_t* vfs_lookup(const char* path) {
@@ -149,39 +260,152 @@ vfs_inode_t* vfs_lookup(const char* path) {
         return NULL;
     }
     
-    vfs_mount_point_t* mp = find_mount_point(path);
+    size_t consumed;
+    vfs_mount_point_t* mp = mount_resolve(path, &consumed);
     if (!mp || !mp->superblock) {
         return NULL;
     }
     
-    if (strcmp(path, "/") == 0) {
-        return mp->mount_inode;
+    return walk_path(mp->mount_inode, path + consumed);
+}
+
+/*
+ * directory holding the last component of path, name is set to that
+ * component. "." and ".." cannot be created or removed
+ */
+static vfs_inode_t* lookup_parent(const char* path, const char** name) {
+    const char* last_slash = strrchr(path, '/');
+    if (path[0] != '/' || !last_slash) {
+        return NULL;
     }
     
-    if (strcmp(path, mp->mount_point) == 0) {
-        return mp->mount_inode;
+    const char* base = last_slash + 1;
+    size_t length = strlen(base);
+    if (length == 0 || length >= VFS_MAX_FILENAME_LENGTH ||
+        (base[0] == '.' && (length == 1 || (length == 2 && base[1] == '.')))) {
+        return NULL;
     }
     
-    const char* remaining_path = path + strlen(mp->mount_point);
-    if (*remaining_path == '\0') {
-        return mp->mount_inode;
+    vfs_inode_t* parent;
+    size_t parent_length = last_slash - path;
+    if (parent_length == 0) {
+        parent = vfs_lookup("/");
+    } else {
+        char parent_path[VFS_MAX_PATH_LENGTH];
+        if (parent_length >= VFS_MAX_PATH_LENGTH) {
+            return NULL;
+        }
+        memcpy(parent_path, path, parent_length);
+        parent_path[parent_length] = '\0';
+        parent = vfs_lookup(parent_path);
     }
     
-    if (*remaining_path == '/') {
-        remaining_path++;
+    if (!parent || parent->type != VFS_TYPE_DIRECTORY) {
+        return NULL;
     }
     
-    if (*remaining_path == '\0') {
-        return mp->mount_inode;
+    *name = base;
+    return parent;
+}
+
+/*
+ * create a regular file at path through its directory
+ */
+static vfs_inode_t* create_file(const char* path, uint32_t permissions) {
+    const char* name;
+    vfs_inode_t* parent = lookup_parent(path, &name);
+    if (!parent || !parent->ops || !parent->ops->create_file) {
+        return NULL;
     }
     
-    if (mp->superblock->ops && mp->superblock->ops->mount) {
-        char file_path[VFS_MAX_PATH_LENGTH];
-        snprintf(file_path, sizeof(file_path), "%s", remaining_path);
+    /* a cached miss for this name is now stale */
+    dcache_invalidate(parent, name, strlen(name));
+    if (parent->ops->create_file(parent, name, permissions) != 0) {
         return NULL;
     }
     
-    return mp->mount_inode;
+    return vfs_lookup(path);
+}
+
+/*
+ * descriptor table of the calling task, created on first open
+ */
+static vfs_file_table_t* current_file_table(int create) {
+    task_t* task = scheduler_get_current_task();
+    vfs_file_table_t** table = task ? &task->files : &kernel_files;
+    
+    if (*table == NULL && create) {
+        *table = fdtable_create();
+        if (*table) {
+            /* descriptor 0 stays unused */
+            fdtable_alloc(*table);
+        }
+    }
+    
+    return *table;
+}
+
+/*
+ * descriptor table of the calling task, created if it has none yet
+ */
+vfs_file_table_t* vfs_get_file_table(void) {
+    return current_file_table(1);
+}
+
+/*
+ * make descriptor calls of the calling task use table and return the one
+ * they used before. io ring workers run requests against the table of
+ * the task that submitted them
+ */
+vfs_file_table_t* vfs_swap_file_table(vfs_file_table_t* table) {
+    task_t* task = scheduler_get_current_task();
+    vfs_file_table_t** slot = task ? &task->files : &kernel_files;
+    vfs_file_table_t* previous = *slot;
+    
+    *slot = table;
+    return previous;
+}
+
+/*
+ * open file of a descriptor with a reference taken, so a close while the
+ * caller is blocked does not free it. put_file drops the reference
+ */
+static vfs_file_t* get_file(uint32_t file_id) {
+    vfs_file_table_t* table = current_file_table(0);
+    vfs_file_t* file = table ? fdtable_lookup(table, file_id) : NULL;
+    if (file) {
+        __atomic_add_fetch(&file->reference_count, 1, __ATOMIC_ACQUIRE);
+    }
+    return file;
+}
+
+/*
+ * drop an open file once the descriptor and every call using it let go
+ */
+static void release_file(vfs_file_t* file) {
+    if (file->ops && file->ops->close) {
+        file->ops->close(file);
+    }
+    
+    /* advisory locks belong to the open file and go with it */
+    if (file->inode && !list_is_empty(&file->locks)) {
+        range_lock_clear(&file->inode->advisory_locks, &file->locks, 0, RANGE_LOCK_EOF);
+    }
+    
+    /* the inode stays cached for the next open, close clears inodes it freed */
+    if (file->inode) {
+        if (file->inode->sb) {
+            file->inode->sb->reference_count--;
+        }
+        icache_put(file->inode);
+    }
+    gecko_free_kernel_memory(file);
+}
+
+static void put_file(vfs_file_t* file) {
+    if (file && __atomic_sub_fetch(&file->reference_count, 1, __ATOMIC_ACQ_REL) == 0) {
+        release_file(file);
+    }
 }
 
 int vfs_open(const char* path, uint32_t flags, uint32_t file_id) {
@@ -192,18 +416,40 @@ int vfs_open(const char* path, uint32_t flags, uint32_t file_id) {
     
     vfs_inode_t* inode = vfs_lookup(path);
     if (!inode) {
-        if (flags & VFS_O_CREAT) {
-            return vfs_mkdir(path, 0644);
+        if (!(flags & VFS_O_CREAT) || !(inode = create_file(path, 0644))) {
+            return -1;
         }
+    } else if ((flags & VFS_O_CREAT) && (flags & VFS_O_EXCL)) {
         return -1;
     }
     
-    uint32_t id = next_file_id++;
-    if (id >= VFS_MAX_FILE_DESCRIPTORS) {
+    /* in memory files drop their data, cached files have no truncate yet */
+    if ((flags & VFS_O_TRUNC) && (flags & VFS_PERM_WRITE) && inode->type == VFS_TYPE_FILE &&
+        !(inode->ops && inode->ops->readpage)) {
+        memfile_truncate(inode);
+    }
+    
+    vfs_file_table_t* table = current_file_table(1);
+    if (!table) {
+        return -1;
+    }
+    
+    vfs_file_t* file = gecko_alloc_kernel_memory(sizeof(vfs_file_t));
+    if (!file) {
+        return -1;
+    }
+    
+    int id = fdtable_alloc(table);
+    if (id < 0) {
+        gecko_free_kernel_memory(file);
         return -1;
     }
     
-    vfs_file_t* file = &file_descriptors[id];
+    /* open files keep their filesystem mounted */
+    icache_hold(inode);
+    if (inode->sb) {
+        inode->sb->reference_count++;
+    }
     file->file_id = id;
     file->inode = inode;
     file->position = 0;
@@ -211,180 +457,805 @@ int vfs_open(const char* path, uint32_t flags, uint32_t file_id) {
     file->ops = &default_file_ops;
     file->private_data = NULL;
     file->reference_count = 1;
+    list_init(&file->locks);
+    readahead_init(&file->readahead);
+    
+    /* visible to lookups only once complete */
+    fdtable_install(table, id, file);
+    return id;
+}
+
+int vfs_close(uint32_t file_id) {
+    vfs_file_table_t* table = current_file_table(0);
+    if (!table || !fdtable_lookup(table, file_id)) {
+        return -1;
+    }
+    
+    /* calls still using the file keep it open until they return */
+    put_file(fdtable_remove(table, file_id));
+    return 0;
+}
+
+/*
+ * close every descriptor of an exiting task and free its table
+ */
+void vfs_exit_task(task_t* task) {
+    vfs_file_table_t* table = task->files;
+    if (!table) {
+        return;
+    }
     
-    if (inode->ops && inode->ops->create_file) {
-        if (inode->ops->create_file(inode, path, 0644) < 0) {
+    for (uint32_t fd = 0; fd < table->array->size; fd++) {
+        if (table->array->files[fd]) {
+            put_file(fdtable_remove(table, fd));
+        }
+    }
+    
+    fdtable_destroy(table);
+    task->files = NULL;
+}
+
+/*
+ * total length of iov, or -1 when it is malformed or too long for a file
+ */
+static int64_t iov_total(const vfs_iovec_t* iov, uint32_t iov_count) {
+    if (!iov || iov_count == 0 || iov_count > VFS_IOV_MAX) {
+        return -1;
+    }
+    
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < iov_count; i++) {
+        if (!iov[i].base && iov[i].length) {
+            return -1;
+        }
+        total += iov[i].length;
+        if (total > UINT32_MAX) {
             return -1;
         }
     }
     
-    return id;
+    return (int64_t)total;
 }
 
-int vfs_close(uint32_t file_id) {
-    if (file_id >= VFS_MAX_FILE_DESCRIPTORS) {
+/*
+ * read into the buffers of iov from offset, stops at end of file
+ */
+static int file_read(vfs_file_t* file, uint64_t offset, const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_read) {
+    vfs_inode_t* inode = file->inode;
+    size_t done = 0;
+    int result = 0;
+    
+    if (offset < inode->size && inode->type == VFS_TYPE_FILE) {
+        size_t size = 0;
+        for (uint32_t i = 0; i < iov_count; i++) {
+            size += iov[i].length;
+        }
+        
+        /* writers of these bytes wait, everything else goes on in parallel */
+        range_lock_t range;
+        int locked = range_lock_acquire(&inode->io_locks, &range, offset, offset + size, RANGE_LOCK_READ, 1) == 0;
+        
+        /* filesystem backed files are read through the page cache */
+        if (inode->ops && inode->ops->readpage) {
+            result = page_cache_read(inode, &file->readahead, offset, iov, iov_count, &done);
+        } else {
+            for (uint32_t i = 0; i < iov_count && offset + done < inode->size; i++) {
+                done += memfile_read(inode, offset + done, iov[i].base, iov[i].length);
+            }
+        }
+        
+        if (locked) {
+            range_lock_release(&inode->io_locks, &range);
+        }
+    }
+    
+    if (bytes_read) {
+        *bytes_read = done;
+    }
+    
+    return result;
+}
+
+/*
+ * write the size bytes of iov at offset, extends the file
+ */
+static int file_write(vfs_file_t* file, uint64_t offset, const vfs_iovec_t* iov, uint32_t iov_count,
+                      size_t size, size_t* bytes_written) {
+    vfs_inode_t* inode = file->inode;
+    
+    if (!(file->flags & VFS_PERM_WRITE) || inode->type != VFS_TYPE_FILE) {
         return -1;
     }
     
-    vfs_file_t* file = &file_descriptors[file_id];
-    if (file->inode == NULL) {
+    if (offset + size > UINT32_MAX) {
         return -1;
     }
     
-    if (file->ops && file->ops->close) {
-        file->ops->close(file);
+    /* only transfers overlapping these bytes wait */
+    range_lock_t range;
+    if (range_lock_acquire(&inode->io_locks, &range, offset, offset + size, RANGE_LOCK_WRITE, 1) != 0) {
+        return -1;
     }
     
-    file->inode->reference_count--;
-    if (file->inode->reference_count == 0) {
-        if (file->inode->data) {
-            gecko_free_kernel_memory(file->inode->data);
+    size_t done = 0;
+    int result = 0;
+    if (inode->ops && inode->ops->readpage) {
+        result = page_cache_write(inode, offset, iov, iov_count, &done);
+    } else {
+        /* in memory files allocate only the pages written, a gap stays a hole */
+        for (uint32_t i = 0; i < iov_count; i++) {
+            size_t chunk = memfile_write(inode, offset + done, iov[i].base, iov[i].length);
+            done += chunk;
+            if (chunk < iov[i].length) {
+                result = -1;
+                break;
+            }
         }
-        gecko_free_kernel_memory(file->inode);
     }
     
-    memset(file, 0, sizeof(vfs_file_t));
+    range_lock_release(&inode->io_locks, &range);
     
-    return 0;
+    if (bytes_written) {
+        *bytes_written = done;
+    }
+    
+    return result;
 }
 
 int vfs_read(uint32_t file_id, void* buffer, size_t size, size_t* bytes_read) {
-    if (file_id >= VFS_MAX_FILE_DESCRIPTORS || !buffer || !size) {
+    if (!buffer || !size) {
         return -1;
     }
     
-    vfs_file_t* file = &file_descriptors[file_id];
-    if (!file->inode) {
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
         return -1;
     }
     
-    if (file->position >= file->inode->size) {
-        if (bytes_read) {
-            *bytes_read = 0;
-        }
-        return 0;
+    if (file->ops && file->ops->read) {
+        int result = file->ops->read(file, buffer, size, bytes_read);
+        put_file(file);
+        return result;
     }
     
-    size_t to_read = size;
-    if (file->position + to_read > file->inode->size) {
-        to_read = file->inode->size - file->position;
+    vfs_iovec_t iov = { buffer, size };
+    size_t done = 0;
+    int result = file_read(file, file->position, &iov, 1, &done);
+    file->position += done;
+    put_file(file);
+    
+    if (bytes_read) {
+        *bytes_read = done;
     }
     
-    if (file->inode->type == VFS_TYPE_FILE && file->inode->data) {
-        memcpy(buffer, (char*)file->inode->data + file->position, to_read);
-        file->position += to_read;
-        
-        if (bytes_read) {
-            *bytes_read = to_read;
-        }
-        
-        return 0;
+    return result;
+}
+
+int vfs_write(uint32_t file_id, const void* buffer, size_t size, size_t* bytes_written) {
+    if (!buffer || !size) {
+        return -1;
+    }
+    
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
+    }
+    
+    if (file->ops && file->ops->write) {
+        int result = file->ops->write(file, buffer, size, bytes_written);
+        put_file(file);
+        return result;
+    }
+    
+    vfs_iovec_t iov = { (void*)buffer, size };
+    size_t done = 0;
+    int result = file_write(file, file->position, &iov, 1, size, &done);
+    file->position += done;
+    put_file(file);
+    
+    if (bytes_written) {
+        *bytes_written = done;
+    }
+    
+    return result;
+}
+
+/*
+ * positional calls neither use nor move the file position
+ */
+int vfs_pread(uint32_t file_id, void* buffer, size_t size, uint64_t offset, size_t* bytes_read) {
+    if (!buffer || !size) {
+        return -1;
+    }
+    
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
+    }
+    
+    vfs_iovec_t iov = { buffer, size };
+    int result = file_read(file, offset, &iov, 1, bytes_read);
+    put_file(file);
+    return result;
+}
+
+int vfs_pwrite(uint32_t file_id, const void* buffer, size_t size, uint64_t offset, size_t* bytes_written) {
+    if (!buffer || !size) {
+        return -1;
+    }
+    
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
+    }
+    
+    vfs_iovec_t iov = { (void*)buffer, size };
+    int result = file_write(file, offset, &iov, 1, size, bytes_written);
+    put_file(file);
+    return result;
+}
+
+/*
+ * vectored calls fill or drain the buffers in order as one transfer
+ */
+int vfs_readv(uint32_t file_id, const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_read) {
+    if (iov_total(iov, iov_count) < 0) {
+        return -1;
+    }
+    
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
     }
     
+    size_t done = 0;
+    int result = file_read(file, file->position, iov, iov_count, &done);
+    file->position += done;
+    put_file(file);
+    
     if (bytes_read) {
-        *bytes_read = 0;
+        *bytes_read = done;
     }
     
-    return 0;
+    return result;
 }
 
-int vfs_write(uint32_t file_id, const void* buffer, size_t size, size_t* bytes_written) {
-    if (file_id >= VFS_MAX_FILE_DESCRIPTORS || !buffer || !size) {
+int vfs_writev(uint32_t file_id, const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_written) {
+    int64_t size = iov_total(iov, iov_count);
+    if (size < 0) {
         return -1;
     }
     
-    vfs_file_t* file = &file_descriptors[file_id];
-    if (!file->inode || !(file->flags & VFS_PERM_WRITE)) {
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
         return -1;
     }
     
-    if (file->inode->type != VFS_TYPE_FILE) {
+    size_t done = 0;
+    int result = 0;
+    if (size > 0) {
+        result = file_write(file, file->position, iov, iov_count, (size_t)size, &done);
+        file->position += done;
+    }
+    put_file(file);
+    
+    if (bytes_written) {
+        *bytes_written = done;
+    }
+    
+    return result;
+}
+
+int vfs_preadv(uint32_t file_id, const vfs_iovec_t* iov, uint32_t iov_count, uint64_t offset, size_t* bytes_read) {
+    if (iov_total(iov, iov_count) < 0) {
         return -1;
     }
     
-    if (!file->inode->data) {
-        file->inode->data = gecko_alloc_kernel_memory(file->inode->size + size);
-        if (!file->inode->data) {
-            return -1;
-        }
-        file->inode->size = 0;
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
+    }
+    
+    int result = file_read(file, offset, iov, iov_count, bytes_read);
+    put_file(file);
+    return result;
+}
+
+int vfs_pwritev(uint32_t file_id, const vfs_iovec_t* iov, uint32_t iov_count, uint64_t offset, size_t* bytes_written) {
+    int64_t size = iov_total(iov, iov_count);
+    if (size < 0) {
+        return -1;
     }
     
-    if (file->position + size > file->inode->size) {
-        size_t new_size = file->position + size;
-        void* new_data = gecko_alloc_kernel_memory(new_size);
-        if (!new_data) {
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
+    }
+    
+    int result = 0;
+    if (size > 0) {
+        result = file_write(file, offset, iov, iov_count, (size_t)size, bytes_written);
+    } else if (bytes_written) {
+        *bytes_written = 0;
+    }
+    put_file(file);
+    return result;
+}
+
+/*
+ * open both ends of a new pipe, fds[0] reads and fds[1] writes
+ */
+int vfs_pipe(uint32_t fds[2]) {
+    if (!fds || !vfs_initialized) {
+        return -1;
+    }
+    
+    vfs_file_table_t* table = current_file_table(1);
+    if (!table) {
+        return -1;
+    }
+    
+    pipe_t* pipe = pipe_create();
+    if (!pipe) {
+        return -1;
+    }
+    
+    vfs_file_t* ends[2] = { NULL, NULL };
+    int ids[2] = { -1, -1 };
+    
+    for (int i = 0; i < 2; i++) {
+        ends[i] = gecko_alloc_kernel_memory(sizeof(vfs_file_t));
+        ids[i] = ends[i] ? fdtable_alloc(table) : -1;
+        if (ids[i] < 0) {
+            for (int j = 0; j <= i; j++) {
+                if (ids[j] >= 0) {
+                    fdtable_remove(table, ids[j]);
+                }
+                if (ends[j]) {
+                    gecko_free_kernel_memory(ends[j]);
+                }
+            }
+            gecko_free_kernel_memory(pipe);
             return -1;
         }
         
-        memcpy(new_data, file->inode->data, file->inode->size);
-        gecko_free_kernel_memory(file->inode->data);
+        memset(ends[i], 0, sizeof(vfs_file_t));
+        ends[i]->file_id = ids[i];
+        ends[i]->inode = &pipe->inode;
+        ends[i]->flags = i ? VFS_O_WRONLY : VFS_O_RDONLY;
+        ends[i]->ops = &pipe_file_ops;
+        ends[i]->reference_count = 1;
+    }
+    
+    pipe->inode.reference_count = 2;
+    fdtable_install(table, ids[0], ends[0]);
+    fdtable_install(table, ids[1], ends[1]);
+    fds[0] = ids[0];
+    fds[1] = ids[1];
+    return 0;
+}
+
+static pipe_t* file_pipe(vfs_file_t* file) {
+    return file->inode->type == VFS_TYPE_PIPE ? (pipe_t*)file->inode->data : NULL;
+}
+
+/*
+ * bytes of a regular file from offset that size may cover
+ */
+static size_t clamp_to_file(vfs_inode_t* inode, uint64_t offset, size_t size) {
+    if (offset >= inode->size) {
+        return 0;
+    }
+    return size < inode->size - offset ? size : inode->size - offset;
+}
+
+/*
+ * read the missing pages of a range in one go before taking references
+ */
+static void prefetch_range(vfs_inode_t* inode, uint64_t offset, size_t size) {
+    if (size > 0 && inode->ops && inode->ops->readpage) {
+        uint64_t first = offset / PAGE_SIZE;
+        uint64_t last = (offset + size - 1) / PAGE_SIZE;
+        page_cache_readahead(inode, first, (uint32_t)(last - first + 1), (uint32_t)(last - first + 1), 0);
+    }
+}
+
+/*
+ * add file data at offset to pipe, cached pages go in by reference and
+ * in memory files are copied
+ */
+static int splice_from_file(vfs_file_t* file, uint64_t offset, pipe_t* pipe, size_t size, size_t* bytes_spliced) {
+    vfs_inode_t* inode = file->inode;
+    size_t done = 0;
+    int result = 0;
+    
+    if (inode->type != VFS_TYPE_FILE) {
+        return -1;
+    }
+    
+    size = clamp_to_file(inode, offset, size);
+    if (size > (size_t)(PIPE_BUFFERS - pipe->count) * PAGE_SIZE) {
+        size = (size_t)(PIPE_BUFFERS - pipe->count) * PAGE_SIZE;
+    }
+    prefetch_range(inode, offset, size);
+    
+    while (done < size && pipe->count < PIPE_BUFFERS) {
+        uint64_t position = offset + done;
+        uint32_t page_offset = position % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - page_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
         
-        file->inode->data = new_data;
-        file->inode->size = new_size;
+        if (inode->ops && inode->ops->readpage) {
+            cached_page_t* page = page_cache_get(inode, position / PAGE_SIZE);
+            if (!page) {
+                result = -1;
+                break;
+            }
+            pipe_push_page(pipe, page, page_offset, chunk);
+        } else {
+            chunk = pipe_write(pipe, (const char*)memfile_page(inode, position / PAGE_SIZE) + page_offset, chunk);
+            if (chunk == 0) {
+                break;
+            }
+        }
+        done += chunk;
     }
     
-    memcpy((char*)file->inode->data + file->position, buffer, size);
-    file->position += size;
+    *bytes_spliced = done;
+    return result;
+}
+
+/*
+ * drain pipe into a regular file at offset
+ */
+static int splice_to_file(pipe_t* pipe, vfs_file_t* file, uint64_t offset, size_t size, size_t* bytes_spliced) {
+    size_t done = 0;
+    int result = 0;
+    pipe_buffer_t* buffer;
     
-    if (bytes_written) {
-        *bytes_written = size;
+    while (done < size && (buffer = pipe_peek(pipe)) != NULL) {
+        size_t chunk = buffer->length < size - done ? buffer->length : size - done;
+        vfs_iovec_t iov = { (char*)buffer->data + buffer->offset, chunk };
+        size_t written = 0;
+        
+        result = file_write(file, offset + done, &iov, 1, chunk, &written);
+        pipe_consume(pipe, written);
+        done += written;
+        if (result != 0 || written < chunk) {
+            break;
+        }
     }
     
-    return 0;
+    *bytes_spliced = done;
+    return result;
 }
 
-int vfs_mkdir(const char* path, uint32_t permissions) {
-    if (!path || !vfs_initialized) {
+/*
+ * copy file to file straight from the source pages
+ */
+static int copy_file_range(vfs_file_t* in, uint64_t offset, vfs_file_t* out, uint64_t out_offset,
+                           size_t size, size_t* bytes_copied) {
+    vfs_inode_t* inode = in->inode;
+    size_t done = 0;
+    int result = 0;
+    
+    if (inode->type != VFS_TYPE_FILE) {
         return -1;
     }
     
-    vfs_inode_t* parent = NULL;
-    const char* dirname = path;
-    const char* last_slash = strrchr(path, '/');
+    size = clamp_to_file(inode, offset, size);
     
-    if (last_slash) {
-        size_t parent_len = last_slash - path;
-        if (parent_len == 0) {
-            parent = vfs_lookup("/");
+    while (done < size && result == 0) {
+        uint64_t position = offset + done;
+        uint32_t page_offset = position % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - page_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        
+        vfs_iovec_t iov;
+        cached_page_t* page = NULL;
+        if (inode->ops && inode->ops->readpage) {
+            if (page_offset == 0 && position % (PIPE_BUFFERS * PAGE_SIZE) == 0) {
+                prefetch_range(inode, position, size - done < PIPE_BUFFERS * PAGE_SIZE ? size - done : PIPE_BUFFERS * PAGE_SIZE);
+            }
+            page = page_cache_get(inode, position / PAGE_SIZE);
+            if (!page) {
+                result = -1;
+                break;
+            }
+            /* the write may reclaim clean pages, this one is read from */
+            page_cache_hold(page);
+            iov.base = (char*)page->data + page_offset;
         } else {
-            char parent_path[VFS_MAX_PATH_LENGTH];
-            memcpy(parent_path, path, parent_len);
-            parent_path[parent_len] = '\0';
-            parent = vfs_lookup(parent_path);
+            iov.base = (char*)memfile_page(inode, position / PAGE_SIZE) + page_offset;
+        }
+        iov.length = chunk;
+        
+        size_t written = 0;
+        result = file_write(out, out_offset + done, &iov, 1, chunk, &written);
+        if (page) {
+            page_cache_put(page);
+        }
+        done += written;
+        if (written < chunk) {
+            break;
         }
-        dirname = last_slash + 1;
     }
     
-    if (!parent) {
+    *bytes_copied = done;
+    return result;
+}
+
+/*
+ * move data between a pipe and a file or another pipe. offsets are used
+ * and advanced for files when given, the file position otherwise
+ */
+static int splice_files(vfs_file_t* in, uint64_t* in_offset, vfs_file_t* out, uint64_t* out_offset,
+                        size_t size, size_t* bytes_spliced) {
+    pipe_t* in_pipe = file_pipe(in);
+    pipe_t* out_pipe = file_pipe(out);
+    
+    /* one side must be a pipe, and pipes have no offset */
+    if ((!in_pipe && !out_pipe) || (in_pipe && in_offset) || (out_pipe && out_offset)) {
         return -1;
     }
     
-    vfs_inode_t* dir_inode = gecko_alloc_kernel_memory(sizeof(vfs_inode_t));
-    if (!dir_inode) {
+    size_t done = 0;
+    int result = 0;
+    
+    if (in_pipe && out_pipe) {
+        done = pipe_move(in_pipe, out_pipe, size);
+    } else if (out_pipe) {
+        uint64_t offset = in_offset ? *in_offset : in->position;
+        result = splice_from_file(in, offset, out_pipe, size, &done);
+        if (in_offset) {
+            *in_offset += done;
+        } else {
+            in->position += done;
+        }
+    } else {
+        uint64_t offset = out_offset ? *out_offset : out->position;
+        result = splice_to_file(in_pipe, out, offset, size, &done);
+        if (out_offset) {
+            *out_offset += done;
+        } else {
+            out->position += done;
+        }
+    }
+    
+    if (bytes_spliced) {
+        *bytes_spliced = done;
+    }
+    
+    return result;
+}
+
+int vfs_splice(uint32_t in_fd, uint64_t* in_offset, uint32_t out_fd, uint64_t* out_offset,
+               size_t size, size_t* bytes_spliced) {
+    vfs_file_t* in = get_file(in_fd);
+    vfs_file_t* out = get_file(out_fd);
+    int result = -1;
+    
+    if (in && out && size) {
+        result = splice_files(in, in_offset, out, out_offset, size, bytes_spliced);
+    }
+    
+    put_file(in);
+    put_file(out);
+    return result;
+}
+
+/*
+ * send a regular file to a pipe or another file without a bounce buffer
+ */
+static int send_file(vfs_file_t* out, vfs_file_t* in, uint64_t* offset, size_t size, size_t* bytes_sent) {
+    uint64_t start = offset ? *offset : in->position;
+    pipe_t* out_pipe = file_pipe(out);
+    size_t done = 0;
+    int result;
+    
+    if (out_pipe) {
+        result = splice_from_file(in, start, out_pipe, size, &done);
+    } else {
+        result = copy_file_range(in, start, out, out->position, size, &done);
+        out->position += done;
+    }
+    
+    if (offset) {
+        *offset += done;
+    } else {
+        in->position += done;
+    }
+    
+    if (bytes_sent) {
+        *bytes_sent = done;
+    }
+    
+    return result;
+}
+
+int vfs_sendfile(uint32_t out_fd, uint32_t in_fd, uint64_t* offset, size_t size, size_t* bytes_sent) {
+    vfs_file_t* in = get_file(in_fd);
+    vfs_file_t* out = get_file(out_fd);
+    int result = -1;
+    
+    if (in && out && size && !file_pipe(in)) {
+        result = send_file(out, in, offset, size, bytes_sent);
+    }
+    
+    put_file(in);
+    put_file(out);
+    return result;
+}
+
+static void release_cached_ref(ipc_page_ref_t* ref) {
+    page_cache_put((cached_page_t*)ref->owner);
+}
+
+static void release_owned_ref(ipc_page_ref_t* ref) {
+    pmm_free_page(ref->owner);
+}
+
+/*
+ * next page reference of a file for a message, 0 when there is none
+ */
+static size_t file_page_ref(vfs_inode_t* inode, uint64_t position, size_t size, ipc_page_ref_t* ref) {
+    uint32_t page_offset = position % PAGE_SIZE;
+    size_t chunk = PAGE_SIZE - page_offset;
+    if (chunk > size) {
+        chunk = size;
+    }
+    
+    if (inode->ops && inode->ops->readpage) {
+        cached_page_t* page = page_cache_get(inode, position / PAGE_SIZE);
+        if (!page) {
+            return 0;
+        }
+        page_cache_hold(page);
+        ref->data = (char*)page->data + page_offset;
+        ref->release = release_cached_ref;
+        ref->owner = page;
+    } else {
+        void* data = pmm_alloc_page();
+        if (!data) {
+            return 0;
+        }
+        memcpy(data, (const char*)memfile_page(inode, position / PAGE_SIZE) + page_offset, chunk);
+        ref->data = data;
+        ref->release = release_owned_ref;
+        ref->owner = data;
+    }
+    
+    ref->length = chunk;
+    return chunk;
+}
+
+/*
+ * send a file or the contents of a pipe to an ipc queue as page
+ * references, IPC_MAX_PAGE_REFS pages per message. stops early when the
+ * queue fills up
+ */
+static int send_file_ipc(void* destination, vfs_file_t* in, uint64_t* offset, size_t size, size_t* bytes_sent) {
+    pipe_t* in_pipe = file_pipe(in);
+    if ((in_pipe && offset) || (!in_pipe && in->inode->type != VFS_TYPE_FILE)) {
         return -1;
     }
     
-    memset(dir_inode, 0, sizeof(vfs_inode_t));
+    uint64_t start = offset ? *offset : in->position;
+    if (!in_pipe) {
+        size = clamp_to_file(in->inode, start, size);
+    }
+    
+    size_t done = 0;
+    int result = 0;
     
-    dir_inode->inode_id = next_inode_id++;
-    dir_inode->type = VFS_TYPE_DIRECTORY;
-    dir_inode->permissions = permissions;
-    dir_inode->size = 0;
-    dir_inode->link_count = 1;
-    dir_inode->creation_time = 0;
-    dir_inode->modification_time = 0;
-    dir_inode->access_time = 0;
-    dir_inode->data = gecko_alloc_kernel_memory(VFS_MAX_PATH_LENGTH);
-    if (dir_inode->data) {
-        strncpy((char*)dir_inode->data, dirname, VFS_MAX_FILENAME_LENGTH - 1);
-        ((char*)dir_inode->data)[VFS_MAX_FILENAME_LENGTH - 1] = '\0';
+    while (done < size) {
+        ipc_page_ref_t refs[IPC_MAX_PAGE_REFS];
+        uint32_t count = 0;
+        size_t batch = 0;
+        
+        if (in_pipe) {
+            /* buffers leave the pipe only once their message is queued */
+            pipe_buffer_t* buffer;
+            while (count < IPC_MAX_PAGE_REFS && (buffer = pipe_peek_at(in_pipe, count)) != NULL) {
+                /* a buffer is passed whole or not at all */
+                if (buffer->length > size - done - batch) {
+                    break;
+                }
+                refs[count].data = (char*)buffer->data + buffer->offset;
+                refs[count].length = buffer->length;
+                refs[count].release = buffer->page ? release_cached_ref : release_owned_ref;
+                refs[count].owner = buffer->page ? (void*)buffer->page : buffer->data;
+                batch += buffer->length;
+                count++;
+            }
+        } else {
+            size_t span = size - done < IPC_MAX_PAGE_REFS * PAGE_SIZE ? size - done : IPC_MAX_PAGE_REFS * PAGE_SIZE;
+            prefetch_range(in->inode, start + done, span);
+            while (count < IPC_MAX_PAGE_REFS && done + batch < size) {
+                size_t chunk = file_page_ref(in->inode, start + done + batch, size - done - batch, &refs[count]);
+                if (chunk == 0) {
+                    result = -1;
+                    break;
+                }
+                batch += chunk;
+                count++;
+            }
+        }
+        
+        if (count == 0) {
+            break;
+        }
+        
+        if (ipc_send_pages(destination, refs, count, IPC_NONBLOCKING) != 0) {
+            if (!in_pipe) {
+                ipc_release_pages(refs, count);
+            }
+            if (done == 0) {
+                result = -1;
+            }
+            break;
+        }
+        
+        /* the references now belong to the message */
+        if (in_pipe) {
+            pipe_buffer_t taken;
+            for (uint32_t i = 0; i < count; i++) {
+                pipe_take(in_pipe, &taken);
+            }
+        }
+        done += batch;
+        
+        if (result != 0) {
+            break;
+        }
     }
-    dir_inode->ops = &default_inode_ops;
-    dir_inode->sb = NULL;
-    dir_inode->reference_count = 1;
     
-    return 0;
+    if (!in_pipe) {
+        if (offset) {
+            *offset += done;
+        } else {
+            in->position += done;
+        }
+    }
+    
+    if (bytes_sent) {
+        *bytes_sent = done;
+    }
+    
+    return result;
+}
+
+int vfs_sendfile_ipc(void* destination, uint32_t in_fd, uint64_t* offset, size_t size, size_t* bytes_sent) {
+    vfs_file_t* in = get_file(in_fd);
+    int result = -1;
+    
+    if (in && size) {
+        result = send_file_ipc(destination, in, offset, size, bytes_sent);
+    }
+    
+    put_file(in);
+    return result;
+}
+
+int vfs_mkdir(const char* path, uint32_t permissions) {
+    if (!path || !vfs_initialized) {
+        return -1;
+    }
+    
+    const char* name;
+    vfs_inode_t* parent = lookup_parent(path, &name);
+    if (!parent || !parent->ops || !parent->ops->mkdir) {
+        return -1;
+    }
+    
+    /* a cached miss for this name is now stale */
+    dcache_invalidate(parent, name, strlen(name));
+    
+    return parent->ops->mkdir(parent, name, permissions);
 }
 
 int vfs_umount(const char* mount_point) {
@@ -392,35 +1263,58 @@ int vfs_umount(const char* mount_point) {
         return -1;
     }
     
-    for (int i = 0; i < VFS_MAX_MOUNT_POINTS; i++) {
-        if (mount_points[i].active && strcmp(mount_points[i].mount_point, mount_point) == 0) {
-            if (mount_points[i].superblock->ops && mount_points[i].superblock->ops->umount) {
-                mount_points[i].superblock->ops->umount(mount_points[i].superblock);
-            }
-            
-            mount_points[i].active = 0;
-            memset(&mount_points[i], 0, sizeof(vfs_mount_point_t));
-            
-            return 0;
-        }
+    vfs_mount_point_t* mp = mount_find(mount_point);
+    if (!mp) {
+        return -1;
+    }
+    
+    vfs_superblock_t* sb = mp->superblock;
+    
+    /* the mount holds the only reference of an idle filesystem */
+    if (sb->reference_count > 1) {
+        LOG_WARNING("vfs", "%s is busy", mount_point);
+        return -1;
     }
     
-    return -1;
+    /* dirty data goes out before the filesystem does */
+    writeback_superblock(sb);
+    if (sb->ops && sb->ops->sync) {
+        sb->ops->sync(sb);
+    }
+    if (sb->ops && sb->ops->umount) {
+        sb->ops->umount(sb);
+    }
+    
+    /* drop cached names and unused inodes of the filesystem */
+    dcache_prune_superblock(sb);
+    icache_put(mp->mount_inode);
+    icache_evict_superblock(sb);
+    
+    mount_remove(mp);
+    list_remove(&mounts, &mp->mount_link);
+    gecko_free_kernel_memory(sb);
+    gecko_free_kernel_memory(mp);
+    
+    return 0;
 }
 
 vfs_superblock_t* vfs_get_superblock(const char* path) {
-    vfs_mount_point_t* mp = find_mount_point(path);
+    vfs_mount_point_t* mp = mount_resolve(path, NULL);
     return mp ? mp->superblock : NULL;
 }
 
-int vfs_seek(uint32_t file_id, int64_t offset, int whence) {
-    if (file_id >= VFS_MAX_FILE_DESCRIPTORS) {
+static int seek_file(vfs_file_t* file, int64_t offset, int whence) {
+    if (file->inode->type == VFS_TYPE_PIPE) {
         return -1;
     }
     
-    vfs_file_t* file = &file_descriptors[file_id];
-    if (!file->inode) {
-        return -1;
+    /* directory positions are cookies, only ever set to one handed out */
+    if (file->inode->type == VFS_TYPE_DIRECTORY) {
+        if (whence != SEEK_SET || offset < 0 || offset > UINT32_MAX) {
+            return -1;
+        }
+        file->position = (uint32_t)offset;
+        return 0;
     }
     
     int64_t new_position = file->position;
@@ -452,35 +1346,250 @@ int vfs_seek(uint32_t file_id, int64_t offset, int whence) {
     return 0;
 }
 
+int vfs_seek(uint32_t file_id, int64_t offset, int whence) {
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
+    }
+    
+    int result = seek_file(file, offset, whence);
+    put_file(file);
+    return result;
+}
+
+/*
+ * advisory lock on length bytes from start, 0 locks to the end of file.
+ * the lock is held by the open file and dropped when it closes
+ */
+static int lock_file(vfs_file_t* file, vfs_lock_type_t type, uint64_t start, uint64_t length, uint32_t flags) {
+    if (file->inode->type != VFS_TYPE_FILE) {
+        return -1;
+    }
+    
+    uint64_t end = length ? start + length : RANGE_LOCK_EOF;
+    if (end <= start) {
+        return -1;
+    }
+    
+    vfs_inode_t* inode = file->inode;
+    switch (type) {
+        case VFS_LOCK_UNLOCK:
+            return range_lock_clear(&inode->advisory_locks, &file->locks, start, end);
+        case VFS_LOCK_READ:
+            if (!(file->flags & VFS_PERM_READ)) {
+                return -1;
+            }
+            return range_lock_set(&inode->advisory_locks, &file->locks, file, start, end,
+                                  RANGE_LOCK_READ, !(flags & VFS_LOCK_NOWAIT));
+        case VFS_LOCK_WRITE:
+            if (!(file->flags & VFS_PERM_WRITE)) {
+                return -1;
+            }
+            return range_lock_set(&inode->advisory_locks, &file->locks, file, start, end,
+                                  RANGE_LOCK_WRITE, !(flags & VFS_LOCK_NOWAIT));
+        default:
+            return -1;
+    }
+}
+
+int vfs_lock(uint32_t file_id, vfs_lock_type_t type, uint64_t start, uint64_t length, uint32_t flags) {
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
+    }
+    
+    int result = lock_file(file, type, start, length, flags);
+    put_file(file);
+    return result;
+}
+
+int vfs_fsync(uint32_t file_id) {
+    vfs_file_t* file = get_file(file_id);
+    if (!file) {
+        return -1;
+    }
+    
+    int result = writeback_inode(file->inode);
+    put_file(file);
+    return result;
+}
+
+int vfs_sync(void) {
+    int result = 0;
+    
+    for (list_node_t* link = list_get_head(&mounts); link != NULL; link = link->next) {
+        vfs_superblock_t* sb = ((vfs_mount_point_t*)link->data)->superblock;
+        if (writeback_superblock(sb) != 0) {
+            result = -1;
+        }
+        if (sb->ops && sb->ops->sync && sb->ops->sync(sb) != 0) {
+            result = -1;
+        }
+    }
+    
+    return result;
+}
+
+/*
+ * make a filesystem type mountable by name, the table is kept in
+ * priority order
+ */
 int vfs_register_filesystem(const char* name, const vfs_inode_operations_t* inode_ops,
                            const vfs_superblock_operations_t* sb_ops, uint32_t priority) {
-    (void)name;
-    (void)inode_ops;
-    (void)sb_ops;
-    (void)priority;
+    if (!name || find_filesystem(name) || filesystem_count == VFS_MAX_FILESYSTEMS) {
+        return -1;
+    }
+    
+    uint32_t i = filesystem_count++;
+    while (i > 0 && filesystems[i - 1].priority < priority) {
+        filesystems[i] = filesystems[i - 1];
+        i--;
+    }
+    
+    filesystems[i].name = name;
+    filesystems[i].inode_ops = inode_ops;
+    filesystems[i].sb_ops = sb_ops;
+    filesystems[i].priority = priority;
+    
+    LOG_INFO("vfs", "registered filesystem %s", name);
     return 0;
 }
 
+/*
+ * remove the entry at path through its directory, rmdir picks directories
+ */
+static int remove_entry(const char* path, int directory) {
+    if (!path || !vfs_initialized) {
+        return -1;
+    }
+    
+    const char* name;
+    vfs_inode_t* parent = lookup_parent(path, &name);
+    if (!parent || !parent->ops) {
+        return -1;
+    }
+    
+    int (*remove)(vfs_inode_t*, const char*) = directory ? parent->ops->rmdir : parent->ops->unlink;
+    if (!remove) {
+        return -1;
+    }
+    
+    /* the dentry holds a reference, drop it before the filesystem lets go.
+     * names cached under a directory hold it too */
+    if (directory) {
+        vfs_inode_t* dir = lookup_child(parent, name, strlen(name));
+        if (dir) {
+            dcache_prune_directory(dir);
+        }
+    }
+    dcache_invalidate(parent, name, strlen(name));
+    
+    return remove(parent, name);
+}
+
 int vfs_unlink(const char* path) {
-    (void)path;
-    return 0;
+    return remove_entry(path, 0);
 }
 
 int vfs_rmdir(const char* path) {
-    (void)path;
-    return 0;
+    return remove_entry(path, 1);
+}
+
+static void fill_stat(const vfs_inode_t* inode, vfs_stat_t* stat_buf) {
+    stat_buf->inode_id = inode->inode_id;
+    stat_buf->type = inode->type;
+    stat_buf->permissions = inode->permissions;
+    stat_buf->size = inode->size;
+    stat_buf->link_count = inode->link_count;
+    stat_buf->creation_time = inode->creation_time;
+    stat_buf->modification_time = inode->modification_time;
+    stat_buf->access_time = inode->access_time;
 }
 
-int vfs_stat(const char* path, void* stat_buf) {
-    (void)path;
-    (void)stat_buf;
+int vfs_stat(const char* path, vfs_stat_t* stat_buf) {
+    if (!path || !stat_buf) {
+        return -1;
+    }
+    
+    vfs_inode_t* inode = vfs_lookup(path);
+    if (!inode) {
+        return -1;
+    }
+    
+    fill_stat(inode, stat_buf);
     return 0;
 }
 
+/*
+ * attributes of count names in the open directory dir_fd, the directory
+ * is resolved once for all of them. a missing name gets inode_id 0,
+ * returns how many were found
+ */
+int vfs_stat_bulk(uint32_t dir_fd, const char* const* names, uint32_t count, vfs_stat_t* stats) {
+    if (!names || !stats) {
+        return -1;
+    }
+    
+    vfs_file_t* file = get_file(dir_fd);
+    if (!file || file->inode->type != VFS_TYPE_DIRECTORY) {
+        put_file(file);
+        return -1;
+    }
+    
+    vfs_inode_t* dir = file->inode;
+    int found = 0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        size_t length = names[i] ? strlen(names[i]) : 0;
+        vfs_inode_t* inode = NULL;
+        if (length > 0 && length < VFS_MAX_FILENAME_LENGTH) {
+            inode = lookup_child(dir, names[i], length);
+        }
+        
+        if (inode) {
+            fill_stat(inode, &stats[i]);
+            found++;
+        } else {
+            memset(&stats[i], 0, sizeof(vfs_stat_t));
+        }
+    }
+    
+    put_file(file);
+    return found;
+}
+
+/*
+ * fill the buffer with whole vfs_dirent_t records from the directory's
+ * position on. the position is a cookie of the filesystem, so a listing
+ * can be continued later, or from another descriptor after seeking to
+ * the cookie of the last entry seen. no bytes means the end
+ */
 int vfs_getdents(uint32_t file_id, void* dirent_buffer, size_t size, size_t* bytes_read) {
-    (void)file_id;
-    (void)dirent_buffer;
-    (void)size;
-    (void)bytes_read;
+    uint32_t count = size / sizeof(vfs_dirent_t);
+    if (!dirent_buffer || count == 0) {
+        return -1;
+    }
+    
+    vfs_file_t* file = get_file(file_id);
+    vfs_inode_t* dir = file ? file->inode : NULL;
+    if (!dir || dir->type != VFS_TYPE_DIRECTORY || !dir->ops || !dir->ops->readdir) {
+        put_file(file);
+        return -1;
+    }
+    
+    uint32_t cookie = file->position;
+    int filled = dir->ops->readdir(dir, &cookie, (vfs_dirent_t*)dirent_buffer, count);
+    if (filled >= 0) {
+        file->position = cookie;
+    }
+    put_file(file);
+    if (filled < 0) {
+        return -1;
+    }
+    
+    if (bytes_read) {
+        *bytes_read = (size_t)filled * sizeof(vfs_dirent_t);
+    }
+    
     return 0;
-}
\ No newline at end of file
+}
@@ -3,11 +3,17 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "list.h"
+#include "hash.h"
+#include "radix_tree.h"
+#include "range_lock.h"
 
 #define VFS_MAX_PATH_LENGTH 256
 #define VFS_MAX_FILENAME_LENGTH 64
-#define VFS_MAX_FILE_DESCRIPTORS 64
-#define VFS_MAX_MOUNT_POINTS 32
+#define VFS_MAX_FILE_DESCRIPTORS 65536    /* per task */
+#define VFS_MAX_MOUNT_POINTS 4096
+#define VFS_MAX_FILESYSTEMS 16
+#define VFS_IOV_MAX 1024                  /* buffers in one vectored call */
 
 #define SEEK_SET 0
 #define SEEK_CUR 1
@@ -37,10 +43,48 @@ typedef enum {
     VFS_O_APPEND = 0x00000080
 } vfs_open_flags_t;
 
+/* advisory lock requests for vfs_lock */
+typedef enum {
+    VFS_LOCK_UNLOCK,
+    VFS_LOCK_READ,
+    VFS_LOCK_WRITE
+} vfs_lock_type_t;
+
+#define VFS_LOCK_NOWAIT 0x1           /* fail instead of waiting for a conflicting lock */
+
 typedef struct vfs_file vfs_file_t;
 typedef struct vfs_inode vfs_inode_t;
 typedef struct vfs_superblock vfs_superblock_t;
 typedef struct vfs_mount_point vfs_mount_point_t;
+typedef struct vfs_file_table vfs_file_table_t;
+struct task_control_block;
+
+/* one buffer of a vectored read or write */
+typedef struct {
+    void* base;
+    size_t length;
+} vfs_iovec_t;
+
+/* one directory entry, getdents packs them back to back */
+typedef struct {
+    char name[VFS_MAX_FILENAME_LENGTH];
+    vfs_type_t type;
+    uint32_t size;
+    uint32_t inode_id;
+    uint32_t cookie;            /* seek the directory here to continue after this entry */
+} vfs_dirent_t;
+
+/* inode attributes */
+typedef struct {
+    uint32_t inode_id;          /* 0 when bulk stat found no such name */
+    vfs_type_t type;
+    uint32_t permissions;
+    uint32_t size;
+    uint32_t link_count;
+    uint32_t creation_time;
+    uint32_t modification_time;
+    uint32_t access_time;
+} vfs_stat_t;
 
 typedef struct vfs_file_operations {
     int (*open)(vfs_file_t* file, const char* path, uint32_t flags);
@@ -58,6 +102,13 @@ typedef struct vfs_inode_operations {
     int (*link)(vfs_inode_t* target, const char* link_name);
     int (*unlink)(vfs_inode_t* parent, const char* name);
     int (*create_file)(vfs_inode_t* parent, const char* name, uint32_t permissions);
+    /* referenced inode of name, found through icache_get before building a new one */
+    vfs_inode_t* (*lookup)(vfs_inode_t* parent, const char* name, size_t length);
+    /* fill up to count entries from cookie on, cookie is advanced past them */
+    int (*readdir)(vfs_inode_t* dir, uint32_t* cookie, vfs_dirent_t* entries, uint32_t count);
+    int (*readpage)(vfs_inode_t* inode, uint64_t index, void* page);
+    int (*readpages)(vfs_inode_t* inode, uint64_t index, void** pages, uint32_t count);
+    int (*writepages)(vfs_inode_t* inode, uint64_t index, void** pages, uint32_t count);
 } vfs_inode_operations_t;
 
 typedef struct vfs_superblock_operations {
@@ -79,6 +130,15 @@ struct vfs_inode {
     const vfs_inode_operations_t* ops;
     vfs_superblock_t* sb;
     int reference_count;
+    hash_node_t cache_link;     /* inode cache index, keyed by (sb, inode_id) */
+    list_node_t lru_link;       /* unused inode lru while reference_count is 0 */
+    int cached;
+    radix_tree_t pages;         /* page cache, keyed by page index */
+    uint32_t dirty_pages;
+    list_node_t dirty_link;     /* writeback list while dirty_pages is not 0 */
+    uint64_t dirtied_time;      /* uptime when the first page was dirtied */
+    range_lock_tree_t io_locks;         /* byte ranges of transfers in progress */
+    range_lock_tree_t advisory_locks;   /* byte ranges locked through vfs_lock */
 };
 
 struct vfs_superblock {
@@ -87,9 +147,18 @@ struct vfs_superblock {
     vfs_inode_t* root_inode;
     const vfs_superblock_operations_t* ops;
     void* data;
-    int reference_count;
+    int reference_count;        /* the mount and each open file */
 };
 
+/* sequential readahead state of an open file, in pages */
+typedef struct {
+    uint64_t start;             /* first page of the current window */
+    uint32_t size;              /* pages in the window, 0 when not sequential */
+    uint32_t async_size;        /* pages left in the window when the marker is read */
+    uint32_t max_pages;
+    uint64_t prev_index;        /* last page read */
+} vfs_readahead_t;
+
 struct vfs_file {
     uint32_t file_id;
     vfs_inode_t* inode;
@@ -97,23 +166,31 @@ struct vfs_file {
     uint32_t flags;
     const vfs_file_operations_t* ops;
     void* private_data;
-    int reference_count;
+    int reference_count;        /* the descriptor and each call using the file */
+    vfs_readahead_t readahead;
+    list_t locks;               /* advisory locks held through this file */
 };
 
+/* registered filesystem type */
+typedef struct {
+    const char* name;
+    const vfs_inode_operations_t* inode_ops;
+    const vfs_superblock_operations_t* sb_ops;
+    uint32_t priority;
+} vfs_filesystem_t;
+
 struct vfs_mount_point {
     const char* path;
     const char* mount_point;
     const char* device_name;
+    size_t path_length;
     vfs_superblock_t* superblock;
     vfs_inode_t* mount_inode;
-    int active;
+    struct mount_node* node;            /* mount table trie node */
+    vfs_mount_point_t* covered;         /* earlier mount on the same path */
+    list_node_t mount_link;             /* all mounts, oldest first */
 };
 
-typedef struct {
-    vfs_file_t* files;
-    uint32_t used_count;
-} vfs_file_table_t;
-
 int vfs_init(void);
 int vfs_mount(const char* device, const char* mount_point, const char* fs_type);
 int vfs_umount(const char* mount_point);
@@ -122,21 +199,33 @@ int vfs_open(const char* path, uint32_t flags, uint32_t file_id);
 int vfs_close(uint32_t file_id);
 int vfs_read(uint32_t file_id, void* buffer, size_t size, size_t* bytes_read);
 int vfs_write(uint32_t file_id, const void* buffer, size_t size, size_t* bytes_written);
+int vfs_pread(uint32_t file_id, void* buffer, size_t size, uint64_t offset, size_t* bytes_read);
+int vfs_pwrite(uint32_t file_id, const void* buffer, size_t size, uint64_t offset, size_t* bytes_written);
+int vfs_readv(uint32_t file_id, const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_read);
+int vfs_writev(uint32_t file_id, const vfs_iovec_t* iov, uint32_t iov_count, size_t* bytes_written);
+int vfs_preadv(uint32_t file_id, const vfs_iovec_t* iov, uint32_t iov_count, uint64_t offset, size_t* bytes_read);
+int vfs_pwritev(uint32_t file_id, const vfs_iovec_t* iov, uint32_t iov_count, uint64_t offset, size_t* bytes_written);
+int vfs_pipe(uint32_t fds[2]);
+int vfs_splice(uint32_t in_fd, uint64_t* in_offset, uint32_t out_fd, uint64_t* out_offset,
+               size_t size, size_t* bytes_spliced);
+int vfs_sendfile(uint32_t out_fd, uint32_t in_fd, uint64_t* offset, size_t size, size_t* bytes_sent);
+int vfs_sendfile_ipc(void* destination, uint32_t in_fd, uint64_t* offset, size_t size, size_t* bytes_sent);
 int vfs_mkdir(const char* path, uint32_t permissions);
 int vfs_rmdir(const char* path);
 int vfs_unlink(const char* path);
-int vfs_stat(const char* path, void* stat_buf);
+int vfs_stat(const char* path, vfs_stat_t* stat_buf);
+int vfs_stat_bulk(uint32_t dir_fd, const char* const* names, uint32_t count, vfs_stat_t* stats);
 int vfs_getdents(uint32_t file_id, void* dirent_buffer, size_t size, size_t* bytes_read);
 int vfs_seek(uint32_t file_id, int64_t offset, int whence);
+int vfs_lock(uint32_t file_id, vfs_lock_type_t type, uint64_t start, uint64_t length, uint32_t flags);
+int vfs_fsync(uint32_t file_id);
+int vfs_sync(void);
 int vfs_register_filesystem(const char* name, const vfs_inode_operations_t* inode_ops,
                            const vfs_superblock_operations_t* sb_ops, uint32_t priority);
 vfs_superblock_t* vfs_get_superblock(const char* path);
+void vfs_exit_task(struct task_control_block* task);
+vfs_file_table_t* vfs_get_file_table(void);
+vfs_file_table_t* vfs_swap_file_table(vfs_file_table_t* table);
 
-typedef struct {
-    char name[VFS_MAX_FILENAME_LENGTH];
-    vfs_type_t type;
-    uint32_t size;
-    uint32_t inode_id;
-} vfs_dirent_t;
 
 #endif
\ No newline at end of file
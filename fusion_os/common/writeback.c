@@ -0,0 +1,264 @@
+/*
+ * writeback.c - deferred writeback implementation
+ */
+
+#include "writeback.h"
+#include "page_cache.h"
+#include "string.h"
+#include "logger.h"
+#include "../gecko/pmm.h"
+#include "../gecko/gecko.h"
+#include "../gecko/scheduler.h"
+
+/* most pages handed to writepages in one call */
+#define WRITEBACK_BATCH 64
+
+static list_t dirty_inodes;
+static writeback_stats_t writeback_stats;
+static uint64_t last_run = 0;
+static int flusher_id = -1;
+static int flusher_started = 0;
+static int flusher_parked = 0;
+static int writeback_initialized = 0;
+
+/*
+ * flusher task body, one pass per wakeup
+ */
+static void flusher_task(void) {
+    for (;;) {
+        writeback_run(gecko_get_uptime());
+        flusher_parked = 1;
+        scheduler_block_task(TASK_BLOCKED);
+    }
+}
+
+/*
+ * initialize writeback
+ */
+void writeback_init(void) {
+    if (writeback_initialized) {
+        return;
+    }
+
+    list_init(&dirty_inodes);
+    memset(&writeback_stats, 0, sizeof(writeback_stats));
+    writeback_initialized = 1;
+    LOG_INFO("writeback", "writeback initialized");
+}
+
+/*
+ * start the flusher once there is dirty data for it
+ */
+static void start_flusher(void) {
+    flusher_started = 1;
+    flusher_id = gecko_create_task(flusher_task, "flusher");
+    if (flusher_id < 0) {
+        LOG_WARNING("writeback", "no flusher task, dirty data is written on sync only");
+    }
+}
+
+/*
+ * dirty pages allowed at ratio percent of memory
+ */
+static uint32_t dirty_limit(uint32_t ratio) {
+    uint32_t total_pages = pmm_get_total_memory() / PAGE_SIZE;
+    if (total_pages == 0) {
+        total_pages = PAGE_CACHE_MAX_PAGES;
+    }
+    return total_pages / 100 * ratio;
+}
+
+static uint32_t dirty_pages(void) {
+    page_cache_stats_t stats;
+    page_cache_get_stats(&stats);
+    return stats.dirty;
+}
+
+/*
+ * inode got its first dirty page, oldest dirty inodes stay at the head
+ */
+void writeback_mark_inode(vfs_inode_t* inode) {
+    inode->dirtied_time = gecko_get_uptime();
+    inode->dirty_link.data = inode;
+    list_add_tail(&dirty_inodes, &inode->dirty_link);
+    writeback_stats.dirty_inodes++;
+
+    if (!flusher_started) {
+        start_flusher();
+    }
+}
+
+/*
+ * inode has no dirty pages left
+ */
+void writeback_clear_inode(vfs_inode_t* inode) {
+    list_remove(&dirty_inodes, &inode->dirty_link);
+    writeback_stats.dirty_inodes--;
+}
+
+/*
+ * hand a run of adjacent dirty pages to the filesystem
+ */
+static int write_run(vfs_inode_t* inode, cached_page_t** run, uint32_t count) {
+    void* data[WRITEBACK_BATCH];
+    for (uint32_t i = 0; i < count; i++) {
+        data[i] = run[i]->data;
+    }
+
+    writeback_stats.writes++;
+    if (inode->ops->writepages(inode, run[0]->index_link.key, data, count) != 0) {
+        LOG_ERROR("writeback", "inode %u: write of %u pages failed", inode->inode_id, count);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        page_cache_clear_dirty(run[i]);
+    }
+    writeback_stats.pages_written += count;
+    return 0;
+}
+
+/*
+ * write every dirty page of inode, in index order
+ */
+int writeback_inode(vfs_inode_t* inode) {
+    if (inode->dirty_pages == 0) {
+        return 0;
+    }
+    if (!inode->ops || !inode->ops->writepages) {
+        return -1;
+    }
+
+    cached_page_t* run[WRITEBACK_BATCH];
+    uint32_t count = 0;
+    int result = 0;
+
+    radix_node_t* node = radix_tree_first(&inode->pages);
+    while (node != NULL && result == 0) {
+        cached_page_t* page = radix_entry(node, cached_page_t, index_link);
+        node = radix_tree_next(node);
+
+        if (!(page->flags & PAGE_CACHE_DIRTY)) {
+            continue;
+        }
+
+        /* a gap or a full batch ends the run */
+        if (count > 0 && (page->index_link.key != run[0]->index_link.key + count || count == WRITEBACK_BATCH)) {
+            result = write_run(inode, run, count);
+            count = 0;
+        }
+        run[count++] = page;
+    }
+
+    if (result == 0 && count > 0) {
+        result = write_run(inode, run, count);
+    }
+
+    return result;
+}
+
+/*
+ * write out inodes from the head of the list, oldest first, while they
+ * are expired at now or dirty pages exceed limit
+ */
+static void write_oldest(uint64_t now, uint32_t limit) {
+    /* inodes that fail to write move to the tail, so visit each once */
+    uint32_t remaining = list_count(&dirty_inodes);
+
+    while (remaining-- > 0) {
+        list_node_t* link = list_get_head(&dirty_inodes);
+        if (link == NULL) {
+            break;
+        }
+
+        vfs_inode_t* inode = (vfs_inode_t*)link->data;
+        if (inode->dirtied_time + WRITEBACK_EXPIRE_MS > now && dirty_pages() <= limit) {
+            break;
+        }
+
+        if (writeback_inode(inode) != 0 && inode->dirty_pages > 0) {
+            list_remove(&dirty_inodes, link);
+            list_add_tail(&dirty_inodes, link);
+        }
+    }
+}
+
+/*
+ * write out every dirty inode of sb
+ */
+int writeback_superblock(vfs_superblock_t* sb) {
+    int result = 0;
+
+    if (!writeback_initialized) {
+        return 0;
+    }
+
+    list_node_t* link = list_get_head(&dirty_inodes);
+    while (link != NULL) {
+        list_node_t* next = link->next;
+        vfs_inode_t* inode = (vfs_inode_t*)link->data;
+        if (inode->sb == sb && writeback_inode(inode) != 0) {
+            result = -1;
+        }
+        link = next;
+    }
+
+    return result;
+}
+
+/*
+ * flusher pass, writes expired inodes and works the dirty count down to
+ * the background limit
+ */
+void writeback_run(uint64_t now) {
+    uint32_t background = dirty_limit(WRITEBACK_BACKGROUND_RATIO);
+    if (now - last_run < WRITEBACK_INTERVAL_MS && dirty_pages() <= background) {
+        return;
+    }
+
+    last_run = now;
+    writeback_stats.flusher_passes++;
+    write_oldest(now, background);
+}
+
+/*
+ * whether a flusher pass at now would write anything
+ */
+static int flusher_due(uint64_t now) {
+    list_node_t* head = list_get_head(&dirty_inodes);
+    if (head == NULL) {
+        return 0;
+    }
+    if (dirty_pages() > dirty_limit(WRITEBACK_BACKGROUND_RATIO)) {
+        return 1;
+    }
+
+    vfs_inode_t* oldest = (vfs_inode_t*)head->data;
+    return now - last_run >= WRITEBACK_INTERVAL_MS && oldest->dirtied_time + WRITEBACK_EXPIRE_MS <= now;
+}
+
+/*
+ * writers past the dirty limit write back until the flusher would stop,
+ * below it they wake the flusher when it has work
+ */
+void writeback_balance(void) {
+    if (dirty_pages() <= dirty_limit(WRITEBACK_DIRTY_RATIO)) {
+        if (flusher_parked && flusher_due(gecko_get_uptime())) {
+            flusher_parked = 0;
+            scheduler_unblock_task(flusher_id);
+        }
+        return;
+    }
+
+    writeback_stats.throttled++;
+    write_oldest(0, dirty_limit(WRITEBACK_BACKGROUND_RATIO));
+}
+
+/*
+ * get writeback statistics
+ */
+void writeback_get_stats(writeback_stats_t* stats) {
+    if (stats) {
+        *stats = writeback_stats;
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * writeback.h - deferred writeback of dirty file data for fusion os
+ *
+ * writes land in the page cache and reach the filesystem later. inodes
+ * with dirty pages sit on a list ordered by when they were first dirtied.
+ * a flusher task writes out inodes whose data is older than
+ * WRITEBACK_EXPIRE_MS, and more while dirty pages exceed the background
+ * ratio of memory. it starts with the first dirty inode and stays
+ * blocked until a writer finds it work, there is no timer to wake it.
+ * writers that push dirty pages past the dirty ratio write back
+ * themselves. runs of adjacent dirty pages go to the
+ * filesystem in one writepages call
+ */
+
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+#define WRITEBACK_INTERVAL_MS 5000      /* flusher pass period */
+#define WRITEBACK_EXPIRE_MS 30000       /* dirty data older than this is written */
+#define WRITEBACK_BACKGROUND_RATIO 10   /* percent of memory, the flusher writes beyond */
+#define WRITEBACK_DIRTY_RATIO 20        /* percent of memory, writers write beyond */
+
+/* writeback statistics */
+typedef struct {
+    uint64_t pages_written;
+    uint64_t writes;                    /* writepages calls */
+    uint64_t flusher_passes;
+    uint64_t throttled;                 /* writers that had to write back */
+    uint32_t dirty_inodes;
+} writeback_stats_t;
+
+/* writeback initialization, the flusher task starts on first use */
+void writeback_init(void);
+
+/* dirty inode list, maintained by the page cache */
+void writeback_mark_inode(vfs_inode_t* inode);
+void writeback_clear_inode(vfs_inode_t* inode);
+
+/* write out every dirty page of an inode or of a filesystem */
+int writeback_inode(vfs_inode_t* inode);
+int writeback_superblock(vfs_superblock_t* sb);
+
+/* one flusher pass at uptime now */
+void writeback_run(uint64_t now);
+
+/* called after pages were dirtied, writes back over the dirty limit */
+void writeback_balance(void);
+
+/* statistics */
+void writeback_get_stats(writeback_stats_t* stats);
+
+#endif /* WRITEBACK_H */
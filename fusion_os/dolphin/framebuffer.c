@@ -8,6 +8,7 @@
 #include "framebuffer.h"
 #include "../common/logger.h"
 #include "../common/string.h"
+#include "../gecko/pmm.h"
 #include <stdlib.h>
 
 /* global framebuffer configuration */
@@ -208,7 +209,7 @@ void framebuffer_clear(uint32_t color) {
     
     /* clear entire framebuffer */
     size_t total_size = current_config.pitch * current_config.height;
-    memset(current_config.lfb_address, 0, total_size);
+    memset_stream(current_config.lfb_address, 0, total_size);
     
     /* fill with color if not black */
     if (color != 0) {
@@ -327,6 +328,14 @@ int framebuffer_copy_to_buffer(void* source, void* destination, size_t size) {
         return -1;
     }
     
-    memcpy(destination, source, size);
+    /* stream whole pages when both sides are page aligned */
+    size_t offset = 0;
+    if ((((uintptr_t)source | (uintptr_t)destination) & (PAGE_SIZE - 1)) == 0) {
+        for (; offset + PAGE_SIZE <= size; offset += PAGE_SIZE) {
+            copy_page_nt((uint8_t*)destination + offset, (uint8_t*)source + offset);
+        }
+    }
+    
+    memcpy((uint8_t*)destination + offset, (uint8_t*)source + offset, size - offset);
     return 0;
 }
\ No newline at end of file
@@ -2,25 +2,12 @@
 #include "../common/vfs.h"
 #include "../common/logger.h"
 #include "../common/string.h"
+#include "../common/format.h"
 #include "../gecko/scheduler.h"
 #include "../gecko/gecko.h"
 #include <stdarg.h>
 
 static int fs_driver_initialized = 0;
-static char* memory_filesystem = NULL;
-static size_t memory_filesystem_size = 0x100000;
-
-typedef struct {
-    char path[FS_MAX_PATH_LENGTH];
-    uint32_t type;
-    uint32_t size;
-    uint32_t permissions;
-    uint32_t created;
-} fs_file_entry_t;
-
-static fs_file_entry_t* file_entries = NULL;
-static size_t max_entries = 1024;
-static size_t entry_count = 0;
 
 int fs_driver_init(void) {
     if (fs_driver_initialized) {
@@ -34,55 +21,18 @@ int fs_driver_init(void) {
         return -1;
     }
     
-    memory_filesystem = gecko_alloc_kernel_memory(memory_filesystem_size);
-    if (!memory_filesystem) {
-        LOG_ERROR("fs_driver", "failed to allocate memory for filesystem");
+    /* files live in a tmpfs on the root until a disk is mounted over it */
+    if (vfs_mount("tmpfs", "/", "tmpfs") != 0) {
+        LOG_ERROR("fs_driver", "failed to mount root tmpfs");
         return -1;
     }
     
-    memset(memory_filesystem, 0, memory_filesystem_size);
-    
-    file_entries = gecko_alloc_kernel_memory(max_entries * sizeof(fs_file_entry_t));
-    if (!file_entries) {
-        LOG_ERROR("fs_driver", "failed to allocate file entry table");
-        gecko_free_kernel_memory(memory_filesystem);
-        return -1;
-    }
-    
-    memset(file_entries, 0, max_entries * sizeof(fs_file_entry_t));
-    entry_count = 0;
-    
     fs_driver_initialized = 1;
     LOG_INFO("fs_driver", "file system driver initialized successfully");
     
     return 0;
 }
 
-static int add_file_entry(const char* path, uint32_t type, uint32_t size, uint32_t permissions) {
-    if (entry_count >= max_entries) {
-        return -1;
-    }
-    
-    fs_file_entry_t* entry = &file_entries[entry_count++];
-    strncpy(entry->path, path, FS_MAX_PATH_LENGTH - 1);
-    entry->path[FS_MAX_PATH_LENGTH - 1] = '\0';
-    entry->type = type;
-    entry->size = size;
-    entry->permissions = permissions;
-    entry->created = 0;
-    
-    return 0;
-}
-
-static fs_file_entry_t* find_file_entry(const char* path) {
-    for (size_t i = 0; i < entry_count; i++) {
-        if (strcmp(file_entries[i].path, path) == 0) {
-            return &file_entries[i];
-        }
-    }
-    return NULL;
-}
-
 int fs_driver_process(fs_request_t* request, fs_response_t* response) {
     if (!request || !response) {
         return -1;
@@ -97,11 +47,6 @@ int fs_driver_process(fs_request_t* request, fs_response_t* response) {
             if (file_id >= 0) {
                 response->status = 0;
                 response->file_id = file_id;
-                
-                fs_file_entry_t* entry = find_file_entry(request->path);
-                if (!entry) {
-                    add_file_entry(request->path, 0, 0, request->permissions);
-                }
             }
             break;
         }
@@ -123,7 +68,9 @@ int fs_driver_process(fs_request_t* request, fs_response_t* response) {
             response->bytes_read = bytes_read;
             if (result == 0 && bytes_read > 0) {
                 memcpy(response->result_buffer, request->buffer, bytes_read);
-                response->result_buffer[bytes_read] = '\0';
+                if (bytes_read < sizeof(response->result_buffer)) {
+                    response->result_buffer[bytes_read] = '\0';
+                }
             }
             break;
         }
@@ -134,11 +81,6 @@ int fs_driver_process(fs_request_t* request, fs_response_t* response) {
                                   request->buffer_size, &bytes_written);
             response->status = result;
             response->bytes_written = bytes_written;
-            
-            fs_file_entry_t* entry = find_file_entry(request->path);
-            if (entry && result == 0) {
-                entry->size += bytes_written;
-            }
             break;
         }
         
@@ -149,11 +91,7 @@ int fs_driver_process(fs_request_t* request, fs_response_t* response) {
         }
         
         case FS_OP_MKDIR: {
-            int result = vfs_mkdir(request->path, request->permissions);
-            response->status = result;
-            if (result == 0) {
-                add_file_entry(request->path, 1, 0, request->permissions);
-            }
+            response->status = vfs_mkdir(request->path, request->permissions);
             break;
         }
         
@@ -212,7 +150,7 @@ int fs_create_file(const char* path, const char* content, size_t content_size) {
         return -1;
     }
     
-    int file_id = vfs_open(path, 0, 0);
+    int file_id = vfs_open(path, VFS_O_WRONLY | VFS_O_CREAT | VFS_O_TRUNC, 0);
     if (file_id < 0) {
         return -1;
     }
@@ -224,8 +162,6 @@ int fs_create_file(const char* path, const char* content, size_t content_size) {
     
     vfs_close(file_id);
     
-    add_file_entry(path, 0, content_size, 0644);
-    
     return 0;
 }
 
@@ -268,30 +204,47 @@ int fs_list_directory(const char* path, char* output, size_t output_size, size_t
     
     *bytes_written = 0;
     
-    char temp_buffer[256];
-    int written = snprintf(temp_buffer, sizeof(temp_buffer), "Directory listing for %s:\n", path);
-    
-    if (written >= (int)output_size) {
+    int dir_fd = vfs_open(path, VFS_O_RDONLY, 0);
+    if (dir_fd < 0) {
         return -1;
     }
     
-    memcpy(output, temp_buffer, written);
-    *bytes_written = written;
-    
-    for (size_t i = 0; i < entry_count; i++) {
-        char* slash_pos = strrchr(file_entries[i].path, '/');
-        const char* name = slash_pos ? (slash_pos + 1) : file_entries[i].path;
-        
-        int line_written = snprintf(temp_buffer, sizeof(temp_buffer), "  %s\n", name);
-        
-        if (*bytes_written + line_written >= output_size) {
-            break;
+    format_buffer_t fb;
+    format_init(&fb, output, output_size);
+    format_appendf(&fb, "Directory listing for %s:\n", path);
+    
+    /* entries come in batches, the directory position resumes the listing */
+    vfs_dirent_t entries[FS_LIST_BATCH];
+    size_t bytes_read = 0;
+    int full = format_truncated(&fb);
+    
+    while (!full && vfs_getdents(dir_fd, entries, sizeof(entries), &bytes_read) == 0 && bytes_read > 0) {
+        size_t count = bytes_read / sizeof(vfs_dirent_t);
+        for (size_t i = 0; i < count; i++) {
+            /* only keep whole lines */
+            size_t line_start = fb.used;
+            format_append_bytes(&fb, "  ", 2);
+            format_append_string(&fb, entries[i].name);
+            if (entries[i].type == VFS_TYPE_DIRECTORY) {
+                format_append_char(&fb, '/');
+            }
+            format_append_char(&fb, '\n');
+            
+            if (format_truncated(&fb)) {
+                format_rewind(&fb, line_start);
+                full = 1;
+                break;
+            }
         }
-        
-        memcpy(output + *bytes_written, temp_buffer, line_written);
-        *bytes_written += line_written;
     }
     
+    vfs_close(dir_fd);
+    
+    if (format_truncated(&fb)) {
+        return -1;
+    }
+    
+    *bytes_written = fb.used;
     return 0;
 }
 
@@ -300,12 +253,7 @@ int fs_mkdir(const char* path) {
         return -1;
     }
     
-    int result = vfs_mkdir(path, 0755);
-    if (result == 0) {
-        add_file_entry(path, 1, 0, 0755);
-    }
-    
-    return result;
+    return vfs_mkdir(path, 0755);
 }
 
 int fs_remove_file(const char* path) {
@@ -313,17 +261,7 @@ int fs_remove_file(const char* path) {
         return -1;
     }
     
-    vfs_unlink(path);
-    
-    for (size_t i = 0; i < entry_count; i++) {
-        if (strcmp(file_entries[i].path, path) == 0) {
-            file_entries[i] = file_entries[entry_count - 1];
-            entry_count--;
-            break;
-        }
-    }
-    
-    return 0;
+    return vfs_unlink(path);
 }
 
 int fs_remove_directory(const char* path) {
@@ -331,18 +269,7 @@ int fs_remove_directory(const char* path) {
         return -1;
     }
     
-    int result = vfs_rmdir(path);
-    if (result == 0) {
-        for (size_t i = 0; i < entry_count; i++) {
-            if (strcmp(file_entries[i].path, path) == 0) {
-                file_entries[i] = file_entries[entry_count - 1];
-                entry_count--;
-                break;
-            }
-        }
-    }
-    
-    return result;
+    return vfs_rmdir(path);
 }
 
 int fs_get_file_info(const char* path, uint32_t* size, uint32_t* type, uint32_t* permissions) {
@@ -350,19 +277,19 @@ int fs_get_file_info(const char* path, uint32_t* size, uint32_t* type, uint32_t*
         return -1;
     }
     
-    fs_file_entry_t* entry = find_file_entry(path);
-    if (!entry) {
+    vfs_stat_t stat;
+    if (vfs_stat(path, &stat) != 0) {
         return -1;
     }
     
     if (size) {
-        *size = entry->size;
+        *size = stat.size;
     }
     if (type) {
-        *type = entry->type;
+        *type = stat.type;
     }
     if (permissions) {
-        *permissions = entry->permissions;
+        *permissions = stat.permissions;
     }
     
     return 0;
@@ -8,6 +8,7 @@
 #define FS_MAX_BUFFER_SIZE 4096
 #define FS_MAX_PATH_LENGTH 256
 #define FS_MAX_FILENAME_LENGTH 64
+#define FS_LIST_BATCH 16              /* directory entries read per getdents call */
 
 typedef enum {
     FS_OP_OPEN = 1,
@@ -0,0 +1,653 @@
+/*
+ * fsbench.c - in-kernel filesystem benchmark implementation
+ *
+ * every operation is timed on its own with the tsc, which is calibrated
+ * against pit channel 2 before the first run. a workload keeps all of its
+ * samples, so percentiles are exact. result lines look like
+ *
+ *   fsbench vfs seq-read bs=4096 ops=256 ops/s=... MiB/s=... p50=... p90=... p99=... max=... ns
+ *
+ * and latencies stay in cycles when calibration failed
+ */
+
+#include "fsbench.h"
+#include "fs_driver.h"
+#include "../common/vfs.h"
+#include "../common/ext2.h"
+#include "../common/page_cache.h"
+#include "../common/readahead.h"
+#include "../common/writeback.h"
+#include "../common/string.h"
+#include "../common/logger.h"
+#include "../gecko/gecko.h"
+#include "../gecko/serial.h"
+#include "../gecko/port_io.h"
+
+/* pit channel 2 times the calibration, its gate is on port 0x61 */
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_GATE 0x61
+#define PIT_OUTPUT 0x20
+#define CALIBRATION_MS 10
+#define CALIBRATION_SPINS 10000000      /* give up when no pit answers */
+
+#define DATA_PATH FSBENCH_ROOT "/data"
+#define DEEP_PATH FSBENCH_ROOT "/deep"
+#define EXT2_DEVICE "fsbench-ext2"
+#define EXT2_PATH FSBENCH_ROOT "/ext2"
+#define EXT2_DATA_PATH EXT2_PATH "/data"
+
+/* data workload modes */
+#define MODE_WRITE  0x1
+#define MODE_RANDOM 0x2
+
+/* samples and totals of one workload */
+typedef struct {
+    const char* via;
+    const char* name;
+    uint32_t block_size;                /* 0 for metadata workloads */
+    uint32_t count;
+    uint64_t cycles;
+    uint64_t bytes;
+} run_t;
+
+static const uint32_t block_sizes[] = { 512, 4096, FSBENCH_MAX_BLOCK_SIZE };
+static const char* const mode_names[] = { "seq-read", "seq-write", "rand-read", "rand-write" };
+
+static uint64_t cycles_per_us;
+static uint64_t* samples;
+static uint8_t* block;
+static uint64_t random_state;
+static uint32_t failures;
+static fsbench_print_t printer;
+
+/* file of the vfs data workloads and the name they report under */
+static const char* data_path = DATA_PATH;
+static const char* data_via = "vfs";
+
+/* requests are too large for the stack */
+static fs_request_t request;
+static fs_response_t response;
+
+static inline uint64_t read_cycles(void) {
+    uint32_t low, high;
+    __asm__ volatile ("lfence; rdtsc" : "=a"(low), "=d"(high) :: "memory");
+    return ((uint64_t)high << 32) | low;
+}
+
+/*
+ * tsc cycles per microsecond, 0 when the pit never counted down
+ */
+static uint64_t calibrate_cycles(void) {
+    uint16_t count = PIT_FREQUENCY / 1000 * CALIBRATION_MS;
+
+    /* gate channel 2 on with the speaker off, mode 0 raises the output at zero */
+    outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xb0);
+    outb(PIT_CHANNEL2, count & 0xff);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    uint64_t start = read_cycles();
+    uint32_t spins = 0;
+    while (!(inb(PIT_GATE) & PIT_OUTPUT)) {
+        if (++spins > CALIBRATION_SPINS) {
+            return 0;
+        }
+    }
+
+    return (read_cycles() - start) / (CALIBRATION_MS * 1000);
+}
+
+static uint64_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+/*
+ * format a line to the serial port and the printer
+ */
+static void emit(const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    serial_write_string(line);
+    if (printer) {
+        printer(line);
+    }
+}
+
+static void begin(run_t* run, const char* via, const char* name, uint32_t block_size) {
+    memset(run, 0, sizeof(run_t));
+    run->via = via;
+    run->name = name;
+    run->block_size = block_size;
+}
+
+static inline void record(run_t* run, uint64_t cycles, uint64_t bytes) {
+    if (run->count < FSBENCH_MAX_OPS) {
+        samples[run->count++] = cycles;
+    }
+    run->cycles += cycles;
+    run->bytes += bytes;
+}
+
+/*
+ * shell sort, the samples are sorted once per workload
+ */
+static void sort_samples(uint32_t count) {
+    static const uint32_t gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+    for (size_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+        uint32_t gap = gaps[g];
+        for (uint32_t i = gap; i < count; i++) {
+            uint64_t value = samples[i];
+            uint32_t j = i;
+            while (j >= gap && samples[j - gap] > value) {
+                samples[j] = samples[j - gap];
+                j -= gap;
+            }
+            samples[j] = value;
+        }
+    }
+}
+
+static uint64_t to_time(uint64_t cycles) {
+    return cycles_per_us ? cycles * 1000 / cycles_per_us : cycles;
+}
+
+/*
+ * print the result line of run, result says whether every operation succeeded
+ */
+static int finish(run_t* run, int result) {
+    if (result != 0 || run->count == 0) {
+        emit("fsbench %s %s failed after %u ops\n", run->via, run->name, run->count);
+        failures++;
+        return -1;
+    }
+
+    sort_samples(run->count);
+    uint64_t p50 = to_time(samples[run->count * 50 / 100]);
+    uint64_t p90 = to_time(samples[run->count * 90 / 100]);
+    uint64_t p99 = to_time(samples[run->count * 99 / 100]);
+    uint64_t max = to_time(samples[run->count - 1]);
+    const char* unit = cycles_per_us ? "ns" : "cyc";
+
+    char size[24] = "";
+    char rate[64] = "";
+    if (run->block_size) {
+        snprintf(size, sizeof(size), " bs=%u", run->block_size);
+    }
+    if (cycles_per_us && run->cycles) {
+        uint64_t ops_per_second = (uint64_t)run->count * cycles_per_us * 1000000 / run->cycles;
+        uint64_t tenths = run->bytes * 10 * cycles_per_us * 1000000 / run->cycles >> 20;
+        if (run->bytes) {
+            snprintf(rate, sizeof(rate), " ops/s=%llu MiB/s=%llu.%llu",
+                     ops_per_second, tenths / 10, tenths % 10);
+        } else {
+            snprintf(rate, sizeof(rate), " ops/s=%llu", ops_per_second);
+        }
+    }
+
+    emit("fsbench %s %s%s ops=%u%s p50=%llu p90=%llu p99=%llu max=%llu %s\n",
+         run->via, run->name, size, run->count, rate, p50, p90, p99, max, unit);
+    return 0;
+}
+
+/*
+ * block index of operation i. sequential runs walk the file, random
+ * runs pick any block
+ */
+static uint32_t block_index(uint32_t i, uint32_t blocks, uint32_t mode) {
+    return (mode & MODE_RANDOM) ? (uint32_t)(next_random() % blocks) : i % blocks;
+}
+
+static uint32_t data_ops(uint32_t block_size) {
+    uint32_t blocks = FSBENCH_FILE_SIZE / block_size;
+    return blocks < FSBENCH_MAX_OPS ? blocks : FSBENCH_MAX_OPS;
+}
+
+/*
+ * positioned reads or writes through the vfs calls
+ */
+static int vfs_data(uint32_t block_size, uint32_t mode) {
+    run_t run;
+    begin(&run, data_via, mode_names[mode], block_size);
+
+    int fd = vfs_open(data_path, VFS_O_RDWR | VFS_O_CREAT, 0);
+    if (fd < 0) {
+        return finish(&run, -1);
+    }
+
+    uint32_t blocks = FSBENCH_FILE_SIZE / block_size;
+    uint32_t ops = data_ops(block_size);
+    int result = 0;
+
+    for (uint32_t i = 0; i < ops; i++) {
+        uint64_t offset = (uint64_t)block_index(i, blocks, mode) * block_size;
+        size_t done = 0;
+
+        uint64_t start = read_cycles();
+        int status = (mode & MODE_WRITE) ? vfs_pwrite(fd, block, block_size, offset, &done)
+                                         : vfs_pread(fd, block, block_size, offset, &done);
+        uint64_t cycles = read_cycles() - start;
+
+        if (status != 0 || done != block_size) {
+            result = -1;
+            break;
+        }
+        record(&run, cycles, done);
+    }
+
+    vfs_close(fd);
+    return finish(&run, result);
+}
+
+static int driver_call(fs_operation_t operation) {
+    request.operation = operation;
+    return fs_driver_process(&request, &response) == 0 ? response.status : -1;
+}
+
+/*
+ * the same pattern as fs_driver requests, a seek and a read or write per
+ * operation since the driver has no positioned i/o
+ */
+static int driver_data(uint32_t block_size, uint32_t mode) {
+    run_t run;
+    begin(&run, "driver", mode_names[mode], block_size);
+
+    memset(&request, 0, sizeof(request));
+    strcpy(request.path, DATA_PATH);
+    request.flags = VFS_O_RDWR | VFS_O_CREAT;
+    if (driver_call(FS_OP_OPEN) != 0) {
+        return finish(&run, -1);
+    }
+
+    uint32_t file_id = response.file_id;
+    uint32_t blocks = FSBENCH_FILE_SIZE / block_size;
+    uint32_t ops = data_ops(block_size);
+    int result = 0;
+
+    memcpy(request.buffer, block, block_size);
+    request.file_id = file_id;
+    request.whence = SEEK_SET;
+
+    for (uint32_t i = 0; i < ops; i++) {
+        request.offset = block_index(i, blocks, mode) * block_size;
+
+        uint64_t start = read_cycles();
+        int status = driver_call(FS_OP_SEEK);
+        if (status == 0) {
+            request.buffer_size = block_size;
+            status = driver_call((mode & MODE_WRITE) ? FS_OP_WRITE : FS_OP_READ);
+        }
+        uint64_t cycles = read_cycles() - start;
+
+        size_t done = (mode & MODE_WRITE) ? response.bytes_written : response.bytes_read;
+        if (status != 0 || done != block_size) {
+            result = -1;
+            break;
+        }
+        record(&run, cycles, done);
+    }
+
+    request.file_id = file_id;
+    driver_call(FS_OP_CLOSE);
+    return finish(&run, result);
+}
+
+/*
+ * write the whole data file untimed, for random runs without the
+ * sequential write before them
+ */
+static int fill_data(void) {
+    int fd = vfs_open(DATA_PATH, VFS_O_WRONLY | VFS_O_CREAT, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int result = 0;
+    for (uint32_t offset = 0; offset < FSBENCH_FILE_SIZE && result == 0; offset += FSBENCH_MAX_BLOCK_SIZE) {
+        size_t done = 0;
+        result = vfs_pwrite(fd, block, FSBENCH_MAX_BLOCK_SIZE, offset, &done);
+    }
+
+    vfs_close(fd);
+    return result;
+}
+
+/*
+ * the selected modes at every block size through both interfaces. the
+ * sequential write runs first and fills the file the others work on
+ */
+static void run_data(const char* only) {
+    static const uint32_t seq_modes[] = { MODE_WRITE, 0 };
+    static const uint32_t rand_modes[] = { MODE_RANDOM | MODE_WRITE, MODE_RANDOM };
+    int want_seq = !only || strcmp(only, "seq") == 0;
+    int want_rand = !only || strcmp(only, "rand") == 0;
+    if (!want_seq && !want_rand) {
+        return;
+    }
+
+    for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+        uint32_t block_size = block_sizes[b];
+
+        for (int driver = 0; driver < 2; driver++) {
+            /* requests carry at most one buffer of data */
+            if (driver && block_size > FS_MAX_BUFFER_SIZE) {
+                continue;
+            }
+
+            int (*workload)(uint32_t, uint32_t) = driver ? driver_data : vfs_data;
+            if (want_seq) {
+                workload(block_size, seq_modes[0]);
+                workload(block_size, seq_modes[1]);
+            } else if (fill_data() != 0) {
+                failures++;
+            }
+            if (want_rand) {
+                workload(block_size, rand_modes[0]);
+                workload(block_size, rand_modes[1]);
+            }
+            vfs_unlink(DATA_PATH);
+        }
+    }
+}
+
+/*
+ * the ext2 sequential read, cold so the page cache reads the file ahead
+ * of it. the readahead line says how much of the file came in that way
+ */
+static void ext2_cold_read(uint32_t block_size) {
+    page_cache_stats_t cache_before, cache_after;
+    readahead_stats_t ra_before, ra_after;
+    page_cache_get_stats(&cache_before);
+    readahead_get_stats(&ra_before);
+
+    vfs_data(block_size, 0);
+
+    page_cache_get_stats(&cache_after);
+    readahead_get_stats(&ra_after);
+    emit("fsbench ext2 readahead bs=%u misses=%llu pages=%llu hits=%llu windows=%llu async=%llu\n",
+         block_size,
+         cache_after.misses - cache_before.misses,
+         cache_after.readahead_pages - cache_before.readahead_pages,
+         cache_after.readahead_hits - cache_before.readahead_hits,
+         ra_after.windows - ra_before.windows,
+         ra_after.async_windows - ra_before.async_windows);
+}
+
+/*
+ * sequential writes on ext2, each followed by fsync so its page goes
+ * through writeback to the filesystem before the next. the writeback line
+ * counts the pages written and the writepages calls
+ */
+static int ext2_fsync(uint32_t block_size) {
+    run_t run;
+    begin(&run, "ext2", "fsync", block_size);
+
+    int fd = vfs_open(EXT2_DATA_PATH, VFS_O_RDWR | VFS_O_CREAT, 0);
+    if (fd < 0) {
+        return finish(&run, -1);
+    }
+
+    /* pages left dirty by the random writes go out untimed */
+    writeback_stats_t before, after;
+    vfs_fsync(fd);
+    writeback_get_stats(&before);
+
+    uint32_t ops = data_ops(block_size);
+    int result = 0;
+
+    for (uint32_t i = 0; i < ops; i++) {
+        size_t done = 0;
+
+        uint64_t start = read_cycles();
+        int status = vfs_pwrite(fd, block, block_size, (uint64_t)i * block_size, &done);
+        if (status == 0) {
+            status = vfs_fsync(fd);
+        }
+        uint64_t cycles = read_cycles() - start;
+
+        if (status != 0 || done != block_size) {
+            result = -1;
+            break;
+        }
+        record(&run, cycles, done);
+    }
+
+    vfs_close(fd);
+    writeback_get_stats(&after);
+    emit("fsbench ext2 writeback bs=%u pages=%llu writes=%llu\n", block_size,
+         after.pages_written - before.pages_written, after.writes - before.writes);
+    return finish(&run, result);
+}
+
+/*
+ * the vfs data workloads on an ext2 image mounted under FSBENCH_ROOT,
+ * where file data goes through the page cache. the filesystem is mounted
+ * again after each sequential write, which drops its cached pages
+ */
+static void run_ext2(void) {
+    void* image = gecko_alloc_kernel_memory(FSBENCH_EXT2_IMAGE_SIZE);
+    if (!image || ext2_mount_image(EXT2_DEVICE, image, FSBENCH_EXT2_IMAGE_SIZE) != 0) {
+        emit("fsbench ext2 no image\n");
+        failures++;
+        if (image) {
+            gecko_free_kernel_memory(image);
+        }
+        return;
+    }
+
+    vfs_stat_t stat;
+    int mounted = (vfs_mkdir(EXT2_PATH, 0755) == 0 || vfs_stat(EXT2_PATH, &stat) == 0) &&
+                  vfs_mount(EXT2_DEVICE, EXT2_PATH, "ext2") == 0;
+    data_path = EXT2_DATA_PATH;
+    data_via = "ext2";
+    for (size_t b = 0; mounted && b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+        vfs_data(block_sizes[b], MODE_WRITE);
+        mounted = vfs_umount(EXT2_PATH) == 0 && vfs_mount(EXT2_DEVICE, EXT2_PATH, "ext2") == 0;
+        if (!mounted) {
+            break;
+        }
+        ext2_cold_read(block_sizes[b]);
+        vfs_data(block_sizes[b], MODE_RANDOM | MODE_WRITE);
+        vfs_data(block_sizes[b], MODE_RANDOM);
+        ext2_fsync(block_sizes[b]);
+        vfs_unlink(EXT2_DATA_PATH);
+    }
+    data_path = DATA_PATH;
+    data_via = "vfs";
+
+    if (!mounted || vfs_umount(EXT2_PATH) != 0) {
+        emit("fsbench ext2 mount failed\n");
+        failures++;
+    }
+
+    vfs_rmdir(EXT2_PATH);
+    if (ext2_umount(EXT2_DEVICE) == 0) {
+        gecko_free_kernel_memory(image);
+    }
+}
+
+static void meta_path(char* path, uint32_t i) {
+    snprintf(path, VFS_MAX_PATH_LENGTH, FSBENCH_ROOT "/m%u", i);
+}
+
+/*
+ * create, stat and unlink storm over FSBENCH_META_FILES empty files
+ */
+static void run_meta(int driver) {
+    const char* via = driver ? "driver" : "vfs";
+    char path[VFS_MAX_PATH_LENGTH];
+    run_t run;
+    int result = 0;
+
+    begin(&run, via, "create", 0);
+    for (uint32_t i = 0; i < FSBENCH_META_FILES && result == 0; i++) {
+        meta_path(path, i);
+        uint64_t start = read_cycles();
+        if (driver) {
+            result = fs_create_file(path, NULL, 0);
+        } else {
+            int fd = vfs_open(path, VFS_O_WRONLY | VFS_O_CREAT | VFS_O_EXCL, 0);
+            result = fd < 0 ? -1 : vfs_close(fd);
+        }
+        record(&run, read_cycles() - start, 0);
+    }
+    finish(&run, result);
+
+    begin(&run, via, "stat", 0);
+    result = 0;
+    for (uint32_t i = 0; i < FSBENCH_META_FILES && result == 0; i++) {
+        meta_path(path, i);
+        vfs_stat_t stat;
+        uint32_t size;
+        uint64_t start = read_cycles();
+        result = driver ? fs_get_file_info(path, &size, NULL, NULL) : vfs_stat(path, &stat);
+        record(&run, read_cycles() - start, 0);
+    }
+    finish(&run, result);
+
+    begin(&run, via, "unlink", 0);
+    result = 0;
+    for (uint32_t i = 0; i < FSBENCH_META_FILES && result == 0; i++) {
+        meta_path(path, i);
+        uint64_t start = read_cycles();
+        result = driver ? fs_remove_file(path) : vfs_unlink(path);
+        record(&run, read_cycles() - start, 0);
+    }
+    finish(&run, result);
+
+    /* leave nothing behind for the next storm */
+    for (uint32_t i = 0; i < FSBENCH_META_FILES; i++) {
+        meta_path(path, i);
+        vfs_unlink(path);
+    }
+}
+
+/*
+ * repeated stat of a file FSBENCH_PATH_DEPTH directories down
+ */
+static void run_lookup(void) {
+    char path[VFS_MAX_PATH_LENGTH];
+    size_t length = strlen(DEEP_PATH);
+    int result = 0;
+
+    strcpy(path, DEEP_PATH);
+    if (vfs_mkdir(path, 0755) != 0) {
+        result = -1;
+    }
+    for (uint32_t depth = 0; depth < FSBENCH_PATH_DEPTH && result == 0; depth++) {
+        length += snprintf(path + length, sizeof(path) - length, "/d%02u", depth);
+        result = vfs_mkdir(path, 0755);
+    }
+    size_t directories_end = length;
+    strcpy(path + length, "/leaf");
+    if (result == 0) {
+        result = fs_create_file(path, "leaf", 4);
+    }
+
+    for (int driver = 0; driver < 2; driver++) {
+        run_t run;
+        begin(&run, driver ? "driver" : "vfs", "deep-lookup", 0);
+        for (uint32_t i = 0; i < FSBENCH_MAX_OPS && result == 0; i++) {
+            vfs_stat_t stat;
+            uint32_t size;
+            uint64_t start = read_cycles();
+            result = driver ? fs_get_file_info(path, &size, NULL, NULL) : vfs_stat(path, &stat);
+            record(&run, read_cycles() - start, 0);
+        }
+        finish(&run, result);
+    }
+
+    /* remove the leaf, then the directories from the bottom up */
+    vfs_unlink(path);
+    path[directories_end] = '\0';
+    while (strcmp(path, FSBENCH_ROOT) != 0) {
+        vfs_rmdir(path);
+        *strrchr(path, '/') = '\0';
+    }
+}
+
+/*
+ * run the selected workloads
+ */
+int fsbench_run(const char* only, fsbench_print_t print) {
+    if (fs_driver_init() != 0) {
+        return -1;
+    }
+
+    /* the root may be left over from an earlier run */
+    vfs_stat_t root;
+    if (vfs_mkdir(FSBENCH_ROOT, 0755) != 0 &&
+        (vfs_stat(FSBENCH_ROOT, &root) != 0 || root.type != VFS_TYPE_DIRECTORY)) {
+        LOG_ERROR("fsbench", "cannot create %s", FSBENCH_ROOT);
+        return -1;
+    }
+
+    samples = gecko_alloc_kernel_memory(FSBENCH_MAX_OPS * sizeof(uint64_t));
+    block = gecko_alloc_kernel_memory(FSBENCH_MAX_BLOCK_SIZE);
+    if (!samples || !block) {
+        if (samples) {
+            gecko_free_kernel_memory(samples);
+        }
+        if (block) {
+            gecko_free_kernel_memory(block);
+        }
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < FSBENCH_MAX_BLOCK_SIZE; i++) {
+        block[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    if (!cycles_per_us) {
+        cycles_per_us = calibrate_cycles();
+    }
+    printer = print;
+    random_state = 0x9e3779b97f4a7c15ULL;
+    failures = 0;
+
+    emit("fsbench start tsc=%llu MHz file=%u max_ops=%u\n",
+         cycles_per_us, FSBENCH_FILE_SIZE, FSBENCH_MAX_OPS);
+
+    run_data(only);
+    if (!only || strcmp(only, "meta") == 0) {
+        run_meta(0);
+        run_meta(1);
+    }
+    if (!only || strcmp(only, "lookup") == 0) {
+        run_lookup();
+    }
+    if (!only || strcmp(only, "ext2") == 0) {
+        run_ext2();
+    }
+
+    emit("fsbench done failures=%u\n", failures);
+
+    gecko_free_kernel_memory(samples);
+    gecko_free_kernel_memory(block);
+    samples = NULL;
+    block = NULL;
+    printer = NULL;
+    return failures ? -1 : 0;
+}
+
+/*
+ * run everything at boot, then exit qemu or halt
+ */
+void fsbench_boot(void) {
+    serial_init();
+    int result = fsbench_run(NULL, NULL);
+
+    /* qemu exits with status (value << 1) | 1 */
+    outb(FSBENCH_QEMU_EXIT_PORT, result == 0 ? 0 : 1);
+    for (;;) {
+        __asm__ volatile ("hlt");
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * fsbench.h - in-kernel filesystem benchmark for fusion os
+ *
+ * runs fixed workloads through the vfs calls and through the fs_driver
+ * request interface: sequential and random reads and writes at several
+ * block sizes, a create, stat and unlink storm over many files and
+ * lookups of a deep path. the data workloads run again on an ext2 image
+ * in memory, through the page cache, with the sequential read cold after
+ * a remount so it shows readahead, and a write and fsync workload there
+ * shows writeback. every workload reports throughput and latency
+ * percentiles as one line, on the serial port and to an optional printer.
+ * build with make fsbench=1 to run the whole suite at boot
+ */
+
+#ifndef FSBENCH_H
+#define FSBENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FSBENCH_ROOT "/fsbench"
+#define FSBENCH_FILE_SIZE (1024 * 1024)  /* data file of the read and write workloads */
+#define FSBENCH_MAX_BLOCK_SIZE 65536
+#define FSBENCH_MAX_OPS 4096             /* timed operations per workload */
+#define FSBENCH_META_FILES 1024          /* files of the metadata storm */
+#define FSBENCH_PATH_DEPTH 32            /* directories above the deep lookup target */
+#define FSBENCH_EXT2_IMAGE_SIZE (8 * 1024 * 1024)  /* memory image of the ext2 workloads */
+#define FSBENCH_QEMU_EXIT_PORT 0xf4      /* isa-debug-exit, ends qemu after a boot run */
+
+/* receives every result line */
+typedef void (*fsbench_print_t)(const char* text);
+
+/* run the workloads whose group is named by only, all of them when only
+ * is NULL. groups are seq, rand, meta, lookup and ext2. returns -1 if any
+ * workload failed */
+int fsbench_run(const char* only, fsbench_print_t print);
+
+/* boot mode, runs everything and stops the machine */
+void fsbench_boot(void);
+
+#endif /* FSBENCH_H */
@@ -2,8 +2,10 @@
 #include "framebuffer.h"
 #include "proggy_clean_font.h"
 #include "fs_driver.h"
+#include "fsbench.h"
 #include "../gecko/pmm.h"
 #include "../gecko/smp.h"
+#include "../gecko/serial.h"
 #include "../common/string.h"
 #include "../common/logger.h"
 #include "../gecko/gecko.h"
@@ -25,12 +27,22 @@ static int command_buffer_pos = 0;
 static terminal_command_t registered_commands[MAX_COMMANDS];
 static int command_count = 0;
 
+/* commands by name for dispatch */
+#define COMMAND_TABLE_SIZE 64
+static hash_table_t command_table;
+static uint64_t command_table_storage[HASH_TABLE_STORAGE_SIZE(COMMAND_TABLE_SIZE) / sizeof(uint64_t)];
+
+static int command_name_match(const hash_node_t* node, const void* key) {
+    return strcmp(hash_entry(node, terminal_command_t, hash_link)->name, (const char*)key) == 0;
+}
+
 static int cmd_fs_create(int argc, char** argv);
 static int cmd_fs_read(int argc, char** argv);
 static int cmd_fs_write(int argc, char** argv);
 static int cmd_fs_list(int argc, char** argv);
 static int cmd_fs_mkdir(int argc, char** argv);
 static int cmd_fs_stat(int argc, char** argv);
+static int cmd_fsbench(int argc, char** argv);
 
 int terminal_init(void) {
     LOG_INFO("terminal", "initializing terminal");
@@ -83,6 +95,7 @@ int terminal_init(void) {
     terminal_register_command("fs_list", "list directory contents", cmd_fs_list);
     terminal_register_command("fs_mkdir", "create a directory", cmd_fs_mkdir);
     terminal_register_command("fs_stat", "show file information", cmd_fs_stat);
+    terminal_register_command("fsbench", "benchmark the file system", cmd_fsbench);
     
     
     terminal_clear();
@@ -386,9 +399,19 @@ int terminal_register_command(const char* name, const char* description,
         return -1;
     }
     
-    registered_commands[command_count].name = name;
-    registered_commands[command_count].description = description;
-    registered_commands[command_count].handler = handler;
+    if (command_count == 0) {
+        hash_table_init(&command_table, command_table_storage, COMMAND_TABLE_SIZE, command_name_match);
+    }
+    
+    terminal_command_t* command = &registered_commands[command_count];
+    command->name = name;
+    command->description = description;
+    command->handler = handler;
+    
+    /* first registration of a name wins */
+    if (hash_table_insert(&command_table, &command->hash_link, hash_string(name), name) != 0) {
+        return -1;
+    }
     command_count++;
     
     return 0;
@@ -418,12 +441,14 @@ int terminal_execute_command(const char* command_line) {
     }
     
     
-    for (int i = 0; i < command_count; i++) {
-        if (strcmp(registered_commands[i].name, argv[0]) == 0) {
-            int result = registered_commands[i].handler(argc, argv);
-            free(cmd_copy);
-            return result;
-        }
+    hash_node_t* node = NULL;
+    if (command_count > 0) {
+        node = hash_table_find(&command_table, hash_string(argv[0]), argv[0]);
+    }
+    if (node != NULL) {
+        int result = hash_entry(node, terminal_command_t, hash_link)->handler(argc, argv);
+        free(cmd_copy);
+        return result;
     }
     
     
@@ -631,6 +656,24 @@ int cmd_fs_stat(int argc, char** argv) {
     return 0;
 }
 
+int cmd_fsbench(int argc, char** argv) {
+    const char* only = argc > 1 ? argv[1] : NULL;
+    if (only && strcmp(only, "seq") != 0 && strcmp(only, "rand") != 0 &&
+        strcmp(only, "meta") != 0 && strcmp(only, "lookup") != 0 && strcmp(only, "ext2") != 0) {
+        terminal_printf("usage: fsbench [seq|rand|meta|lookup|ext2]\n");
+        return -1;
+    }
+    
+    /* results also go to the serial port for scripted runs */
+    serial_init();
+    if (fsbench_run(only, terminal_write_string) != 0) {
+        terminal_printf("fsbench: some workloads failed\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
  
 void terminal_print_state(void) {
     LOG_INFO("terminal", "terminal state:");
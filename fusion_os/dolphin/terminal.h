@@ -11,6 +11,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "proggy_clean_font.h"
+#include "../common/hash.h"
 
 /* terminal configuration */
 #define TERMINAL_WIDTH_CHARS  80
@@ -52,6 +53,7 @@ typedef struct {
     const char* name;
     const char* description;
     terminal_command_func_t handler;
+    hash_node_t hash_link;
 } terminal_command_t;
 
 /* terminal initialization */
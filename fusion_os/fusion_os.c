@@ -7,6 +7,7 @@
 
 #include "gecko/gecko.h"
 #include "dolphin/dolphin.h"
+#include "dolphin/fsbench.h"
 #include "common/logger.h"
 #include "common/string.h"
 
@@ -38,6 +39,11 @@ void kernel_main(void) {
     system_initialized = 1;
     LOG_INFO("fusion_os", "fusion os initialization complete");
     
+#ifdef FSBENCH_BOOT
+    /* benchmark boot, results go to the serial port and qemu exits */
+    fsbench_boot();
+#endif
+    
     /* start the system scheduler */
     gecko_start_scheduler();
     
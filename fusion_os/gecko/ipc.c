@@ -7,6 +7,7 @@
 #include "ipc.h"
 #include "scheduler.h"
 #include "pmm.h"
+#include "gecko.h"
 #include "../common/logger.h"
 #include "../common/string.h"
 
@@ -20,6 +21,21 @@ static int ipc_initialized = 0;
 static service_entry_t service_registry[MAX_SERVICES];
 static uint32_t service_count = 0;
 
+/* services by name, twice MAX_SERVICES slots */
+#define SERVICE_TABLE_SIZE 128
+static hash_table_t service_table;
+static uint64_t service_table_storage[HASH_TABLE_STORAGE_SIZE(SERVICE_TABLE_SIZE) / sizeof(uint64_t)];
+
+static int service_name_match(const hash_node_t* node, const void* key) {
+    const service_entry_t* service = hash_entry(node, service_entry_t, service_hash);
+    return strcmp(service->service_name, (const char*)key) == 0;
+}
+
+static service_entry_t* find_service(const char* service_name) {
+    hash_node_t* node = hash_table_find(&service_table, hash_string(service_name), service_name);
+    return node ? hash_entry(node, service_entry_t, service_hash) : NULL;
+}
+
 /*
  * create new message
  */
@@ -43,6 +59,7 @@ static ipc_message_t* create_message(const char* data, uint32_t length,
     message->message_length = length;
     message->message_type = type;
     message->message_flags = flags;
+    message->page_count = 0;
     
     /* get actual timestamp from system timer */
     extern uint64_t gecko_get_uptime(void);
@@ -56,6 +73,41 @@ static ipc_message_t* create_message(const char* data, uint32_t length,
     return message;
 }
 
+/*
+ * queue a message, a NULL destination is the system queue
+ */
+static int enqueue_message(void* destination, ipc_message_t* message) {
+    message_queue_t* queue = destination ? (message_queue_t*)destination : &system_message_queue;
+    
+    if (queue->current_messages >= queue->max_messages) {
+        LOG_WARNING("ipc", "%s queue full", destination ? "destination" : "system message");
+        return -1;
+    }
+    
+    list_add_tail(&queue->message_list, &message->queue_link);
+    queue->current_messages++;
+    return 0;
+}
+
+/*
+ * wait for the first message of a queue, NULL after timeout
+ */
+static ipc_message_t* wait_message(message_queue_t* queue, uint32_t timeout_ms) {
+    /* wait for message if queue is empty */
+    uint32_t wait_time = 0;
+    while (list_is_empty(&queue->message_list) && wait_time < timeout_ms) {
+        /* simple busy wait - in real implementation would use proper synchronization */
+        wait_time++;
+    }
+    
+    if (list_is_empty(&queue->message_list)) {
+        LOG_DEBUG("ipc", "timeout waiting for message");
+        return NULL;
+    }
+    
+    return (ipc_message_t*)list_get_head(&queue->message_list)->data;
+}
+
 /*
  * initialize ipc system
  */
@@ -76,6 +128,7 @@ void ipc_init(void) {
     list_init(&registered_services);
     memset(service_registry, 0, sizeof(service_registry));
     service_count = 0;
+    hash_table_init(&service_table, service_table_storage, SERVICE_TABLE_SIZE, service_name_match);
     
     ipc_initialized = 1;
     LOG_INFO("ipc", "ipc system initialized");
@@ -153,29 +206,11 @@ int ipc_send_message(void* destination, const char* message, uint32_t length,
     ipc_msg->sender = scheduler_get_current_task();
     ipc_msg->receiver = destination;
     
-    /* handle system messages */
-    if (destination == NULL) {
-        /* broadcast to system queue */
-        if (system_message_queue.current_messages < system_message_queue.max_messages) {
-            list_add_tail(&system_message_queue.message_list, &ipc_msg->queue_link);
-            system_message_queue.current_messages++;
-            LOG_DEBUG("ipc", "sent system message: %s", message);
-        } else {
-            LOG_WARNING("ipc", "system message queue full");
-            return -1;
-        }
-    } else {
-        /* send to specific destination */
-        message_queue_t* dest_queue = (message_queue_t*)destination;
-        if (dest_queue->current_messages < dest_queue->max_messages) {
-            list_add_tail(&dest_queue->message_list, &ipc_msg->queue_link);
-            dest_queue->current_messages++;
-            LOG_DEBUG("ipc", "sent message to %p: %s", destination, message);
-        } else {
-            LOG_WARNING("ipc", "destination queue full");
-            return -1;
-        }
+    if (enqueue_message(destination, ipc_msg) != 0) {
+        pmm_free_page(ipc_msg);
+        return -1;
     }
+    LOG_DEBUG("ipc", "sent message to %p: %s", destination, message);
     
     return 0;
 }
@@ -194,24 +229,19 @@ int ipc_receive_message(void* source, char* buffer, uint32_t* length,
         queue = &system_message_queue; /* receive from system queue */
     }
     
-    /* wait for message if queue is empty */
-    uint32_t wait_time = 0;
-    while (list_is_empty(&queue->message_list) && wait_time < timeout_ms) {
-        /* simple busy wait - in real implementation would use proper synchronization */
-        wait_time++;
+    ipc_message_t* message = wait_message(queue, timeout_ms);
+    if (message == NULL) {
+        return -1;
     }
     
-    if (list_is_empty(&queue->message_list)) {
-        LOG_DEBUG("ipc", "timeout waiting for message");
+    /* page references are taken with ipc_receive_pages */
+    if (message->message_type == IPC_MESSAGE_PAGES) {
+        LOG_WARNING("ipc", "page message needs ipc_receive_pages");
         return -1;
     }
     
-    /* get first message */
-    list_node_t* node = list_get_head(&queue->message_list);
-    ipc_message_t* message = (ipc_message_t*)node->data;
-    
     /* remove from queue */
-    list_remove(&queue->message_list, node);
+    list_remove(&queue->message_list, &message->queue_link);
     queue->current_messages--;
     
     /* copy message data */
@@ -233,6 +263,90 @@ int ipc_receive_message(void* source, char* buffer, uint32_t* length,
     return 0;
 }
 
+/*
+ * send page references, the bytes stay where they are
+ */
+int ipc_send_pages(void* destination, const ipc_page_ref_t* refs, uint32_t count, uint32_t flags) {
+    if (!ipc_initialized) {
+        ipc_init();
+    }
+    
+    if (refs == NULL || count == 0 || count > IPC_MAX_PAGE_REFS) {
+        LOG_WARNING("ipc", "invalid page message parameters");
+        return -1;
+    }
+    
+    ipc_message_t* message = (ipc_message_t*)pmm_alloc_page();
+    if (message == NULL) {
+        LOG_ERROR("ipc", "failed to allocate message memory");
+        return -1;
+    }
+    
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        message->page_refs[i] = refs[i];
+        length += refs[i].length;
+    }
+    message->page_count = count;
+    message->message_length = length;
+    message->message_data[0] = '\0';
+    message->message_type = IPC_MESSAGE_PAGES;
+    message->message_flags = flags;
+    message->timestamp = gecko_get_uptime();
+    message->sender = scheduler_get_current_task();
+    message->receiver = destination;
+    message->queue_link.data = message;
+    message->queue_link.next = NULL;
+    message->queue_link.prev = NULL;
+    
+    if (enqueue_message(destination, message) != 0) {
+        pmm_free_page(message);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * receive page references, count holds the room in refs on entry
+ */
+int ipc_receive_pages(void* source, ipc_page_ref_t* refs, uint32_t* count, uint32_t timeout_ms) {
+    if (!ipc_initialized) {
+        ipc_init();
+    }
+    
+    message_queue_t* queue = source ? (message_queue_t*)source : &system_message_queue;
+    ipc_message_t* message = wait_message(queue, timeout_ms);
+    if (message == NULL) {
+        return -1;
+    }
+    
+    if (message->message_type != IPC_MESSAGE_PAGES || *count < message->page_count) {
+        LOG_WARNING("ipc", "no page message or too little room for it");
+        return -1;
+    }
+    
+    list_remove(&queue->message_list, &message->queue_link);
+    queue->current_messages--;
+    
+    memcpy(refs, message->page_refs, message->page_count * sizeof(ipc_page_ref_t));
+    *count = message->page_count;
+    
+    pmm_free_page(message);
+    return 0;
+}
+
+/*
+ * done with received pages
+ */
+void ipc_release_pages(ipc_page_ref_t* refs, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (refs[i].release) {
+            refs[i].release(&refs[i]);
+        }
+    }
+}
+
 /*
  * register service
  */
@@ -246,18 +360,36 @@ int ipc_register_service(const char* service_name, void* service_handler) {
         return -1;
     }
     
+    /* names are stored and looked up whole, longer ones would be cut */
+    if (strlen(service_name) >= sizeof(service_registry[0].service_name)) {
+        LOG_WARNING("ipc", "service name %s too long", service_name);
+        return -1;
+    }
+    
     /* check if service already exists */
-    for (uint32_t i = 0; i < service_count; i++) {
-        if (strcmp(service_registry[i].service_name, service_name) == 0) {
-            LOG_WARNING("ipc", "service %s already registered", service_name);
-            return -1;
+    if (find_service(service_name) != NULL) {
+        LOG_WARNING("ipc", "service %s already registered", service_name);
+        return -1;
+    }
+    
+    /* take a free registry slot, unregistering leaves holes */
+    service_entry_t* service = NULL;
+    for (uint32_t i = 0; i < MAX_SERVICES; i++) {
+        if (service_registry[i].service_name[0] == '\0') {
+            service = &service_registry[i];
+            break;
         }
     }
     
     /* register new service */
-    service_entry_t* service = &service_registry[service_count];
     strncpy(service->service_name, service_name, sizeof(service->service_name) - 1);
     service->service_handler = service_handler;
+    if (hash_table_insert(&service_table, &service->service_hash,
+                          hash_string(service->service_name), service->service_name) != 0) {
+        LOG_WARNING("ipc", "service table full, %s not registered", service_name);
+        service->service_name[0] = '\0';
+        return -1;
+    }
     
     /* create service queue */
     if (ipc_create_queue(service, 64) == 0) {
@@ -290,41 +422,34 @@ void* ipc_lookup_service(const char* service_name) {
         ipc_init();
     }
     
-    /* search registered services */
-    list_node_t* node = list_get_head(&registered_services);
-    while (node != NULL) {
-        service_entry_t* service = (service_entry_t*)node->data;
-        if (strcmp(service->service_name, service_name) == 0) {
-            return service->service_handler;
-        }
-        node = node->next;
-    }
-    
-    return NULL;
+    service_entry_t* service = find_service(service_name);
+    return service ? service->service_handler : NULL;
 }
 
 /*
  * unregister service
  */
 int ipc_unregister_service(const char* service_name) {
+    if (!ipc_initialized) {
+        return -1;
+    }
+    
     /* find and remove service */
-    list_node_t* node = list_get_head(&registered_services);
-    while (node != NULL) {
-        service_entry_t* service = (service_entry_t*)node->data;
-        if (strcmp(service->service_name, service_name) == 0) {
-            list_remove(&registered_services, node);
-            /* destroy service queue */
-            if (service->service_queue != NULL) {
-                ipc_destroy_queue(service->service_queue);
-            }
-            service_count--;
-            LOG_INFO("ipc", "unregistered service: %s", service_name);
-            return 0;
-        }
-        node = node->next;
+    service_entry_t* service = find_service(service_name);
+    if (service == NULL) {
+        return -1;
     }
     
-    return -1;
+    hash_table_remove(&service_table, &service->service_hash);
+    list_remove(&registered_services, &service->service_link);
+    /* destroy service queue */
+    if (service->service_queue != NULL) {
+        ipc_destroy_queue(service->service_queue);
+    }
+    service_count--;
+    LOG_INFO("ipc", "unregistered service: %s", service_name);
+    memset(service, 0, sizeof(service_entry_t));
+    return 0;
 }
 
 /*
@@ -11,12 +11,17 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "../common/list.h"
+#include "../common/hash.h"
 
 /* message types */
 #define IPC_MESSAGE_DATA   0x01
 #define IPC_MESSAGE_SYSTEM 0x02
 #define IPC_MESSAGE_TERMINAL 0x03
 #define IPC_MESSAGE_SERVICE  0x04
+#define IPC_MESSAGE_PAGES    0x05       /* page references instead of bytes */
+
+/* most page references in one message */
+#define IPC_MAX_PAGE_REFS 16
 
 /* message flags */
 #define IPC_BLOCKING    0x01
@@ -31,6 +36,14 @@ typedef struct message_queue {
     uint32_t current_messages;
 } message_queue_t;
 
+/* bytes in a page passed by reference, the receiver calls release when done */
+typedef struct ipc_page_ref {
+    void* data;
+    uint32_t length;
+    void (*release)(struct ipc_page_ref* ref);
+    void* owner;                        /* for release */
+} ipc_page_ref_t;
+
 /* message structure */
 typedef struct ipc_message {
     char message_data[1024];
@@ -41,6 +54,8 @@ typedef struct ipc_message {
     void* receiver;
     uint64_t timestamp;
     list_node_t queue_link;
+    ipc_page_ref_t page_refs[IPC_MAX_PAGE_REFS];
+    uint32_t page_count;
 } ipc_message_t;
 
 /* service registration */
@@ -49,6 +64,7 @@ typedef struct service_entry {
     void* service_handler;
     message_queue_t* service_queue;
     list_node_t service_link;
+    hash_node_t service_hash;
 } service_entry_t;
 
 /* global structures */
@@ -68,6 +84,11 @@ int ipc_send_message(void* destination, const char* message, uint32_t length,
 int ipc_receive_message(void* source, char* buffer, uint32_t* length, 
                        uint32_t* message_type, uint32_t timeout_ms);
 
+/* page reference messages, the sender's references move to the receiver */
+int ipc_send_pages(void* destination, const ipc_page_ref_t* refs, uint32_t count, uint32_t flags);
+int ipc_receive_pages(void* source, ipc_page_ref_t* refs, uint32_t* count, uint32_t timeout_ms);
+void ipc_release_pages(ipc_page_ref_t* refs, uint32_t count);
+
 /* service registration */
 int ipc_register_service(const char* service_name, void* service_handler);
 void* ipc_lookup_service(const char* service_name);
@@ -5,7 +5,7 @@
 #include "page_tables.h"
 #include "../common/logger.h"
 #include <stddef.h>
-#include <string.h>
+#include "../common/string.h"
 #include "pmm.h"
 
 /* walk page table to find PTE for virtual address */
@@ -118,7 +118,8 @@ void init_kernel_page_tables(void) {
 void* create_page_table_page(void) {
     void* page_table = pmm_alloc_page();
     if (page_table != NULL) {
-        memset(page_table, 0, PAGE_SIZE);
+        /* the walker reads entries only once they are filled in */
+        clear_page_nt(page_table);
     }
     return page_table;
 }
@@ -0,0 +1,20 @@
+/*
+ * port_io.h - x86 i/o port access for fusion os
+ */
+
+#ifndef PORT_IO_H
+#define PORT_IO_H
+
+#include <stdint.h>
+
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ volatile ("outb %0, %1" :: "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t value;
+    __asm__ volatile ("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+#endif /* PORT_IO_H */
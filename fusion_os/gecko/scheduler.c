@@ -7,6 +7,8 @@
 #include "scheduler.h"
 #include "../common/logger.h"
 #include "../common/string.h"
+#include "../common/vfs.h"
+#include "../common/io_ring.h"
 #include "vmm.h"
 
 /* scheduler state */
@@ -310,7 +312,9 @@ int scheduler_terminate_task(uint32_t task_id) {
     list_remove(&blocked_queue, &task->task_list);
     list_remove(&sleeping_queue, &task->task_list);
     
-    /* free resources */
+    /* free resources, requests in flight still need the descriptors */
+    io_ring_exit_task(task);
+    vfs_exit_task(task);
     if (task->kernel_stack != NULL) {
         vmm_free_kernel_memory(task->kernel_stack);
     }
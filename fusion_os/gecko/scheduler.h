@@ -22,6 +22,9 @@
 #define PRIORITY_HIGH   2
 #define PRIORITY_CRITICAL 3
 
+struct vfs_file_table;
+struct io_ring;
+
 /* maximum number of tasks */
 #define MAX_TASKS 256
 
@@ -50,6 +53,12 @@ typedef struct task_control_block {
     list_node_t scheduler_list;
     list_node_t task_list;
     
+    /* open files, NULL until the first vfs_open */
+    struct vfs_file_table* files;
+    
+    /* asynchronous io ring, NULL until io_ring_setup */
+    struct io_ring* io_ring;
+    
     /* function pointer */
     void (*task_function)(void);
 } task_t;
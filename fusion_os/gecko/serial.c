@@ -0,0 +1,79 @@
+/*
+ * serial.c - serial port output implementation
+ */
+
+#include "serial.h"
+#include "port_io.h"
+#include "../common/string.h"
+
+/* uart registers, offsets from the base port */
+#define UART_DATA          0
+#define UART_INTERRUPT     1
+#define UART_FIFO          2
+#define UART_LINE_CONTROL  3
+#define UART_MODEM_CONTROL 4
+#define UART_LINE_STATUS   5
+#define UART_SCRATCH       7
+
+#define UART_DLAB          0x80         /* divisor latch access */
+#define UART_8N1           0x03
+#define UART_THR_EMPTY     0x20
+
+static int serial_ready = 0;
+
+/*
+ * program com1 for 115200 8n1 with fifos and no interrupts
+ */
+int serial_init(void) {
+    if (serial_ready) {
+        return 0;
+    }
+
+    /* a missing uart reads back all ones */
+    outb(SERIAL_COM1 + UART_SCRATCH, 0x5a);
+    if (inb(SERIAL_COM1 + UART_SCRATCH) != 0x5a) {
+        return -1;
+    }
+
+    outb(SERIAL_COM1 + UART_INTERRUPT, 0x00);
+    outb(SERIAL_COM1 + UART_LINE_CONTROL, UART_DLAB);
+    outb(SERIAL_COM1 + UART_DATA, SERIAL_BAUD_DIVISOR & 0xff);
+    outb(SERIAL_COM1 + UART_INTERRUPT, (SERIAL_BAUD_DIVISOR >> 8) & 0xff);
+    outb(SERIAL_COM1 + UART_LINE_CONTROL, UART_8N1);
+    outb(SERIAL_COM1 + UART_FIFO, 0xc7);        /* enable and clear, 14 byte threshold */
+    outb(SERIAL_COM1 + UART_MODEM_CONTROL, 0x03); /* dtr and rts */
+
+    serial_ready = 1;
+    return 0;
+}
+
+static void put_byte(char c) {
+    while (!(inb(SERIAL_COM1 + UART_LINE_STATUS) & UART_THR_EMPTY)) {
+    }
+    outb(SERIAL_COM1 + UART_DATA, (uint8_t)c);
+}
+
+/*
+ * write length bytes
+ */
+void serial_write(const char* data, size_t length) {
+    if (!serial_ready || !data) {
+        return;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == '\n') {
+            put_byte('\r');
+        }
+        put_byte(data[i]);
+    }
+}
+
+/*
+ * write a nul terminated string
+ */
+void serial_write_string(const char* str) {
+    if (str) {
+        serial_write(str, strlen(str));
+    }
+}
@@ -0,0 +1,25 @@
+/*
+ * serial.h - serial port output for fusion os
+ *
+ * polled output on the first 16550 uart, the port qemu connects with
+ * -serial stdio. meant for machine readable output of automated runs,
+ * nothing is ever read back
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SERIAL_COM1 0x3f8
+#define SERIAL_BAUD_DIVISOR 1            /* 115200 baud */
+
+/* program the uart, returns -1 when no uart answers */
+int serial_init(void);
+
+/* write bytes, newlines go out as cr lf. nothing is written before init */
+void serial_write(const char* data, size_t length);
+void serial_write_string(const char* str);
+
+#endif /* SERIAL_H */